@@ -14,7 +14,7 @@
 #include "chatmessage.h"
 #include "errors.h"
 #include "sessionserver.h"
-#include "statusmessage.h"
+#include "statsmessage.h"
 
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -24,9 +24,12 @@
 #include <errno.h>
 #include <netdb.h>
 #include <semaphore.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 
 /**
  * @def KEYCODE_ESC
@@ -59,6 +62,25 @@
 #define STATUS_MESSAGE_TIMEOUT   5
 
 
+/**
+ * Write a byte amount in a human readable form.
+ */
+static void formatBytes( char* string, const double bytes )
+{
+  const char* units[] = { "B", "KB", "MB", "GB", "TB" };
+  double value = bytes;
+  int unit = 0;
+
+  while( value >= 1024 && unit < 4 )
+  {
+    value /= 1024;
+    unit++;
+  }
+
+  sprintf( string, ( unit == 0 ) ? "%.0f %s" : "%.1f %s", value, units[ unit ] );
+}
+
+
 // Semaphore used to end the session
 sem_t sessionEndSignal;
 
@@ -68,8 +90,13 @@ Client::Client()
 : connection_( NULL )
 , connectionThread_( 0 )
 , currentMessagePos_( 0 )
+, hasRoster_( false )
+, isListingRoster_( false )
+, isReceivingRoster_( false )
+, isReceivingStats_( false )
 , maxX_( 0 )
 , maxY_( 0 )
+, rosterVersion_( 0 )
 , socket_( -1 )
 {
   int result = pthread_mutex_init( &inputMutex_, NULL );
@@ -285,7 +312,44 @@ void Client::gotChatMessage( const char* sender, const char* message )
 
 
 
-bool Client::gotFileTransferRequest( const char* sender, const char* filename, char* targetFileName )
+void Client::gotFileProgress( const char* fileName, const bool isSending, const off_t doneSize, const off_t fileSize,
+                              const double rate, const int secondsLeft )
+{
+  char done[ 16 ], total[ 16 ], speed[ 16 ];
+  formatBytes( done, doneSize );
+  formatBytes( total, fileSize );
+  formatBytes( speed, rate );
+
+  char timeLeft[ 32 ] = "";
+  if( secondsLeft >= 3600 )
+  {
+    snprintf( timeLeft, sizeof( timeLeft ), ", %d:%02d:%02d left", secondsLeft / 3600, ( secondsLeft / 60 ) % 60, secondsLeft % 60 );
+  }
+  else if( secondsLeft >= 0 )
+  {
+    snprintf( timeLeft, sizeof( timeLeft ), ", %d:%02d left", secondsLeft / 60, secondsLeft % 60 );
+  }
+
+  char message[ MAX_CHATMESSAGE_SIZE ];
+  if( fileSize > 0 )
+  {
+    snprintf( message, MAX_CHATMESSAGE_SIZE, "%s \"%s\": %s of %s (%d%%) at %s/s%s",
+              isSending ? "Sending" : "Receiving", fileName, done, total,
+              static_cast<int>( std::min( doneSize, fileSize ) * 100 / fileSize ), speed, timeLeft );
+  }
+  else
+  {
+    snprintf( message, MAX_CHATMESSAGE_SIZE, "%s \"%s\": %s at %s/s",
+              isSending ? "Sending" : "Receiving", fileName, done, speed );
+  }
+
+  // Goes away by itself if the reports stop
+  changeStatusMessage( message );
+}
+
+
+
+bool Client::gotFileTransferRequest( const char* sender, const char* filename, char* targetFileName, const bool isFolder )
 {
   // Make the run() loop to block while we're asking the user to accept or reject
   pthread_mutex_lock( &inputMutex_ );
@@ -294,7 +358,7 @@ bool Client::gotFileTransferRequest( const char* sender, const char* filename, c
   char string[ MAX_CHATMESSAGE_SIZE ];
   gotStatusMessage( "Received a request to transfer \"%s\" from \"%s\"", filename, sender );
 
-  sprintf( string, "Do you want to accept the file \"%s\" from \"%s\"? [Y/n]", filename, sender );
+  sprintf( string, "Do you want to accept the %s \"%s\" from \"%s\"? [Y/n]", isFolder ? "folder" : "file", filename, sender );
 
   bool accept = false;
   bool answered = false;
@@ -320,18 +384,14 @@ bool Client::gotFileTransferRequest( const char* sender, const char* filename, c
     strcpy( targetFileName, filename );
 
     answered = false;
-    sprintf( string, "Please enter a name for the saved file:"  );
+    sprintf( string, "Please enter a name for the saved %s:", isFolder ? "folder" : "file" );
     if( ! askQuestion( string, targetFileName, MAX_PATH_SIZE ) )
     {
       accept = false;
     }
   }
 
-  Errors::StatusCode status = ( accept ? Errors::Status_AcceptFileTransfer
-                                       : Errors::Status_RejectFileTransfer );
-
-  connection_->sendMessage( new StatusMessage( status ) );
-
+  // The session answers, once it knows where the file would continue from
   gotStatusMessage( "File transfer request %s.", accept ? "accepted" : "rejected" );
 
   changeStatusMessage();
@@ -353,6 +413,184 @@ void Client::gotNicknameChange( const char* nickName )
 
 
 
+void Client::gotPrivateMessage( const char* sender, const unsigned int senderId, const char* message )
+{
+  // Show how to answer: users of other servers have no id
+  char text[ MAX_CHATMESSAGE_SIZE ];
+  if( senderId != 0 )
+  {
+    snprintf( text, MAX_CHATMESSAGE_SIZE, "(private, #%u) %s", senderId, message );
+  }
+  else
+  {
+    snprintf( text, MAX_CHATMESSAGE_SIZE, "(private) %s", message );
+  }
+
+  gotChatMessage( sender, text );
+}
+
+
+
+void Client::gotRoster( const RosterMessage* message )
+{
+  if( message->isSnapshot() )
+  {
+    // A snapshot replaces whatever was known
+    if( ! isReceivingRoster_ )
+    {
+      roster_.clear();
+      isReceivingRoster_ = true;
+    }
+
+    for( int i = 0; i < message->entriesCount(); i++ )
+    {
+      roster_.push_back( message->entry( i ) );
+    }
+
+    if( ! message->isLast() )
+    {
+      return;
+    }
+
+    isReceivingRoster_ = false;
+    hasRoster_ = true;
+    rosterVersion_ = message->version();
+
+    if( isListingRoster_ )
+    {
+      char list[ MAX_CHATMESSAGE_SIZE ];
+      int length = snprintf( list, MAX_CHATMESSAGE_SIZE, "Online (%lu):", roster_.size() );
+
+      std::list<RosterMessage::Entry>::iterator it;
+      for( it = roster_.begin(); it != roster_.end() && length < MAX_CHATMESSAGE_SIZE; it++ )
+      {
+        if( (*it).id != 0 )
+        {
+          length += snprintf( list + length, MAX_CHATMESSAGE_SIZE - length, " %s (#%u)", (*it).nickName, (*it).id );
+        }
+        else
+        {
+          length += snprintf( list + length, MAX_CHATMESSAGE_SIZE - length, " %s", (*it).nickName );
+        }
+      }
+
+      gotStatusMessage( "%s", list );
+      isListingRoster_ = false;
+    }
+
+    updateView();
+    return;
+  }
+
+  // Changes which came before the snapshot, or which it already contains
+  if( ! hasRoster_ || (int32_t)( message->version() - rosterVersion_ ) <= 0 )
+  {
+    return;
+  }
+
+  // Some changes went missing, start over
+  if( message->version() != rosterVersion_ + 1 )
+  {
+    Common::debug( "Roster version %u after %u, asking for the whole roster", message->version(), rosterVersion_ );
+    hasRoster_ = false;
+    connection_->requestRoster();
+    return;
+  }
+
+  rosterVersion_ = message->version();
+
+  for( int i = 0; i < message->entriesCount(); i++ )
+  {
+    const RosterMessage::Entry& change = message->entry( i );
+
+    if( change.event == RosterMessage::ROSTER_JOINED )
+    {
+      roster_.push_back( change );
+
+      if( strcmp( change.nickName, connection_->nickName() ) != 0 )
+      {
+        gotStatusMessage( "%s joined the chat", change.nickName );
+      }
+      continue;
+    }
+
+    const char* nickName = ( change.event == RosterMessage::ROSTER_RENAMED ) ? change.oldNickName : change.nickName;
+
+    std::list<RosterMessage::Entry>::iterator it;
+    for( it = roster_.begin(); it != roster_.end(); it++ )
+    {
+      if( strcmp( (*it).nickName, nickName ) != 0 )
+      {
+        continue;
+      }
+
+      if( change.event == RosterMessage::ROSTER_LEFT )
+      {
+        roster_.erase( it );
+        gotStatusMessage( "%s left the chat", change.nickName );
+      }
+      else
+      {
+        memcpy( (*it).nickName, change.nickName, MAX_NICKNAME_SIZE );
+        gotStatusMessage( "%s is now known as %s", change.oldNickName, change.nickName );
+      }
+      break;
+    }
+  }
+
+  updateView();
+}
+
+
+
+void Client::gotServerStats( const StatsMessage* message )
+{
+  // The summary is repeated in each message, show it once
+  if( ! isReceivingStats_ )
+  {
+    const StatsMessage::Summary& summary = message->summary();
+    gotStatusMessage( "Server up for %lldh %02lldm %02llds, %d threads, %d sessions, %llu connections accepted, %llu rejected",
+                      (long long)( summary.uptime / 3600 ),
+                      (long long)( ( summary.uptime / 60 ) % 60 ),
+                      (long long)( summary.uptime % 60 ),
+                      summary.threadsCount,
+                      summary.sessionsCount,
+                      (unsigned long long)summary.connectionsAccepted,
+                      (unsigned long long)summary.connectionsRejected );
+    gotStatusMessage( "Slow clients: %llu messages dropped, %llu replaced, %llu spilled to disk, %llu clients disconnected",
+                      (unsigned long long)summary.slowDroppedNewest,
+                      (unsigned long long)summary.slowDroppedOldest,
+                      (unsigned long long)summary.slowSpilled,
+                      (unsigned long long)summary.slowDisconnected );
+    isReceivingStats_ = true;
+  }
+
+  for( int i = 0; i < message->entriesCount(); i++ )
+  {
+    const StatsMessage::Entry& entry = message->entry( i );
+
+    char bytesIn[ 16 ], bytesOut[ 16 ], rateIn[ 16 ], rateOut[ 16 ];
+    formatBytes( bytesIn, entry.bytesIn );
+    formatBytes( bytesOut, entry.bytesOut );
+    formatBytes( rateIn, entry.rateIn );
+    formatBytes( rateOut, entry.rateOut );
+
+    gotStatusMessage( "%s: in %llu msgs/%s (%s/s), out %llu msgs/%s (%s/s), queued %d, dropped %llu",
+                      entry.nickName,
+                      (unsigned long long)entry.messagesIn, bytesIn, rateIn,
+                      (unsigned long long)entry.messagesOut, bytesOut, rateOut,
+                      entry.queueDepth,
+                      (unsigned long long)entry.messagesDropped );
+  }
+
+  if( message->isLast() )
+  {
+    isReceivingStats_ = false;
+  }
+}
+
+
+
 void Client::gotStatusMessage( const char* format, ... )
 {
   char statusMessage[ MAX_CHATMESSAGE_SIZE ];
@@ -360,7 +598,7 @@ void Client::gotStatusMessage( const char* format, ... )
 
   // Get all the parameters that have been passed to this function
   va_start( args, format );
-  vsprintf( statusMessage, format, args );
+  vsnprintf( statusMessage, MAX_CHATMESSAGE_SIZE, format, args );
   va_end( args );
 
 
@@ -387,7 +625,7 @@ void Client::gotStatusMessage( const char* format, ... )
 
 
 
-Errors::ErrorCode Client::initialize( const in_addr& serverIp, const int serverPort )
+Errors::ErrorCode Client::initialize( const in_addr& serverIp, const int serverPort, SSL_CTX* tlsContext, const int fileStripes, const bool directFiles )
 {
   changeStatusMessage( "Connecting...", true );
 
@@ -415,6 +653,13 @@ Errors::ErrorCode Client::initialize( const in_addr& serverIp, const int serverP
   }
 
   connection_ = new SessionServer( this, socket_ );
+  connection_->setFileStripes( fileStripes );
+  connection_->setDirectFiles( directFiles );
+
+  if( tlsContext != NULL && ! connection_->startTls( tlsContext, false ) )
+  {
+    connection_->dropConnection();
+  }
 
   pthread_create( &connectionThread_, NULL, &SessionServer::pollForData, connection_ );
 
@@ -495,6 +740,13 @@ void Client::run()
         break;
       }
 
+      case KEY_F( 3 ):
+      {
+        Common::debug( "Requesting server statistics..." );
+        connection_->requestStats();
+        break;
+      }
+
       case KEY_F( 4 ):
       {
         if( connection_->hasFileTransfer() )
@@ -508,7 +760,7 @@ void Client::run()
         char fileName[ MAX_PATH_SIZE ];
         memset( fileName, '\0', MAX_PATH_SIZE );
 
-        if( askQuestion( "Choose a file name:", fileName, MAX_PATH_SIZE ) && strlen( fileName ) >= 1 )
+        if( askQuestion( "Choose a file or a folder to send:", fileName, MAX_PATH_SIZE ) && strlen( fileName ) >= 1 )
         {
           connection_->sendFile( fileName );
         }
@@ -517,6 +769,15 @@ void Client::run()
         break;
       }
 
+      case KEY_F( 5 ):
+      {
+        // Get a fresh copy, it's shown when it arrives
+        Common::debug( "Requesting the roster..." );
+        isListingRoster_ = true;
+        connection_->requestRoster();
+        break;
+      }
+
       case KEYCODE_ENTER:
         Common::debug( "Enter pressed" );
         if( currentMessagePos_ <= 0 )
@@ -566,6 +827,12 @@ void Client::run()
 
 void Client::sendChatMessage( const char* message )
 {
+  if( strncmp( message, "/msg ", 5 ) == 0 )
+  {
+    sendPrivateMessage( message + 5 );
+    return;
+  }
+
   Row* row = new Row();
   row->incoming = false;
   row->special = false;
@@ -592,6 +859,54 @@ void Client::sendChatMessage( const char* message )
 
 
 
+void Client::sendPrivateMessage( const char* command )
+{
+  // The recipient goes up to the first space, the message is the rest
+  const char* separator = strchr( command, ' ' );
+  int recipientLength = ( separator != NULL ) ? ( separator - command ) : 0;
+  if( recipientLength < 1 || recipientLength >= MAX_NICKNAME_SIZE || strlen( separator + 1 ) == 0 )
+  {
+    gotStatusMessage( "To write to a single user: /msg <nickname or #id> <message>" );
+    return;
+  }
+
+  char recipient[ MAX_NICKNAME_SIZE ];
+  memset( recipient, '\0', MAX_NICKNAME_SIZE );
+  strncpy( recipient, command, recipientLength );
+
+  const char* message = separator + 1;
+
+  unsigned int id = 0;
+  if( recipient[ 0 ] == '#' )
+  {
+    id = strtoul( recipient + 1, NULL, 10 );
+  }
+
+  connection_->privateChat( ( id != 0 ) ? NULL : recipient, id, message );
+
+  Row* row = new Row();
+  row->incoming = false;
+  row->special = false;
+
+  memset( row->sender, '\0', MAX_NICKNAME_SIZE );
+  strncpy( row->sender, connection_->nickName(), MAX_NICKNAME_SIZE );
+  snprintf( row->message, MAX_CHATMESSAGE_SIZE, "(to %s) %s", recipient, message );
+  row->dateTime = time( NULL );
+
+  if( chatHistory_.size() > HISTORY_SIZE )
+  {
+    delete chatHistory_.front();
+    chatHistory_.pop_front();
+  }
+
+  chatHistory_.push_back( row );
+
+  changeStatusMessage();
+  updateView();
+}
+
+
+
 void Client::updateView()
 {
   getmaxyx( stdscr, maxY_, maxX_ );
@@ -629,7 +944,7 @@ void Client::updateView()
     // The previous status message has expired, change it with the default
     if( connectionThread_ != 0 && connection_ != 0 )
     {
-      sprintf( statusMessage_, "In chat as %s", connection_->nickName() );
+      sprintf( statusMessage_, "In chat as %s, %lu online", connection_->nickName(), roster_.size() );
     }
     else
     {
@@ -13,12 +13,16 @@
 
 #include "errors.h"
 #include "protocol.h"
+#include "rostermessage.h"
+#include "sessionserver.h"
+#include "tls.h"
 
 #include <netinet/in.h>
 #include <pthread.h>
 #include <time.h>
 
 #include <deque>
+#include <list>
 
 
 /**
@@ -29,6 +33,7 @@
 
 
 class SessionServer;
+class StatsMessage;
 
 
 
@@ -40,19 +45,48 @@ class Client
     Client();
     ~Client();
 
-    Errors::ErrorCode initialize( const in_addr& serverIp, const int serverPort );
+    /**
+     * Connect to the server.
+     *
+     * @param tlsContext Settings to encrypt the connection with, or NULL to connect in clear text
+     * @param fileStripes Data connections to open for the file transfers, besides the session
+     * @param directFiles Whether to send the files straight to their receivers
+     */
+    Errors::ErrorCode initialize( const in_addr& serverIp, const int serverPort, SSL_CTX* tlsContext = NULL,
+                                  const int fileStripes = FILE_STRIPES, const bool directFiles = false );
 
     bool askQuestion( const char* question, char* answer, const int answerSize );
     void changeStatusMessage( const char* message = NULL, bool permanent = false );
     void connectionClosed( SessionServer* connection );
 
     void gotChatMessage( const char* sender, const char* message );
-    bool gotFileTransferRequest( const char* sender, const char* filename, char* targetFileName );
+
+    /**
+     * Show how a file transfer is going in the status line.
+     *
+     * @param fileSize 0 if unknown
+     * @param rate Bytes per second
+     * @param secondsLeft Estimated time to the end, or -1 if unknown
+     */
+    void gotFileProgress( const char* fileName, const bool isSending, const off_t doneSize, const off_t fileSize,
+                          const double rate, const int secondsLeft );
+
+    bool gotFileTransferRequest( const char* sender, const char* filename, char* targetFileName, const bool isFolder = false );
     void gotNicknameChange( const char* nickName );
+    void gotPrivateMessage( const char* sender, const unsigned int senderId, const char* message );
+    void gotRoster( const RosterMessage* message );
+    void gotServerStats( const StatsMessage* message );
     void gotStatusMessage( const char* format, ... );
     void run();
     void sendChatMessage( const char* message );
 
+    /**
+     * Send a message to a single user.
+     *
+     * @param command The recipient's nickname, or its id prefixed by '#', then the message
+     */
+    void sendPrivateMessage( const char* command );
+
     void updateView();
 
 
@@ -81,9 +115,27 @@ class Client
 
     pthread_mutex_t inputMutex_;
 
+    /// Whether the roster is known, and kept up to date with the changes
+    bool hasRoster_;
+
+    /// Whether the user asked to see the roster
+    bool isListingRoster_;
+
+    /// Whether more parts of a roster snapshot are about to arrive
+    bool isReceivingRoster_;
+
+    /// Whether more server statistics are about to arrive
+    bool isReceivingStats_;
+
     int maxX_;
     int maxY_;
 
+    /// Users online
+    std::list<RosterMessage::Entry> roster_;
+
+    /// Version of the roster, to notice missing changes
+    uint32_t rosterVersion_;
+
     int socket_;
 
     char statusMessage_[ MAX_CHATMESSAGE_SIZE ];
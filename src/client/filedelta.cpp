@@ -0,0 +1,495 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "filedelta.h"
+
+#include "common.h"
+
+#include <openssl/evp.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+
+
+/// Number of tags the rolling checksums are grouped by
+static const int TAGS_COUNT = 65536;
+
+
+
+/**
+ * Compute the two sums of the rolling checksum of a block.
+ */
+static void rollingSums( const unsigned char* data, const int size, uint32_t& a, uint32_t& b )
+{
+  a = 0;
+  b = 0;
+  for( int i = 0; i < size; i++ )
+  {
+    a += data[ i ];
+    b += a;
+  }
+}
+
+
+
+/**
+ * Combine the sums into the rolling checksum.
+ */
+static inline uint32_t rollingChecksum( const uint32_t a, const uint32_t b )
+{
+  return ( ( a & 0xFFFF ) | ( b << 16 ) );
+}
+
+
+
+/**
+ * Tag of a rolling checksum, to find the blocks which may have it at once.
+ */
+static inline int tagOf( const uint32_t weak )
+{
+  return ( ( weak + ( weak >> 16 ) ) & 0xFFFF );
+}
+
+
+
+FileDelta::FileDelta()
+: blocks_( NULL )
+, blocksCount_( 0 )
+, blockSize_( 0 )
+, buffer_( NULL )
+, bufferOffset_( 0 )
+, bufferSize_( 0 )
+, file_( -1 )
+, fileSize_( 0 )
+, foundBasisOffset_( 0 )
+, foundOffset_( -1 )
+, foundSize_( 0 )
+, index_( NULL )
+, isComplete_( false )
+, isDropped_( false )
+, rollingA_( 0 )
+, rollingB_( 0 )
+, rollingOffset_( -1 )
+, tagStarts_( NULL )
+{
+}
+
+
+
+FileDelta::~FileDelta()
+{
+  clear();
+}
+
+
+
+bool FileDelta::addSignature( const FileSignatureMessage* message )
+{
+  if( isDropped_ )
+  {
+    return false;
+  }
+
+  int count = message->blocksCount();
+  if( isComplete_
+  ||  message->blockSize() < DELTA_MIN_BLOCK_SIZE || message->blockSize() > DELTA_MAX_BLOCK_SIZE
+  ||  ( blocksCount_ > 0 && message->blockSize() != blockSize_ )
+  ||  blocksCount_ + count > SIGNATURE_MAX_BLOCKS )
+  {
+    Common::error( "Invalid signature of the receiver's copy, the file will be sent whole" );
+    clear();
+    isDropped_ = true;
+    return false;
+  }
+
+  blockSize_ = message->blockSize();
+  blocks_ = static_cast<FileSignatureMessage::Block*>( realloc( blocks_, ( blocksCount_ + count ) * sizeof( FileSignatureMessage::Block ) ) );
+  for( int i = 0; i < count; i++ )
+  {
+    blocks_[ blocksCount_++ ] = message->block( i );
+  }
+
+  if( ! message->isLast() )
+  {
+    return true;
+  }
+
+  // Group the blocks by tag, in the order of the file
+  tagStarts_ = static_cast<int*>( calloc( TAGS_COUNT + 1, sizeof( int ) ) );
+  for( int i = 0; i < blocksCount_; i++ )
+  {
+    tagStarts_[ tagOf( blocks_[ i ].weak ) + 1 ]++;
+  }
+  for( int tag = 0; tag < TAGS_COUNT; tag++ )
+  {
+    tagStarts_[ tag + 1 ] += tagStarts_[ tag ];
+  }
+
+  int* nextEntries = static_cast<int*>( malloc( TAGS_COUNT * sizeof( int ) ) );
+  memcpy( nextEntries, tagStarts_, TAGS_COUNT * sizeof( int ) );
+
+  index_ = static_cast<IndexEntry*>( malloc( std::max( blocksCount_, 1 ) * sizeof( IndexEntry ) ) );
+  for( int i = 0; i < blocksCount_; i++ )
+  {
+    IndexEntry& entry = index_[ nextEntries[ tagOf( blocks_[ i ].weak ) ]++ ];
+    entry.weak = blocks_[ i ].weak;
+    entry.index = i;
+  }
+
+  free( nextEntries );
+
+  isComplete_ = true;
+  return true;
+}
+
+
+
+void FileDelta::clear()
+{
+  if( file_ != -1 )
+  {
+    close( file_ );
+    file_ = -1;
+  }
+
+  free( blocks_ );
+  blocks_ = NULL;
+  blocksCount_ = 0;
+  blockSize_ = 0;
+
+  free( buffer_ );
+  buffer_ = NULL;
+  bufferOffset_ = 0;
+  bufferSize_ = 0;
+
+  free( index_ );
+  index_ = NULL;
+  free( tagStarts_ );
+  tagStarts_ = NULL;
+
+  fileSize_ = 0;
+  foundOffset_ = -1;
+  isComplete_ = false;
+  isDropped_ = false;
+  rollingOffset_ = -1;
+}
+
+
+
+const unsigned char* FileDelta::data( const off_t offset, const int size )
+{
+  if( offset >= bufferOffset_ && offset + size <= bufferOffset_ + bufferSize_ )
+  {
+    return buffer_ + ( offset - bufferOffset_ );
+  }
+
+  bufferOffset_ = offset;
+  bufferSize_ = 0;
+
+  int wanted = std::min( (off_t)DELTA_BUFFER_SIZE, fileSize_ - offset );
+  while( bufferSize_ < wanted )
+  {
+    ssize_t readBytes = pread( file_, buffer_ + bufferSize_, wanted - bufferSize_, offset + bufferSize_ );
+    if( readBytes == -1 && errno == EINTR )
+    {
+      continue;
+    }
+    if( readBytes == -1 )
+    {
+      return NULL;
+    }
+
+    // The file got shorter since the transfer started
+    if( readBytes == 0 )
+    {
+      break;
+    }
+
+    bufferSize_ += readBytes;
+  }
+
+  if( bufferSize_ < size )
+  {
+    errno = EIO;
+    return NULL;
+  }
+
+  return buffer_;
+}
+
+
+
+int FileDelta::findBlock( const uint32_t weak, const unsigned char* data, const int index )
+{
+  uint8_t strong[ SIGNATURE_STRONG_SIZE ];
+
+  if( index != -1 )
+  {
+    if( index >= blocksCount_ || blocks_[ index ].weak != weak )
+    {
+      return -1;
+    }
+
+    strongChecksum( data, blockSize_, strong );
+    return ( memcmp( strong, blocks_[ index ].strong, SIGNATURE_STRONG_SIZE ) == 0 ) ? index : -1;
+  }
+
+  // The strong checksum is only computed when the rolling one matches
+  bool hasStrong = false;
+  int tag = tagOf( weak );
+  for( int i = tagStarts_[ tag ]; i < tagStarts_[ tag + 1 ]; i++ )
+  {
+    if( index_[ i ].weak != weak )
+    {
+      continue;
+    }
+
+    if( ! hasStrong )
+    {
+      strongChecksum( data, blockSize_, strong );
+      hasStrong = true;
+    }
+
+    if( memcmp( strong, blocks_[ index_[ i ].index ].strong, SIGNATURE_STRONG_SIZE ) == 0 )
+    {
+      return index_[ i ].index;
+    }
+  }
+
+  return -1;
+}
+
+
+
+bool FileDelta::findMatch( const off_t offset, const off_t limit, off_t& matchOffset, off_t& basisOffset, off_t& matchSize )
+{
+  matchOffset = limit;
+  basisOffset = 0;
+  matchSize = 0;
+
+  // Found by the previous call, and still ahead
+  if( foundOffset_ != -1 && foundOffset_ >= offset )
+  {
+    if( foundOffset_ < limit )
+    {
+      matchOffset = foundOffset_;
+      basisOffset = foundBasisOffset_;
+      matchSize = foundSize_;
+    }
+    return true;
+  }
+  foundOffset_ = -1;
+
+  off_t position = offset;
+  while( position < limit && position + blockSize_ <= fileSize_ )
+  {
+    // The window, and the byte which comes in when it slides
+    bool canSlide = ( position + blockSize_ < fileSize_ );
+    const unsigned char* window = data( position, blockSize_ + ( canSlide ? 1 : 0 ) );
+    if( window == NULL )
+    {
+      return false;
+    }
+
+    if( rollingOffset_ != position )
+    {
+      rollingSums( window, blockSize_, rollingA_, rollingB_ );
+      rollingOffset_ = position;
+    }
+
+    int index = findBlock( rollingChecksum( rollingA_, rollingB_ ), window );
+    if( index != -1 )
+    {
+      // Files usually change in a few places: the blocks which follow are likely there too
+      off_t size = blockSize_;
+      while( size + blockSize_ <= DELTA_MAX_COPY_SIZE && position + size + blockSize_ <= fileSize_ )
+      {
+        const unsigned char* next = data( position + size, blockSize_ );
+        if( next == NULL )
+        {
+          return false;
+        }
+
+        uint32_t a, b;
+        rollingSums( next, blockSize_, a, b );
+        if( findBlock( rollingChecksum( a, b ), next, index + size / blockSize_ ) == -1 )
+        {
+          break;
+        }
+
+        size += blockSize_;
+      }
+
+      // The search goes on after the blocks
+      rollingOffset_ = -1;
+
+      foundOffset_ = matchOffset = position;
+      foundBasisOffset_ = basisOffset = (off_t)index * blockSize_;
+      foundSize_ = matchSize = size;
+      return true;
+    }
+
+    if( canSlide )
+    {
+      uint32_t out = window[ 0 ];
+      rollingA_ += window[ blockSize_ ] - out;
+      rollingB_ += rollingA_ - blockSize_ * out;
+      rollingOffset_ = position + 1;
+    }
+
+    position++;
+  }
+
+  return true;
+}
+
+
+
+bool FileDelta::isComplete() const
+{
+  return isComplete_;
+}
+
+
+
+bool FileDelta::isStarted() const
+{
+  return ( file_ != -1 );
+}
+
+
+
+bool FileDelta::sign( const int file, std::list<FileSignatureMessage*>& messages )
+{
+  struct stat status;
+  if( fstat( file, &status ) == -1 )
+  {
+    return false;
+  }
+
+  // The bigger the file, the bigger its blocks, so its signature doesn't grow as fast
+  off_t blockSize = (off_t)sqrt( (double)status.st_size );
+  blockSize = std::max( blockSize, ( status.st_size + SIGNATURE_MAX_BLOCKS - 1 ) / SIGNATURE_MAX_BLOCKS );
+  blockSize = std::max( blockSize, (off_t)DELTA_MIN_BLOCK_SIZE );
+  blockSize = ( blockSize + 1023 ) & ~1023;
+
+  // The last part of the file, shorter than a block, is left out
+  int blocksCount = status.st_size / blockSize;
+  if( blockSize > DELTA_MAX_BLOCK_SIZE || blocksCount == 0 )
+  {
+    return true;
+  }
+
+  posix_fadvise( file, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+  unsigned char* data = static_cast<unsigned char*>( malloc( blockSize ) );
+  FileSignatureMessage* message = NULL;
+
+  for( int i = 0; i < blocksCount; i++ )
+  {
+    off_t readSize = 0;
+    while( readSize < blockSize )
+    {
+      ssize_t readBytes = pread( file, data + readSize, blockSize - readSize, (off_t)i * blockSize + readSize );
+      if( readBytes == -1 && errno == EINTR )
+      {
+        continue;
+      }
+      if( readBytes <= 0 )
+      {
+        int error = ( readBytes == 0 ) ? EIO : errno;
+        free( data );
+        delete message;
+        while( messages.size() > 0 )
+        {
+          delete messages.front();
+          messages.pop_front();
+        }
+        errno = error;
+        return false;
+      }
+
+      readSize += readBytes;
+    }
+
+    FileSignatureMessage::Block block;
+    uint32_t a, b;
+    rollingSums( data, blockSize, a, b );
+    block.weak = rollingChecksum( a, b );
+    strongChecksum( data, blockSize, block.strong );
+
+    if( message != NULL && ! message->addBlock( block ) )
+    {
+      messages.push_back( message );
+      message = NULL;
+    }
+    if( message == NULL )
+    {
+      message = new FileSignatureMessage();
+      message->setBlockSize( blockSize );
+      message->addBlock( block );
+    }
+  }
+
+  message->markLast();
+  messages.push_back( message );
+
+  free( data );
+  return true;
+}
+
+
+
+bool FileDelta::start( const int file, const off_t fileSize )
+{
+  if( ! isComplete_ || blocksCount_ == 0 )
+  {
+    errno = EINVAL;
+    return false;
+  }
+
+  file_ = fcntl( file, F_DUPFD_CLOEXEC, 0 );
+  if( file_ == -1 )
+  {
+    return false;
+  }
+
+  if( buffer_ == NULL )
+  {
+    buffer_ = static_cast<unsigned char*>( malloc( DELTA_BUFFER_SIZE ) );
+  }
+
+  fileSize_ = fileSize;
+  bufferOffset_ = 0;
+  bufferSize_ = 0;
+  foundOffset_ = -1;
+  rollingOffset_ = -1;
+
+  return true;
+}
+
+
+
+void FileDelta::strongChecksum( const unsigned char* data, const int size, uint8_t* checksum )
+{
+  unsigned char digest[ EVP_MAX_MD_SIZE ];
+  memset( digest, '\0', sizeof( digest ) );
+
+  EVP_Digest( data, size, digest, NULL, EVP_md5(), NULL );
+
+  memcpy( checksum, digest, SIGNATURE_STRONG_SIZE );
+}
@@ -0,0 +1,208 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FILEDELTA_H
+#define FILEDELTA_H
+
+#include "filesignaturemessage.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <list>
+
+
+/**
+ * @def DELTA_MIN_BLOCK_SIZE
+ *
+ * Smallest block of a signature; smaller blocks would cost more to describe than to send.
+ */
+#define DELTA_MIN_BLOCK_SIZE   2048
+
+
+/**
+ * @def DELTA_MAX_BLOCK_SIZE
+ *
+ * Biggest block of a signature. Files which would need bigger ones are sent whole.
+ */
+#define DELTA_MAX_BLOCK_SIZE   ( 128 * 1024 )
+
+
+/**
+ * @def DELTA_MAX_COPY_SIZE
+ *
+ * Most bytes of consecutive unchanged blocks which a single copied block stands for.
+ */
+#define DELTA_MAX_COPY_SIZE   ( 4 * 1024 * 1024 )
+
+
+/**
+ * @def DELTA_BUFFER_SIZE
+ *
+ * Bytes of the file being sent read at once while looking for unchanged blocks.
+ */
+#define DELTA_BUFFER_SIZE   ( 1024 * 1024 )
+
+
+
+/**
+ * @class FileDelta
+ *
+ * Finds which parts of a file being sent its receiver already has, the way rsync does.
+ *
+ * The receiver splits its older copy of the file in blocks, and sends their signature:
+ * a cheap rolling checksum and a strong one for each of them. The sender slides a window
+ * of the same size over the file being sent, one byte at a time, updating the rolling
+ * checksum as it goes; only when it matches the one of a block is the strong checksum
+ * computed, to make sure.
+ *
+ * The blocks found don't need to be sent, just where they are in the older copy. Runs
+ * of unchanged blocks are described at once.
+ */
+class FileDelta
+{
+
+  public:
+
+    FileDelta();
+    ~FileDelta();
+
+    /**
+     * Take the next part of the signature of the receiver's copy.
+     *
+     * @return false if it doesn't fit with the previous parts; the whole signature is dropped
+     */
+    bool addSignature( const FileSignatureMessage* message );
+
+    /**
+     * Forget the signature and the file being sent.
+     */
+    void clear();
+
+    /**
+     * Find the next part of the file being sent which the receiver has already.
+     *
+     * @param offset Where to start looking; it never goes back from one call to the next
+     * @param limit Where to stop looking
+     * @param matchOffset Set to where the part starts, or to the limit
+     * @param basisOffset Set to where the part is in the receiver's copy
+     * @param matchSize Set to the bytes of the part, or to 0 if there's none before the limit
+     * @return false on error, with errno set
+     */
+    bool findMatch( const off_t offset, const off_t limit, off_t& matchOffset, off_t& basisOffset, off_t& matchSize );
+
+    /**
+     * Whether the whole signature of the receiver's copy has arrived.
+     */
+    bool isComplete() const;
+
+    /**
+     * Whether blocks are being looked for in a file.
+     */
+    bool isStarted() const;
+
+    /**
+     * Start looking for the blocks of the receiver's copy in the file being sent.
+     *
+     * @return false if the signature isn't complete, or on error with errno set
+     */
+    bool start( const int file, const off_t fileSize );
+
+    /**
+     * Compute the signature of a file.
+     *
+     * The messages are left empty when the file is too small or too big to be worth it.
+     *
+     * @return false on error, with errno set
+     */
+    static bool sign( const int file, std::list<FileSignatureMessage*>& messages );
+
+
+  private:
+
+    /// A block of the signature, in the lookup table
+    struct IndexEntry
+    {
+      uint32_t weak;
+      int index;
+    };
+
+
+  private:
+
+    /**
+     * Get some of the file being sent, reading more of it if needed.
+     *
+     * @return NULL on error, with errno set
+     */
+    const unsigned char* data( const off_t offset, const int size );
+
+    /**
+     * Find a block of the signature with the same checksums as some data.
+     *
+     * @param index If it's not -1, the only block which is looked at
+     * @return The index of the block, or -1
+     */
+    int findBlock( const uint32_t weak, const unsigned char* data, const int index = -1 );
+
+    /**
+     * Compute the strong checksum of a block.
+     */
+    static void strongChecksum( const unsigned char* data, const int size, uint8_t* checksum );
+
+
+  private:
+
+    /// Blocks of the signature, in order
+    FileSignatureMessage::Block* blocks_;
+
+    int blocksCount_;
+
+    int blockSize_;
+
+    /// Part of the file being sent which was read last
+    unsigned char* buffer_;
+    off_t bufferOffset_;
+    int bufferSize_;
+
+    /// Duplicate of the file being sent, or -1
+    int file_;
+
+    off_t fileSize_;
+
+    /// Match which was found beyond where the caller asked, to be given at the next call
+    off_t foundBasisOffset_;
+    off_t foundOffset_;
+    off_t foundSize_;
+
+    /// Blocks of the signature grouped by the tags of their rolling checksums
+    IndexEntry* index_;
+
+    bool isComplete_;
+
+    /// Whether the signature was dropped; what's left of it is ignored
+    bool isDropped_;
+
+    /// Sums making up the rolling checksum of the window
+    uint32_t rollingA_;
+    uint32_t rollingB_;
+
+    /// Where the window starts, or -1 if the sums must be computed again
+    off_t rollingOffset_;
+
+    /// Where each tag starts in index_, plus where the last one ends
+    int* tagStarts_;
+
+
+};
+
+
+
+#endif // FILEDELTA_H
@@ -0,0 +1,330 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "filereader.h"
+
+#include "crc32c.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+
+
+FileReader::FileReader()
+: blockPosition_( 0 )
+, buffer_( NULL )
+, bufferOffset_( 0 )
+, bufferSize_( 0 )
+, checksum_( 0 )
+, entryOffset_( 0 )
+, file_( -1 )
+, fileOffset_( 0 )
+, fileSize_( 0 )
+, size_( 0 )
+{
+  *directoryName_ = '\0';
+}
+
+
+
+FileReader::~FileReader()
+{
+  close();
+  free( buffer_ );
+}
+
+
+
+off_t FileReader::blockPosition() const
+{
+  return blockPosition_;
+}
+
+
+
+uint32_t FileReader::checksum() const
+{
+  return checksum_;
+}
+
+
+
+void FileReader::close()
+{
+  if( file_ != -1 )
+  {
+    ::close( file_ );
+    file_ = -1;
+  }
+
+  blockPosition_ = 0;
+  bufferOffset_ = 0;
+  bufferSize_ = 0;
+  checksum_ = 0;
+  entries_.clear();
+  entryOffset_ = 0;
+  fileOffset_ = 0;
+  fileSize_ = 0;
+  size_ = 0;
+}
+
+
+
+int FileReader::file() const
+{
+  return file_;
+}
+
+
+
+bool FileReader::isAtEnd() const
+{
+  return ( offset() >= size_ );
+}
+
+
+
+bool FileReader::isOpen() const
+{
+  return ( file_ != -1 );
+}
+
+
+
+off_t FileReader::offset() const
+{
+  return entryOffset_ + fileOffset_ + bufferOffset_;
+}
+
+
+
+bool FileReader::open( const char* fileName )
+{
+  close();
+
+  FileManifestMessage::Entry entry;
+  memset( &entry, '\0', sizeof( entry ) );
+  entries_.push_back( entry );
+
+  strncpy( directoryName_, fileName, PATH_MAX - 1 );
+  directoryName_[ PATH_MAX - 1 ] = '\0';
+
+  return rewind();
+}
+
+
+
+bool FileReader::open( const char* directoryName, const std::list<FileManifestMessage::Entry>& entries )
+{
+  close();
+
+  std::list<FileManifestMessage::Entry>::const_iterator it;
+  for( it = entries.begin(); it != entries.end(); it++ )
+  {
+    if( ! (*it).isDirectory )
+    {
+      entries_.push_back( *it );
+      size_ += (*it).size;
+    }
+  }
+
+  strncpy( directoryName_, directoryName, PATH_MAX - 1 );
+  directoryName_[ PATH_MAX - 1 ] = '\0';
+
+  return rewind();
+}
+
+
+
+bool FileReader::openEntry()
+{
+  if( file_ != -1 )
+  {
+    ::close( file_ );
+    file_ = -1;
+  }
+
+  // The empty files of a folder have nothing to send
+  while( entry_ != entries_.end() && *(*entry_).path != '\0' && (*entry_).size == 0 )
+  {
+    entry_++;
+  }
+  if( entry_ == entries_.end() )
+  {
+    return true;
+  }
+
+  bool isSingleFile = ( *(*entry_).path == '\0' );
+
+  char fileName[ PATH_MAX ];
+  if( isSingleFile )
+  {
+    strcpy( fileName, directoryName_ );
+  }
+  else if( snprintf( fileName, PATH_MAX, "%s/%s", directoryName_, (*entry_).path ) >= PATH_MAX )
+  {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  int newFile = ::open( fileName, O_RDONLY | O_CLOEXEC );
+  if( newFile == -1 )
+  {
+    return false;
+  }
+
+  struct stat status;
+  if( fstat( newFile, &status ) == -1 )
+  {
+    int error = errno;
+    ::close( newFile );
+    errno = error;
+    return false;
+  }
+
+  if( buffer_ == NULL )
+  {
+    buffer_ = static_cast<char*>( malloc( FILE_READ_AHEAD_SIZE ) );
+  }
+
+  // Let the system read ahead more aggressively, the file is read once from start to end
+  posix_fadvise( newFile, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+  file_ = newFile;
+  fileOffset_ = 0;
+  bufferOffset_ = 0;
+  bufferSize_ = 0;
+
+  // The files of a folder take the place they were announced with
+  fileSize_ = isSingleFile ? status.st_size : (*entry_).size;
+  if( isSingleFile )
+  {
+    size_ = fileSize_;
+  }
+
+  return true;
+}
+
+
+
+int FileReader::read( const char*& data, const int maxSize )
+{
+  // Move on to the next file of the folder
+  if( fileOffset_ + bufferOffset_ >= fileSize_ && entry_ != entries_.end() && offset() < size_ )
+  {
+    entryOffset_ += fileSize_;
+    fileSize_ = 0;
+    entry_++;
+    if( ! openEntry() )
+    {
+      return -1;
+    }
+  }
+
+  int available = bufferSize_ - bufferOffset_;
+  off_t bufferEnd = fileOffset_ + bufferSize_;
+
+  if( available < maxSize && bufferEnd < fileSize_ )
+  {
+    // Keep what's left of the buffer in front of the next part of the file, so blocks are never split
+    memmove( buffer_, buffer_ + bufferOffset_, available );
+    fileOffset_ += bufferOffset_;
+    bufferOffset_ = 0;
+    bufferSize_ = available;
+
+    size_t wanted = std::min( (off_t)( FILE_READ_AHEAD_SIZE - available ), fileSize_ - bufferEnd );
+    ssize_t readBytes;
+    do
+    {
+      readBytes = pread( file_, buffer_ + available, wanted, bufferEnd );
+    }
+    while( readBytes == -1 && errno == EINTR );
+
+    if( readBytes == -1 )
+    {
+      return -1;
+    }
+
+    // The file got shorter since it was opened; the files of a folder can't, the ones
+    // which follow would be out of place
+    if( (size_t)readBytes < wanted && *(*entry_).path != '\0' )
+    {
+      errno = EIO;
+      return -1;
+    }
+    if( (size_t)readBytes < wanted )
+    {
+      fileSize_ = bufferEnd + readBytes;
+      size_ = fileSize_;
+    }
+
+    bufferSize_ += readBytes;
+    available = bufferSize_;
+
+    // Have the next part loaded while this one is being sent
+    posix_fadvise( file_, fileOffset_ + bufferSize_, FILE_READ_AHEAD_SIZE, POSIX_FADV_WILLNEED );
+  }
+
+  int size = std::min( maxSize, available );
+  data = buffer_ + bufferOffset_;
+  blockPosition_ = fileOffset_ + bufferOffset_;
+  bufferOffset_ += size;
+  checksum_ = Crc32c::update( checksum_, data, size );
+
+  return size;
+}
+
+
+
+bool FileReader::rewind()
+{
+  blockPosition_ = 0;
+  checksum_ = 0;
+  entryOffset_ = 0;
+  fileOffset_ = 0;
+  fileSize_ = 0;
+  bufferOffset_ = 0;
+  bufferSize_ = 0;
+
+  entry_ = entries_.begin();
+  return openEntry();
+}
+
+
+
+bool FileReader::seek( const off_t position )
+{
+  return ( rewind() && skip( position ) );
+}
+
+
+
+bool FileReader::skip( const off_t size )
+{
+  const off_t position = std::min( offset() + size, size_ );
+
+  const char* data;
+  while( offset() < position )
+  {
+    if( read( data, std::min( (off_t)FILE_READ_AHEAD_SIZE, position - offset() ) ) == -1 )
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,189 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FILEREADER_H
+#define FILEREADER_H
+
+#include "filemanifestmessage.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <list>
+
+
+/**
+ * @def FILE_READ_AHEAD_SIZE
+ *
+ * Bytes of the file read at once. While they're being sent, the system is asked
+ * to load the following ones.
+ */
+#define FILE_READ_AHEAD_SIZE   ( 256 * 1024 )
+
+
+
+/**
+ * @class FileReader
+ *
+ * Reads a file to be sent, sequentially, in blocks.
+ *
+ * The file is read with a single system call for many blocks, and the blocks are
+ * taken straight from the read-ahead buffer, without copying them first.
+ *
+ * A folder is read as a single file, made of its files one after the other; a block
+ * never spans two of them.
+ *
+ * The checksum of what was read so far is kept along the way.
+ */
+class FileReader
+{
+
+  public:
+
+    FileReader();
+    ~FileReader();
+
+    /**
+     * Where the last block taken is, in the file it was read from.
+     */
+    off_t blockPosition() const;
+
+    /**
+     * CRC-32C checksum of the file, from its beginning to the current position.
+     */
+    uint32_t checksum() const;
+
+    void close();
+
+    /**
+     * The descriptor of the file the last block was read from, or -1.
+     */
+    int file() const;
+
+    /**
+     * Whether the whole file has been read.
+     */
+    bool isAtEnd() const;
+
+    bool isOpen() const;
+
+    /**
+     * Position of the next byte to be read.
+     */
+    off_t offset() const;
+
+    /**
+     * Open a file, and start reading from its beginning.
+     *
+     * @return false if the file can't be opened; errno tells why
+     */
+    bool open( const char* fileName );
+
+    /**
+     * Open the files of a folder, and start reading from the beginning of the first one.
+     *
+     * @param entries Contents of the folder; the files are read in this order, for the
+     *                sizes they're listed with
+     * @return false if the first file can't be opened; errno tells why
+     */
+    bool open( const char* directoryName, const std::list<FileManifestMessage::Entry>& entries );
+
+    /**
+     * Take the next block of the file.
+     *
+     * @param data Set to the block, which is valid until the next call
+     * @param maxSize Maximum length of the block
+     * @return The length of the block, shorter only at the end of the file; or -1 on error, with errno set
+     */
+    int read( const char*& data, const int maxSize );
+
+    /**
+     * Continue reading from another position.
+     *
+     * The part of the file before it is read through anyway, to keep the checksum.
+     *
+     * @return false on error, with errno set
+     */
+    bool seek( const off_t position );
+
+    /**
+     * Move past some of the file, which the receivers already have.
+     *
+     * Like seek(), it reads it through for the checksum.
+     *
+     * @return false on error, with errno set
+     */
+    bool skip( const off_t size );
+
+
+  private:
+
+    /**
+     * Open the current entry, or the first one after it which isn't empty.
+     *
+     * @return false on error, with errno set
+     */
+    bool openEntry();
+
+    /**
+     * Go back to the beginning of the first file.
+     *
+     * @return false on error, with errno set
+     */
+    bool rewind();
+
+
+  private:
+
+    /// Position of the last block taken, in file_
+    off_t blockPosition_;
+
+    /// Read-ahead buffer
+    char* buffer_;
+
+    /// Offset of the next byte to take from the buffer
+    int bufferOffset_;
+
+    /// Bytes in the buffer
+    int bufferSize_;
+
+    /// Checksum of the file up to the current position
+    uint32_t checksum_;
+
+    /// The file being sent, or the folder holding the files being sent
+    char directoryName_[ PATH_MAX ];
+
+    /// Files to read; for a single file, one entry without a path
+    std::list<FileManifestMessage::Entry> entries_;
+
+    /// File being read
+    std::list<FileManifestMessage::Entry>::const_iterator entry_;
+
+    /// Position of the file being read, from the beginning of the first one
+    off_t entryOffset_;
+
+    int file_;
+
+    /// Position in the file of the beginning of the buffer
+    off_t fileOffset_;
+
+    /// Length of the file being read: for a single file, when it was opened; otherwise, as it was listed
+    off_t fileSize_;
+
+    /// Length of all the files together
+    off_t size_;
+
+
+};
+
+
+
+#endif // FILEREADER_H
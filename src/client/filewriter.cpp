@@ -0,0 +1,723 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "filewriter.h"
+
+#include "common.h"
+#include "crc32c.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+
+
+
+/**
+ * Write data at a position of a file, retrying until it's all written.
+ *
+ * @return false on error, with errno set
+ */
+static bool writeAt( const int file, const char* data, const int size, const off_t offset )
+{
+  int written = 0;
+  while( written < size )
+  {
+    ssize_t writtenBytes = pwrite( file, data + written, size - written, offset + written );
+    if( writtenBytes == -1 )
+    {
+      if( errno == EINTR )
+      {
+        continue;
+      }
+
+      return false;
+    }
+
+    written += writtenBytes;
+  }
+
+  return true;
+}
+
+
+
+FileWriter::FileWriter()
+: basis_( -1 )
+, buffer_( NULL )
+, bufferOffset_( 0 )
+, bufferSize_( 0 )
+, checksum_( 0 )
+, checksumSize_( 0 )
+, committedSize_( 0 )
+, contiguousSize_( 0 )
+, directory_( -1 )
+, entryOffset_( -1 )
+, file_( -1 )
+, recordFile_( -1 )
+, transferId_( 0 )
+{
+  *recordName_ = '\0';
+}
+
+
+
+FileWriter::~FileWriter()
+{
+  close();
+  free( buffer_ );
+}
+
+
+
+int FileWriter::basis() const
+{
+  return basis_;
+}
+
+
+
+bool FileWriter::checksum( uint32_t& checksum )
+{
+  if( ! flush() )
+  {
+    return false;
+  }
+
+  // Read what came out of order, or was saved by a previous transfer
+  while( checksumSize_ < contiguousSize_ )
+  {
+    size_t wanted = std::min( (off_t)FILE_WRITE_BEHIND_SIZE, contiguousSize_ - checksumSize_ );
+    ssize_t readBytes = readAt( buffer_, wanted, checksumSize_ );
+    if( readBytes == -1 && errno == EINTR )
+    {
+      continue;
+    }
+    if( readBytes == -1 )
+    {
+      return false;
+    }
+
+    // The file got shorter behind our back
+    if( readBytes == 0 )
+    {
+      errno = EIO;
+      return false;
+    }
+
+    checksum_ = Crc32c::update( checksum_, buffer_, readBytes );
+    checksumSize_ += readBytes;
+  }
+
+  checksum = checksum_;
+  return true;
+}
+
+
+
+void FileWriter::close()
+{
+  if( basis_ != -1 )
+  {
+    ::close( basis_ );
+    basis_ = -1;
+  }
+
+  if( ! isOpen() )
+  {
+    return;
+  }
+
+  if( ! flush() )
+  {
+    Common::error( "Unable to write the file: %s", strerror( errno ) );
+  }
+
+  // The next transfer of the file can continue from here
+  if( recordFile_ != -1 )
+  {
+    commit();
+    ::close( recordFile_ );
+    recordFile_ = -1;
+  }
+
+  if( file_ != -1 )
+  {
+    ::close( file_ );
+    file_ = -1;
+  }
+  if( directory_ != -1 )
+  {
+    ::close( directory_ );
+    directory_ = -1;
+  }
+  entries_.clear();
+  entryOffset_ = -1;
+  scattered_.clear();
+}
+
+
+
+void FileWriter::commit()
+{
+  if( contiguousSize_ == committedSize_ )
+  {
+    return;
+  }
+
+  // The record must never claim more than what would survive a crash
+  if( ! sync( false ) )
+  {
+    Common::error( "Unable to sync the file: %s", strerror( errno ) );
+    return;
+  }
+
+  ResumeRecord record;
+  record.transferId = transferId_;
+  record.committedSize = contiguousSize_;
+  if( pwrite( recordFile_, &record, sizeof( ResumeRecord ), 0 ) != sizeof( ResumeRecord ) )
+  {
+    Common::error( "Unable to update %s: %s", recordName_, strerror( errno ) );
+    return;
+  }
+
+  committedSize_ = contiguousSize_;
+}
+
+
+
+off_t FileWriter::committedSize() const
+{
+  return committedSize_;
+}
+
+
+
+bool FileWriter::copy( const off_t basisOffset, const off_t size, const off_t offset )
+{
+  if( basis_ == -1 )
+  {
+    errno = EBADF;
+    return false;
+  }
+
+  // Not in the write-behind buffer, which the data goes to
+  char* data = static_cast<char*>( malloc( FILE_WRITE_BEHIND_SIZE ) );
+
+  off_t copied = 0;
+  while( copied < size )
+  {
+    size_t wanted = std::min( (off_t)FILE_WRITE_BEHIND_SIZE, size - copied );
+    ssize_t readBytes = pread( basis_, data, wanted, basisOffset + copied );
+    if( readBytes == -1 && errno == EINTR )
+    {
+      continue;
+    }
+
+    // Nothing else can change the older copy: it's shorter than the sender was told
+    if( readBytes == 0 )
+    {
+      errno = EIO;
+    }
+    if( readBytes <= 0 || ! write( data, readBytes, offset + copied ) )
+    {
+      int error = errno;
+      free( data );
+      errno = error;
+      return false;
+    }
+
+    copied += readBytes;
+  }
+
+  free( data );
+  return true;
+}
+
+
+
+bool FileWriter::finish()
+{
+  if( ! isOpen() )
+  {
+    return true;
+  }
+
+  bool isWritten = flush();
+  int error = errno;
+
+  // Only report the file as received once it would survive a crash
+  if( isWritten && ! sync( true ) )
+  {
+    isWritten = false;
+    error = errno;
+  }
+
+  if( file_ != -1 && ::close( file_ ) == -1 && isWritten )
+  {
+    isWritten = false;
+    error = errno;
+  }
+
+  file_ = -1;
+  if( directory_ != -1 )
+  {
+    ::close( directory_ );
+    directory_ = -1;
+  }
+  if( basis_ != -1 )
+  {
+    ::close( basis_ );
+    basis_ = -1;
+  }
+  bufferSize_ = 0;
+  entries_.clear();
+  entryOffset_ = -1;
+  scattered_.clear();
+
+  // Complete files don't need to be resumed
+  if( recordFile_ != -1 )
+  {
+    ::close( recordFile_ );
+    recordFile_ = -1;
+    if( isWritten )
+    {
+      unlink( recordName_ );
+    }
+  }
+
+  errno = error;
+  return isWritten;
+}
+
+
+
+bool FileWriter::flush()
+{
+  bool isWritten = writeData( buffer_, bufferSize_, bufferOffset_ );
+
+  bufferOffset_ += bufferSize_;
+  bufferSize_ = 0;
+
+  if( isWritten && recordFile_ != -1 && contiguousSize_ - committedSize_ >= FILE_RESUME_INTERVAL )
+  {
+    commit();
+  }
+
+  return isWritten;
+}
+
+
+
+bool FileWriter::isOpen() const
+{
+  return ( file_ != -1 || directory_ != -1 );
+}
+
+
+
+bool FileWriter::open( const char* fileName, const off_t fileSize, const uint64_t transferId, const bool keepsBasis )
+{
+  close();
+
+  bufferOffset_ = 0;
+  bufferSize_ = 0;
+  checksum_ = 0;
+  checksumSize_ = 0;
+  committedSize_ = 0;
+  contiguousSize_ = 0;
+  transferId_ = transferId;
+
+  // Keep what a previous transfer of the same file has left
+  readRecord( fileName, transferId );
+
+  struct stat status;
+  if( committedSize_ > 0 && ( stat( fileName, &status ) == -1 || status.st_size < committedSize_ ) )
+  {
+    committedSize_ = 0;
+    contiguousSize_ = 0;
+  }
+
+  // The new file takes the place of the older copy, which stays readable until it's closed.
+  // Links are left alone, as writing through them changes other files
+  if( keepsBasis && committedSize_ == 0 && lstat( fileName, &status ) == 0
+  &&  S_ISREG( status.st_mode ) && status.st_nlink == 1 && status.st_size > 0 )
+  {
+    basis_ = ::open( fileName, O_RDONLY | O_CLOEXEC );
+    if( basis_ != -1 && unlink( fileName ) == -1 )
+    {
+      ::close( basis_ );
+      basis_ = -1;
+    }
+  }
+
+  // Parts of the file may have to be read back for its checksum
+  int flags = O_RDWR | O_CREAT | O_CLOEXEC | ( committedSize_ == 0 ? O_TRUNC : 0 );
+  file_ = ::open( fileName, flags, 0666 );
+  if( file_ == -1 )
+  {
+    int error = errno;
+    if( recordFile_ != -1 )
+    {
+      ::close( recordFile_ );
+      recordFile_ = -1;
+    }
+    if( basis_ != -1 )
+    {
+      ::close( basis_ );
+      basis_ = -1;
+    }
+    errno = error;
+    return false;
+  }
+
+  FileManifestMessage::Entry entry;
+  memset( &entry, '\0', sizeof( entry ) );
+  entries_[ 0 ] = entry;
+  entryOffset_ = 0;
+
+  startRecord();
+
+  if( buffer_ == NULL )
+  {
+    buffer_ = static_cast<char*>( malloc( FILE_WRITE_BEHIND_SIZE ) );
+  }
+
+  // Reserve the space in one go. The size grows only with the data, so a transfer
+  // which is interrupted doesn't leave a file which looks complete
+  if( fileSize > 0 && fallocate( file_, FALLOC_FL_KEEP_SIZE, 0, fileSize ) == -1 )
+  {
+    Common::debug( "Unable to reserve %lld bytes for %s: %s", (long long)fileSize, fileName, strerror( errno ) );
+  }
+
+  return true;
+}
+
+
+
+bool FileWriter::open( const char* directoryName, const std::list<FileManifestMessage::Entry>& entries, const uint64_t transferId )
+{
+  close();
+
+  bufferOffset_ = 0;
+  bufferSize_ = 0;
+  checksum_ = 0;
+  checksumSize_ = 0;
+  committedSize_ = 0;
+  contiguousSize_ = 0;
+  transferId_ = transferId;
+
+  // Keep what a previous transfer of the same folder has left, if its files are still there
+  readRecord( directoryName, transferId );
+
+  std::list<FileManifestMessage::Entry>::const_iterator it;
+  off_t offset = 0;
+  for( it = entries.begin(); it != entries.end() && committedSize_ > 0; it++ )
+  {
+    char fileName[ PATH_MAX ];
+    snprintf( fileName, PATH_MAX, "%s/%s", directoryName, (*it).path );
+
+    struct stat status;
+    off_t kept = std::min( (off_t)(*it).size, committedSize_ - offset );
+    if( ! (*it).isDirectory && kept > 0 && ( stat( fileName, &status ) == -1 || status.st_size < kept ) )
+    {
+      committedSize_ = 0;
+      contiguousSize_ = 0;
+    }
+    offset += (*it).isDirectory ? 0 : (*it).size;
+  }
+
+  if( mkdir( directoryName, 0777 ) == -1 && errno != EEXIST )
+  {
+    directory_ = -1;
+  }
+  else
+  {
+    directory_ = ::open( directoryName, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  }
+
+  if( directory_ == -1 )
+  {
+    int error = errno;
+    if( recordFile_ != -1 )
+    {
+      ::close( recordFile_ );
+      recordFile_ = -1;
+    }
+    errno = error;
+    return false;
+  }
+
+  // Create everything up front: the empty files and folders never get any blocks.
+  // The folders come before what they contain
+  offset = 0;
+  for( it = entries.begin(); it != entries.end(); it++ )
+  {
+    const FileManifestMessage::Entry& entry = *it;
+    if( entry.isDirectory )
+    {
+      if( mkdirat( directory_, entry.path, 0777 ) == -1 && errno != EEXIST )
+      {
+        int error = errno;
+        Common::error( "Unable to create the folder %s/%s: %s", directoryName, entry.path, strerror( error ) );
+        close();
+        errno = error;
+        return false;
+      }
+      continue;
+    }
+
+    // The size grows only with the data, like for single files
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC | ( offset >= committedSize_ ? O_TRUNC : 0 );
+    int file = openat( directory_, entry.path, flags, 0666 );
+    if( file == -1 )
+    {
+      int error = errno;
+      Common::error( "Unable to create the file %s/%s: %s", directoryName, entry.path, strerror( error ) );
+      close();
+      errno = error;
+      return false;
+    }
+    if( entry.size > 0 && fallocate( file, FALLOC_FL_KEEP_SIZE, 0, entry.size ) == -1 )
+    {
+      Common::debug( "Unable to reserve %lld bytes for %s: %s", (long long)entry.size, entry.path, strerror( errno ) );
+    }
+    ::close( file );
+
+    if( entry.size > 0 )
+    {
+      entries_[ offset ] = entry;
+      offset += entry.size;
+    }
+  }
+
+  startRecord();
+
+  if( buffer_ == NULL )
+  {
+    buffer_ = static_cast<char*>( malloc( FILE_WRITE_BEHIND_SIZE ) );
+  }
+
+  return true;
+}
+
+
+
+bool FileWriter::openEntry( const off_t offset, off_t& position, off_t& length )
+{
+  std::map<off_t,FileManifestMessage::Entry>::iterator it = entries_.upper_bound( offset );
+  if( it == entries_.begin() )
+  {
+    errno = EINVAL;
+    return false;
+  }
+  it--;
+
+  position = offset - (*it).first;
+
+  // A single file can grow as much as it needs
+  if( directory_ == -1 )
+  {
+    length = std::numeric_limits<off_t>::max() - position;
+    return true;
+  }
+
+  // Nothing goes past the last file of a folder
+  length = (*it).second.size - position;
+  if( length <= 0 )
+  {
+    errno = EFBIG;
+    return false;
+  }
+
+  if( entryOffset_ == (*it).first )
+  {
+    return true;
+  }
+
+  if( file_ != -1 )
+  {
+    ::close( file_ );
+    entryOffset_ = -1;
+  }
+
+  file_ = openat( directory_, (*it).second.path, O_RDWR | O_CLOEXEC );
+  if( file_ == -1 )
+  {
+    return false;
+  }
+
+  entryOffset_ = (*it).first;
+  return true;
+}
+
+
+
+ssize_t FileWriter::readAt( char* data, const size_t size, const off_t offset )
+{
+  off_t position, length;
+  if( ! openEntry( offset, position, length ) )
+  {
+    return -1;
+  }
+
+  return pread( file_, data, std::min( (off_t)size, length ), position );
+}
+
+
+
+void FileWriter::readRecord( const char* fileName, const uint64_t transferId )
+{
+  if( transferId == 0 )
+  {
+    return;
+  }
+
+  snprintf( recordName_, PATH_MAX, "%s" FILE_RESUME_SUFFIX, fileName );
+  recordFile_ = ::open( recordName_, O_RDWR | O_CREAT | O_CLOEXEC, 0666 );
+  if( recordFile_ == -1 )
+  {
+    Common::error( "Unable to open %s, the file won't be resumable: %s", recordName_, strerror( errno ) );
+    return;
+  }
+
+  ResumeRecord record;
+  if( pread( recordFile_, &record, sizeof( ResumeRecord ), 0 ) == sizeof( ResumeRecord )
+  &&  record.transferId == transferId
+  &&  record.committedSize >= 0 )
+  {
+    committedSize_ = record.committedSize;
+    contiguousSize_ = record.committedSize;
+  }
+}
+
+
+
+void FileWriter::startRecord()
+{
+  if( recordFile_ == -1 || committedSize_ > 0 )
+  {
+    return;
+  }
+
+  // Whatever the record told is about another file
+  ResumeRecord record;
+  record.transferId = transferId_;
+  record.committedSize = 0;
+  if( pwrite( recordFile_, &record, sizeof( ResumeRecord ), 0 ) != sizeof( ResumeRecord ) )
+  {
+    Common::error( "Unable to update %s: %s", recordName_, strerror( errno ) );
+  }
+  ftruncate( recordFile_, sizeof( ResumeRecord ) );
+}
+
+
+
+bool FileWriter::sync( const bool withMetadata )
+{
+  // The blocks of a folder may have gone to any of its files: flush the whole file system
+  // once, rather than each file
+  if( directory_ != -1 )
+  {
+    return ( syncfs( directory_ ) == 0 );
+  }
+
+  return ( ( withMetadata ? fsync( file_ ) : fdatasync( file_ ) ) == 0 );
+}
+
+
+
+bool FileWriter::write( const char* data, const int size, const off_t offset )
+{
+  if( offset == checksumSize_ )
+  {
+    checksum_ = Crc32c::update( checksum_, data, size );
+    checksumSize_ += size;
+  }
+
+  bool isFollowing = ( offset == bufferOffset_ + bufferSize_ );
+
+  if( ! isFollowing || bufferSize_ + size > FILE_WRITE_BEHIND_SIZE )
+  {
+    if( ! flush() )
+    {
+      return false;
+    }
+
+    bufferOffset_ = offset;
+  }
+
+  // Blocks which wouldn't fit anyway don't need to be copied
+  if( size > FILE_WRITE_BEHIND_SIZE )
+  {
+    bufferOffset_ = offset + size;
+    if( ! writeData( data, size, offset ) )
+    {
+      return false;
+    }
+  }
+  else
+  {
+    memcpy( buffer_ + bufferSize_, data, size );
+    bufferSize_ += size;
+  }
+
+  // Follow how much of the file has no holes; only now, as flush() commits it to the
+  // resume record, which must not claim a block before it's at least buffered
+  if( offset <= contiguousSize_ )
+  {
+    contiguousSize_ = std::max( contiguousSize_, offset + size );
+
+    std::map<off_t,off_t>::iterator it;
+    while( ( it = scattered_.begin() ) != scattered_.end() && (*it).first <= contiguousSize_ )
+    {
+      contiguousSize_ = std::max( contiguousSize_, (*it).second );
+      scattered_.erase( it );
+    }
+  }
+  else
+  {
+    off_t& end = scattered_[ offset ];
+    end = std::max( end, offset + size );
+  }
+
+  return true;
+}
+
+
+
+bool FileWriter::writeData( const char* data, const int size, const off_t offset )
+{
+  int written = 0;
+  while( written < size )
+  {
+    off_t position, length;
+    if( ! openEntry( offset + written, position, length ) )
+    {
+      return false;
+    }
+
+    int part = std::min( (off_t)( size - written ), length );
+    if( ! writeAt( file_, data + written, part, position ) )
+    {
+      return false;
+    }
+
+    written += part;
+  }
+
+  return true;
+}
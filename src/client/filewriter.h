@@ -0,0 +1,275 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+#include "filemanifestmessage.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <list>
+#include <map>
+
+
+/**
+ * @def FILE_WRITE_BEHIND_SIZE
+ *
+ * Bytes of consecutive blocks gathered before writing them to the file at once.
+ */
+#define FILE_WRITE_BEHIND_SIZE   ( 256 * 1024 )
+
+
+/**
+ * @def FILE_RESUME_SUFFIX
+ *
+ * Appended to the name of a file being received, to name the record of how much of it
+ * is saved.
+ */
+#define FILE_RESUME_SUFFIX   ".resume"
+
+
+/**
+ * @def FILE_RESUME_INTERVAL
+ *
+ * Bytes received between the updates of the resume record. Each update waits for the
+ * file to be on disk.
+ */
+#define FILE_RESUME_INTERVAL   ( 8 * 1024 * 1024 )
+
+
+
+/**
+ * @class FileWriter
+ *
+ * Saves a file being received, in blocks which usually arrive in order.
+ *
+ * The space for the whole file is reserved when it's opened, so it isn't fragmented
+ * while it grows. Consecutive blocks are gathered and written together; a block which
+ * doesn't follow the previous ones just starts a new batch.
+ *
+ * Files which can be resumed are kept if the transfer is interrupted, along with a record
+ * of how much of them is on disk. When the same file is received again at the same place,
+ * only the rest of it is needed.
+ *
+ * The checksum of the file is kept while its blocks arrive in order; whatever it doesn't
+ * cover is read back from the disk when it's asked for.
+ *
+ * A folder is received as a single file, made of its files one after the other: they're
+ * all created when it's opened, and each block is written to the ones it belongs to.
+ *
+ * An older copy of the file found at its place can be kept aside, as the basis of a delta
+ * transfer: the parts of it which didn't change are copied rather than received.
+ */
+class FileWriter
+{
+
+  public:
+
+    FileWriter();
+    ~FileWriter();
+
+    /**
+     * The older copy of the file which was at its place, or -1.
+     */
+    int basis() const;
+
+    /**
+     * Compute the CRC-32C checksum of the file, up to where it has no holes.
+     *
+     * @param checksum Set to the checksum
+     * @return false on error, with errno set
+     */
+    bool checksum( uint32_t& checksum );
+
+    /**
+     * Write what's left, and close the file.
+     *
+     * If the file isn't complete and can be resumed, its record is brought up to date.
+     */
+    void close();
+
+    /**
+     * Bytes from the beginning of the file which are on disk, without holes.
+     *
+     * Right after open(), it tells where the transfer can continue from.
+     */
+    off_t committedSize() const;
+
+    /**
+     * Save a part of the file taken from its older copy.
+     *
+     * @return false on error, with errno set
+     */
+    bool copy( const off_t basisOffset, const off_t size, const off_t offset );
+
+    /**
+     * Write what's left, wait until the whole file is on disk, and close it.
+     *
+     * @return false on error, with errno set; the file is closed anyway
+     */
+    bool finish();
+
+    bool isOpen() const;
+
+    /**
+     * Create a file, or continue one which was partially received.
+     *
+     * @param fileName Where to save the file
+     * @param fileSize Expected size of the file, or 0 if unknown
+     * @param transferId Identifies the file across transfers, or 0 if it can't be resumed
+     * @param keepsBasis Whether to keep a file already at that place as the basis of a
+     *                   delta transfer, unless the transfer continues
+     * @return false if the file can't be created; errno tells why
+     */
+    bool open( const char* fileName, const off_t fileSize, const uint64_t transferId, const bool keepsBasis = false );
+
+    /**
+     * Create a folder and its contents, or continue one which was partially received.
+     *
+     * @param directoryName Where to save the folder
+     * @param entries Contents of the folder; the files follow each other in this order
+     * @param transferId Identifies the folder across transfers, or 0 if it can't be resumed
+     * @return false if the folder or its contents can't be created; errno tells why
+     */
+    bool open( const char* directoryName, const std::list<FileManifestMessage::Entry>& entries, const uint64_t transferId );
+
+    /**
+     * Save a block of the file.
+     *
+     * @return false on error, with errno set
+     */
+    bool write( const char* data, const int size, const off_t offset );
+
+
+  private:
+
+    /// Contents of the resume record
+    struct ResumeRecord
+    {
+      uint64_t transferId;
+      int64_t committedSize;
+    };
+
+
+  private:
+
+    /**
+     * Make sure the file is on disk up to where it has no holes, and write it down
+     * in the resume record.
+     */
+    void commit();
+
+    /**
+     * Write the gathered blocks to the file.
+     *
+     * @return false on error, with errno set
+     */
+    bool flush();
+
+    /**
+     * Open the file which holds a position of the transfer: the file itself, or one of
+     * the files of the folder.
+     *
+     * @param position Set to where the position is in that file
+     * @param length Set to the bytes of that file from the position on
+     * @return false on error, with errno set
+     */
+    bool openEntry( const off_t offset, off_t& position, off_t& length );
+
+    /**
+     * Read back a part of the transfer, from a single file.
+     *
+     * @return The bytes read, 0 at the end of the file, or -1 on error, with errno set
+     */
+    ssize_t readAt( char* data, const size_t size, const off_t offset );
+
+    /**
+     * Open the resume record, and take from it how much of the transfer is on disk already.
+     */
+    void readRecord( const char* fileName, const uint64_t transferId );
+
+    /**
+     * Start a new resume record, unless the transfer continues a previous one.
+     */
+    void startRecord();
+
+    /**
+     * Make sure that what was written is on disk.
+     *
+     * @return false on error, with errno set
+     */
+    bool sync( const bool withMetadata );
+
+    /**
+     * Write a part of the transfer, over as many files as it spans.
+     *
+     * @return false on error, with errno set
+     */
+    bool writeData( const char* data, const int size, const off_t offset );
+
+
+  private:
+
+    /// Older copy of the file, no longer linked at its place; or -1
+    int basis_;
+
+    /// Write-behind buffer
+    char* buffer_;
+
+    /// Position in the file of the beginning of the buffer
+    off_t bufferOffset_;
+
+    /// Bytes in the buffer
+    int bufferSize_;
+
+    /// Checksum of the file up to checksumSize_
+    uint32_t checksum_;
+
+    /// Bytes from the beginning covered by the checksum
+    off_t checksumSize_;
+
+    /// Bytes from the beginning which were on disk at the last update of the resume record
+    off_t committedSize_;
+
+    /// Bytes from the beginning which were written or buffered, without holes
+    off_t contiguousSize_;
+
+    /// The folder being received, or -1 for a single file
+    int directory_;
+
+    /// Files of the folder which aren't empty, by their position in the transfer; for a
+    /// single file, one entry without a path
+    std::map<off_t,FileManifestMessage::Entry> entries_;
+
+    /// Position in the transfer of the open file
+    off_t entryOffset_;
+
+    /// The file being received, or the file of the folder written last
+    int file_;
+
+    /// Resume record, or -1 if the file can't be resumed
+    int recordFile_;
+
+    char recordName_[ PATH_MAX ];
+
+    /// Blocks written past a hole, as their beginning and end offsets; merged as the holes fill
+    std::map<off_t,off_t> scattered_;
+
+    uint64_t transferId_;
+
+
+};
+
+
+
+#endif // FILEWRITER_H
@@ -11,8 +11,11 @@
 #include "client.h"
 #include "common.h"
 #include "errors.h"
+#include "stripemessage.h"
+#include "tls.h"
 
 #include <netdb.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -23,8 +26,15 @@
 
 void usage( const char* programName )
 {
-  fprintf( stderr, "Usage: %s [address]\n",programName );
+  fprintf( stderr, "Usage: %s [-t] [-c certificate] [-d count] [-p] [address]\n",programName );
   fprintf( stderr, "If the [address] argument is omitted, the client will try to connect to %s.\n", DEFAULT_SERVER_IP );
+  fprintf( stderr, "  -t  Encrypt the connection with TLS; the server certificate must be trusted by the system.\n" );
+  fprintf( stderr, "  -c  Encrypt the connection with TLS, trusting the certificate in the given PEM file,\n" );
+  fprintf( stderr, "      like the server's own self-signed one.\n" );
+  fprintf( stderr, "  -d  Data connections to open for the file transfers besides the session, if the server\n" );
+  fprintf( stderr, "      allows them: 0 to %d (default: %d).\n", MAX_FILE_STRIPES, FILE_STRIPES );
+  fprintf( stderr, "  -p  Send files straight to their receivers, which connect to this computer; the server\n" );
+  fprintf( stderr, "      only brokers the transfers. Not available with TLS.\n" );
 }
 
 
@@ -41,18 +51,52 @@ int main( int argc, char* argv[] )
 
   // Check command-line arguments:
 
-  in_addr serverIp;
-  serverIp.s_addr = htonl( INADDR_LOOPBACK );
+  bool isEncrypted = false;
+  const char* caFile = NULL;
+  int fileStripes = FILE_STRIPES;
+  bool directFiles = false;
 
-  const char* serverIpString = argv[ 1 ];
-  if( argc == 2 )
+  int option;
+  while( ( option = getopt( argc, argv, "c:d:hpt" ) ) != -1 )
   {
-    if( strcmp( serverIpString, "-h" ) == 0 )
+    switch( option )
     {
-      usage( argv[ 0 ] );
-      return 1;
+      case 'c':
+        caFile = optarg;
+        isEncrypted = true;
+        break;
+      case 'd':
+        fileStripes = atoi( optarg );
+        if( fileStripes < 0 || fileStripes > MAX_FILE_STRIPES )
+        {
+          usage( argv[ 0 ] );
+          return 1;
+        }
+        break;
+      case 'p':
+        directFiles = true;
+        break;
+      case 't':
+        isEncrypted = true;
+        break;
+      default:
+        usage( argv[ 0 ] );
+        return 1;
     }
+  }
+
+  if( argc - optind > 1 )
+  {
+    usage( argv[ 0 ] );
+    return 1;
+  }
+
+  in_addr serverIp;
+  serverIp.s_addr = htonl( INADDR_LOOPBACK );
 
+  const char* serverIpString = argv[ optind ];
+  if( optind < argc )
+  {
     hostent* host = gethostbyname( serverIpString );
 
     if( ! host || h_errno != NETDB_SUCCESS )
@@ -67,24 +111,36 @@ int main( int argc, char* argv[] )
     serverIpString = DEFAULT_SERVER_IP;
   }
 
+  // The server certificate is checked against the name the user gave
+  SSL_CTX* tlsContext = NULL;
+  if( isEncrypted )
+  {
+    tlsContext = Tls::createClientContext( caFile, serverIpString );
+    if( tlsContext == NULL )
+    {
+      fprintf( stderr, "Unable to set up TLS, see the log file for details\n" );
+      return Errors::Error_Tls;
+    }
+  }
+
   Client* client = new Client();
 
-  Errors::ErrorCode status = client->initialize( serverIp, SERVER_PORT );
+  Errors::ErrorCode status = client->initialize( serverIp, SERVER_PORT, tlsContext, fileStripes, directFiles );
   if( status != Errors::Error_None )
   {
     fprintf( stderr, "Unable to connect to the server at %s: error %d\n", serverIpString, status );
 
     delete client;
+    SSL_CTX_free( tlsContext );
     return status;
   }
 
   client->run();
 
   delete client;
+  SSL_CTX_free( tlsContext );
 
   Common::debug( "Goodbye!" );
 
   return Errors::Error_None;
 }
-
-
@@ -0,0 +1,392 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "multicastfile.h"
+
+#include "common.h"
+#include "filedatamessage.h"
+#include "sessionbase.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+
+
+/**
+ * Current time in milliseconds, from an arbitrary point.
+ */
+static long milliseconds()
+{
+  timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+
+MulticastFile::MulticastFile( const uint32_t transferId )
+: acknowledged_( 0 )
+, acknowledgedAt_( 0 )
+, blocksCount_( 0 )
+, blocksReceived_( 0 )
+, blocksSent_( 0 )
+, fileChecksum_( 0 )
+, firstIncomplete_( 0 )
+, isFinished_( false )
+, transferId_( transferId )
+{
+}
+
+
+
+MulticastFile::~MulticastFile()
+{
+  std::map<uint32_t,Group>::iterator it;
+  for( it = groups_.begin(); it != groups_.end(); it++ )
+  {
+    Group& group = (*it).second;
+    for( int i = 0; i < MULTICAST_FEC_GROUP_SIZE; i++ )
+    {
+      free( group.frames[ i ] );
+    }
+    free( group.parity );
+  }
+}
+
+
+
+void MulticastFile::add( const MulticastMessage::Datagram& header, const char* frame, std::list<Message*>& ready )
+{
+  size_t previouslyReady = ready.size();
+  bool isCountNew = ( blocksCount_ == 0 && header.blocksCount > 0 );
+  if( isCountNew )
+  {
+    blocksCount_ = header.blocksCount;
+  }
+
+  switch( header.kind )
+  {
+    case MulticastMessage::DATAGRAM_FILE_BLOCK:
+      blocksSent_ = std::max( blocksSent_, header.sequence + 1 );
+      if( frame != NULL )
+      {
+        // A repaired block may leave only one missing, which the parity already held can rebuild
+        addBlock( header.sequence, frame, header.frameSize, ready );
+        recover( header.sequence / MULTICAST_FEC_GROUP_SIZE, ready );
+      }
+      break;
+
+    case MulticastMessage::DATAGRAM_FILE_PARITY:
+    {
+      uint32_t index = header.sequence / MULTICAST_FEC_GROUP_SIZE;
+      blocksSent_ = std::max( blocksSent_, header.sequence + groupSize( index ) );
+      if( frame == NULL || index < firstIncomplete_ )
+      {
+        break;
+      }
+
+      Group& parityGroup = group( index );
+      if( parityGroup.isComplete || parityGroup.parity != NULL )
+      {
+        break;
+      }
+
+      parityGroup.parity = static_cast<char*>( malloc( header.frameSize ) );
+      memcpy( parityGroup.parity, frame, header.frameSize );
+      parityGroup.paritySize = header.frameSize;
+      recover( index, ready );
+      break;
+    }
+
+    case MulticastMessage::DATAGRAM_FILE_HEARTBEAT:
+      blocksSent_ = std::max( blocksSent_, header.sequence );
+      break;
+
+    default:
+      break;
+  }
+
+  // Knowing how long the last group is may be enough to rebuild its missing block
+  if( isCountNew )
+  {
+    recover( ( blocksCount_ - 1 ) / MULTICAST_FEC_GROUP_SIZE, ready );
+  }
+
+  if( isComplete() && ! isFinished_ && ready.size() > previouslyReady )
+  {
+    FileDataMessage* lastBlock = dynamic_cast<FileDataMessage*>( ready.back() );
+    lastBlock->markLastBlock();
+    lastBlock->setFileChecksum( fileChecksum_ );
+    isFinished_ = true;
+  }
+}
+
+
+
+void MulticastFile::addBlock( const uint32_t sequence, const char* frame, const int frameSize, std::list<Message*>& ready )
+{
+  uint32_t index = sequence / MULTICAST_FEC_GROUP_SIZE;
+  uint32_t bit = 1U << ( sequence % MULTICAST_FEC_GROUP_SIZE );
+  if( index < firstIncomplete_ || ( blocksCount_ > 0 && sequence >= blocksCount_ ) )
+  {
+    return;
+  }
+
+  Group& blockGroup = group( index );
+  if( blockGroup.isComplete || ( blockGroup.received & bit ) )
+  {
+    return;
+  }
+
+  Message* message = SessionBase::deserializeMessage( frame, frameSize );
+  FileDataMessage* dataMessage = dynamic_cast<FileDataMessage*>( message );
+  if( dataMessage == NULL )
+  {
+    Common::error( "Block %u of the multicast file is invalid", sequence );
+    delete message;
+    return;
+  }
+
+  if( dataMessage->isLastBlock() )
+  {
+    blocksCount_ = sequence + 1;
+    fileChecksum_ = dataMessage->fileChecksum();
+  }
+
+  // The block is kept until the whole group is there, to rebuild the others
+  blockGroup.frames[ sequence % MULTICAST_FEC_GROUP_SIZE ] = static_cast<char*>( malloc( frameSize ) );
+  memcpy( blockGroup.frames[ sequence % MULTICAST_FEC_GROUP_SIZE ], frame, frameSize );
+  blockGroup.frameSizes[ sequence % MULTICAST_FEC_GROUP_SIZE ] = frameSize;
+  blockGroup.received |= bit;
+  blocksReceived_++;
+
+  // Only the block completing the file will be the last one
+  FileDataMessage* block = new FileDataMessage();
+  block->setBuffer( dataMessage->buffer(), dataMessage->bufferSize() );
+  block->setChecksum( dataMessage->checksum() );
+  block->setFileOffset( dataMessage->fileOffset() );
+  ready.push_back( block );
+  delete message;
+
+  if( (uint32_t)__builtin_popcount( blockGroup.received ) == groupSize( index ) )
+  {
+    for( int i = 0; i < MULTICAST_FEC_GROUP_SIZE; i++ )
+    {
+      free( blockGroup.frames[ i ] );
+      blockGroup.frames[ i ] = NULL;
+    }
+    free( blockGroup.parity );
+    blockGroup.parity = NULL;
+    blockGroup.isComplete = true;
+  }
+
+  std::map<uint32_t,Group>::iterator it;
+  while( ( it = groups_.begin() ) != groups_.end() && (*it).first == firstIncomplete_ && (*it).second.isComplete )
+  {
+    groups_.erase( it );
+    firstIncomplete_++;
+  }
+}
+
+
+
+void MulticastFile::finish( SessionBase* connection )
+{
+  MulticastMessage* message;
+  if( isComplete() )
+  {
+    if( acknowledged_ == blocksCount_ )
+    {
+      return;
+    }
+
+    message = new MulticastMessage( MulticastMessage::MULTICAST_FILE_ACK );
+    message->setSequence( blocksCount_ );
+  }
+  else
+  {
+    message = new MulticastMessage( MulticastMessage::MULTICAST_FILE_ABORT );
+  }
+
+  // Otherwise the server would wait for this client until it times out
+  message->setTransferId( transferId_ );
+  if( ! connection->sendMessage( message, true ) )
+  {
+    delete message;
+  }
+}
+
+
+
+MulticastFile::Group& MulticastFile::group( const uint32_t index )
+{
+  std::map<uint32_t,Group>::iterator it = groups_.find( index );
+  if( it != groups_.end() )
+  {
+    return (*it).second;
+  }
+
+  Group& newGroup = groups_[ index ];
+  memset( &newGroup, '\0', sizeof( Group ) );
+  return newGroup;
+}
+
+
+
+uint32_t MulticastFile::groupSize( const uint32_t index ) const
+{
+  if( blocksCount_ > 0 && index == ( blocksCount_ - 1 ) / MULTICAST_FEC_GROUP_SIZE )
+  {
+    return blocksCount_ - index * MULTICAST_FEC_GROUP_SIZE;
+  }
+
+  return MULTICAST_FEC_GROUP_SIZE;
+}
+
+
+
+bool MulticastFile::isComplete() const
+{
+  return ( blocksCount_ > 0 && blocksReceived_ == blocksCount_ );
+}
+
+
+
+void MulticastFile::recover( const uint32_t index, std::list<Message*>& ready )
+{
+  std::map<uint32_t,Group>::iterator it = groups_.find( index );
+  if( it == groups_.end() )
+  {
+    return;
+  }
+
+  Group& parityGroup = (*it).second;
+  uint32_t size = groupSize( index );
+  if( parityGroup.isComplete || parityGroup.parity == NULL || (uint32_t)__builtin_popcount( parityGroup.received ) != size - 1 )
+  {
+    return;
+  }
+
+  // What's left of the parity without the blocks which are there is the missing one
+  char frame[ MAX_MESSAGE_SIZE ];
+  memset( frame, '\0', MAX_MESSAGE_SIZE );
+  memcpy( frame, parityGroup.parity, parityGroup.paritySize );
+
+  uint32_t missing = 0;
+  for( uint32_t i = 0; i < size; i++ )
+  {
+    if( parityGroup.received & ( 1U << i ) )
+    {
+      MulticastMessage::addToParity( frame, parityGroup.frames[ i ], parityGroup.frameSizes[ i ] );
+    }
+    else
+    {
+      missing = i;
+    }
+  }
+
+  MessageHeader header;
+  memcpy( &header, frame, sizeof( MessageHeader ) );
+  int frameSize = sizeof( MessageHeader ) + header.size;
+  if( header.size < 0 || frameSize > parityGroup.paritySize )
+  {
+    Common::error( "Unable to rebuild block %u of the multicast file", index * MULTICAST_FEC_GROUP_SIZE + missing );
+    return;
+  }
+
+  addBlock( index * MULTICAST_FEC_GROUP_SIZE + missing, frame, frameSize, ready );
+}
+
+
+
+void MulticastFile::report( SessionBase* connection, const bool canAcknowledge )
+{
+  long now = milliseconds();
+
+  // Groups are asked for once the parity had the time to arrive, or once the whole file was sent
+  uint32_t lastGroup;
+  if( blocksCount_ > 0 && blocksSent_ >= blocksCount_ )
+  {
+    lastGroup = ( blocksCount_ - 1 ) / MULTICAST_FEC_GROUP_SIZE + 1;
+  }
+  else
+  {
+    lastGroup = ( blocksSent_ / MULTICAST_FEC_GROUP_SIZE > 1 ) ? blocksSent_ / MULTICAST_FEC_GROUP_SIZE - 1 : 0;
+  }
+
+  int requests = 0;
+  for( uint32_t index = firstIncomplete_; index < lastGroup && requests < MULTICAST_FILE_MAX_NACKS; index++ )
+  {
+    Group& missingGroup = group( index );
+    if( missingGroup.isComplete || now - missingGroup.nackedAt < MULTICAST_FILE_NACK_INTERVAL )
+    {
+      continue;
+    }
+
+    MulticastMessage* request = new MulticastMessage( MulticastMessage::MULTICAST_FILE_NACK );
+    request->setTransferId( transferId_ );
+    request->setSequence( index * MULTICAST_FEC_GROUP_SIZE );
+    request->setMissingBlocks( ~missingGroup.received & ( ( 1U << groupSize( index ) ) - 1 ) );
+    if( ! connection->sendMessage( request ) )
+    {
+      // Try again later
+      delete request;
+      return;
+    }
+
+    missingGroup.nackedAt = now;
+    requests++;
+  }
+
+  if( ! canAcknowledge )
+  {
+    return;
+  }
+
+  // Blocks held from the first, without holes
+  uint32_t held = firstIncomplete_ * MULTICAST_FEC_GROUP_SIZE;
+  std::map<uint32_t,Group>::iterator it = groups_.find( firstIncomplete_ );
+  if( it != groups_.end() )
+  {
+    held += __builtin_ctz( ~(*it).second.received );
+  }
+  if( blocksCount_ > 0 )
+  {
+    held = std::min( held, blocksCount_ );
+  }
+
+  if( held <= acknowledged_
+  || ( held - acknowledged_ < MULTICAST_FILE_WINDOW / 8 && now - acknowledgedAt_ < MULTICAST_FILE_REPORT_INTERVAL && ! isComplete() ) )
+  {
+    return;
+  }
+
+  MulticastMessage* acknowledgement = new MulticastMessage( MulticastMessage::MULTICAST_FILE_ACK );
+  acknowledgement->setTransferId( transferId_ );
+  acknowledgement->setSequence( held );
+  if( ! connection->sendMessage( acknowledgement ) )
+  {
+    delete acknowledgement;
+    return;
+  }
+
+  acknowledged_ = held;
+  acknowledgedAt_ = now;
+}
+
+
+
+uint32_t MulticastFile::transferId() const
+{
+  return transferId_;
+}
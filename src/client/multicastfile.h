@@ -0,0 +1,173 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MULTICASTFILE_H
+#define MULTICASTFILE_H
+
+#include "multicastmessage.h"
+
+#include <stdint.h>
+
+#include <list>
+#include <map>
+
+
+/**
+ * @def MULTICAST_FILE_REPORT_INTERVAL
+ *
+ * Milliseconds between the reports to the server of the blocks received.
+ */
+#define MULTICAST_FILE_REPORT_INTERVAL   100
+
+
+/**
+ * @def MULTICAST_FILE_NACK_INTERVAL
+ *
+ * Milliseconds to wait for the repair of a parity group, before asking for it again.
+ */
+#define MULTICAST_FILE_NACK_INTERVAL   200
+
+
+/**
+ * @def MULTICAST_FILE_MAX_NACKS
+ *
+ * Maximum number of parity groups asked for in a single report.
+ */
+#define MULTICAST_FILE_MAX_NACKS   32
+
+
+class Message;
+class SessionBase;
+
+
+
+/**
+ * @class MulticastFile
+ *
+ * Puts back together a file which the server sends to the multicast group.
+ *
+ * Blocks are made available as soon as they arrive, or can be rebuilt from the parity
+ * of their group, in whatever order. Only the one which completes the file is marked as
+ * its last block, so the file is closed once every block has been saved.
+ *
+ * Not thread-safe: the MulticastReceiver which owns it serializes the calls.
+ */
+class MulticastFile
+{
+
+  public:
+
+    MulticastFile( const uint32_t transferId );
+    ~MulticastFile();
+
+    /**
+     * Take in a datagram of the file.
+     *
+     * @param frame The frame following the header, or NULL if there is none
+     * @param ready New FileDataMessages are appended to it
+     */
+    void add( const MulticastMessage::Datagram& header, const char* frame, std::list<Message*>& ready );
+
+    /**
+     * Tell the server the file won't be received anymore: with a last acknowledgement
+     * if it was completed, or by abandoning it.
+     */
+    void finish( SessionBase* connection );
+
+    bool isComplete() const;
+
+    /**
+     * Acknowledge the blocks received, and ask for the groups which can't be rebuilt.
+     *
+     * @param canAcknowledge Whether the received blocks can be acknowledged; held back while
+     *                       they can't be saved quickly enough, which slows the sender down
+     */
+    void report( SessionBase* connection, const bool canAcknowledge );
+
+    uint32_t transferId() const;
+
+
+  private:
+
+    /// Blocks covered by a parity, until all of them are there
+    struct Group
+    {
+      /// The frames received or rebuilt, or NULL
+      char* frames[ MULTICAST_FEC_GROUP_SIZE ];
+      int frameSizes[ MULTICAST_FEC_GROUP_SIZE ];
+      /// The blocks which are there, one bit each
+      uint32_t received;
+      char* parity;
+      int paritySize;
+      bool isComplete;
+      /// When the missing blocks were last asked for
+      long nackedAt;
+    };
+
+
+  private:
+
+    /**
+     * Keep a block, and make it available.
+     */
+    void addBlock( const uint32_t sequence, const char* frame, const int frameSize, std::list<Message*>& ready );
+
+    /**
+     * Get a parity group, adding it if it's new.
+     */
+    Group& group( const uint32_t index );
+
+    /**
+     * Number of blocks in a parity group: only the last one can be shorter.
+     */
+    uint32_t groupSize( const uint32_t index ) const;
+
+    /**
+     * Rebuild the only missing block of a group from its parity, if possible.
+     */
+    void recover( const uint32_t index, std::list<Message*>& ready );
+
+
+  private:
+
+    /// Number of blocks acknowledged to the server, from the first
+    uint32_t acknowledged_;
+
+    /// When the blocks were last acknowledged
+    long acknowledgedAt_;
+
+    /// Number of blocks of the whole file, or 0 until it's known
+    uint32_t blocksCount_;
+
+    /// Number of distinct blocks received or rebuilt
+    uint32_t blocksReceived_;
+
+    /// Number of blocks which the server has sent, as far as is known
+    uint32_t blocksSent_;
+
+    /// Checksum of the whole file, carried by its last block
+    uint32_t fileChecksum_;
+
+    /// Index of the first parity group which isn't complete; the previous ones are gone
+    uint32_t firstIncomplete_;
+
+    std::map<uint32_t,Group> groups_;
+
+    /// Whether the block completing the file was made available
+    bool isFinished_;
+
+    const uint32_t transferId_;
+
+
+};
+
+
+
+#endif // MULTICASTFILE_H
@@ -0,0 +1,501 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "multicastreceiver.h"
+
+#include "common.h"
+#include "filedatamessage.h"
+#include "multicastfile.h"
+#include "sessionbase.h"
+
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+
+
+MulticastReceiver::MulticastReceiver( SessionBase* connection )
+: connection_( connection )
+, file_( NULL )
+, expectedSequence_( 0 )
+, hasGap_( false )
+, highestSequence_( 0 )
+, isSubscribed_( false )
+, ownId_( 0 )
+, requestedSequence_( 0 )
+, socket_( -1 )
+, stopEvent_( -1 )
+, streamId_( 0 )
+{
+  pthread_mutex_init( &mutex_, NULL );
+}
+
+
+
+MulticastReceiver::~MulticastReceiver()
+{
+  if( socket_ != -1 )
+  {
+    uint64_t one = 1;
+    if( write( stopEvent_, &one, sizeof( one ) ) < 0 )
+    {
+      Common::error( "Unable to stop the multicast receiver: %s", strerror( errno ) );
+    }
+
+    pthread_join( thread_, NULL );
+    close( socket_ );
+    close( stopEvent_ );
+  }
+
+  delete file_;
+
+  std::map<uint32_t,Pending>::iterator it;
+  for( it = pending_.begin(); it != pending_.end(); it++ )
+  {
+    free( (*it).second.frame );
+  }
+
+  while( ready_.size() > 0 )
+  {
+    delete ready_.front();
+    ready_.pop_front();
+  }
+
+  pthread_mutex_destroy( &mutex_ );
+}
+
+
+
+void MulticastReceiver::add( const uint32_t sequence, const uint32_t senderId, const char* frame, const int frameSize )
+{
+  if( sequence > highestSequence_ )
+  {
+    highestSequence_ = sequence;
+  }
+
+  // Already shown, given up on, or received twice
+  if( ( isSubscribed_ && sequence < expectedSequence_ ) || pending_.find( sequence ) != pending_.end() )
+  {
+    return;
+  }
+
+  if( pending_.size() >= MULTICAST_MAX_PENDING )
+  {
+    free( (*pending_.begin()).second.frame );
+    pending_.erase( pending_.begin() );
+  }
+
+  Pending message;
+  message.senderId = senderId;
+  message.frame = NULL;
+  message.frameSize = frameSize;
+  if( frame != NULL )
+  {
+    message.frame = static_cast<char*>( malloc( frameSize ) );
+    memcpy( message.frame, frame, frameSize );
+  }
+
+  pending_[ sequence ] = message;
+}
+
+
+
+void MulticastReceiver::advance()
+{
+  if( ! isSubscribed_ )
+  {
+    return;
+  }
+
+  uint32_t previousSequence = expectedSequence_;
+  bool hasReadyMessages = false;
+
+  std::map<uint32_t,Pending>::iterator it;
+  while( ( it = pending_.begin() ) != pending_.end() && (*it).first <= expectedSequence_ )
+  {
+    Pending& message = (*it).second;
+    if( (*it).first == expectedSequence_ )
+    {
+      // Our own messages were already shown when they were sent
+      if( message.frame != NULL && message.senderId != ownId_ )
+      {
+        Message* chatMessage = SessionBase::deserializeMessage( message.frame, message.frameSize );
+        if( chatMessage != NULL )
+        {
+          ready_.push_back( chatMessage );
+          hasReadyMessages = true;
+        }
+      }
+      expectedSequence_++;
+    }
+
+    free( message.frame );
+    pending_.erase( it );
+  }
+
+  if( expectedSequence_ != previousSequence )
+  {
+    hasGap_ = false;
+  }
+
+  if( expectedSequence_ <= highestSequence_ )
+  {
+    if( ! hasGap_ )
+    {
+      hasGap_ = true;
+      clock_gettime( CLOCK_MONOTONIC, &gapSince_ );
+    }
+
+    // Ask for each range of missing messages which wasn't asked for yet
+    uint32_t sequence = std::max( expectedSequence_, requestedSequence_ );
+    while( sequence <= highestSequence_ )
+    {
+      std::map<uint32_t,Pending>::iterator next = pending_.lower_bound( sequence );
+      if( next != pending_.end() && (*next).first == sequence )
+      {
+        sequence++;
+        continue;
+      }
+
+      uint32_t end = ( next != pending_.end() ) ? (*next).first : highestSequence_ + 1;
+      uint32_t count = std::min( end - sequence, (uint32_t)MULTICAST_MAX_REPAIRS );
+
+      MulticastMessage* request = new MulticastMessage( MulticastMessage::MULTICAST_NACK );
+      request->setSequence( sequence, count );
+      if( ! connection_->sendMessage( request ) )
+      {
+        // Try again later
+        delete request;
+        break;
+      }
+
+      sequence += count;
+    }
+
+    requestedSequence_ = sequence;
+  }
+
+  if( hasReadyMessages )
+  {
+    connection_->wakeUp();
+  }
+}
+
+
+
+void MulticastReceiver::checkGaps()
+{
+  if( ! isSubscribed_ || ! hasGap_ )
+  {
+    return;
+  }
+
+  timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  long elapsed = ( now.tv_sec - gapSince_.tv_sec ) * 1000 + ( now.tv_nsec - gapSince_.tv_nsec ) / 1000000;
+  if( elapsed < MULTICAST_REPAIR_TIMEOUT )
+  {
+    return;
+  }
+
+  // Skip to the next message which has arrived
+  uint32_t resumeSequence = pending_.empty() ? highestSequence_ + 1 : (*pending_.begin()).first;
+  Common::error( "%u chat messages were lost", resumeSequence - expectedSequence_ );
+
+  expectedSequence_ = resumeSequence;
+  requestedSequence_ = std::max( requestedSequence_, resumeSequence );
+
+  advance();
+}
+
+
+
+bool MulticastReceiver::hasFile( const uint32_t transferId )
+{
+  pthread_mutex_lock( &mutex_ );
+  bool hasFile = ( file_ != NULL && file_->transferId() == transferId );
+  pthread_mutex_unlock( &mutex_ );
+
+  return hasFile;
+}
+
+
+
+Message* MulticastReceiver::receiveMessage()
+{
+  Message* message = NULL;
+
+  pthread_mutex_lock( &mutex_ );
+  if( ready_.size() > 0 )
+  {
+    message = ready_.front();
+    ready_.pop_front();
+  }
+  pthread_mutex_unlock( &mutex_ );
+
+  return message;
+}
+
+
+
+void MulticastReceiver::repaired( const MulticastMessage* repair )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  // Messages which are not kept by the server anymore are lost for good
+  add( repair->sequence(), repair->clientId(), ( repair->frameSize() > 0 ) ? repair->frame() : NULL, repair->frameSize() );
+  advance();
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+void* MulticastReceiver::run( void* thisPointer )
+{
+  MulticastReceiver* self = static_cast<MulticastReceiver*>( thisPointer );
+
+  pollfd watched[ 2 ];
+  watched[ 0 ].fd = self->socket_;
+  watched[ 0 ].events = POLLIN;
+  watched[ 1 ].fd = self->stopEvent_;
+  watched[ 1 ].events = POLLIN;
+
+  int headerSize = sizeof( MulticastMessage::Datagram );
+  char datagram[ sizeof( MulticastMessage::Datagram ) + MAX_MESSAGE_SIZE ];
+
+  // Wake up now and then to check for the messages which are missing for too long
+  int timeout = MULTICAST_REPAIR_TIMEOUT / 4;
+
+  while( true )
+  {
+    int ready = poll( watched, 2, timeout );
+    if( ready == -1 && errno != EINTR )
+    {
+      Common::error( "Unable to receive from the multicast group: %s", strerror( errno ) );
+      break;
+    }
+
+    if( ready > 0 && ( watched[ 1 ].revents & POLLIN ) )
+    {
+      break;
+    }
+
+    pthread_mutex_lock( &self->mutex_ );
+
+    size_t previouslyReady = self->ready_.size();
+
+    // Take everything which has arrived at once
+    ssize_t size;
+    while( ready > 0 && ( size = recv( self->socket_, datagram, sizeof( datagram ), MSG_DONTWAIT ) ) >= 0 )
+    {
+      MulticastMessage::Datagram header;
+      if( size < headerSize )
+      {
+        continue;
+      }
+
+      memcpy( &header, datagram, headerSize );
+
+      // Other servers may use the same group
+      if( header.streamId != self->streamId_ )
+      {
+        continue;
+      }
+
+      const char* frame = ( header.frameSize > 0 && header.frameSize == size - headerSize ) ? datagram + headerSize : NULL;
+
+      switch( header.kind )
+      {
+        case MulticastMessage::DATAGRAM_CHAT:
+          if( frame != NULL )
+          {
+            self->add( header.sequence, header.senderId, frame, header.frameSize );
+          }
+          break;
+
+        case MulticastMessage::DATAGRAM_HEARTBEAT:
+          // A heartbeat only tells how far the server is
+          self->highestSequence_ = std::max( self->highestSequence_, header.sequence );
+          break;
+
+        default:
+          // Blocks of other files, or of no file at all, are dropped
+          if( self->file_ != NULL && header.senderId == self->file_->transferId() )
+          {
+            self->file_->add( header, frame, self->ready_ );
+          }
+          break;
+      }
+    }
+
+    self->advance();
+    self->checkGaps();
+
+    timeout = MULTICAST_REPAIR_TIMEOUT / 4;
+    if( self->file_ != NULL )
+    {
+      self->file_->report( self->connection_, self->ready_.size() < MULTICAST_MAX_PENDING );
+      timeout = MULTICAST_FILE_REPORT_INTERVAL;
+    }
+
+    if( self->ready_.size() > previouslyReady )
+    {
+      self->connection_->wakeUp();
+    }
+
+    pthread_mutex_unlock( &self->mutex_ );
+  }
+
+  return NULL; // Unused value
+}
+
+
+
+bool MulticastReceiver::start( const MulticastMessage* announcement )
+{
+  streamId_ = announcement->streamId();
+
+  sockaddr_in address;
+  memset( &address, '\0', sizeof( sockaddr_in ) );
+  address.sin_family = AF_INET;
+  address.sin_port = htons( announcement->groupPort() );
+  address.sin_addr.s_addr = announcement->groupAddress();
+
+  ip_mreq membership;
+  membership.imr_multiaddr.s_addr = announcement->groupAddress();
+  membership.imr_interface.s_addr = htonl( INADDR_ANY );
+
+  // Other clients on this same machine listen to the group too
+  int reuse = 1;
+
+  int newSocket = socket( AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+  if( newSocket == -1
+  ||  setsockopt( newSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) ) == -1
+  ||  bind( newSocket, reinterpret_cast<sockaddr*>( &address ), sizeof( sockaddr_in ) ) == -1
+  ||  setsockopt( newSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof( ip_mreq ) ) == -1 )
+  {
+    Common::error( "Unable to join the multicast group: %s", strerror( errno ) );
+    if( newSocket != -1 )
+    {
+      close( newSocket );
+    }
+    return false;
+  }
+
+  stopEvent_ = eventfd( 0, EFD_CLOEXEC );
+  if( stopEvent_ == -1 )
+  {
+    Common::error( "Unable to create the multicast stop event: %s", strerror( errno ) );
+    close( newSocket );
+    return false;
+  }
+
+  // Not fatal: it's only more likely to lose datagrams, which are repaired anyway
+  int bufferSize = MULTICAST_RECEIVE_BUFFER;
+  if( setsockopt( newSocket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof( bufferSize ) ) == -1 )
+  {
+    Common::debug( "Unable to enlarge the multicast receive buffer: %s", strerror( errno ) );
+  }
+
+  socket_ = newSocket;
+
+  int result = pthread_create( &thread_, NULL, &MulticastReceiver::run, this );
+  if( result != 0 )
+  {
+    Common::error( "Unable to start the multicast receiver: error %d", result );
+    close( socket_ );
+    close( stopEvent_ );
+    socket_ = -1;
+    return false;
+  }
+
+  Common::debug( "Joined the multicast group" );
+
+  return true;
+}
+
+
+
+void MulticastReceiver::startFile( const MulticastMessage* start )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  delete file_;
+  file_ = new MulticastFile( start->transferId() );
+
+  pthread_mutex_unlock( &mutex_ );
+
+  Common::debug( "Receiving the file through the multicast group, as transfer %u", start->transferId() );
+}
+
+
+
+void MulticastReceiver::stopFile()
+{
+  pthread_mutex_lock( &mutex_ );
+
+  if( file_ == NULL )
+  {
+    pthread_mutex_unlock( &mutex_ );
+    return;
+  }
+
+  file_->finish( connection_ );
+  delete file_;
+  file_ = NULL;
+
+  std::list<Message*>::iterator it = ready_.begin();
+  while( it != ready_.end() )
+  {
+    if( dynamic_cast<FileDataMessage*>( *it ) != NULL )
+    {
+      delete *it;
+      it = ready_.erase( it );
+    }
+    else
+    {
+      it++;
+    }
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+void MulticastReceiver::subscribed( const MulticastMessage* reply )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  isSubscribed_ = true;
+  ownId_ = reply->clientId();
+  expectedSequence_ = reply->sequence();
+  requestedSequence_ = reply->sequence();
+
+  // The messages before were received through the session
+  std::map<uint32_t,Pending>::iterator it;
+  while( ( it = pending_.begin() ) != pending_.end() && (*it).first < expectedSequence_ )
+  {
+    free( (*it).second.frame );
+    pending_.erase( it );
+  }
+
+  advance();
+
+  pthread_mutex_unlock( &mutex_ );
+}
@@ -0,0 +1,202 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MULTICASTRECEIVER_H
+#define MULTICASTRECEIVER_H
+
+#include "multicastmessage.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+
+
+/**
+ * @def MULTICAST_REPAIR_TIMEOUT
+ *
+ * Milliseconds to wait for a missing message, before giving up on it.
+ */
+#define MULTICAST_REPAIR_TIMEOUT   3000
+
+
+/**
+ * @def MULTICAST_MAX_PENDING
+ *
+ * Maximum number of messages kept while waiting for a missing one.
+ */
+#define MULTICAST_MAX_PENDING   1024
+
+
+/**
+ * @def MULTICAST_RECEIVE_BUFFER
+ *
+ * Bytes the system should keep for the datagrams not taken yet. Files come in quick bursts.
+ */
+#define MULTICAST_RECEIVE_BUFFER   ( 4 * 1024 * 1024 )
+
+
+class MulticastFile;
+class SessionBase;
+
+
+
+/**
+ * @class MulticastReceiver
+ *
+ * Receives the chat messages which the server sends to a multicast group.
+ *
+ * Datagrams can be lost, duplicated or reordered: the messages are put back in order by
+ * their sequence numbers, and the missing ones are asked to the server through the session.
+ * The receiving thread never shows the messages itself: it wakes the session up, and the
+ * session thread takes them with receiveMessage().
+ *
+ * The blocks of a file sent to the group are taken the same way, as FileDataMessages,
+ * between startFile() and stopFile().
+ */
+class MulticastReceiver
+{
+
+  public:
+
+    MulticastReceiver( SessionBase* connection );
+    ~MulticastReceiver();
+
+    /**
+     * Whether the blocks of the given file transfer are being received.
+     */
+    bool hasFile( const uint32_t transferId );
+
+    /**
+     * Take the next chat message, in order.
+     *
+     * @return A new message, or NULL if there are none ready
+     */
+    Message* receiveMessage();
+
+    /**
+     * A missing message has been sent again by the server.
+     */
+    void repaired( const MulticastMessage* repair );
+
+    /**
+     * Join the announced group, and start receiving from it.
+     *
+     * @return false if the group can't be joined
+     */
+    bool start( const MulticastMessage* announcement );
+
+    /**
+     * The accepted file will come through the group.
+     */
+    void startFile( const MulticastMessage* start );
+
+    /**
+     * Stop receiving the file, and drop its blocks which weren't taken yet.
+     */
+    void stopFile();
+
+    /**
+     * The server has confirmed the subscription: the group takes over from the given sequence number.
+     */
+    void subscribed( const MulticastMessage* reply );
+
+
+  private:
+
+    /// A received message, waiting for the previous ones
+    struct Pending
+    {
+      uint32_t senderId;
+      /// The frame, or NULL if the message is lost for good
+      char* frame;
+      int frameSize;
+    };
+
+
+  private:
+
+    /**
+     * Store a message until it's its turn.
+     *
+     * @note The mutex must be locked by the caller.
+     */
+    void add( const uint32_t sequence, const uint32_t senderId, const char* frame, const int frameSize );
+
+    /**
+     * Make the messages which are in order ready, and ask for the missing ones.
+     *
+     * @note The mutex must be locked by the caller.
+     */
+    void advance();
+
+    /**
+     * Give up on the messages which have been missing for too long.
+     *
+     * @note The mutex must be locked by the caller.
+     */
+    void checkGaps();
+
+    static void* run( void* thisPointer );
+
+
+  private:
+
+    SessionBase* connection_;
+
+    /// The file being received, or NULL
+    MulticastFile* file_;
+
+    /// Sequence number of the next message to make ready, once subscribed
+    uint32_t expectedSequence_;
+
+    /// When the oldest missing message was noticed
+    timespec gapSince_;
+
+    /// Whether a message is missing
+    bool hasGap_;
+
+    /// Highest sequence number known to be used by the server
+    uint32_t highestSequence_;
+
+    bool isSubscribed_;
+
+    pthread_mutex_t mutex_;
+
+    /// Id of the user, whose own messages are skipped
+    uint32_t ownId_;
+
+    /// Messages received ahead of the missing ones
+    std::map<uint32_t,Pending> pending_;
+
+    /// Messages which can be shown
+    std::list<Message*> ready_;
+
+    /// Messages before this one were already asked to the server
+    uint32_t requestedSequence_;
+
+    /// UDP socket joined to the group, or -1
+    int socket_;
+
+    /// Written to stop the thread
+    int stopEvent_;
+
+    uint32_t streamId_;
+
+    pthread_t thread_;
+
+
+};
+
+
+
+#endif // MULTICASTRECEIVER_H
@@ -12,30 +12,239 @@
 
 #include "common.h"
 #include "client.h"
+#include "crc32c.h"
+#include "multicastreceiver.h"
+#include "sessionstripe.h"
 
 #include "byemessage.h"
 #include "chatmessage.h"
 #include "filedatamessage.h"
+#include "filemanifestmessage.h"
+#include "filesignaturemessage.h"
 #include "filetransfermessage.h"
 #include "hellomessage.h"
+#include "multicastmessage.h"
 #include "nicknamemessage.h"
+#include "privatemessage.h"
+#include "rostermessage.h"
+#include "statsmessage.h"
 #include "statusmessage.h"
+#include "stripemessage.h"
 
 #include "errno.h"
 #include "string.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+
+
+/**
+ * Mix some data into a FNV-1a hash.
+ */
+static uint64_t hashBytes( uint64_t hash, const void* data, const size_t size )
+{
+  const unsigned char* bytes = static_cast<const unsigned char*>( data );
+  for( size_t i = 0; i < size; i++ )
+  {
+    hash = ( hash ^ bytes[ i ] ) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+
+
+/**
+ * Whether a path from the contents of a folder stays inside the folder.
+ */
+static bool isInsideFolder( const char* path )
+{
+  if( *path == '\0' || *path == '/' )
+  {
+    return false;
+  }
+
+  const char* component = path;
+  while( component != NULL )
+  {
+    const char* end = strchr( component, '/' );
+    size_t length = ( end != NULL ) ? (size_t)( end - component ) : strlen( component );
+    if( length == 0
+    ||  ( length == 1 && component[ 0 ] == '.' )
+    ||  ( length == 2 && component[ 0 ] == '.' && component[ 1 ] == '.' ) )
+    {
+      return false;
+    }
+
+    component = ( end != NULL ) ? end + 1 : NULL;
+  }
+
+  return true;
+}
+
+
+
+/**
+ * Identify a file by where it is and by when it last changed, so that receivers can tell
+ * another transfer of the same file from the transfer of a different one.
+ */
+static uint64_t transferIdOf( const struct stat& status )
+{
+  const uint64_t values[] = { (uint64_t)status.st_dev, (uint64_t)status.st_ino, (uint64_t)status.st_size,
+                              (uint64_t)status.st_mtim.tv_sec, (uint64_t)status.st_mtim.tv_nsec };
+
+  uint64_t hash = hashBytes( 14695981039346656037ULL, values, sizeof( values ) );
+
+  // 0 means that the transfer can't be resumed
+  return ( hash != 0 ) ? hash : 1;
+}
+
+
+
+/**
+ * List what's in a folder being sent, and in the folders within it; each folder comes
+ * before its contents. Links and special files are left out.
+ *
+ * @param path Of the folder to list, within the one being sent; empty for that one
+ * @param transferId Updated with each file, to identify the whole folder across transfers
+ * @param skipped Increased for each entry left out
+ * @return false if a folder can't be read, with errno set
+ */
+static bool listFolder( const char* folderName, const char* path, std::list<FileManifestMessage::Entry>& entries,
+                        uint64_t& transferId, int& skipped )
+{
+  char fullPath[ PATH_MAX ];
+  snprintf( fullPath, PATH_MAX, "%s/%s", folderName, path );
+
+  DIR* folder = opendir( fullPath );
+  if( folder == NULL )
+  {
+    return false;
+  }
+
+  dirent* item;
+  while( ( item = readdir( folder ) ) != NULL )
+  {
+    if( strcmp( item->d_name, "." ) == 0 || strcmp( item->d_name, ".." ) == 0 )
+    {
+      continue;
+    }
+
+    FileManifestMessage::Entry entry;
+    memset( &entry, '\0', sizeof( entry ) );
+    int length = ( *path != '\0' ) ? snprintf( entry.path, MANIFEST_PATH_SIZE, "%s/%s", path, item->d_name )
+                                   : snprintf( entry.path, MANIFEST_PATH_SIZE, "%s", item->d_name );
+
+    struct stat status;
+    if( length >= MANIFEST_PATH_SIZE || fstatat( dirfd( folder ), item->d_name, &status, AT_SYMLINK_NOFOLLOW ) == -1 )
+    {
+      Common::error( "Leaving %s/%s out of the folder", path, item->d_name );
+      skipped++;
+      continue;
+    }
+
+    if( S_ISDIR( status.st_mode ) )
+    {
+      entry.isDirectory = true;
+      entries.push_back( entry );
+      if( ! listFolder( folderName, entry.path, entries, transferId, skipped ) )
+      {
+        int error = errno;
+        closedir( folder );
+        errno = error;
+        return false;
+      }
+    }
+    else if( S_ISREG( status.st_mode ) )
+    {
+      entry.size = status.st_size;
+      entries.push_back( entry );
+
+      uint64_t fileId = transferIdOf( status );
+      transferId = hashBytes( transferId, entry.path, length );
+      transferId = hashBytes( transferId, &fileId, sizeof( fileId ) );
+    }
+    else
+    {
+      skipped++;
+    }
+  }
+
+  closedir( folder );
+  return true;
+}
+
+
+
+/**
+ * Pick a number which can't be guessed, for the receivers of a file to show to its sender.
+ */
+static uint64_t randomToken()
+{
+  uint64_t token = 0;
+
+  int randomSource = open( "/dev/urandom", O_RDONLY | O_CLOEXEC );
+  if( randomSource == -1 || read( randomSource, &token, sizeof( token ) ) != sizeof( token ) )
+  {
+    token = ( (uint64_t)time( NULL ) << 32 ) ^ getpid();
+  }
+  if( randomSource != -1 )
+  {
+    close( randomSource );
+  }
+
+  return token;
+}
 
 
 
 SessionServer::SessionServer( Client* parent, const int socket )
 : SessionBase( socket )
 , client_( parent )
-, fileTransferHandle_( NULL )
-, fileTransferOffset_( 0LL )
+, directSocket_( -1 )
+, directToken_( 0 )
 , isReceivingFile_( false )
 , isSendingFile_( false )
 , hasFileTransferStarted_( false )
+, fileChecksum_( 0 )
+, fileConnections_( 0 )
+, fileEndMarks_( 0 )
+, fileRequest_( NULL )
+, fileStripes_( FILE_STRIPES )
+, multicast_( NULL )
+, hasLastBlock_( false )
+, hasLostPeer_( false )
+, hasLostStripe_( false )
+, isDirect_( false )
+, isFileDirect_( false )
+, isFileStriped_( false )
+, isFolder_( false )
+, nextStripe_( 0 )
+, progressRate_( 0 )
+, progressSize_( 0 )
+, receivedSize_( 0 )
 {
   *fileName_ = '\0';
+  fileSize_ = 0;
+  progressTime_.tv_sec = 0;
+  progressTime_.tv_nsec = 0;
+
+  pthread_mutex_init( &stripesMutex_, NULL );
+  pthread_cond_init( &stripesCondition_, NULL );
+
+  // The data connections go to the same place
+  if( ! peerAddress( serverAddress_ ) )
+  {
+    Common::error( "Unable to get the server address, files will go through the session only: %s", strerror( errno ) );
+    fileStripes_ = 0;
+  }
 
   sendMessage( new HelloMessage() );
 }
@@ -44,11 +253,146 @@ SessionServer::SessionServer( Client* parent, const int socket )
 
 SessionServer::~SessionServer()
 {
+  // It uses the session until it's stopped
+  delete multicast_;
+
+  // So do the data connections
+  pthread_mutex_lock( &stripesMutex_ );
+  std::list<SessionStripe*> connections( stripes_ );
+  connections.insert( connections.end(), peers_.begin(), peers_.end() );
+  connections.insert( connections.end(), leavingPeers_.begin(), leavingPeers_.end() );
+  std::list<SessionStripe*>::iterator it;
+  for( it = connections.begin(); it != connections.end(); it++ )
+  {
+    (*it)->dropConnection();
+  }
+  while( stripes_.size() > 0 || peers_.size() > 0 || leavingPeers_.size() > 0 )
+  {
+    pthread_cond_wait( &stripesCondition_, &stripesMutex_ );
+  }
+  pthread_mutex_unlock( &stripesMutex_ );
+
+  while( closedMessages_.size() > 0 )
+  {
+    delete closedMessages_.front();
+    closedMessages_.pop_front();
+  }
+
+  if( directSocket_ != -1 )
+  {
+    close( directSocket_ );
+  }
+
+  delete fileRequest_;
+
+  pthread_cond_destroy( &stripesCondition_ );
+  pthread_mutex_destroy( &stripesMutex_ );
+
   client_->connectionClosed( this );
 }
 
 
 
+void SessionServer::acceptReceivers()
+{
+  // They connected before answering the request, so they're all there already
+  while( true )
+  {
+    int peerSocket = accept4( directSocket_, NULL, NULL, SOCK_CLOEXEC );
+    if( peerSocket == -1 && ( errno == EINTR || errno == ECONNABORTED ) )
+    {
+      continue;
+    }
+    if( peerSocket == -1 )
+    {
+      break;
+    }
+
+    Common::debug( "A receiver of %s has connected", fileName_ );
+    if( ! startStripe( new SessionStripe( this, peerSocket, directToken_, true ), peers_ ) )
+    {
+      break;
+    }
+  }
+
+  close( directSocket_ );
+  directSocket_ = -1;
+}
+
+
+
+void SessionServer::answerFileRequest( const FileTransferMessage* request, bool accepted )
+{
+  // Keep what an interrupted transfer of the same file has left there
+  bool isOpen = ! accepted
+             || ( isFolder_ ? fileWriter_.open( fileName_, manifest_, request->transferId() )
+                            : fileWriter_.open( fileName_, fileSize_, request->transferId(), true ) );
+  if( ! isOpen )
+  {
+    Common::error( "Couldn't open %s: %s", fileName_, strerror( errno ) );
+    client_->gotStatusMessage( "Unable to open file %s! %s", fileName_, strerror( errno ) );
+    disableFileTransferMode();
+    accepted = false;
+  }
+
+  // The sender waits for the connection before it starts, so it's made before answering
+  if( accepted && request->directPort() != 0 && ! connectToSender( request ) )
+  {
+    client_->gotStatusMessage( "Unable to reach \"%s\" to get the file!", request->sender() );
+    disableFileTransferMode();
+    accepted = false;
+  }
+
+  // With an older copy of the file, the sender may only need to send what changed; the
+  // signature goes before the answer, for the server to have it all when it's needed
+  std::list<FileSignatureMessage*> signature;
+  if( accepted && fileWriter_.basis() != -1 && fileWriter_.committedSize() == 0 )
+  {
+    if( ! FileDelta::sign( fileWriter_.basis(), signature ) )
+    {
+      Common::error( "Couldn't read the older copy of %s: %s", fileName_, strerror( errno ) );
+    }
+    else if( signature.size() > 0 )
+    {
+      client_->gotStatusMessage( "Already got an older copy of \"%s\", asking for the changes only.", fileName_ );
+    }
+  }
+  while( signature.size() > 0 )
+  {
+    FileSignatureMessage* signatureMessage = signature.front();
+    signature.pop_front();
+    if( ! sendMessage( signatureMessage, true ) )
+    {
+      delete signatureMessage;
+    }
+  }
+
+  StatusMessage* answer = new StatusMessage( accepted ? Errors::Status_AcceptFileTransfer
+                                                      : Errors::Status_RejectFileTransfer );
+  if( accepted && fileWriter_.committedSize() > 0 )
+  {
+    answer->setFileOffset( fileWriter_.committedSize() );
+    client_->gotStatusMessage( "Already got %lld bytes of \"%s\", asking for the rest.", (long long)fileWriter_.committedSize(), fileName_ );
+  }
+
+  // Behind a whole signature, the queue may be full: the answer can't be lost
+  if( ! sendMessage( answer, true ) )
+  {
+    Common::error( "Couldn't answer the request of %s", fileName_ );
+    delete answer;
+  }
+
+  if( accepted )
+  {
+    receivedSize_ = fileWriter_.committedSize();
+    startProgress( receivedSize_ );
+  }
+
+  Common::debug( "File transfer %s", accepted ? "accepted" : "rejected" );
+}
+
+
+
 void SessionServer::availableMessages()
 {
   Message* message;
@@ -73,6 +417,19 @@ void SessionServer::availableMessages()
             client_->gotStatusMessage( "There are no other participants to the chat!" );
             break;
 
+          case Errors::Status_RateLimited:
+            client_->gotStatusMessage( "You are sending messages too quickly, some of them were dropped!" );
+            break;
+
+          case Errors::Status_UnknownRecipient:
+            client_->gotStatusMessage( "The recipient of the private message is not online!" );
+            break;
+
+          case Errors::Status_Heartbeat:
+            // The server checks whether we're still here
+            sendMessage( new StatusMessage( Errors::Status_Heartbeat ) );
+            break;
+
           case Errors::Status_AcceptFileTransfer:
 
             if( ! isSendingFile_ || strlen( fileName_ ) == 0 )
@@ -80,8 +437,52 @@ void SessionServer::availableMessages()
               Common::fatal( "Client doesn't have started a file transfer!" );
             }
 
+            if( ! ( isFolder_ ? fileReader_.open( fileName_, manifest_ ) : fileReader_.open( fileName_ ) ) )
+            {
+              // Opening the file failed somehow
+              Common::error( "Couldn't open %s: %s", fileName_, strerror( errno ) );
+
+              client_->gotStatusMessage( "Unable to open file %s! %s", fileName_, strerror( errno ) );
+              disableFileTransferMode();
+              break;
+            }
+
+            // Nobody else can join once the transfer starts
+            if( isFileDirect_ )
+            {
+              acceptReceivers();
+            }
+
             hasFileTransferStarted_ = true; // let cycle() go
+
+            // The only receiver has an older copy of the file: the blocks it has aren't sent
+            if( statusMessage->fileOffset() == 0 && ! isFolder_ && fileDelta_.isComplete() )
+            {
+              if( fileDelta_.start( fileReader_.file(), fileSize_ ) )
+              {
+                client_->gotStatusMessage( "The transfer of \"%s\" has started, sending the changes only.", fileName_ );
+                startProgress( 0 );
+                break;
+              }
+              Common::error( "Couldn't compare %s to the receiver's copy: %s", fileName_, strerror( errno ) );
+            }
+            fileDelta_.clear();
+
+            // The receivers kept what they got from an interrupted transfer of the file
+            if( statusMessage->fileOffset() > 0 )
+            {
+              // On error, the transfer goes on from where the reading stopped, if it can
+              if( ! fileReader_.seek( statusMessage->fileOffset() ) )
+              {
+                Common::error( "Couldn't read %s: %s", fileName_, strerror( errno ) );
+              }
+              client_->gotStatusMessage( "The transfer of \"%s\" continues from byte %lld.", fileName_, (long long)statusMessage->fileOffset() );
+              startProgress( fileReader_.offset() );
+              break;
+            }
+
             client_->gotStatusMessage( "The transfer of \"%s\" has started.", fileName_ );
+            startProgress( 0 );
             break;
 
           case Errors::Status_RejectFileTransfer:
@@ -132,38 +533,149 @@ void SessionServer::availableMessages()
         break;
       }
 
+      case Message::MSG_PRIVATE:
+      {
+        PrivateMessage* privateMessage = dynamic_cast<PrivateMessage*>( message );
+
+        Common::debug( "Got private message by '%s': %s", privateMessage->sender(), privateMessage->message() );
+        client_->gotPrivateMessage( privateMessage->sender(), privateMessage->senderId(), privateMessage->message() );
+        break;
+      }
+
       case Message::MSG_FILE_REQUEST:
       {
         FileTransferMessage* fileMessage = dynamic_cast<FileTransferMessage*>( message );
 
         Common::debug( "Got file transfer request by '%s': %s", fileMessage->sender(), fileMessage->fileName() );
 
-        bool accepted = client_->gotFileTransferRequest( fileMessage->sender(),fileMessage->fileName(), fileName_ );
+        bool isFolder = ( fileMessage->entriesCount() > 0 );
+        bool accepted = client_->gotFileTransferRequest( fileMessage->sender(),fileMessage->fileName(), fileName_, isFolder );
         isReceivingFile_ = accepted;
+        isFolder_ = isFolder;
+        fileSize_ = fileMessage->fileSize();
+
+        pthread_mutex_lock( &stripesMutex_ );
+        hasLostStripe_ = false;
+        pthread_mutex_unlock( &stripesMutex_ );
+
+        // The contents of the folder follow the request: it's answered once they're all there
+        manifest_.clear();
+        delete fileRequest_;
+        fileRequest_ = NULL;
+        if( accepted && isFolder )
+        {
+          fileRequest_ = fileMessage;
+          message = NULL;
+          break;
+        }
 
-        Common::debug( "File transfer %s", accepted ? "accepted" : "rejected" );
+        answerFileRequest( fileMessage, accepted );
         break;
       }
 
-      case Message::MSG_FILE_DATA:
-      {
-        // We had ignored the file request
-        if( ! isReceivingFile_ )
+      case Message::MSG_FILE_MANIFEST:
+        gotFileManifest( dynamic_cast<FileManifestMessage*>( message ) );
+        break;
+
+      case Message::MSG_FILE_SIGNATURE:
+        // Only the signature of the receiver of the file being offered is of use
+        if( isSendingFile_ && ! hasFileTransferStarted_ && ! isFolder_ )
         {
-          break;
+          fileDelta_.addSignature( dynamic_cast<FileSignatureMessage*>( message ) );
         }
+        break;
+
+      case Message::MSG_STATS:
+      {
+        StatsMessage* statsMessage = dynamic_cast<StatsMessage*>( message );
+        client_->gotServerStats( statsMessage );
+        break;
+      }
 
-        FileDataMessage* dataMessage = dynamic_cast<FileDataMessage*>( message );
-        saveData( dataMessage->buffer(), dataMessage->bufferSize(), dataMessage->fileOffset() );
+      case Message::MSG_ROSTER:
+      {
+        RosterMessage* rosterMessage = dynamic_cast<RosterMessage*>( message );
+        client_->gotRoster( rosterMessage );
+        break;
+      }
 
-        if( dataMessage->isLastBlock() )
+      case Message::MSG_MULTICAST:
+      {
+        MulticastMessage* multicastMessage = dynamic_cast<MulticastMessage*>( message );
+        switch( multicastMessage->kind() )
         {
-          client_->gotStatusMessage( "The file \"%s\" was received.", fileName_ );
-          disableFileTransferMode();
+          case MulticastMessage::MULTICAST_ANNOUNCE:
+            // Without the group, the server keeps sending the chat messages through the session;
+            // an encrypted session doesn't want them in clear on the network
+            if( multicast_ == NULL && ! isEncrypted() )
+            {
+              multicast_ = new MulticastReceiver( this );
+              if( multicast_->start( multicastMessage ) )
+              {
+                sendMessage( new MulticastMessage( MulticastMessage::MULTICAST_SUBSCRIBE ) );
+              }
+              else
+              {
+                delete multicast_;
+                multicast_ = NULL;
+              }
+            }
+            break;
+
+          case MulticastMessage::MULTICAST_SUBSCRIBE:
+            if( multicast_ != NULL )
+            {
+              multicast_->subscribed( multicastMessage );
+            }
+            break;
+
+          case MulticastMessage::MULTICAST_REPAIR:
+            if( multicast_ != NULL )
+            {
+              multicast_->repaired( multicastMessage );
+            }
+            break;
+
+          case MulticastMessage::MULTICAST_FILE_START:
+            if( multicast_ != NULL && isReceivingFile_ )
+            {
+              multicast_->startFile( multicastMessage );
+            }
+            else
+            {
+              // Don't keep the server waiting for a file we won't save
+              MulticastMessage* abort = new MulticastMessage( MulticastMessage::MULTICAST_FILE_ABORT );
+              abort->setTransferId( multicastMessage->transferId() );
+              if( ! sendMessage( abort ) )
+              {
+                delete abort;
+              }
+            }
+            break;
+
+          case MulticastMessage::MULTICAST_FILE_ABORT:
+            // We couldn't keep up with the group, and the rest of the file won't come
+            if( multicast_ != NULL && multicast_->hasFile( multicastMessage->transferId() ) )
+            {
+              client_->gotStatusMessage( "The file \"%s\" could not be received.", fileName_ );
+              disableFileTransferMode();
+            }
+            break;
+
+          default:
+            break;
         }
         break;
       }
 
+      case Message::MSG_FILE_DATA:
+        gotFileData( dynamic_cast<FileDataMessage*>( message ) );
+        break;
+
+      case Message::MSG_STRIPE:
+        gotStripeMessage( dynamic_cast<StripeMessage*>( message ) );
+        break;
+
       default:
         break;
     }
@@ -181,99 +693,404 @@ void SessionServer::chat( const char* message )
 
 
 
-void SessionServer::cycle()
+void SessionServer::checkFileEnd()
 {
-  if( ! isSendingFile_ || ! hasFileTransferStarted_ )
+  if( ! isReceivingFile_ || ! hasLastBlock_ )
   {
     return;
   }
 
-  if( fileTransferHandle_ == NULL )
+  // Blocks sent through the other connections may still be on their way: the server marks
+  // the end of the file on each of them. Without one of them, only the session's mark can come
+  if( isFileStriped_ )
   {
-    fileTransferHandle_ = fopen( fileName_, "r" );
+    pthread_mutex_lock( &stripesMutex_ );
+    int neededMarks = hasLostStripe_ ? 1 : fileConnections_;
+    pthread_mutex_unlock( &stripesMutex_ );
 
-    if( fileTransferHandle_ == NULL )
+    if( fileEndMarks_ == 0 || fileEndMarks_ < neededMarks )
     {
-      // Opening the file failed somehow
-      Common::error( "Couldn't open %s: %s", fileName_, strerror( errno ) );
-
-      client_->gotStatusMessage( "Unable to open file %s! %s", fileName_, strerror( errno ) );
-      disableFileTransferMode();
       return;
     }
   }
 
-  // The file is open, we can send the data if the queue isn't full
-  if( ! canSendMessages() )
+  uint32_t checksum = 0;
+  if( ! fileWriter_.checksum( checksum ) )
   {
-    return;
+    Common::error( "Couldn't read back %s: %s", fileName_, strerror( errno ) );
   }
 
-  FileDataMessage* message = new FileDataMessage();
-
-
-  const int maxPayloadSize = MAX_PAYLOAD_SIZE - message->size();
+  bool isIntact = ( checksum == fileChecksum_ );
 
-  int offset;
-  bool endOfFile = false;
-  for( offset = 0; offset < maxPayloadSize; offset++ )
+  if( ! fileWriter_.finish() )
   {
-    int read = fread( fileTransferBuffer_ + offset, 1, 1, fileTransferHandle_ );
-
-    // EOF reached
-    if( read == 0 && feof( fileTransferHandle_ ) != 0 )
-    {
-      Common::debug( "End of file reached." );
-      client_->gotStatusMessage( "The file has been sent." );
-      endOfFile = true;
-      break;
-    }
+    Common::error( "Couldn't write %s: %s", fileName_, strerror( errno ) );
+    client_->gotStatusMessage( "Unable to write file %s! %s", fileName_, strerror( errno ) );
+  }
+  else if( ! isIntact )
+  {
+    Common::error( "Checksum mismatch for %s: got %08x, expected %08x", fileName_, checksum, fileChecksum_ );
+    client_->gotStatusMessage( "The file \"%s\" was received, but it's damaged!", fileName_ );
+  }
+  else
+  {
+    client_->gotStatusMessage( "The file \"%s\" was received.", fileName_ );
   }
 
-//   Common::debug( "File: Read %d (max %d) chars from offset %lu, last? %s", offset, maxPayloadSize, fileTransferOffset_, endOfFile?"yes":"no" );
+  disableFileTransferMode();
+}
 
-  message->setBuffer( fileTransferBuffer_, offset );
-  message->setFileOffset( fileTransferOffset_ );
 
-  fileTransferOffset_ += offset;
 
-  if( endOfFile )
+bool SessionServer::connectToSender( const FileTransferMessage* message )
+{
+  sockaddr_in address;
+  memset( &address, '\0', sizeof( address ) );
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = message->directAddress();
+  address.sin_port = message->directPort();
+
+  // The other receivers wait for the answer as well
+  timeval timeout;
+  timeout.tv_sec = DIRECT_CONNECT_TIMEOUT;
+  timeout.tv_usec = 0;
+
+  int peerSocket = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if( peerSocket == -1
+  ||  setsockopt( peerSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) ) == -1
+  ||  connect( peerSocket, reinterpret_cast<sockaddr*>( &address ), sizeof( address ) ) == -1 )
   {
-    message->markLastBlock();
-    disableFileTransferMode();
+    Common::error( "Unable to connect to the sender of %s: %s", fileName_, strerror( errno ) );
+    if( peerSocket != -1 )
+    {
+      close( peerSocket );
+    }
+    return false;
   }
 
-  sendMessage( message );
+  pthread_mutex_lock( &stripesMutex_ );
+  hasLostPeer_ = false;
+  pthread_mutex_unlock( &stripesMutex_ );
+
+  isFileDirect_ = true;
+  return startStripe( new SessionStripe( this, peerSocket, message->directToken() ), peers_ );
 }
 
 
 
-void SessionServer::disableFileTransferMode()
+void SessionServer::copyData( const off_t basisOffset, const off_t size, const off_t offset )
 {
-  // Reset the state variables
+  if( ! isReceivingFile_ )
+  {
+    return;
+  }
 
-  if( fileTransferHandle_ != NULL )
+  if( ! fileWriter_.copy( basisOffset, size, offset ) )
   {
-    fclose( fileTransferHandle_ );
-    fileTransferHandle_ = NULL;
+    // The sender would go on for nothing
+    Common::error( "Couldn't copy the older %s: %s", fileName_, strerror( errno ) );
+    client_->gotStatusMessage( "Unable to copy the older file %s! %s", fileName_, strerror( errno ) );
+    disableFileTransferMode();
+    return;
   }
 
-  fileTransferOffset_ = 0;
-  isReceivingFile_ = false;
-  isSendingFile_ = false;
-  hasFileTransferStarted_ = false;
-  *fileName_ = '\0';
+  receivedSize_ += size;
+
+  Common::debug( "File: Copied %lld chars at offset %lld", (long long)size, (long long)offset );
 }
 
 
 
-void SessionServer::disconnect()
+void SessionServer::cycle()
+{
+  // Show the chat messages which came through the multicast group, and save the file blocks
+  if( multicast_ != NULL )
+  {
+    Message* message;
+    while( ( message = multicast_->receiveMessage() ) != NULL )
+    {
+      ChatMessage* chatMessage = dynamic_cast<ChatMessage*>( message );
+      FileDataMessage* dataMessage = dynamic_cast<FileDataMessage*>( message );
+      if( chatMessage != NULL )
+      {
+        Common::debug( "Got multicast message by '%s': %s", chatMessage->sender(), chatMessage->message() );
+        client_->gotChatMessage( chatMessage->sender(), chatMessage->message() );
+      }
+      else if( dataMessage != NULL )
+      {
+        gotFileData( dataMessage );
+      }
+      delete message;
+    }
+  }
+
+  // Take what came through the data connections, and let them read more
+  std::list<Message*> stripeMessages;
+  pthread_mutex_lock( &stripesMutex_ );
+  stripeMessages.swap( closedMessages_ );
+  std::list<SessionStripe*> connections( stripes_ );
+  connections.insert( connections.end(), peers_.begin(), peers_.end() );
+  std::list<SessionStripe*>::iterator it;
+  for( it = connections.begin(); it != connections.end(); it++ )
+  {
+    size_t taken = stripeMessages.size();
+    Message* message;
+    while( ( message = (*it)->takeMessage() ) != NULL )
+    {
+      stripeMessages.push_back( message );
+    }
+    if( stripeMessages.size() > taken )
+    {
+      (*it)->wakeUp();
+    }
+  }
+  bool hasLostPeer = hasLostPeer_;
+  bool hasPeers = ( peers_.size() > 0 );
+  pthread_mutex_unlock( &stripesMutex_ );
+
+  std::list<Message*>::iterator messageIt;
+  for( messageIt = stripeMessages.begin(); messageIt != stripeMessages.end(); messageIt++ )
+  {
+    if( (*messageIt)->type() == Message::MSG_FILE_DATA )
+    {
+      gotFileData( dynamic_cast<FileDataMessage*>( *messageIt ) );
+    }
+    else
+    {
+      gotStripeMessage( dynamic_cast<StripeMessage*>( *messageIt ) );
+    }
+    delete (*messageIt);
+  }
+
+  // A data connection may have ended without the end mark
+  checkFileEnd();
+
+  // Without its direct connection, the rest of the file won't come
+  if( isReceivingFile_ && isFileDirect_ && hasLostPeer )
+  {
+    Common::error( "The connection to the sender of %s was lost", fileName_ );
+    client_->gotStatusMessage( "The sender of \"%s\" went away before the end of the file.", fileName_ );
+    disableFileTransferMode();
+  }
+
+  reportProgress();
+
+  if( ! isSendingFile_ || ! hasFileTransferStarted_ )
+  {
+    return;
+  }
+
+  if( isFileDirect_ && ! hasPeers )
+  {
+    Common::error( "None of the receivers of %s is connected", fileName_ );
+    client_->gotStatusMessage( "Unable to send the file! None of the receivers is connected anymore." );
+    disableFileTransferMode();
+    return;
+  }
+
+  // The file is open, we can send the data until the queues are full
+  bool isLastBlock = false;
+  const int maxPayloadSize = MAX_PAYLOAD_SIZE - FileDataMessage().size();
+  std::list<SessionBase*> fileTargets;
+  pthread_mutex_lock( &stripesMutex_ );
+  while( ! isLastBlock && fileConnections( fileTargets ) )
+  {
+    const char* data = NULL;
+    off_t offset = fileReader_.offset();
+
+    // What the receiver has already is sent as where it is in its older copy, up to the next part it has
+    off_t matchOffset = offset + maxPayloadSize;
+    off_t basisOffset = 0;
+    off_t matchSize = 0;
+    if( fileDelta_.isStarted() && ! fileDelta_.findMatch( offset, offset + maxPayloadSize, matchOffset, basisOffset, matchSize ) )
+    {
+      Common::error( "Couldn't compare %s to the receiver's copy: %s", fileName_, strerror( errno ) );
+      fileDelta_.clear();
+      matchOffset = offset + maxPayloadSize;
+      matchSize = 0;
+    }
+
+    FileDataMessage::Copy copy;
+    int size;
+    if( matchOffset == offset && matchSize > 0 )
+    {
+      copy.basisOffset = basisOffset;
+      copy.size = matchSize;
+      size = -1;
+      if( fileReader_.skip( matchSize ) )
+      {
+        data = reinterpret_cast<const char*>( &copy );
+        size = sizeof( copy );
+      }
+    }
+    else
+    {
+      // The data is read even when the system sends it straight from the file, for its checksum
+      size = fileReader_.read( data, matchOffset - offset );
+    }
+
+    // The others would wait forever for the rest: end the file where it can't be read anymore
+    if( size == -1 )
+    {
+      Common::error( "Couldn't read %s: %s", fileName_, strerror( errno ) );
+      client_->gotStatusMessage( "Unable to read file %s! %s", fileName_, strerror( errno ) );
+      size = 0;
+    }
+    else if( fileReader_.isAtEnd() )
+    {
+      Common::debug( "End of file reached." );
+      client_->gotStatusMessage( "The file has been sent." );
+    }
+
+    isLastBlock = ( size == 0 || fileReader_.isAtEnd() );
+    uint32_t checksum = Crc32c::update( 0, data, size );
+
+    std::list<SessionBase*>::iterator targetIt;
+    for( targetIt = fileTargets.begin(); targetIt != fileTargets.end(); targetIt++ )
+    {
+      FileDataMessage* message = new FileDataMessage();
+      message->setFileOffset( offset );
+      message->setChecksum( checksum );
+
+      // A copied part has no data of its own; the rest is still in memory if it can't be sent from the file
+      if( data == reinterpret_cast<const char*>( &copy ) )
+      {
+        message->setCopy( copy.basisOffset, copy.size );
+      }
+      else if( size == 0 || ! (*targetIt)->canWriteDirectly() || ! message->setFile( fileReader_.file(), size, fileReader_.blockPosition() ) )
+      {
+        message->setBuffer( data, size );
+      }
+
+      if( isLastBlock )
+      {
+        message->markLastBlock();
+        message->setFileChecksum( fileReader_.checksum() );
+      }
+
+      // An answer to a heartbeat may have taken the last place in the queue
+      if( ! (*targetIt)->sendMessage( message, true ) )
+      {
+        Common::error( "Couldn't send the block at offset %ld of %s", message->fileOffset(), fileName_ );
+        delete message;
+      }
+    }
+  }
+  pthread_mutex_unlock( &stripesMutex_ );
+
+  if( isLastBlock )
+  {
+    disableFileTransferMode();
+  }
+}
+
+
+
+void SessionServer::disableFileTransferMode()
+{
+  // Reset the state variables
+
+  fileDelta_.clear();
+  fileReader_.close();
+  fileWriter_.close();
+
+  // Nothing more of the file is needed from the group
+  if( multicast_ != NULL )
+  {
+    multicast_->stopFile();
+  }
+
+  if( directSocket_ != -1 )
+  {
+    close( directSocket_ );
+    directSocket_ = -1;
+  }
+
+  // The direct connections close once they've sent what's queued
+  pthread_mutex_lock( &stripesMutex_ );
+  std::list<SessionStripe*>::iterator it;
+  for( it = peers_.begin(); it != peers_.end(); it++ )
+  {
+    (*it)->disconnect();
+  }
+  leavingPeers_.splice( leavingPeers_.end(), peers_ );
+  pthread_mutex_unlock( &stripesMutex_ );
+
+  isReceivingFile_ = false;
+  isSendingFile_ = false;
+  hasFileTransferStarted_ = false;
+  *fileName_ = '\0';
+  fileSize_ = 0;
+
+  fileChecksum_ = 0;
+  fileConnections_ = 0;
+  fileEndMarks_ = 0;
+  hasLastBlock_ = false;
+  isFileDirect_ = false;
+  isFileStriped_ = false;
+
+  delete fileRequest_;
+  fileRequest_ = NULL;
+  isFolder_ = false;
+  manifest_.clear();
+}
+
+
+
+void SessionServer::disconnect()
 {
   if( isConnected() )
   {
     sendMessage( new ByeMessage() );
     SessionBase::disconnect();
   }
+
+  pthread_mutex_lock( &stripesMutex_ );
+  std::list<SessionStripe*> connections( stripes_ );
+  connections.insert( connections.end(), peers_.begin(), peers_.end() );
+  std::list<SessionStripe*>::iterator it;
+  for( it = connections.begin(); it != connections.end(); it++ )
+  {
+    (*it)->disconnect();
+  }
+  pthread_mutex_unlock( &stripesMutex_ );
+}
+
+
+
+bool SessionServer::fileConnections( std::list<SessionBase*>& connections )
+{
+  connections.clear();
+
+  if( ! isFileDirect_ )
+  {
+    SessionBase* connection = nextFileConnection();
+    if( connection != NULL )
+    {
+      connections.push_back( connection );
+    }
+    return ( connection != NULL );
+  }
+
+  // Each receiver gets every block, so they all wait for the slowest; the ones which
+  // didn't join yet would miss the first blocks
+  std::list<SessionStripe*>::iterator it;
+  for( it = peers_.begin(); it != peers_.end(); it++ )
+  {
+    if( ! (*it)->isConnected() )
+    {
+      continue;
+    }
+
+    if( ! (*it)->hasJoined() || ! (*it)->canSendMessages() )
+    {
+      return false;
+    }
+
+    connections.push_back( *it );
+  }
+
+  return ( connections.size() > 0 );
 }
 
 
@@ -292,38 +1109,308 @@ bool SessionServer::hasFileTransfer() const
 
 
 
-const char* SessionServer::nickName() const
+void SessionServer::gotFileData( const FileDataMessage* message )
 {
-  return nickName_;
+  // We had ignored the file request
+  if( ! isReceivingFile_ )
+  {
+    return;
+  }
+
+  // A damaged block isn't saved: what's on disk so far is good, and can be resumed
+  if( Crc32c::update( 0, message->buffer(), message->bufferSize() ) != message->checksum() )
+  {
+    Common::error( "Damaged block at offset %ld of %s", message->fileOffset(), fileName_ );
+    client_->gotStatusMessage( "A block of \"%s\" arrived damaged! Send the file again to get the rest.", fileName_ );
+    disableFileTransferMode();
+    return;
+  }
+
+  if( message->isCopy() )
+  {
+    copyData( message->basisOffset(), message->blockSize(), message->fileOffset() );
+  }
+  else
+  {
+    saveData( message->buffer(), message->bufferSize(), message->fileOffset() );
+  }
+
+  // Saving the block may have failed
+  if( ! isReceivingFile_ || ! message->isLastBlock() )
+  {
+    return;
+  }
+
+  hasLastBlock_ = true;
+  fileChecksum_ = message->fileChecksum();
+  checkFileEnd();
 }
 
 
 
-void SessionServer::saveData( const char* buffer, int size, long offset )
+void SessionServer::gotFileManifest( const FileManifestMessage* message )
 {
-  if( ! isReceivingFile_ )
+  // Only the folder being accepted
+  if( fileRequest_ == NULL )
+  {
+    return;
+  }
+
+  for( int i = 0; i < message->entriesCount(); i++ )
+  {
+    manifest_.push_back( message->entry( i ) );
+  }
+
+  if( ! message->isLast() && (int)manifest_.size() < fileRequest_->entriesCount() )
   {
     return;
   }
 
-  if( fileTransferHandle_ == NULL )
+  // Nothing may be written outside of the folder, nor past the end of its files
+  bool isValid = ( (int)manifest_.size() == fileRequest_->entriesCount() );
+  off_t size = 0;
+  std::list<FileManifestMessage::Entry>::iterator it;
+  for( it = manifest_.begin(); it != manifest_.end() && isValid; it++ )
+  {
+    isValid = isInsideFolder( (*it).path ) && ( ! (*it).isDirectory || (*it).size == 0 );
+    size += (*it).size;
+  }
+  isValid = isValid && ( size == fileSize_ );
+
+  FileTransferMessage* request = fileRequest_;
+  fileRequest_ = NULL;
+
+  if( ! isValid )
+  {
+    Common::error( "The contents of %s don't match its request", fileName_ );
+    client_->gotStatusMessage( "The folder \"%s\" can't be received, its contents are damaged!", fileName_ );
+    disableFileTransferMode();
+  }
+
+  answerFileRequest( request, isValid );
+  delete request;
+}
+
+
+
+void SessionServer::gotStripeMessage( const StripeMessage* message )
+{
+  switch( message->kind() )
+  {
+    case StripeMessage::STRIPE_OFFER:
+      // Only the session can be offered them
+      if( isReceivingFile_ )
+      {
+        isFileStriped_ = true;
+      }
+      openStripes( message->token(), message->count() );
+      break;
+
+    case StripeMessage::STRIPE_END:
+      if( isReceivingFile_ && isFileStriped_ )
+      {
+        fileConnections_ = message->count();
+        fileEndMarks_++;
+        checkFileEnd();
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+
+
+uint16_t SessionServer::listenForReceivers()
+{
+  sockaddr_in address;
+  memset( &address, '\0', sizeof( address ) );
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl( INADDR_ANY );
+  address.sin_port = 0;
+
+  // Any free port will do, the server tells the receivers which one it is
+  socklen_t addressSize = sizeof( address );
+  directSocket_ = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if( directSocket_ == -1
+  ||  bind( directSocket_, reinterpret_cast<sockaddr*>( &address ), sizeof( address ) ) == -1
+  ||  listen( directSocket_, SOMAXCONN ) == -1
+  ||  getsockname( directSocket_, reinterpret_cast<sockaddr*>( &address ), &addressSize ) == -1 )
   {
-    fileTransferHandle_ = fopen( fileName_, "w" );
+    Common::error( "Unable to wait for the receivers, the file will go through the server: %s", strerror( errno ) );
+    if( directSocket_ != -1 )
+    {
+      close( directSocket_ );
+      directSocket_ = -1;
+    }
+    return 0;
+  }
+
+  return address.sin_port;
+}
+
+
+
+SessionBase* SessionServer::nextFileConnection()
+{
+  unsigned int count = stripes_.size() + 1;
+
+  for( unsigned int i = 0; i < count; i++ )
+  {
+    unsigned int index = nextStripe_++ % count;
+
+    SessionBase* connection = this;
+    if( index > 0 )
+    {
+      std::list<SessionStripe*>::iterator it = stripes_.begin();
+      std::advance( it, index - 1 );
+
+      // It can't carry blocks until the server has tied it to the session
+      if( ! (*it)->hasJoined() )
+      {
+        continue;
+      }
+      connection = *it;
+    }
+
+    if( connection->isConnected() && connection->canSendMessages() )
+    {
+      return connection;
+    }
+  }
+
+  return NULL;
+}
+
+
+
+const char* SessionServer::nickName() const
+{
+  return nickName_;
+}
+
+
+
+void SessionServer::openStripes( const uint64_t token, const int count )
+{
+  pthread_mutex_lock( &stripesMutex_ );
+  int missing = std::min( count, fileStripes_ ) - (int)stripes_.size();
+  pthread_mutex_unlock( &stripesMutex_ );
+
+  for( int i = 0; i < missing; i++ )
+  {
+    int stripeSocket = socket( AF_INET, SOCK_STREAM, 0 );
+    if( stripeSocket == -1
+    ||  connect( stripeSocket, reinterpret_cast<sockaddr*>( &serverAddress_ ), sizeof( serverAddress_ ) ) == -1 )
+    {
+      Common::error( "Unable to open a data connection: %s", strerror( errno ) );
+      if( stripeSocket != -1 )
+      {
+        close( stripeSocket );
+      }
+      return;
+    }
+
+    SessionStripe* stripe = new SessionStripe( this, stripeSocket, token );
+
+    // Encrypted like the session
+    if( tlsContext() != NULL && ! stripe->startTls( tlsContext(), false ) )
+    {
+      stripe->dropConnection();
+    }
 
-    if( fileTransferHandle_ == NULL )
+    if( ! startStripe( stripe, stripes_ ) )
     {
-      // Opening the file failed somehow
-      Common::error( "Couldn't open %s: %s", fileName_, strerror( errno ) );
-      char message[ MAX_CHATMESSAGE_SIZE ];
-      sprintf( message, "Unable to open file %s! %s", fileName_, strerror( errno ) );
-      client_->gotStatusMessage( message );
-      disableFileTransferMode();
       return;
     }
   }
+}
+
+
+
+void SessionServer::privateChat( const char* nickName, const unsigned int id, const char* message )
+{
+  PrivateMessage* privateMessage = new PrivateMessage( message );
+  privateMessage->setRecipient( nickName, id );
+  sendMessage( privateMessage );
+}
+
+
+
+void SessionServer::reportProgress()
+{
+  // A folder is accepted only once its contents are known
+  bool isTransferring = ( isSendingFile_ && hasFileTransferStarted_ ) || ( isReceivingFile_ && fileWriter_.isOpen() );
+  if( ! isTransferring )
+  {
+    return;
+  }
+
+  timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  double elapsed =   ( now.tv_sec  - progressTime_.tv_sec  )
+                   + ( now.tv_nsec - progressTime_.tv_nsec ) / 1000000000.0;
+  if( elapsed < FILE_PROGRESS_INTERVAL )
+  {
+    return;
+  }
+
+  // What's been read is as good as sent: the queues don't take much more
+  off_t doneSize = isSendingFile_ ? fileReader_.offset() : receivedSize_;
+
+  // A single slow moment shouldn't throw the estimate off
+  double rate = ( doneSize - progressSize_ ) / elapsed;
+  progressRate_ = ( progressRate_ == 0 ) ? rate : ( progressRate_ + rate ) / 2;
+
+  progressSize_ = doneSize;
+  progressTime_ = now;
+
+  // Unknown without the size, or while nothing moves
+  int secondsLeft = -1;
+  if( fileSize_ > 0 && progressRate_ > 0 )
+  {
+    secondsLeft = static_cast<int>( std::max( (off_t)0, fileSize_ - doneSize ) / progressRate_ );
+  }
+
+  Common::debug( "File: %lld of %lld bytes done, %.0f bytes/s", (long long)doneSize, (long long)fileSize_, progressRate_ );
+  client_->gotFileProgress( fileName_, isSendingFile_, doneSize, fileSize_, progressRate_, secondsLeft );
+}
+
+
+
+void SessionServer::requestRoster()
+{
+  sendMessage( new RosterMessage() );
+}
+
+
+
+void SessionServer::requestStats()
+{
+  sendMessage( new StatsMessage() );
+}
+
+
+
+void SessionServer::saveData( const char* buffer, int size, long offset )
+{
+  if( ! isReceivingFile_ )
+  {
+    return;
+  }
+
+  if( ! fileWriter_.write( buffer, size, offset ) )
+  {
+    // The sender would go on for nothing
+    Common::error( "Couldn't write %s: %s", fileName_, strerror( errno ) );
+    client_->gotStatusMessage( "Unable to write file %s! %s", fileName_, strerror( errno ) );
+    disableFileTransferMode();
+    return;
+  }
 
-  fseek( fileTransferHandle_, offset, SEEK_SET );
-  fwrite( buffer, size, 1, fileTransferHandle_ );
+  receivedSize_ += size;
 
   Common::debug( "File: Saved %d chars at offset %ld", size, offset );
 }
@@ -332,10 +1419,124 @@ void SessionServer::saveData( const char* buffer, int size, long offset )
 
 void SessionServer::sendFile( const char* fileName )
 {
+  // A folder is sent with all its contents, listed along with the request
+  struct stat status;
+  bool isFolder = ( stat( fileName, &status ) == 0 && S_ISDIR( status.st_mode ) );
+  uint64_t transferId = 0;
+  if( isFolder )
+  {
+    int skipped = 0;
+    manifest_.clear();
+    transferId = transferIdOf( status );
+    if( ! listFolder( fileName, "", manifest_, transferId, skipped ) )
+    {
+      Common::error( "Couldn't list %s: %s", fileName, strerror( errno ) );
+      client_->gotStatusMessage( "Unable to read folder %s! %s", fileName, strerror( errno ) );
+      manifest_.clear();
+      return;
+    }
+    if( manifest_.size() == 0 )
+    {
+      client_->gotStatusMessage( "The folder %s is empty, there's nothing to send.", fileName );
+      return;
+    }
+    if( skipped > 0 )
+    {
+      client_->gotStatusMessage( "%d items of the folder %s can't be sent, and were left out.", skipped, fileName );
+    }
+    transferId = ( transferId != 0 ) ? transferId : 1;
+  }
+
   isSendingFile_ = true;
+  isFolder_ = isFolder;
   strncpy( fileName_, fileName, MAX_PATH_SIZE );
+  fileDelta_.clear();
+
+  // Lets the receivers reserve the space for the file, and keep what they got of it before;
+  // if it can't be read, it'll be told later
+  FileTransferMessage* message = new FileTransferMessage( fileName );
+  if( isFolder )
+  {
+    fileSize_ = 0;
+    std::list<FileManifestMessage::Entry>::iterator it;
+    for( it = manifest_.begin(); it != manifest_.end(); it++ )
+    {
+      fileSize_ += (*it).size;
+    }
+    message->setEntriesCount( manifest_.size() );
+    message->setFileSize( fileSize_ );
+    message->setTransferId( transferId );
+  }
+  else if( stat( fileName, &status ) == 0 )
+  {
+    fileSize_ = status.st_size;
+    message->setFileSize( status.st_size );
+    message->setTransferId( transferIdOf( status ) );
+  }
+
+  // The direct connections would be in clear text
+  uint16_t port = ( isDirect_ && tlsContext() == NULL ) ? listenForReceivers() : 0;
+  if( port != 0 )
+  {
+    directToken_ = randomToken();
+    isFileDirect_ = true;
+    message->setDirectAddress( 0, port );
+    message->setDirectToken( directToken_ );
+  }
+
+  sendMessage( message );
+
+  if( ! isFolder )
+  {
+    return;
+  }
+
+  // The contents follow right away, however many they are: the receivers answer once they
+  // have them all, and the files then go one after the other without waiting
+  std::list<FileManifestMessage::Entry>::iterator it = manifest_.begin();
+  FileManifestMessage* manifestMessage = new FileManifestMessage();
+  while( manifestMessage != NULL )
+  {
+    while( it != manifest_.end() && manifestMessage->addEntry( *it ) )
+    {
+      it++;
+    }
+
+    FileManifestMessage* nextMessage = NULL;
+    if( it == manifest_.end() )
+    {
+      manifestMessage->markLast();
+    }
+    else
+    {
+      nextMessage = new FileManifestMessage();
+    }
+
+    if( ! sendMessage( manifestMessage, true ) )
+    {
+      Common::error( "Couldn't send the contents of %s", fileName_ );
+      delete manifestMessage;
+    }
+    manifestMessage = nextMessage;
+  }
+}
+
 
-  sendMessage( new FileTransferMessage( fileName ) );
+
+void SessionServer::setDirectFiles( const bool isDirect )
+{
+  isDirect_ = isDirect;
+}
+
+
+
+void SessionServer::setFileStripes( const int count )
+{
+  // Unless they can't be opened at all
+  if( fileStripes_ > 0 )
+  {
+    fileStripes_ = std::max( 0, std::min( count, MAX_FILE_STRIPES ) );
+  }
 }
 
 
@@ -346,3 +1547,63 @@ void SessionServer::setNickName( const char* nickName )
 }
 
 
+
+bool SessionServer::startStripe( SessionStripe* stripe, std::list<SessionStripe*>& connections )
+{
+  // Listed before its thread starts, as it may end right away
+  pthread_mutex_lock( &stripesMutex_ );
+  connections.push_back( stripe );
+  pthread_mutex_unlock( &stripesMutex_ );
+
+  pthread_t thread;
+  if( pthread_create( &thread, NULL, &SessionBase::pollForData, stripe ) != 0 )
+  {
+    Common::error( "Unable to start a data connection" );
+    delete stripe;
+    return false;
+  }
+  pthread_detach( thread );
+
+  return true;
+}
+
+
+
+void SessionServer::startProgress( const off_t doneSize )
+{
+  progressRate_ = 0;
+  progressSize_ = doneSize;
+  clock_gettime( CLOCK_MONOTONIC, &progressTime_ );
+}
+
+
+
+void SessionServer::stripeClosed( SessionStripe* stripe, std::list<Message*>& messages )
+{
+  pthread_mutex_lock( &stripesMutex_ );
+  if( std::find( leavingPeers_.begin(), leavingPeers_.end(), stripe ) != leavingPeers_.end() )
+  {
+    leavingPeers_.remove( stripe );
+  }
+  else
+  {
+    if( std::find( peers_.begin(), peers_.end(), stripe ) != peers_.end() )
+    {
+      peers_.remove( stripe );
+      hasLostPeer_ = true;
+    }
+    else
+    {
+      stripes_.remove( stripe );
+      hasLostStripe_ = true;
+    }
+
+    // The last blocks of the file may be among them
+    closedMessages_.splice( closedMessages_.end(), messages );
+  }
+  pthread_cond_signal( &stripesCondition_ );
+  pthread_mutex_unlock( &stripesMutex_ );
+
+  // The file being received may not have to wait for it anymore
+  wakeUp();
+}
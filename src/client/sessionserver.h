@@ -11,12 +11,52 @@
 #ifndef SESSIONSERVER_H
 #define SESSIONSERVER_H
 
+#include "filedelta.h"
+#include "filemanifestmessage.h"
+#include "filereader.h"
+#include "filewriter.h"
 #include "sessionbase.h"
 
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
+
+#include <list>
+
+
+/**
+ * @def FILE_STRIPES
+ *
+ * Default number of data connections opened for the file transfers besides the session,
+ * when the server allows them.
+ */
+#define FILE_STRIPES   3
+
+
+/**
+ * @def DIRECT_CONNECT_TIMEOUT
+ *
+ * Seconds a receiver waits to connect to the sender of a file, when it's sent directly.
+ */
+#define DIRECT_CONNECT_TIMEOUT   5
+
+
+/**
+ * @def FILE_PROGRESS_INTERVAL
+ *
+ * Seconds between the reports of how a file transfer is going.
+ */
+#define FILE_PROGRESS_INTERVAL   1
 
 
 class Client;
+class FileDataMessage;
+class FileTransferMessage;
+class MulticastReceiver;
+class SessionStripe;
+class StripeMessage;
 
 
 
@@ -38,34 +78,265 @@ class SessionServer : public SessionBase
     bool hasFileTransfer() const;
     const char* fileTransferName() const;
     const char* nickName() const;
+
+    /**
+     * Send a message to a single user.
+     *
+     * @param id Id of the user, from the roster; if 0, the nickname is used
+     */
+    void privateChat( const char* nickName, const unsigned int id, const char* message );
+    void requestRoster();
+    void requestStats();
     void setNickName( const char* nickName );
     void saveData( const char* buffer, int size, long int offset );
+
+    /**
+     * Offer a file to the other users; a folder is sent with all of its contents.
+     */
     void sendFile( const char* fileName );
 
+    /**
+     * Choose whether the files sent go straight to their receivers, which connect to this
+     * computer, rather than through the server. The server only brokers the transfers.
+     *
+     * Encrypted sessions send them through the server anyway.
+     */
+    void setDirectFiles( const bool isDirect );
+
+    /**
+     * Choose how many data connections to open for the file transfers.
+     *
+     * Must be called before the session thread is started.
+     *
+     * @param count Up to MAX_FILE_STRIPES; 0 sends and receives the files through the session only
+     */
+    void setFileStripes( const int count );
+
+    /**
+     * A data connection has ended. Called by its thread.
+     *
+     * @param messages What it received and wasn't taken yet; the session takes what it needs
+     */
+    void stripeClosed( SessionStripe* stripe, std::list<Message*>& messages );
+
 
   private:
 
+    /**
+     * Take the connections of the receivers of the file being sent directly, and stop
+     * waiting for more.
+     */
+    void acceptReceivers();
+
+    /**
+     * Get ready to receive a file or a folder, and tell the sender whether it's wanted
+     * and where to start from.
+     */
+    void answerFileRequest( const FileTransferMessage* request, bool accepted );
+
     virtual void availableMessages();
+
+    /**
+     * Finish the file being received once its last block has arrived and, if it was spread
+     * among the data connections, once all of them are done with it.
+     */
+    void checkFileEnd();
+
+    /**
+     * Connect to the sender of a file which is sent directly.
+     *
+     * @return false if it can't be reached
+     */
+    bool connectToSender( const FileTransferMessage* message );
+
+    /**
+     * Save a part of the file being received which didn't change, from its older copy.
+     */
+    void copyData( const off_t basisOffset, const off_t size, const off_t offset );
+
     virtual void cycle();
     void disableFileTransferMode(  );
 
+    /**
+     * Pick the connections which get the next block of the file being sent: through the
+     * server, one of the session and its data connections; sent directly, every receiver.
+     *
+     * Must be called with the data connections locked.
+     *
+     * @return false if they can't take it yet
+     */
+    bool fileConnections( std::list<SessionBase*>& connections );
+
+    /**
+     * Save a block of the file being received, through the session or the multicast group.
+     */
+    void gotFileData( const FileDataMessage* message );
+
+    /**
+     * Take part of the contents of the folder being received; answer its request once
+     * they're all there.
+     */
+    void gotFileManifest( const FileManifestMessage* message );
+
+    /**
+     * Handle the offer of data connections, or the end of a file on one of them.
+     */
+    void gotStripeMessage( const StripeMessage* message );
+
+    /**
+     * Start waiting for the receivers of the file being sent.
+     *
+     * @return Port they can connect to, in network byte order, or 0 on error
+     */
+    uint16_t listenForReceivers();
+
+    /**
+     * Tell the client how much of the file has been transferred, how fast, and how long
+     * it should take to finish; at most once every FILE_PROGRESS_INTERVAL.
+     */
+    void reportProgress();
+
+    /**
+     * Pick the connection which sends the next file block: the session and the joined data
+     * connections take turns, skipping the full ones.
+     *
+     * Must be called with the data connections locked.
+     *
+     * @return NULL if they're all full
+     */
+    SessionBase* nextFileConnection();
+
+    /**
+     * Open the data connections offered by the server, up to the chosen number.
+     * They're kept for the next transfers as well.
+     */
+    void openStripes( const uint64_t token, const int count );
+
+    /**
+     * Start the thread of a data connection.
+     *
+     * @param connections List to add it to
+     * @return false on error; the connection is deleted
+     */
+    bool startStripe( SessionStripe* stripe, std::list<SessionStripe*>& connections );
+
+    /**
+     * Start measuring the transfer of the file.
+     *
+     * @param doneSize Bytes of the file which don't need to be transferred
+     */
+    void startProgress( const off_t doneSize );
+
 
   private:
 
     /// Pointer to the parent client
     Client* client_;
 
-    FILE* fileTransferHandle_;
-    unsigned long long fileTransferOffset_;
+    /// Messages received by data connections which have ended, not handled yet; guarded by stripesMutex_
+    std::list<Message*> closedMessages_;
+
+    /// Where the receivers of the file being sent directly connect, or -1
+    int directSocket_;
+
+    /// Given by the receivers of the file being sent directly
+    uint64_t directToken_;
+
+    /// Finds what the only receiver of the file being sent already has of it
+    FileDelta fileDelta_;
+
+    /// Reads the file being sent
+    FileReader fileReader_;
+
+    /// Saves the file being received
+    FileWriter fileWriter_;
+
     bool isReceivingFile_;
     bool isSendingFile_;
     bool hasFileTransferStarted_;
-    char fileTransferBuffer_[ MAX_MESSAGE_SIZE ];
+
+    /// Checksum of the whole file being received, from its last block
+    uint32_t fileChecksum_;
+
+    /// Connections which carried the file being received, as told by its end marks
+    int fileConnections_;
+
+    /// End marks of the file being received which have arrived
+    int fileEndMarks_;
 
     char fileName_[ MAX_PATH_SIZE ];
 
+    /// Request for the folder being received, answered once its contents are all known
+    FileTransferMessage* fileRequest_;
+
+    /// Data connections to open, when the server offers them
+    int fileStripes_;
+
+    /// Size of the file being transferred; when receiving, as announced by its sender; 0 if unknown
+    off_t fileSize_;
+
+    /// Receives the chat messages sent to the multicast group, if the server uses one
+    MulticastReceiver* multicast_;
+
     char nickName_[ MAX_NICKNAME_SIZE ];
 
+    /// Whether the last block of the file being received has arrived
+    bool hasLastBlock_;
+
+    /// Whether a direct connection of the file being transferred ended; guarded by stripesMutex_
+    bool hasLostPeer_;
+
+    /// Whether a data connection ended during the file transfer; guarded by stripesMutex_
+    bool hasLostStripe_;
+
+    /// Whether the files sent go straight to their receivers
+    bool isDirect_;
+
+    /// Whether the file being transferred goes straight between its sender and its receivers
+    bool isFileDirect_;
+
+    /// Whether the file being received may come through the data connections too
+    bool isFileStriped_;
+
+    /// Whether a folder is being transferred, rather than a single file
+    bool isFolder_;
+
+    /// Direct connections of past files, until they're closed
+    std::list<SessionStripe*> leavingPeers_;
+
+    /// Contents of the folder being transferred
+    std::list<FileManifestMessage::Entry> manifest_;
+
+    /// Data connection which sends the next file block, after the session
+    unsigned int nextStripe_;
+
+    /// Direct connections to the receivers of the file being sent, or to its sender
+    std::list<SessionStripe*> peers_;
+
+    /// Speed of the file transfer in bytes per second, smoothed over the reports; 0 before the first
+    double progressRate_;
+
+    /// Bytes of the file transferred at the last progress report
+    off_t progressSize_;
+
+    /// When the progress of the file transfer was last reported
+    timespec progressTime_;
+
+    /// Bytes of the file being received which were saved, or kept from an interrupted transfer
+    off_t receivedSize_;
+
+    /// Where the session is connected to, for the data connections
+    sockaddr_in serverAddress_;
+
+    /// Data connections, which remove themselves when they end
+    std::list<SessionStripe*> stripes_;
+
+    /// Signaled when a data connection ends
+    pthread_cond_t stripesCondition_;
+
+    /// Guards the data connections
+    pthread_mutex_t stripesMutex_;
+
 
 };
 
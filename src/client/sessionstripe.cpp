@@ -0,0 +1,198 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sessionstripe.h"
+
+#include "common.h"
+#include "protocol.h"
+#include "sessionserver.h"
+
+#include "byemessage.h"
+#include "statusmessage.h"
+#include "stripemessage.h"
+
+
+
+SessionStripe::SessionStripe( SessionServer* parent, const int socket, const uint64_t token, const bool isIncoming )
+: SessionBase( socket )
+, hasJoined_( false )
+, isIncoming_( isIncoming )
+, parent_( parent )
+, token_( token )
+{
+  pthread_mutex_init( &mutex_, NULL );
+
+  // Instead of logging in
+  if( ! isIncoming_ )
+  {
+    sendMessage( new StripeMessage( StripeMessage::STRIPE_JOIN, token_ ) );
+  }
+}
+
+
+
+SessionStripe::~SessionStripe()
+{
+  // After this, the session doesn't use the connection anymore; it still gets what the
+  // connection received before it ended
+  std::list<Message*> messages;
+  pthread_mutex_lock( &mutex_ );
+  messages.swap( messages_ );
+  pthread_mutex_unlock( &mutex_ );
+
+  parent_->stripeClosed( this, messages );
+
+  while( messages.size() > 0 )
+  {
+    delete messages.front();
+    messages.pop_front();
+  }
+
+  pthread_mutex_destroy( &mutex_ );
+}
+
+
+
+void SessionStripe::availableMessages()
+{
+  bool hasNews = false;
+
+  Message* message;
+  while( ( message = receiveMessage() ) != NULL )
+  {
+    switch( message->type() )
+    {
+      case Message::MSG_STRIPE:
+      {
+        StripeMessage* stripeMessage = dynamic_cast<StripeMessage*>( message );
+        if( stripeMessage->kind() == StripeMessage::STRIPE_JOIN )
+        {
+          if( isIncoming_ && ( hasJoined() || stripeMessage->token() != token_ ) )
+          {
+            Common::error( "Data connection 0x%X didn't give the right token, closing it", this );
+            disconnect();
+            break;
+          }
+
+          // Whoever opened the connection is told that it's been accepted
+          if( isIncoming_ )
+          {
+            sendMessage( new StripeMessage( StripeMessage::STRIPE_JOIN, token_ ) );
+          }
+
+          Common::debug( "Data connection 0x%X joined the session", this );
+          pthread_mutex_lock( &mutex_ );
+          hasJoined_ = true;
+          pthread_mutex_unlock( &mutex_ );
+          hasNews = true;
+        }
+        else if( stripeMessage->kind() == StripeMessage::STRIPE_END )
+        {
+          pthread_mutex_lock( &mutex_ );
+          messages_.push_back( message );
+          pthread_mutex_unlock( &mutex_ );
+          message = NULL;
+          hasNews = true;
+        }
+        break;
+      }
+
+      case Message::MSG_FILE_DATA:
+        pthread_mutex_lock( &mutex_ );
+        messages_.push_back( message );
+        pthread_mutex_unlock( &mutex_ );
+        message = NULL;
+        hasNews = true;
+        break;
+
+      case Message::MSG_STATUS:
+      {
+        // The server checks whether we're still here
+        StatusMessage* statusMessage = dynamic_cast<StatusMessage*>( message );
+        if( statusMessage->statusCode() == Errors::Status_Heartbeat )
+        {
+          sendMessage( new StatusMessage( Errors::Status_Heartbeat ) );
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+
+    delete message;
+  }
+
+  if( hasNews )
+  {
+    parent_->wakeUp();
+  }
+}
+
+
+
+bool SessionStripe::canReceiveData()
+{
+  // Leave the blocks in the socket while the session is busy with the others
+  pthread_mutex_lock( &mutex_ );
+  bool canReceive = ( messages_.size() < MAX_NETWORK_MESSAGE_QUEUE );
+  pthread_mutex_unlock( &mutex_ );
+
+  return canReceive;
+}
+
+
+
+void SessionStripe::cycle()
+{
+  if( hasJoined() && canSendMessages() )
+  {
+    parent_->wakeUp();
+  }
+}
+
+
+
+void SessionStripe::disconnect()
+{
+  if( isConnected() )
+  {
+    sendMessage( new ByeMessage() );
+    SessionBase::disconnect();
+  }
+}
+
+
+
+bool SessionStripe::hasJoined()
+{
+  pthread_mutex_lock( &mutex_ );
+  bool joined = hasJoined_;
+  pthread_mutex_unlock( &mutex_ );
+
+  return joined;
+}
+
+
+
+Message* SessionStripe::takeMessage()
+{
+  Message* message = NULL;
+
+  pthread_mutex_lock( &mutex_ );
+  if( messages_.size() > 0 )
+  {
+    message = messages_.front();
+    messages_.pop_front();
+  }
+  pthread_mutex_unlock( &mutex_ );
+
+  return message;
+}
@@ -0,0 +1,103 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SESSIONSTRIPE_H
+#define SESSIONSTRIPE_H
+
+#include "sessionbase.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <list>
+
+
+class SessionServer;
+
+
+
+/**
+ * @class SessionStripe
+ *
+ * A data connection, which carries file blocks alongside the session.
+ *
+ * Connections to the server tie themselves to the session with the token the server offered,
+ * as their first message. Direct connections between the sender of a file and its receivers
+ * work the same way, with the token chosen by the sender: its end of the connection waits
+ * for it, and answers when it's right.
+ *
+ * Like the multicast receiver, it never handles the blocks itself: the messages it gets
+ * wait for the session thread, which takes them with takeMessage().
+ */
+class SessionStripe : public SessionBase
+{
+
+  public:
+
+    /**
+     * @param isIncoming Whether the other end opened the connection, and has to give the token
+     */
+    SessionStripe( SessionServer* parent, const int socket, const uint64_t token, const bool isIncoming = false );
+    virtual ~SessionStripe();
+
+    virtual void disconnect();
+
+    /**
+     * Whether the connection is tied to the session, so it can carry file blocks.
+     */
+    bool hasJoined();
+
+    /**
+     * Take the next file block, or end of file mark, received through the connection.
+     *
+     * It's safe to call it from other threads.
+     *
+     * @return NULL if there are none
+     */
+    Message* takeMessage();
+
+
+  private:
+
+    virtual void availableMessages();
+    virtual bool canReceiveData();
+
+    /**
+     * Let the session send more file blocks, when there's room for them.
+     */
+    virtual void cycle();
+
+
+  private:
+
+    /// Whether the connection is tied to the session
+    bool hasJoined_;
+
+    /// Whether the other end opened the connection
+    bool isIncoming_;
+
+    /// Messages for the session, not taken yet
+    std::list<Message*> messages_;
+
+    /// Guards the messages and the joined state
+    pthread_mutex_t mutex_;
+
+    /// The session the connection belongs to
+    SessionServer* parent_;
+
+    /// Ties the connection to the session
+    uint64_t token_;
+
+
+};
+
+
+
+#endif // SESSIONSTRIPE_H
@@ -37,7 +37,7 @@ void Common::debug( const char* debugString, ... )
   va_start( args, debugString );
 
   // Apply the parameters to the debug string
-  vsprintf( outputString, debugString, args );
+  vsnprintf( outputString, MAX_STRING_LENGTH, debugString, args );
   va_end( args );
 
   writeLine( NULL, outputString );
@@ -52,7 +52,7 @@ void Common::error( const char* errorString, ... )
 
   // Get all the parameters that have been passed to this function
   va_start( args, errorString );
-  vsprintf( outputString, errorString, args );
+  vsnprintf( outputString, MAX_STRING_LENGTH, errorString, args );
   va_end( args );
 
   writeLine( "ERROR: ", outputString );
@@ -67,7 +67,7 @@ void Common::fatal( const char* errorString, ... )
 
   // Get all the parameters that have been passed to this function
   va_start( args, errorString );
-  vsprintf( outputString, errorString, args );
+  vsnprintf( outputString, MAX_STRING_LENGTH, errorString, args );
   va_end( args );
 
   writeLine( "ERROR: ", outputString );
@@ -185,11 +185,11 @@ void Common::writeLine( const char* prefix, const char* string )
 
   if( prefix == NULL )
   {
-    sprintf( line, "%7.3f> %s\n", elapsed, string );
+    snprintf( line, MAX_STRING_LENGTH, "%7.3f> %s\n", elapsed, string );
   }
   else
   {
-    sprintf( line, "%7.3f> %s%s\n", elapsed, prefix, string );
+    snprintf( line, MAX_STRING_LENGTH, "%7.3f> %s%s\n", elapsed, prefix, string );
   }
 
   writeRawData( line );
@@ -0,0 +1,163 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <nmmintrin.h>
+#endif
+
+
+
+/**
+ * The CRC-32C polynomial, in reversed bit order.
+ */
+static const uint32_t POLYNOMIAL = 0x82F63B78;
+
+
+
+/**
+ * Lookup tables for the software computation: the first one has the checksum of each
+ * byte value, the others of each byte value followed by 1 to 7 zero bytes.
+ */
+struct Tables
+{
+  uint32_t entries[ 8 ][ 256 ];
+
+  Tables()
+  {
+    for( uint32_t i = 0; i < 256; i++ )
+    {
+      uint32_t crc = i;
+      for( int bit = 0; bit < 8; bit++ )
+      {
+        crc = ( crc & 1 ) ? ( crc >> 1 ) ^ POLYNOMIAL : ( crc >> 1 );
+      }
+      entries[ 0 ][ i ] = crc;
+    }
+
+    for( uint32_t i = 0; i < 256; i++ )
+    {
+      for( int table = 1; table < 8; table++ )
+      {
+        uint32_t previous = entries[ table - 1 ][ i ];
+        entries[ table ][ i ] = entries[ 0 ][ previous & 0xFF ] ^ ( previous >> 8 );
+      }
+    }
+  }
+};
+
+
+
+uint32_t Crc32c::update( const uint32_t checksum, const char* data, const size_t size )
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+  static const bool hasHardware = __builtin_cpu_supports( "sse4.2" );
+#else
+  static const bool hasHardware = false;
+#endif
+
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>( data );
+  uint32_t crc = ~checksum;
+
+  crc = hasHardware ? updateHardware( crc, bytes, size ) : updateSoftware( crc, bytes, size );
+
+  return ~crc;
+}
+
+
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+
+__attribute__(( target( "sse4.2" ) ))
+uint32_t Crc32c::updateHardware( uint32_t crc, const unsigned char* data, size_t size )
+{
+  // Eight bytes at a time, once they're aligned
+  while( size > 0 && ( reinterpret_cast<uintptr_t>( data ) & 7 ) != 0 )
+  {
+    crc = _mm_crc32_u8( crc, *data++ );
+    size--;
+  }
+
+#if defined( __x86_64__ )
+  uint64_t wideCrc = crc;
+  while( size >= 8 )
+  {
+    uint64_t word;
+    memcpy( &word, data, 8 );
+    wideCrc = _mm_crc32_u64( wideCrc, word );
+    data += 8;
+    size -= 8;
+  }
+  crc = wideCrc;
+#endif
+
+  while( size >= 4 )
+  {
+    uint32_t word;
+    memcpy( &word, data, 4 );
+    crc = _mm_crc32_u32( crc, word );
+    data += 4;
+    size -= 4;
+  }
+
+  while( size > 0 )
+  {
+    crc = _mm_crc32_u8( crc, *data++ );
+    size--;
+  }
+
+  return crc;
+}
+
+#else
+
+uint32_t Crc32c::updateHardware( uint32_t crc, const unsigned char* data, size_t size )
+{
+  return updateSoftware( crc, data, size );
+}
+
+#endif
+
+
+
+uint32_t Crc32c::updateSoftware( uint32_t crc, const unsigned char* data, size_t size )
+{
+  static const Tables tables;
+  const uint32_t ( *entries )[ 256 ] = tables.entries;
+
+  // Eight bytes at a time, one lookup each
+  while( size >= 8 )
+  {
+    uint32_t low;
+    uint32_t high;
+    memcpy( &low, data, 4 );
+    memcpy( &high, data + 4, 4 );
+    low ^= crc;
+
+    crc = entries[ 7 ][ low & 0xFF ]          ^ entries[ 6 ][ ( low >> 8 ) & 0xFF ]
+        ^ entries[ 5 ][ ( low >> 16 ) & 0xFF ] ^ entries[ 4 ][ low >> 24 ]
+        ^ entries[ 3 ][ high & 0xFF ]         ^ entries[ 2 ][ ( high >> 8 ) & 0xFF ]
+        ^ entries[ 1 ][ ( high >> 16 ) & 0xFF ] ^ entries[ 0 ][ high >> 24 ];
+
+    data += 8;
+    size -= 8;
+  }
+
+  while( size > 0 )
+  {
+    crc = entries[ 0 ][ ( crc ^ *data++ ) & 0xFF ] ^ ( crc >> 8 );
+    size--;
+  }
+
+  return crc;
+}
@@ -0,0 +1,58 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/**
+ * @class Crc32c
+ *
+ * CRC-32C (Castagnoli) checksums, to find out whether file data was damaged on its way.
+ *
+ * Processors with SSE 4.2 compute it with a dedicated instruction, many bytes per cycle;
+ * the others use lookup tables, eight bytes at a time.
+ */
+class Crc32c
+{
+
+  public:
+
+    /**
+     * Extend a checksum with more data.
+     *
+     * @param checksum Checksum of the data before, or 0 to start a new one
+     * @return Checksum of the data before followed by the new one
+     */
+    static uint32_t update( const uint32_t checksum, const char* data, const size_t size );
+
+
+  private:
+
+    /**
+     * Compute with the SSE 4.2 instruction; only on processors which have it.
+     */
+    static uint32_t updateHardware( uint32_t crc, const unsigned char* data, size_t size );
+
+    /**
+     * Compute with the lookup tables, on any processor.
+     */
+    static uint32_t updateSoftware( uint32_t crc, const unsigned char* data, size_t size );
+
+
+};
+
+
+
+#endif // CRC32C_H
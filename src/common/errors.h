@@ -26,6 +26,9 @@ class Errors
     , Error_Socket_Bind
     , Error_Socket_Listen
     , Error_Socket_Connection
+    , Error_Handoff
+    , Error_Tls
+    , Error_Federation_Secret
     };
 
 
@@ -37,6 +40,9 @@ class Errors
     , Status_AcceptFileTransfer
     , Status_RejectFileTransfer
     , Status_FileTransferCanceled
+    , Status_RateLimited
+    , Status_Heartbeat
+    , Status_UnknownRecipient
     };
 
 
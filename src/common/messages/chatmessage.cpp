@@ -116,7 +116,7 @@ char* ChatMessage::toRawBytes() const
   int payloadSize = size();
   Payload* writePayload = static_cast<Payload*>( malloc( payloadSize ) );
   memset( writePayload, '\0', payloadSize );
-  memcpy( writePayload, &payload_, payloadSize );
+  memcpy( writePayload, &payload_, sizeof( Payload ) - sizeof( payload_.message ) );
   memcpy( &(writePayload->message), message_, payload_.messageSize );
 
   return reinterpret_cast<char*>( writePayload );
@@ -15,15 +15,23 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 
 FileDataMessage::FileDataMessage()
 : Message( Message::MSG_FILE_DATA )
+, file_( -1 )
+, filePosition_( 0 )
 {
   payload_.offset = 0ULL;
   payload_.isLast = false;
+  payload_.isCopy = false;
   payload_.size = 0;
+  payload_.checksum = 0;
+  payload_.fileChecksum = 0;
   payload_.data = NULL;
 }
 
@@ -32,6 +40,34 @@ FileDataMessage::FileDataMessage()
 FileDataMessage::~FileDataMessage()
 {
   free( payload_.data );
+
+  if( file_ != -1 )
+  {
+    close( file_ );
+  }
+}
+
+
+
+const int64_t FileDataMessage::basisOffset() const
+{
+  Copy copy;
+  memcpy( &copy, payload_.data, sizeof( Copy ) );
+  return copy.basisOffset;
+}
+
+
+
+const int64_t FileDataMessage::blockSize() const
+{
+  if( ! payload_.isCopy )
+  {
+    return payload_.size;
+  }
+
+  Copy copy;
+  memcpy( &copy, payload_.data, sizeof( Copy ) );
+  return copy.size;
 }
 
 
@@ -50,6 +86,34 @@ const int FileDataMessage::bufferSize() const
 
 
 
+const uint32_t FileDataMessage::checksum() const
+{
+  return payload_.checksum;
+}
+
+
+
+const int FileDataMessage::file() const
+{
+  return file_;
+}
+
+
+
+const off_t FileDataMessage::filePosition() const
+{
+  return filePosition_;
+}
+
+
+
+const uint32_t FileDataMessage::fileChecksum() const
+{
+  return payload_.fileChecksum;
+}
+
+
+
 const long FileDataMessage::fileOffset() const
 {
   return payload_.offset;
@@ -73,11 +137,33 @@ bool FileDataMessage::fromRawBytes( const char* buffer, int bufferSize )
   memset( payload_.data, '\0', payload_.size );
   memcpy( payload_.data, &(readPayload->data), payload_.size );
 
+  if( payload_.isCopy && payload_.size != sizeof( Copy ) )
+  {
+    Common::error( "Invalid copied block size %d!", payload_.size );
+    return false;
+  }
+
   return true;
 }
 
 
 
+int FileDataMessage::headerSize() const
+{
+  // The pointer to the actual data within the payload structure
+  // is just a commodity field, and shouldn't be sent
+  return ( sizeof( Payload ) - sizeof( payload_.data ) );
+}
+
+
+
+const bool FileDataMessage::isCopy() const
+{
+  return payload_.isCopy;
+}
+
+
+
 const bool FileDataMessage::isLastBlock() const
 {
   return payload_.isLast;
@@ -85,6 +171,13 @@ const bool FileDataMessage::isLastBlock() const
 
 
 
+void FileDataMessage::markCopy()
+{
+  payload_.isCopy = true;
+}
+
+
+
 void FileDataMessage::markLastBlock()
 {
   payload_.isLast = true;
@@ -92,6 +185,15 @@ void FileDataMessage::markLastBlock()
 
 
 
+int FileDataMessage::releaseFile()
+{
+  int file = file_;
+  file_ = -1;
+  return file;
+}
+
+
+
 void FileDataMessage::setBuffer( const char* buffer, const int size )
 {
   payload_.data = static_cast<char*>( malloc( size ) );
@@ -103,6 +205,57 @@ void FileDataMessage::setBuffer( const char* buffer, const int size )
 
 
 
+void FileDataMessage::setChecksum( const uint32_t checksum )
+{
+  payload_.checksum = checksum;
+}
+
+
+
+void FileDataMessage::setCopy( const int64_t basisOffset, const int64_t size )
+{
+  Copy copy;
+  copy.basisOffset = basisOffset;
+  copy.size = size;
+
+  setBuffer( reinterpret_cast<const char*>( &copy ), sizeof( Copy ) );
+  markCopy();
+}
+
+
+
+bool FileDataMessage::setFile( const int file, const int size, const off_t position )
+{
+  int newFile = fcntl( file, F_DUPFD_CLOEXEC, 0 );
+  if( newFile == -1 )
+  {
+    Common::error( "Unable to duplicate the file descriptor: %s", strerror( errno ) );
+    return false;
+  }
+
+  if( file_ != -1 )
+  {
+    close( file_ );
+  }
+
+  free( payload_.data );
+  payload_.data = NULL;
+  payload_.size = size;
+  file_ = newFile;
+  filePosition_ = position;
+
+  return true;
+}
+
+
+
+void FileDataMessage::setFileChecksum( const uint32_t checksum )
+{
+  payload_.fileChecksum = checksum;
+}
+
+
+
 void FileDataMessage::setFileOffset( const long offset )
 {
   payload_.offset = offset;
@@ -112,9 +265,7 @@ void FileDataMessage::setFileOffset( const long offset )
 
 const int FileDataMessage::size() const
 {
-  // The pointer to the actual data within the payload structure
-  // is just a commodity field, and shouldn't be sent
-  return ( sizeof( Payload ) - sizeof( payload_.data ) + payload_.size );
+  return ( headerSize() + payload_.size );
 }
 
 
@@ -124,10 +275,29 @@ char* FileDataMessage::toRawBytes() const
   int payloadSize = size();
   Payload* writePayload = static_cast<Payload*>( malloc( payloadSize ) );
   memset( writePayload, '\0', payloadSize );
-  memcpy( writePayload, &payload_, payloadSize );
-  memcpy( &(writePayload->data), payload_.data, payload_.size );
+  memcpy( writePayload, &payload_, headerSize() );
+
+  if( file_ == -1 )
+  {
+    memcpy( &(writePayload->data), payload_.data, payload_.size );
+  }
+  else if( pread( file_, &(writePayload->data), payload_.size, filePosition_ ) != payload_.size )
+  {
+    // The rest is left blank, the frame must keep the size it was announced with
+    Common::error( "Unable to read the file data at offset %lld!", (long long)payload_.offset );
+  }
 
   return reinterpret_cast<char*>( writePayload );
 }
 
 
+
+char* FileDataMessage::toRawHeader() const
+{
+  char* header = static_cast<char*>( malloc( headerSize() ) );
+  memcpy( header, &payload_, headerSize() );
+
+  return header;
+}
+
+
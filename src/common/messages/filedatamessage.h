@@ -15,24 +15,101 @@
 #include "protocol.h"
 
 #include <stdint.h>
+#include <sys/types.h>
 
 
 
 class FileDataMessage : public Message
 {
 
+  public:
+
+    /// Data of a block which stands for a part of the receiver's older copy of the file
+    struct Copy
+    {
+      int64_t basisOffset;
+      int64_t size;
+    };
+
+
   public:
 
     FileDataMessage();
     virtual ~FileDataMessage();
 
+    /**
+     * Where the copied part is in the receiver's older copy of the file.
+     */
+    const int64_t basisOffset() const;
+
+    /**
+     * How many bytes of the file the block stands for: the size of its data, or of the
+     * copied part.
+     */
+    const int64_t blockSize() const;
+
     const char* buffer() const;
     const int bufferSize() const;
+
+    /**
+     * CRC-32C checksum of the data of this block.
+     */
+    const uint32_t checksum() const;
+
+    /**
+     * File holding the data of the message, when it's not in memory; or -1.
+     */
+    const int file() const;
+
+    /**
+     * Where the data is in the file holding it.
+     */
+    const off_t filePosition() const;
+
+    /**
+     * CRC-32C checksum of the whole file; only sent with the last block.
+     */
+    const uint32_t fileChecksum() const;
+
     const long fileOffset() const;
+
+    /**
+     * Whether the block has no data of its own, but tells where to find it in the
+     * receiver's older copy of the file.
+     */
+    const bool isCopy() const;
+
     const bool isLastBlock() const;
 
+    void markCopy();
     void markLastBlock();
+
+    /**
+     * Take the ownership of the file holding the data, which the caller will close.
+     */
+    int releaseFile();
+
     void setBuffer( const char* buffer, const int size );
+    void setChecksum( const uint32_t checksum );
+
+    /**
+     * Make the block stand for a part of the receiver's older copy of the file.
+     */
+    void setCopy( const int64_t basisOffset, const int64_t size );
+
+    /**
+     * Leave the data in a file rather than copying it.
+     *
+     * The data is read when the message is sent. The file descriptor is duplicated,
+     * so the file can be closed meanwhile.
+     *
+     * @param position Where the data is in the file; it's the message file offset, unless
+     *                 the file is one of the files of a folder
+     * @return false if the file descriptor can't be duplicated
+     */
+    bool setFile( const int file, const int size, const off_t position );
+
+    void setFileChecksum( const uint32_t checksum );
     void setFileOffset( const long offset );
 
     /**
@@ -40,6 +117,14 @@ class FileDataMessage : public Message
      */
     virtual const int size() const;
 
+    /**
+     * Convert the message contents into raw data, but for the data of the file, which
+     * is sent separately.
+     *
+     * @note The caller is responsible of free()ing the buffer after its use.
+     */
+    char* toRawHeader() const;
+
 
   protected:
 
@@ -56,16 +141,33 @@ class FileDataMessage : public Message
     virtual char* toRawBytes() const;
 
 
+  private:
+
+    /**
+     * Size of the payload fields before the data.
+     */
+    int headerSize() const;
+
+
   private:
 
     struct Payload
     {
       int64_t offset;
       bool isLast;
+      bool isCopy;
       int size;
+      uint32_t checksum;
+      uint32_t fileChecksum;
       char* data;
     };
 
+    /// File holding the data, or -1 if it's in memory
+    int file_;
+
+    /// Where the data is in file_
+    off_t filePosition_;
+
     /// Internal message data
     Payload payload_;
 
@@ -0,0 +1,128 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "filemanifestmessage.h"
+
+#include "common.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+
+FileManifestMessage::FileManifestMessage()
+: Message( Message::MSG_FILE_MANIFEST )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+}
+
+
+
+FileManifestMessage::~FileManifestMessage()
+{
+
+}
+
+
+
+bool FileManifestMessage::addEntry( const Entry& entry )
+{
+  if( payload_.entriesCount >= MANIFEST_ENTRIES_PER_MESSAGE )
+  {
+    return false;
+  }
+
+  payload_.entries[ payload_.entriesCount++ ] = entry;
+
+  return true;
+}
+
+
+
+const FileManifestMessage::Entry& FileManifestMessage::entry( const int index ) const
+{
+  return payload_.entries[ index ];
+}
+
+
+
+int FileManifestMessage::entriesCount() const
+{
+  return payload_.entriesCount;
+}
+
+
+
+bool FileManifestMessage::fromRawBytes( const char* buffer, int size )
+{
+  int headerSize = offsetof( Payload, entries );
+  if( size < headerSize || size > (int)sizeof( Payload ) )
+  {
+    Common::error( "Invalid buffer length: got %d, expected at least %d!", size, headerSize );
+    return false;
+  }
+
+  memcpy( &payload_, buffer, size );
+
+  if( payload_.entriesCount < 0 || payload_.entriesCount > MANIFEST_ENTRIES_PER_MESSAGE
+  ||  size != (int)( headerSize + payload_.entriesCount * sizeof( Entry ) ) )
+  {
+    Common::error( "Invalid manifest entries count %d!", payload_.entriesCount );
+    return false;
+  }
+
+  for( int i = 0; i < payload_.entriesCount; i++ )
+  {
+    Entry& entry = payload_.entries[ i ];
+    if( entry.size < 0 )
+    {
+      Common::error( "Invalid manifest entry size %lld!", (long long)entry.size );
+      return false;
+    }
+
+    entry.path[ MANIFEST_PATH_SIZE - 1 ] = '\0';
+  }
+
+  return true;
+}
+
+
+
+bool FileManifestMessage::isLast() const
+{
+  return payload_.isLast;
+}
+
+
+
+void FileManifestMessage::markLast()
+{
+  payload_.isLast = true;
+}
+
+
+
+const int FileManifestMessage::size() const
+{
+  // Only send the used entries
+  return ( offsetof( Payload, entries ) + payload_.entriesCount * sizeof( Entry ) );
+}
+
+
+
+char* FileManifestMessage::toRawBytes() const
+{
+  int payloadSize = size();
+  char* buffer = static_cast<char*>( malloc( payloadSize + 1 ) );
+  memcpy( buffer, &payload_, payloadSize );
+
+  return buffer;
+}
@@ -0,0 +1,125 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FILEMANIFESTMESSAGE_H
+#define FILEMANIFESTMESSAGE_H
+
+#include "message.h"
+
+#include <stdint.h>
+
+
+/**
+ * @def MANIFEST_PATH_SIZE
+ *
+ * Maximum length of the path of an entry of a folder, within the folder, including the
+ * terminating null character.
+ */
+#define MANIFEST_PATH_SIZE   244
+
+
+/**
+ * @def MANIFEST_ENTRIES_PER_MESSAGE
+ *
+ * Maximum number of entries carried by a single manifest message.
+ */
+#define MANIFEST_ENTRIES_PER_MESSAGE   5
+
+
+
+/**
+ * @class FileManifestMessage
+ *
+ * Contents of a folder being sent.
+ *
+ * Right after the request to transfer a folder, its sender lists the files and the
+ * folders in it, in as many messages as needed; the request tells how many entries to
+ * expect. The receivers answer the request once they have the whole list.
+ *
+ * The folder is then transferred as a single file: the contents of its files, one after
+ * the other in the order of the list.
+ */
+class FileManifestMessage : public Message
+{
+
+  public:
+
+    /// A file or a folder, within the folder being sent
+    struct Entry
+    {
+      /// Bytes of the file; 0 for folders
+      int64_t size;
+      int32_t isDirectory;
+      /// Relative to the folder being sent, with '/' between the components
+      char path[ MANIFEST_PATH_SIZE ];
+    };
+
+
+  public:
+
+    FileManifestMessage();
+    virtual ~FileManifestMessage();
+
+    /**
+     * Add an entry to the message.
+     *
+     * @return false if the message is full
+     */
+    bool addEntry( const Entry& entry );
+
+    const Entry& entry( const int index ) const;
+    int entriesCount() const;
+
+    /**
+     * Whether this is the last message of the list.
+     */
+    bool isLast() const;
+    void markLast();
+
+    /**
+     * Override, tells how big the message-specific payload is.
+     */
+    virtual const int size() const;
+
+
+  protected:
+
+    /**
+     * Override, analyzes a data buffer to retrieve the specific message type's data.
+     * @see Overrides::fromRawBytes()
+     */
+    virtual bool fromRawBytes( const char* buffer, int size );
+
+    /**
+     * Override, convert the message contents into raw data.
+     * @see Message::toRawBytes()
+     */
+    virtual char* toRawBytes() const;
+
+
+  private:
+
+    /// Container for the manifest message data
+    struct Payload
+    {
+      int32_t isLast;
+      int32_t entriesCount;
+      Entry entries[ MANIFEST_ENTRIES_PER_MESSAGE ];
+    };
+
+    /// Internal message data
+    Payload payload_;
+
+
+};
+
+
+
+#endif // FILEMANIFESTMESSAGE_H
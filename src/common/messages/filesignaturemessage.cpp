@@ -0,0 +1,136 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "filesignaturemessage.h"
+
+#include "common.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+
+FileSignatureMessage::FileSignatureMessage()
+: Message( Message::MSG_FILE_SIGNATURE )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+}
+
+
+
+FileSignatureMessage::~FileSignatureMessage()
+{
+
+}
+
+
+
+bool FileSignatureMessage::addBlock( const Block& block )
+{
+  if( payload_.blocksCount >= SIGNATURE_BLOCKS_PER_MESSAGE )
+  {
+    return false;
+  }
+
+  payload_.blocks[ payload_.blocksCount++ ] = block;
+
+  return true;
+}
+
+
+
+const FileSignatureMessage::Block& FileSignatureMessage::block( const int index ) const
+{
+  return payload_.blocks[ index ];
+}
+
+
+
+int FileSignatureMessage::blocksCount() const
+{
+  return payload_.blocksCount;
+}
+
+
+
+int FileSignatureMessage::blockSize() const
+{
+  return payload_.blockSize;
+}
+
+
+
+bool FileSignatureMessage::fromRawBytes( const char* buffer, int size )
+{
+  int headerSize = offsetof( Payload, blocks );
+  if( size < headerSize || size > (int)sizeof( Payload ) )
+  {
+    Common::error( "Invalid buffer length: got %d, expected at least %d!", size, headerSize );
+    return false;
+  }
+
+  memcpy( &payload_, buffer, size );
+
+  if( payload_.blocksCount < 0 || payload_.blocksCount > SIGNATURE_BLOCKS_PER_MESSAGE
+  ||  size != (int)( headerSize + payload_.blocksCount * sizeof( Block ) ) )
+  {
+    Common::error( "Invalid signature blocks count %d!", payload_.blocksCount );
+    return false;
+  }
+
+  if( payload_.blockSize <= 0 )
+  {
+    Common::error( "Invalid signature block size %d!", payload_.blockSize );
+    return false;
+  }
+
+  return true;
+}
+
+
+
+bool FileSignatureMessage::isLast() const
+{
+  return payload_.isLast;
+}
+
+
+
+void FileSignatureMessage::markLast()
+{
+  payload_.isLast = true;
+}
+
+
+
+void FileSignatureMessage::setBlockSize( const int size )
+{
+  payload_.blockSize = size;
+}
+
+
+
+const int FileSignatureMessage::size() const
+{
+  // Only send the used blocks
+  return ( offsetof( Payload, blocks ) + payload_.blocksCount * sizeof( Block ) );
+}
+
+
+
+char* FileSignatureMessage::toRawBytes() const
+{
+  int payloadSize = size();
+  char* buffer = static_cast<char*>( malloc( payloadSize + 1 ) );
+  memcpy( buffer, &payload_, payloadSize );
+
+  return buffer;
+}
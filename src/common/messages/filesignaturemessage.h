@@ -0,0 +1,136 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FILESIGNATUREMESSAGE_H
+#define FILESIGNATUREMESSAGE_H
+
+#include "message.h"
+
+#include <stdint.h>
+
+
+/**
+ * @def SIGNATURE_STRONG_SIZE
+ *
+ * Bytes of the strong checksum of each block which are sent.
+ */
+#define SIGNATURE_STRONG_SIZE   8
+
+
+/**
+ * @def SIGNATURE_BLOCKS_PER_MESSAGE
+ *
+ * Maximum number of blocks described by a single signature message.
+ */
+#define SIGNATURE_BLOCKS_PER_MESSAGE   100
+
+
+/**
+ * @def SIGNATURE_MAX_BLOCKS
+ *
+ * Maximum number of blocks in the signature of a file. Bigger files are sent whole.
+ */
+#define SIGNATURE_MAX_BLOCKS   65536
+
+
+
+/**
+ * @class FileSignatureMessage
+ *
+ * Checksums of the blocks of the copy a receiver already has of the file being sent.
+ *
+ * Before accepting a file it has an older copy of, the receiver sends the checksums of
+ * each of its blocks, in as many messages as needed. When it's the only receiver, the
+ * sender finds the blocks which didn't change, and sends where they are rather than
+ * their data.
+ */
+class FileSignatureMessage : public Message
+{
+
+  public:
+
+    /// A block of the receiver's copy
+    struct Block
+    {
+      /// Rolling checksum, to find the block anywhere in the file being sent
+      uint32_t weak;
+      /// Start of an MD5 digest, to make sure it's the same
+      uint8_t strong[ SIGNATURE_STRONG_SIZE ];
+    };
+
+
+  public:
+
+    FileSignatureMessage();
+    virtual ~FileSignatureMessage();
+
+    /**
+     * Add a block to the message.
+     *
+     * @return false if the message is full
+     */
+    bool addBlock( const Block& block );
+
+    const Block& block( const int index ) const;
+    int blocksCount() const;
+
+    /**
+     * Size of the blocks; the last part of the file, if shorter, has no checksums.
+     */
+    int blockSize() const;
+    void setBlockSize( const int size );
+
+    /**
+     * Whether this is the last message of the signature.
+     */
+    bool isLast() const;
+    void markLast();
+
+    /**
+     * Override, tells how big the message-specific payload is.
+     */
+    virtual const int size() const;
+
+
+  protected:
+
+    /**
+     * Override, analyzes a data buffer to retrieve the specific message type's data.
+     * @see Overrides::fromRawBytes()
+     */
+    virtual bool fromRawBytes( const char* buffer, int size );
+
+    /**
+     * Override, convert the message contents into raw data.
+     * @see Message::toRawBytes()
+     */
+    virtual char* toRawBytes() const;
+
+
+  private:
+
+    /// Container for the signature message data
+    struct Payload
+    {
+      int32_t blockSize;
+      int32_t isLast;
+      int32_t blocksCount;
+      Block blocks[ SIGNATURE_BLOCKS_PER_MESSAGE ];
+    };
+
+    /// Internal message data
+    Payload payload_;
+
+
+};
+
+
+
+#endif // FILESIGNATUREMESSAGE_H
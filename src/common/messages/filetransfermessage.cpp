@@ -12,16 +12,24 @@
 
 #include "common.h"
 
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include <algorithm>
+
 
 
 FileTransferMessage::FileTransferMessage()
 : Message( Message::MSG_FILE_REQUEST )
 {
+  setDirectAddress( 0, 0 );
+  setDirectToken( 0 );
+  setEntriesCount( 0 );
   setFileName( NULL );
+  setFileSize( 0 );
   setSender( NULL );
+  setTransferId( 0 );
 }
 
 
@@ -29,8 +37,13 @@ FileTransferMessage::FileTransferMessage()
 FileTransferMessage::FileTransferMessage( const char* fileName )
 : Message( Message::MSG_FILE_REQUEST )
 {
+  setDirectAddress( 0, 0 );
+  setDirectToken( 0 );
+  setEntriesCount( 0 );
   setFileName( fileName );
-  setSender( NULL ); // Message from the user
+  setFileSize( 0 );
+  setSender( NULL );
+  setTransferId( 0 ); // Message from the user
 }
 
 
@@ -42,17 +55,54 @@ FileTransferMessage::~FileTransferMessage()
 
 
 
+const uint32_t FileTransferMessage::directAddress() const
+{
+  return payload_.directAddress;
+}
+
+
+
+const uint16_t FileTransferMessage::directPort() const
+{
+  return payload_.directPort;
+}
+
+
+
+const uint64_t FileTransferMessage::directToken() const
+{
+  return payload_.directToken;
+}
+
+
+
+const int32_t FileTransferMessage::entriesCount() const
+{
+  return payload_.entriesCount;
+}
+
+
+
 bool FileTransferMessage::fromRawBytes( const char* buffer, int size )
 {
+  // Older clients don't tell the size of the file, nor where to get it from, and only send files
   int payloadSize = sizeof( Payload );
-  if( size < payloadSize )
+  int minimumSize = offsetof( Payload, fileName ) + MAX_PATH_SIZE;
+  if( size < minimumSize )
   {
     Common::error( "Invalid buffer length: got %d, expected %d!", size, payloadSize );
     return false;
   }
 
-  const Payload* readPayload = reinterpret_cast<const Payload*>( buffer );
-  memcpy( &payload_, readPayload, payloadSize );
+  // What they leave out stays zero
+  memset( &payload_, '\0', payloadSize );
+  memcpy( &payload_, buffer, std::min( size, payloadSize ) );
+
+  if( payload_.entriesCount < 0 )
+  {
+    Common::error( "Invalid folder entries count %d!", payload_.entriesCount );
+    return false;
+  }
 
   return true;
 }
@@ -66,6 +116,13 @@ const char* FileTransferMessage::fileName() const
 
 
 
+const int64_t FileTransferMessage::fileSize() const
+{
+  return payload_.fileSize;
+}
+
+
+
 const char* FileTransferMessage::sender() const
 {
   return payload_.sender;
@@ -73,6 +130,36 @@ const char* FileTransferMessage::sender() const
 
 
 
+const uint64_t FileTransferMessage::transferId() const
+{
+  return payload_.transferId;
+}
+
+
+
+void FileTransferMessage::setDirectAddress( const uint32_t address, const uint16_t port )
+{
+  payload_.directAddress = address;
+  payload_.directPort = port;
+  payload_.padding = 0;
+}
+
+
+
+void FileTransferMessage::setDirectToken( const uint64_t token )
+{
+  payload_.directToken = token;
+}
+
+
+
+void FileTransferMessage::setEntriesCount( const int32_t entriesCount )
+{
+  payload_.entriesCount = entriesCount;
+}
+
+
+
 void FileTransferMessage::setFileName( const char* fileName )
 {
   memset( payload_.fileName, '\0', MAX_PATH_SIZE );
@@ -84,6 +171,13 @@ void FileTransferMessage::setFileName( const char* fileName )
 
 
 
+void FileTransferMessage::setFileSize( const int64_t fileSize )
+{
+  payload_.fileSize = fileSize;
+}
+
+
+
 void FileTransferMessage::setSender( const char* sender )
 {
   memset( payload_.sender, '\0', MAX_NICKNAME_SIZE );
@@ -95,6 +189,13 @@ void FileTransferMessage::setSender( const char* sender )
 
 
 
+void FileTransferMessage::setTransferId( const uint64_t transferId )
+{
+  payload_.transferId = transferId;
+}
+
+
+
 const int FileTransferMessage::size() const
 {
   return ( sizeof( Payload ) );
@@ -111,5 +212,3 @@ char* FileTransferMessage::toRawBytes() const
 
   return reinterpret_cast<char*>( writePayload );
 }
-
-
@@ -14,6 +14,8 @@
 #include "message.h"
 #include "protocol.h"
 
+#include <stdint.h>
+
 
 
 class FileTransferMessage : public Message
@@ -28,6 +30,43 @@ class FileTransferMessage : public Message
     const char* fileName() const;
     void setFileName( const char* fileName );
 
+    /**
+     * Files and folders in the folder being sent, which are listed by the manifest
+     * messages following the request; 0 if a single file is sent
+     */
+    const int32_t entriesCount() const;
+    void setEntriesCount( const int32_t entriesCount );
+
+    /**
+     * Size of the file in bytes, or 0 if it wasn't told
+     */
+    const int64_t fileSize() const;
+    void setFileSize( const int64_t fileSize );
+
+    /**
+     * Identifies the file across transfers, so an interrupted one can be continued;
+     * 0 if it can't be
+     */
+    const uint64_t transferId() const;
+    void setTransferId( const uint64_t transferId );
+
+    /**
+     * Where the receivers can get the file straight from the sender, in network byte order;
+     * a port of 0 means that the file goes through the server.
+     *
+     * The sender only tells the port: the server fills in the address it sees the sender at.
+     */
+    const uint32_t directAddress() const;
+    const uint16_t directPort() const;
+    void setDirectAddress( const uint32_t address, const uint16_t port );
+
+    /**
+     * Given by the receivers to the sender when they connect, so it knows them apart
+     * from anyone else
+     */
+    const uint64_t directToken() const;
+    void setDirectToken( const uint64_t token );
+
     /**
      * NULL if the sender is the user
      */
@@ -60,6 +99,13 @@ class FileTransferMessage : public Message
     {
       char sender[ MAX_NICKNAME_SIZE ];
       char fileName[ MAX_PATH_SIZE ];
+      int64_t fileSize;
+      uint64_t transferId;
+      uint64_t directToken;
+      uint32_t directAddress;
+      uint16_t directPort;
+      uint16_t padding;
+      int32_t entriesCount;
     };
 
     /// Internal message data
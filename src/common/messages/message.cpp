@@ -60,6 +60,14 @@ const char* Message::command( Message::Type type )
      case Message::MSG_CHAT:           return "MSG";
      case Message::MSG_FILE_REQUEST:   return "REQ";
      case Message::MSG_FILE_DATA:      return "DTA";
+     case Message::MSG_STATS:          return "STA";
+     case Message::MSG_RELAY:          return "RLY";
+     case Message::MSG_ROSTER:         return "ROS";
+     case Message::MSG_PRIVATE:        return "PRV";
+     case Message::MSG_MULTICAST:      return "MCA";
+     case Message::MSG_STRIPE:         return "STP";
+     case Message::MSG_FILE_MANIFEST:  return "MAN";
+     case Message::MSG_FILE_SIGNATURE: return "SIG";
      case Message::MSG_INVALID:
      default:
        break;
@@ -32,7 +32,16 @@ class Message
     , MSG_CHAT
     , MSG_FILE_REQUEST
     , MSG_FILE_DATA
+    , MSG_STATS
+    , MSG_RELAY
+    , MSG_ROSTER
+    , MSG_PRIVATE
+    , MSG_MULTICAST
+    , MSG_STRIPE
+    , MSG_FILE_MANIFEST
+    , MSG_FILE_SIGNATURE
     , MSG_MAX /// Total number of message types. Do not use.
+    , MSG_RAW /// Already serialized messages, never received from the network. @see RawMessage
     };
 
 
@@ -0,0 +1,241 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "multicastmessage.h"
+
+#include "common.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+
+MulticastMessage::MulticastMessage()
+: Message( Message::MSG_MULTICAST )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+}
+
+
+
+MulticastMessage::MulticastMessage( const Kind kind )
+: Message( Message::MSG_MULTICAST )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+  payload_.kind = kind;
+}
+
+
+
+MulticastMessage::~MulticastMessage()
+{
+
+}
+
+
+
+void MulticastMessage::addToParity( char* parity, const char* frame, const int frameSize )
+{
+  // Whole words first
+  int offset = 0;
+  for( ; offset + (int)sizeof( uint64_t ) <= frameSize; offset += sizeof( uint64_t ) )
+  {
+    uint64_t parityWord;
+    uint64_t frameWord;
+    memcpy( &parityWord, parity + offset, sizeof( uint64_t ) );
+    memcpy( &frameWord, frame + offset, sizeof( uint64_t ) );
+    parityWord ^= frameWord;
+    memcpy( parity + offset, &parityWord, sizeof( uint64_t ) );
+  }
+
+  for( ; offset < frameSize; offset++ )
+  {
+    parity[ offset ] ^= frame[ offset ];
+  }
+}
+
+
+
+uint32_t MulticastMessage::clientId() const
+{
+  return payload_.clientId;
+}
+
+
+
+uint32_t MulticastMessage::count() const
+{
+  return payload_.count;
+}
+
+
+
+const char* MulticastMessage::frame() const
+{
+  return payload_.frame;
+}
+
+
+
+int MulticastMessage::frameSize() const
+{
+  return payload_.frameSize;
+}
+
+
+
+bool MulticastMessage::fromRawBytes( const char* buffer, int size )
+{
+  int headerSize = offsetof( Payload, frame );
+  if( size < headerSize || size > (int)sizeof( Payload ) )
+  {
+    Common::error( "Invalid buffer length: got %d, expected at least %d!", size, headerSize );
+    return false;
+  }
+
+  memset( &payload_, '\0', sizeof( Payload ) );
+  memcpy( &payload_, buffer, size );
+
+  if( payload_.kind < MULTICAST_ANNOUNCE || payload_.kind > MULTICAST_FILE_ABORT )
+  {
+    Common::error( "Invalid multicast message kind %d!", payload_.kind );
+    return false;
+  }
+
+  if( payload_.frameSize < 0 || size != headerSize + payload_.frameSize )
+  {
+    Common::error( "Invalid payload length: got %d, expected %d!", size, headerSize + payload_.frameSize );
+    return false;
+  }
+
+  return true;
+}
+
+
+
+uint32_t MulticastMessage::groupAddress() const
+{
+  return payload_.groupAddress;
+}
+
+
+
+int MulticastMessage::groupPort() const
+{
+  return payload_.groupPort;
+}
+
+
+
+MulticastMessage::Kind MulticastMessage::kind() const
+{
+  return static_cast<Kind>( payload_.kind );
+}
+
+
+
+uint32_t MulticastMessage::missingBlocks() const
+{
+  return payload_.missingBlocks;
+}
+
+
+
+uint32_t MulticastMessage::sequence() const
+{
+  return payload_.sequence;
+}
+
+
+
+void MulticastMessage::setClientId( const uint32_t clientId )
+{
+  payload_.clientId = clientId;
+}
+
+
+
+void MulticastMessage::setFrame( const char* frame, const int size )
+{
+  if( size < 0 || size > MULTICAST_MAX_FRAME_SIZE )
+  {
+    Common::error( "Frame of %d bytes is too big for a multicast message", size );
+    payload_.frameSize = 0;
+    return;
+  }
+
+  memcpy( payload_.frame, frame, size );
+  payload_.frameSize = size;
+}
+
+
+
+void MulticastMessage::setGroup( const uint32_t address, const int port, const uint32_t streamId )
+{
+  payload_.groupAddress = address;
+  payload_.groupPort = port;
+  payload_.streamId = streamId;
+}
+
+
+
+void MulticastMessage::setMissingBlocks( const uint32_t missingBlocks )
+{
+  payload_.missingBlocks = missingBlocks;
+}
+
+
+
+void MulticastMessage::setSequence( const uint32_t sequence, const uint32_t count )
+{
+  payload_.sequence = sequence;
+  payload_.count = count;
+}
+
+
+
+void MulticastMessage::setTransferId( const uint32_t transferId )
+{
+  payload_.transferId = transferId;
+}
+
+
+
+const int MulticastMessage::size() const
+{
+  // Only send the used part of the frame
+  return ( offsetof( Payload, frame ) + payload_.frameSize );
+}
+
+
+
+uint32_t MulticastMessage::streamId() const
+{
+  return payload_.streamId;
+}
+
+
+
+char* MulticastMessage::toRawBytes() const
+{
+  int payloadSize = size();
+  char* buffer = static_cast<char*>( malloc( payloadSize + 1 ) );
+  memcpy( buffer, &payload_, payloadSize );
+
+  return buffer;
+}
+
+
+
+uint32_t MulticastMessage::transferId() const
+{
+  return payload_.transferId;
+}
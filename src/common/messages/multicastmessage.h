@@ -0,0 +1,220 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MULTICASTMESSAGE_H
+#define MULTICASTMESSAGE_H
+
+#include "message.h"
+#include "protocol.h"
+
+#include <stdint.h>
+
+
+/**
+ * @def MULTICAST_MAX_FRAME_SIZE
+ *
+ * Largest frame carried by a multicast datagram, or by a repair. Chat frames always fit.
+ */
+#define MULTICAST_MAX_FRAME_SIZE   1280
+
+
+/**
+ * @def MULTICAST_MAX_REPAIRS
+ *
+ * Maximum number of messages sent back to a client for a single negative acknowledgement.
+ */
+#define MULTICAST_MAX_REPAIRS   64
+
+
+/**
+ * @def MULTICAST_FEC_GROUP_SIZE
+ *
+ * Number of consecutive file blocks covered by each parity block.
+ */
+#define MULTICAST_FEC_GROUP_SIZE   16
+
+
+/**
+ * @def MULTICAST_FILE_WINDOW
+ *
+ * Number of the latest file blocks kept by the server to repair them. The sender of the file
+ * is held back so it never gets further ahead of the slowest receiver; must be a multiple of
+ * MULTICAST_FEC_GROUP_SIZE.
+ */
+#define MULTICAST_FILE_WINDOW   8192
+
+
+
+/**
+ * @class MulticastMessage
+ *
+ * Control of the delivery of chat messages through a multicast group.
+ *
+ * The server announces the group to the clients which log in. Those which could join it
+ * subscribe, and the server answers with the sequence number of the first chat message
+ * they will only receive through the group. From then on, clients ask for the messages
+ * they've missed with negative acknowledgements, and the server sends them back as repairs
+ * through the session.
+ *
+ * Each datagram sent to the group is a Datagram header, followed by the frame of a chat
+ * message. Heartbeats have no frame, and tell the last sequence number used, so clients
+ * notice when they've missed the last messages too.
+ *
+ * A file sent to many clients at once goes through the group as well. The server tells
+ * each receiver the id of the transfer, then sends the blocks of the file, each followed
+ * every MULTICAST_FEC_GROUP_SIZE blocks by their parity: with it, a receiver rebuilds any
+ * single block of the group it has missed. Receivers acknowledge the blocks they have
+ * every now and then, and report the groups they can't rebuild; the server answers by
+ * sending the parity again, which repairs a different block for each receiver, or the
+ * blocks themselves when some receiver misses more than one.
+ */
+class MulticastMessage : public Message
+{
+
+  public:
+
+    enum Kind
+    {
+      MULTICAST_ANNOUNCE    /// Server to client: the group to join
+    , MULTICAST_SUBSCRIBE   /// Client to server: the group was joined. Server to client: where the group takes over
+    , MULTICAST_NACK        /// Client to server: some messages went missing
+    , MULTICAST_REPAIR      /// Server to client: a missing message, or no frame if it's too old to be sent again
+    , MULTICAST_FILE_START  /// Server to client: the accepted file comes through the group
+    , MULTICAST_FILE_ACK    /// Client to server: how many blocks of the file it has, from the first
+    , MULTICAST_FILE_NACK   /// Client to server: blocks of a parity group which it can't rebuild
+    , MULTICAST_FILE_ABORT  /// Either way: the client won't receive the rest of the file
+    };
+
+    /// What a datagram carries
+    enum DatagramKind
+    {
+      DATAGRAM_CHAT             /// A chat message
+    , DATAGRAM_HEARTBEAT        /// No frame: the sequence number of the last chat message
+    , DATAGRAM_FILE_BLOCK       /// A block of a file
+    , DATAGRAM_FILE_PARITY      /// The parity of a group of blocks, padded to the longest one
+    , DATAGRAM_FILE_HEARTBEAT   /// No frame: the number of blocks of the file sent so far
+    };
+
+    /// Header of the datagrams sent to the group
+    struct Datagram
+    {
+      /// Tells apart the servers which use the same group
+      uint32_t streamId;
+      int32_t kind;
+      /// Chat messages: position in the stream. Files: index of the block, or of the first one of the parity group
+      uint32_t sequence;
+      /// Chat messages: id of the user who wrote it, or 0 for the users of other servers. Files: id of the transfer
+      uint32_t senderId;
+      /// Files: number of blocks of the whole file, or 0 until the last one has been sent
+      uint32_t blocksCount;
+      int32_t frameSize;
+    };
+
+
+  public:
+
+    MulticastMessage();
+    MulticastMessage( const Kind kind );
+    virtual ~MulticastMessage();
+
+    /**
+     * Add a frame to the parity of a group of file blocks; the parity is as long as the longest frame.
+     */
+    static void addToParity( char* parity, const char* frame, const int frameSize );
+
+    Kind kind() const;
+
+    /**
+     * Group address, in network byte order.
+     */
+    uint32_t groupAddress() const;
+    int groupPort() const;
+    uint32_t streamId() const;
+    void setGroup( const uint32_t address, const int port, const uint32_t streamId );
+
+    /**
+     * The first sequence number of the message: where the group takes over, the first
+     * missing message, or the repaired one.
+     */
+    uint32_t sequence() const;
+
+    /**
+     * How many messages are missing, starting from sequence().
+     */
+    uint32_t count() const;
+    void setSequence( const uint32_t sequence, const uint32_t count = 1 );
+
+    /**
+     * Missing blocks of the parity group starting at sequence(), one bit each.
+     */
+    uint32_t missingBlocks() const;
+    void setMissingBlocks( const uint32_t missingBlocks );
+
+    /**
+     * Id of the subscribed client, so it can skip its own messages.
+     */
+    uint32_t clientId() const;
+    void setClientId( const uint32_t clientId );
+
+    const char* frame() const;
+    int frameSize() const;
+    void setFrame( const char* frame, const int size );
+
+    uint32_t transferId() const;
+    void setTransferId( const uint32_t transferId );
+
+    /**
+     * Override, tells how big the message-specific payload is.
+     */
+    virtual const int size() const;
+
+
+  protected:
+
+    /**
+     * Override, analyzes a data buffer to retrieve the specific message type's data.
+     * @see Overrides::fromRawBytes()
+     */
+    virtual bool fromRawBytes( const char* buffer, int size );
+
+    /**
+     * Override, convert the message contents into raw data.
+     * @see Message::toRawBytes()
+     */
+    virtual char* toRawBytes() const;
+
+
+  private:
+
+    /// Container for the multicast message data
+    struct Payload
+    {
+      int32_t kind;
+      uint32_t groupAddress;
+      int32_t groupPort;
+      uint32_t streamId;
+      uint32_t sequence;
+      uint32_t count;
+      uint32_t clientId;
+      uint32_t transferId;
+      uint32_t missingBlocks;
+      int32_t frameSize;
+      char frame[ MULTICAST_MAX_FRAME_SIZE ];
+    };
+
+    /// Internal message data
+    Payload payload_;
+
+
+};
+
+
+
+#endif // MULTICASTMESSAGE_H
@@ -0,0 +1,154 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "privatemessage.h"
+
+#include "common.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+
+PrivateMessage::PrivateMessage()
+: Message( Message::MSG_PRIVATE )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+}
+
+
+
+PrivateMessage::PrivateMessage( const char* message )
+: Message( Message::MSG_PRIVATE )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+  setMessage( message );
+}
+
+
+
+PrivateMessage::~PrivateMessage()
+{
+
+}
+
+
+
+bool PrivateMessage::fromRawBytes( const char* buffer, int size )
+{
+  int headerSize = offsetof( Payload, message );
+  if( size < headerSize || size > headerSize + MAX_CHATMESSAGE_SIZE )
+  {
+    Common::error( "Invalid buffer length: got %d, expected at least %d!", size, headerSize );
+    return false;
+  }
+
+  memset( &payload_, '\0', sizeof( Payload ) );
+  memcpy( &payload_, buffer, size );
+
+  if( size != headerSize + payload_.messageSize )
+  {
+    Common::error( "Invalid payload length: got %d, expected %d!", size, headerSize + payload_.messageSize );
+    return false;
+  }
+
+  payload_.sender[ MAX_NICKNAME_SIZE - 1 ] = '\0';
+  payload_.recipient[ MAX_NICKNAME_SIZE - 1 ] = '\0';
+
+  return true;
+}
+
+
+
+const char* PrivateMessage::message() const
+{
+  return payload_.message;
+}
+
+
+
+const char* PrivateMessage::recipient() const
+{
+  return payload_.recipient;
+}
+
+
+
+unsigned int PrivateMessage::recipientId() const
+{
+  return payload_.recipientId;
+}
+
+
+
+const char* PrivateMessage::sender() const
+{
+  return payload_.sender;
+}
+
+
+
+unsigned int PrivateMessage::senderId() const
+{
+  return payload_.senderId;
+}
+
+
+
+void PrivateMessage::setMessage( const char* message )
+{
+  memset( payload_.message, '\0', MAX_CHATMESSAGE_SIZE + 1 );
+  strncpy( payload_.message, message, MAX_CHATMESSAGE_SIZE );
+  payload_.messageSize = strlen( payload_.message );
+}
+
+
+
+void PrivateMessage::setRecipient( const char* nickName, const unsigned int id )
+{
+  memset( payload_.recipient, '\0', MAX_NICKNAME_SIZE );
+  if( nickName != NULL )
+  {
+    strncpy( payload_.recipient, nickName, MAX_NICKNAME_SIZE - 1 );
+  }
+  payload_.recipientId = id;
+}
+
+
+
+void PrivateMessage::setSender( const char* nickName, const unsigned int id )
+{
+  memset( payload_.sender, '\0', MAX_NICKNAME_SIZE );
+  if( nickName != NULL )
+  {
+    strncpy( payload_.sender, nickName, MAX_NICKNAME_SIZE - 1 );
+  }
+  payload_.senderId = id;
+}
+
+
+
+const int PrivateMessage::size() const
+{
+  // Only send the used part of the text
+  return ( offsetof( Payload, message ) + payload_.messageSize );
+}
+
+
+
+char* PrivateMessage::toRawBytes() const
+{
+  int payloadSize = size();
+  char* buffer = static_cast<char*>( malloc( payloadSize + 1 ) );
+  memcpy( buffer, &payload_, payloadSize );
+
+  return buffer;
+}
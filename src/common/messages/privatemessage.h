@@ -0,0 +1,92 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PRIVATEMESSAGE_H
+#define PRIVATEMESSAGE_H
+
+#include "message.h"
+#include "protocol.h"
+
+#include <stdint.h>
+
+
+
+/**
+ * @class PrivateMessage
+ *
+ * Chat message for a single user.
+ *
+ * Clients address the recipient by user id, as listed in the roster, or by nickname
+ * when the id is 0. The server fills in the sender, and only delivers the message
+ * to the recipient.
+ */
+class PrivateMessage : public Message
+{
+
+  public:
+
+    PrivateMessage();
+    PrivateMessage( const char* message );
+    virtual ~PrivateMessage();
+
+    const char* message() const;
+    void setMessage( const char* message );
+
+    const char* recipient() const;
+    unsigned int recipientId() const;
+    void setRecipient( const char* nickName, const unsigned int id = 0 );
+
+    const char* sender() const;
+    unsigned int senderId() const;
+    void setSender( const char* nickName, const unsigned int id = 0 );
+
+    /**
+     * Override, tells how big the message-specific payload is.
+     */
+    virtual const int size() const;
+
+
+  protected:
+
+    /**
+     * Override, analyzes a data buffer to retrieve the specific message type's data.
+     * @see Overrides::fromRawBytes()
+     */
+    virtual bool fromRawBytes( const char* buffer, int size );
+
+    /**
+     * Override, convert the message contents into raw data.
+     * @see Message::toRawBytes()
+     */
+    virtual char* toRawBytes() const;
+
+
+  private:
+
+    /// Container for the private message data
+    struct Payload
+    {
+      char sender[ MAX_NICKNAME_SIZE ];
+      uint32_t senderId;
+      char recipient[ MAX_NICKNAME_SIZE ];
+      uint32_t recipientId;
+      int32_t messageSize;
+      char message[ MAX_CHATMESSAGE_SIZE + 1 ];
+    };
+
+    /// Internal message data
+    Payload payload_;
+
+
+};
+
+
+
+#endif // PRIVATEMESSAGE_H
@@ -0,0 +1,50 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "rawmessage.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+
+
+RawMessage::RawMessage( const char* frames, const int size )
+: Message( Message::MSG_RAW )
+, size_( size )
+{
+  frames_ = static_cast<char*>( malloc( size ) );
+  memcpy( frames_, frames, size );
+}
+
+
+
+RawMessage::~RawMessage()
+{
+  free( frames_ );
+}
+
+
+
+const int RawMessage::size() const
+{
+  return size_;
+}
+
+
+
+char* RawMessage::toRawBytes() const
+{
+  char* buffer = static_cast<char*>( malloc( size_ ) );
+  memcpy( buffer, frames_, size_ );
+
+  return buffer;
+}
+
+
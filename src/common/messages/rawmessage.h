@@ -0,0 +1,60 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef RAWMESSAGE_H
+#define RAWMESSAGE_H
+
+#include "message.h"
+
+
+
+/**
+ * @class RawMessage
+ *
+ * One or more messages which have already been serialized, headers included.
+ *
+ * Sessions send the contents as they are, so data which goes to many
+ * clients only needs to be serialized once.
+ */
+class RawMessage : public Message
+{
+
+  public:
+
+    RawMessage( const char* frames, const int size );
+    virtual ~RawMessage();
+
+    /**
+     * Override, tells how many bytes of messages are contained.
+     */
+    virtual const int size() const;
+
+
+  protected:
+
+    /**
+     * Override, returns a copy of the contained messages.
+     * @see Message::toRawBytes()
+     */
+    virtual char* toRawBytes() const;
+
+
+  private:
+
+    char* frames_;
+
+    int size_;
+
+
+};
+
+
+
+#endif // RAWMESSAGE_H
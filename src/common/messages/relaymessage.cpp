@@ -0,0 +1,148 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "relaymessage.h"
+
+#include "common.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+
+RelayMessage::RelayMessage()
+: Message( Message::MSG_RELAY )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+}
+
+
+
+RelayMessage::RelayMessage( const uint64_t origin, const uint64_t sequence, const Event event, const char* data, const int dataSize )
+: Message( Message::MSG_RELAY )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+
+  payload_.origin = origin;
+  payload_.sequence = sequence;
+  payload_.event = event;
+
+  if( dataSize > (int)MAX_RELAY_DATA_SIZE )
+  {
+    Common::error( "Relayed data is too big: %d bytes", dataSize );
+    return;
+  }
+
+  memcpy( payload_.data, data, dataSize );
+  payload_.dataSize = dataSize;
+}
+
+
+
+RelayMessage::~RelayMessage()
+{
+
+}
+
+
+
+const char* RelayMessage::data() const
+{
+  return payload_.data;
+}
+
+
+
+int RelayMessage::dataSize() const
+{
+  return payload_.dataSize;
+}
+
+
+
+RelayMessage::Event RelayMessage::event() const
+{
+  return static_cast<Event>( payload_.event );
+}
+
+
+
+bool RelayMessage::fromRawBytes( const char* buffer, int size )
+{
+  int headerSize = offsetof( Payload, data );
+  if( size < headerSize || size > (int)sizeof( Payload ) )
+  {
+    Common::error( "Invalid buffer length: got %d, expected at least %d!", size, headerSize );
+    return false;
+  }
+
+  memcpy( &payload_, buffer, size );
+
+  if( payload_.dataSize < 0 || size != headerSize + payload_.dataSize )
+  {
+    Common::error( "Invalid relay data size %d!", payload_.dataSize );
+    return false;
+  }
+
+  if( payload_.event <= RELAY_INVALID || payload_.event >= RELAY_MAX )
+  {
+    Common::error( "Invalid relay event %d!", payload_.event );
+    return false;
+  }
+
+  return true;
+}
+
+
+
+int RelayMessage::hops() const
+{
+  return payload_.hops;
+}
+
+
+
+uint64_t RelayMessage::origin() const
+{
+  return payload_.origin;
+}
+
+
+
+uint64_t RelayMessage::sequence() const
+{
+  return payload_.sequence;
+}
+
+
+
+void RelayMessage::setHops( const int hops )
+{
+  payload_.hops = hops;
+}
+
+
+
+const int RelayMessage::size() const
+{
+  return ( offsetof( Payload, data ) + payload_.dataSize );
+}
+
+
+
+char* RelayMessage::toRawBytes() const
+{
+  int payloadSize = size();
+  char* buffer = static_cast<char*>( malloc( payloadSize + 1 ) );
+  memcpy( buffer, &payload_, payloadSize );
+
+  return buffer;
+}
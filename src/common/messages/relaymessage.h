@@ -0,0 +1,119 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef RELAYMESSAGE_H
+#define RELAYMESSAGE_H
+
+#include "message.h"
+#include "protocol.h"
+
+#include <stdint.h>
+
+
+/**
+ * @def MAX_RELAY_DATA_SIZE
+ *
+ * Maximum size of the data carried by a relay message.
+ */
+#define MAX_RELAY_DATA_SIZE   ( MAX_PAYLOAD_SIZE - 3 * sizeof( int32_t ) - 2 * sizeof( uint64_t ) )
+
+
+
+/**
+ * @class RelayMessage
+ *
+ * Traffic exchanged between federated servers.
+ *
+ * Each relay is identified by the server where it was generated and by a sequence
+ * number which grows within that server, so servers can recognize, and drop, the
+ * relays which reach them more than once through different links.
+ */
+class RelayMessage : public Message
+{
+
+  public:
+
+    /// What has happened on the origin server
+    enum Event
+    {
+      RELAY_INVALID
+    , RELAY_CHAT                /// A user has said something; the data is a serialized ChatMessage
+    , RELAY_NICKNAME_TAKEN      /// A user has taken a nickname; the data is the nickname
+    , RELAY_NICKNAME_RELEASED   /// A user has left or changed nickname; the data is the old nickname
+    , RELAY_FILE_REQUEST        /// A user is sending a file; the data is a serialized ChatMessage announcing it
+    , RELAY_PRIVATE             /// A user wrote to a single user; the data is the recipient's nickname, then a serialized PrivateMessage
+    , RELAY_CHALLENGE           /// A link was opened; the data is random bytes the other server must sign to prove it knows the secret
+    , RELAY_PROOF               /// Answer to a challenge; the data is its HMAC, and the origin the server which signed it
+    , RELAY_MAX
+    };
+
+
+  public:
+
+    RelayMessage();
+    RelayMessage( const uint64_t origin, const uint64_t sequence, const Event event, const char* data, const int dataSize );
+    virtual ~RelayMessage();
+
+    const char* data() const;
+    int dataSize() const;
+    Event event() const;
+
+    /**
+     * Number of links the message has gone through.
+     */
+    int hops() const;
+    void setHops( const int hops );
+
+    uint64_t origin() const;
+    uint64_t sequence() const;
+
+    /**
+     * Override, tells how big the message-specific payload is.
+     */
+    virtual const int size() const;
+
+
+  protected:
+
+    /**
+     * Override, analyzes a data buffer to retrieve the specific message type's data.
+     * @see Overrides::fromRawBytes()
+     */
+    virtual bool fromRawBytes( const char* buffer, int size );
+
+    /**
+     * Override, convert the message contents into raw data.
+     * @see Message::toRawBytes()
+     */
+    virtual char* toRawBytes() const;
+
+
+  private:
+
+    /// Container for the relay message data
+    struct Payload
+    {
+      uint64_t origin;
+      uint64_t sequence;
+      int32_t hops;
+      int32_t event;
+      int32_t dataSize;
+      char data[ MAX_RELAY_DATA_SIZE ];
+    };
+
+    /// Internal message data
+    Payload payload_;
+
+
+};
+
+
+
+#endif // RELAYMESSAGE_H
@@ -0,0 +1,176 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "rostermessage.h"
+
+#include "common.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+
+RosterMessage::RosterMessage()
+: Message( Message::MSG_ROSTER )
+, hasPayload_( false )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+}
+
+
+
+RosterMessage::RosterMessage( const uint32_t version, const bool isSnapshot )
+: Message( Message::MSG_ROSTER )
+, hasPayload_( true )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+  payload_.version = version;
+  payload_.isSnapshot = isSnapshot;
+  payload_.isLast = ! isSnapshot;
+}
+
+
+
+RosterMessage::~RosterMessage()
+{
+
+}
+
+
+
+bool RosterMessage::addEntry( const Entry& entry )
+{
+  if( payload_.entriesCount >= ROSTER_ENTRIES_PER_MESSAGE )
+  {
+    return false;
+  }
+
+  payload_.entries[ payload_.entriesCount++ ] = entry;
+
+  return true;
+}
+
+
+
+const RosterMessage::Entry& RosterMessage::entry( const int index ) const
+{
+  return payload_.entries[ index ];
+}
+
+
+
+int RosterMessage::entriesCount() const
+{
+  return payload_.entriesCount;
+}
+
+
+
+bool RosterMessage::fromRawBytes( const char* buffer, int size )
+{
+  // An empty message is a request
+  if( size == 0 )
+  {
+    hasPayload_ = false;
+    return true;
+  }
+
+  int headerSize = offsetof( Payload, entries );
+  if( size < headerSize || size > (int)sizeof( Payload ) )
+  {
+    Common::error( "Invalid buffer length: got %d, expected at least %d!", size, headerSize );
+    return false;
+  }
+
+  memcpy( &payload_, buffer, size );
+
+  if( payload_.entriesCount < 0 || payload_.entriesCount > ROSTER_ENTRIES_PER_MESSAGE
+  ||  size != (int)( headerSize + payload_.entriesCount * sizeof( Entry ) ) )
+  {
+    Common::error( "Invalid roster entries count %d!", payload_.entriesCount );
+    return false;
+  }
+
+  for( int i = 0; i < payload_.entriesCount; i++ )
+  {
+    Entry& entry = payload_.entries[ i ];
+    if( entry.event < ROSTER_JOINED || entry.event > ROSTER_RENAMED )
+    {
+      Common::error( "Invalid roster event %d!", entry.event );
+      return false;
+    }
+
+    entry.nickName[ MAX_NICKNAME_SIZE - 1 ] = '\0';
+    entry.oldNickName[ MAX_NICKNAME_SIZE - 1 ] = '\0';
+  }
+
+  hasPayload_ = true;
+  return true;
+}
+
+
+
+bool RosterMessage::isLast() const
+{
+  return payload_.isLast;
+}
+
+
+
+bool RosterMessage::isRequest() const
+{
+  return ! hasPayload_;
+}
+
+
+
+bool RosterMessage::isSnapshot() const
+{
+  return payload_.isSnapshot;
+}
+
+
+
+void RosterMessage::markLast()
+{
+  payload_.isLast = true;
+}
+
+
+
+const int RosterMessage::size() const
+{
+  if( ! hasPayload_ )
+  {
+    return 0;
+  }
+
+  // Only send the used entries
+  return ( offsetof( Payload, entries ) + payload_.entriesCount * sizeof( Entry ) );
+}
+
+
+
+char* RosterMessage::toRawBytes() const
+{
+  int payloadSize = size();
+  char* buffer = static_cast<char*>( malloc( payloadSize + 1 ) );
+  memcpy( buffer, &payload_, payloadSize );
+
+  return buffer;
+}
+
+
+
+uint32_t RosterMessage::version() const
+{
+  return payload_.version;
+}
@@ -0,0 +1,147 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef ROSTERMESSAGE_H
+#define ROSTERMESSAGE_H
+
+#include "message.h"
+#include "protocol.h"
+
+#include <stdint.h>
+
+
+/**
+ * @def ROSTER_ENTRIES_PER_MESSAGE
+ *
+ * Maximum number of users or changes carried by a single roster message.
+ */
+#define ROSTER_ENTRIES_PER_MESSAGE   17
+
+
+
+/**
+ * @class RosterMessage
+ *
+ * List of the users who are online, or changes to it.
+ *
+ * After logging in, clients get a snapshot of the whole list, in one or more
+ * messages. Then the server only sends the changes, in batches: each batch has
+ * the version following the previous one, so clients notice when one went missing
+ * (for example, dropped because they were too slow) and can ask for a new snapshot,
+ * by sending an empty message.
+ */
+class RosterMessage : public Message
+{
+
+  public:
+
+    enum Event
+    {
+      ROSTER_JOINED    /// A user is online; snapshots only contain these
+    , ROSTER_LEFT      /// A user went away
+    , ROSTER_RENAMED   /// A user changed nickname
+    };
+
+    /// A user, or a change to the list
+    struct Entry
+    {
+      int32_t event;
+      /// Id to send private messages to, or 0 for the users of other servers
+      uint32_t id;
+      char nickName[ MAX_NICKNAME_SIZE ];
+      /// Previous nickname, with ROSTER_RENAMED
+      char oldNickName[ MAX_NICKNAME_SIZE ];
+    };
+
+
+  public:
+
+    /**
+     * Create a request for a snapshot.
+     */
+    RosterMessage();
+
+    /**
+     * Create a snapshot, or a batch of changes.
+     *
+     * @param version Version of the list after the message is applied
+     */
+    RosterMessage( const uint32_t version, const bool isSnapshot );
+    virtual ~RosterMessage();
+
+    /**
+     * Add a user or a change to the message.
+     *
+     * @return false if the message is full
+     */
+    bool addEntry( const Entry& entry );
+
+    const Entry& entry( const int index ) const;
+    int entriesCount() const;
+
+    /**
+     * Whether this is the last message of a snapshot. Batches of changes always are.
+     */
+    bool isLast() const;
+    void markLast();
+
+    /**
+     * Whether the message is a request from a client.
+     */
+    bool isRequest() const;
+
+    bool isSnapshot() const;
+    uint32_t version() const;
+
+    /**
+     * Override, tells how big the message-specific payload is.
+     */
+    virtual const int size() const;
+
+
+  protected:
+
+    /**
+     * Override, analyzes a data buffer to retrieve the specific message type's data.
+     * @see Overrides::fromRawBytes()
+     */
+    virtual bool fromRawBytes( const char* buffer, int size );
+
+    /**
+     * Override, convert the message contents into raw data.
+     * @see Message::toRawBytes()
+     */
+    virtual char* toRawBytes() const;
+
+
+  private:
+
+    /// Container for the roster message data
+    struct Payload
+    {
+      uint32_t version;
+      int32_t isSnapshot;
+      int32_t isLast;
+      int32_t entriesCount;
+      Entry entries[ ROSTER_ENTRIES_PER_MESSAGE ];
+    };
+
+    /// Whether the message contains a roster
+    bool hasPayload_;
+
+    /// Internal message data
+    Payload payload_;
+
+
+};
+
+
+
+#endif // ROSTERMESSAGE_H
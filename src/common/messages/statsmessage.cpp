@@ -0,0 +1,161 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "statsmessage.h"
+
+#include "common.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+
+StatsMessage::StatsMessage()
+: Message( Message::MSG_STATS )
+, hasPayload_( false )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+}
+
+
+
+StatsMessage::~StatsMessage()
+{
+
+}
+
+
+
+bool StatsMessage::addEntry( const Entry& entry )
+{
+  if( payload_.entriesCount >= STATS_ENTRIES_PER_MESSAGE )
+  {
+    return false;
+  }
+
+  payload_.entries[ payload_.entriesCount++ ] = entry;
+  hasPayload_ = true;
+
+  return true;
+}
+
+
+
+const StatsMessage::Entry& StatsMessage::entry( const int index ) const
+{
+  return payload_.entries[ index ];
+}
+
+
+
+int StatsMessage::entriesCount() const
+{
+  return payload_.entriesCount;
+}
+
+
+
+bool StatsMessage::fromRawBytes( const char* buffer, int size )
+{
+  // An empty message is a request
+  if( size == 0 )
+  {
+    hasPayload_ = false;
+    return true;
+  }
+
+  int headerSize = offsetof( Payload, entries );
+  if( size < headerSize || size > (int)sizeof( Payload ) )
+  {
+    Common::error( "Invalid buffer length: got %d, expected at least %d!", size, headerSize );
+    return false;
+  }
+
+  memcpy( &payload_, buffer, size );
+
+  if( payload_.entriesCount < 0 || payload_.entriesCount > STATS_ENTRIES_PER_MESSAGE
+  ||  size != (int)( headerSize + payload_.entriesCount * sizeof( Entry ) ) )
+  {
+    Common::error( "Invalid statistics entries count %d!", payload_.entriesCount );
+    return false;
+  }
+
+  for( int i = 0; i < payload_.entriesCount; i++ )
+  {
+    payload_.entries[ i ].nickName[ MAX_NICKNAME_SIZE - 1 ] = '\0';
+  }
+
+  hasPayload_ = true;
+  return true;
+}
+
+
+
+bool StatsMessage::isLast() const
+{
+  return payload_.isLast;
+}
+
+
+
+bool StatsMessage::isRequest() const
+{
+  return ! hasPayload_;
+}
+
+
+
+void StatsMessage::markLast()
+{
+  payload_.isLast = true;
+  hasPayload_ = true;
+}
+
+
+
+void StatsMessage::setSummary( const Summary& summary )
+{
+  payload_.summary = summary;
+  hasPayload_ = true;
+}
+
+
+
+const StatsMessage::Summary& StatsMessage::summary() const
+{
+  return payload_.summary;
+}
+
+
+
+const int StatsMessage::size() const
+{
+  if( ! hasPayload_ )
+  {
+    return 0;
+  }
+
+  // Only send the used entries
+  return ( offsetof( Payload, entries ) + payload_.entriesCount * sizeof( Entry ) );
+}
+
+
+
+char* StatsMessage::toRawBytes() const
+{
+  int payloadSize = size();
+  char* buffer = static_cast<char*>( malloc( payloadSize + 1 ) );
+  memcpy( buffer, &payload_, payloadSize );
+
+  return buffer;
+}
+
+
@@ -0,0 +1,146 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef STATSMESSAGE_H
+#define STATSMESSAGE_H
+
+#include "message.h"
+#include "protocol.h"
+
+#include <stdint.h>
+
+
+/**
+ * @def STATS_ENTRIES_PER_MESSAGE
+ *
+ * Maximum number of sessions described in a single statistics message.
+ */
+#define STATS_ENTRIES_PER_MESSAGE   14
+
+
+
+/**
+ * @class StatsMessage
+ *
+ * Server statistics.
+ *
+ * Clients send it empty to ask for the statistics. The server answers with one
+ * or more messages, each with the server-wide figures and a part of the list of sessions.
+ */
+class StatsMessage : public Message
+{
+
+  public:
+
+    /// Figures of a single session
+    struct Entry
+    {
+      char nickName[ MAX_NICKNAME_SIZE ];
+      uint64_t bytesIn;
+      uint64_t bytesOut;
+      uint64_t messagesIn;
+      uint64_t messagesOut;
+      uint64_t messagesDropped;
+      int32_t queueDepth;
+      /// Average bytes per second since the session has started
+      int32_t rateIn;
+      int32_t rateOut;
+    };
+
+    /// Server-wide figures
+    struct Summary
+    {
+      int64_t uptime;
+      int32_t threadsCount;
+      int32_t sessionsCount;
+      uint64_t connectionsAccepted;
+      uint64_t connectionsRejected;
+      /// Broadcast messages affected by the slow consumer policy
+      uint64_t slowDroppedNewest;
+      uint64_t slowDroppedOldest;
+      uint64_t slowSpilled;
+      /// Clients dropped because they couldn't keep up
+      uint64_t slowDisconnected;
+    };
+
+
+  public:
+
+    StatsMessage();
+    virtual ~StatsMessage();
+
+    /**
+     * Add a session to the message.
+     *
+     * @return false if the message is full
+     */
+    bool addEntry( const Entry& entry );
+
+    const Entry& entry( const int index ) const;
+    int entriesCount() const;
+
+    /**
+     * Whether the message is a request from a client.
+     */
+    bool isRequest() const;
+
+    /**
+     * Whether this is the last of the messages sent in answer to a request.
+     */
+    bool isLast() const;
+    void markLast();
+
+    void setSummary( const Summary& summary );
+    const Summary& summary() const;
+
+    /**
+     * Override, tells how big the message-specific payload is.
+     */
+    virtual const int size() const;
+
+
+  protected:
+
+    /**
+     * Override, analyzes a data buffer to retrieve the specific message type's data.
+     * @see Overrides::fromRawBytes()
+     */
+    virtual bool fromRawBytes( const char* buffer, int size );
+
+    /**
+     * Override, convert the message contents into raw data.
+     * @see Message::toRawBytes()
+     */
+    virtual char* toRawBytes() const;
+
+
+  private:
+
+    /// Container for the statistics message data
+    struct Payload
+    {
+      Summary summary;
+      int32_t isLast;
+      int32_t entriesCount;
+      Entry entries[ STATS_ENTRIES_PER_MESSAGE ];
+    };
+
+    /// Whether the message contains any statistics
+    bool hasPayload_;
+
+    /// Internal message data
+    Payload payload_;
+
+
+};
+
+
+
+#endif // STATSMESSAGE_H
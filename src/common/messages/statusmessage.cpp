@@ -19,6 +19,7 @@
 
 StatusMessage::StatusMessage()
 : Message( Message::MSG_STATUS )
+, fileOffset_( 0 )
 {
   payload_.status = Errors::Status_Ok;
 }
@@ -27,6 +28,7 @@ StatusMessage::StatusMessage()
 
 StatusMessage::StatusMessage( const Errors::StatusCode statusCode )
 : Message( Message::MSG_STATUS )
+, fileOffset_( 0 )
 {
   payload_.status = statusCode;
 }
@@ -40,6 +42,20 @@ StatusMessage::~StatusMessage()
 
 
 
+const int64_t StatusMessage::fileOffset() const
+{
+  return fileOffset_;
+}
+
+
+
+void StatusMessage::setFileOffset( const int64_t fileOffset )
+{
+  fileOffset_ = fileOffset;
+}
+
+
+
 const Errors::StatusCode StatusMessage::statusCode() const
 {
   return payload_.status;
@@ -50,7 +66,7 @@ const Errors::StatusCode StatusMessage::statusCode() const
 bool StatusMessage::fromRawBytes( const char* buffer, int size )
 {
   int payloadSize = sizeof( Payload );
-  if( size != payloadSize )
+  if( size != payloadSize && size != payloadSize + (int)sizeof( int64_t ) )
   {
     Common::error( "Invalid buffer length: got %d, expected %d!", size, payloadSize );
     return false;
@@ -58,6 +74,12 @@ bool StatusMessage::fromRawBytes( const char* buffer, int size )
 
   memcpy( &payload_, buffer, payloadSize );
 
+  fileOffset_ = 0;
+  if( size > payloadSize )
+  {
+    memcpy( &fileOffset_, buffer + payloadSize, sizeof( int64_t ) );
+  }
+
   Common::debug( "Read status code: %d", payload_.status );
 
   return true;
@@ -67,7 +89,8 @@ bool StatusMessage::fromRawBytes( const char* buffer, int size )
 
 const int StatusMessage::size() const
 {
-  return ( sizeof( Payload ) );
+  // Peers which don't resume transfers never get the offset
+  return ( sizeof( Payload ) + ( fileOffset_ != 0 ? sizeof( int64_t ) : 0 ) );
 }
 
 
@@ -76,7 +99,12 @@ char* StatusMessage::toRawBytes() const
 {
   int payloadSize = size();
   char* buffer = static_cast<char*>( malloc( payloadSize ) );
-  memcpy( buffer, &payload_, payloadSize );
+  memcpy( buffer, &payload_, sizeof( Payload ) );
+
+  if( fileOffset_ != 0 )
+  {
+    memcpy( buffer + sizeof( Payload ), &fileOffset_, sizeof( int64_t ) );
+  }
 
   Common::debug( "Made message buffer for status %d (%d bytes)", payload_.status, payloadSize );
 
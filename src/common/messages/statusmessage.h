@@ -15,6 +15,8 @@
 #include "errors.h"
 #include "protocol.h"
 
+#include <stdint.h>
+
 
 
 class StatusMessage : public Message
@@ -26,6 +28,12 @@ class StatusMessage : public Message
     StatusMessage( const Errors::StatusCode statusCode );
     virtual ~StatusMessage();
 
+    /**
+     * Where a file transfer continues from, for acceptances of file transfers; 0 to start over.
+     */
+    const int64_t fileOffset() const;
+    void setFileOffset( const int64_t fileOffset );
+
     /**
      * Override, tells how big the message-specific payload is.
      */
@@ -57,6 +65,9 @@ class StatusMessage : public Message
       Errors::StatusCode status;
     };
 
+    /// Sent after the payload, only when it's not 0
+    int64_t fileOffset_;
+
     /// Internal message data
     Payload payload_;
 
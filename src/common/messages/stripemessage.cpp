@@ -0,0 +1,108 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "stripemessage.h"
+
+#include "common.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+
+
+StripeMessage::StripeMessage()
+: Message( Message::MSG_STRIPE )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+}
+
+
+
+StripeMessage::StripeMessage( const Kind kind, const uint64_t token, const int count )
+: Message( Message::MSG_STRIPE )
+{
+  memset( &payload_, '\0', sizeof( Payload ) );
+  payload_.kind = kind;
+  payload_.count = count;
+  payload_.token = token;
+}
+
+
+
+StripeMessage::~StripeMessage()
+{
+
+}
+
+
+
+int StripeMessage::count() const
+{
+  return payload_.count;
+}
+
+
+
+bool StripeMessage::fromRawBytes( const char* buffer, int size )
+{
+  if( size != sizeof( Payload ) )
+  {
+    Common::error( "Invalid buffer length: got %d, expected %d!", size, (int)sizeof( Payload ) );
+    return false;
+  }
+
+  memcpy( &payload_, buffer, size );
+
+  if( payload_.kind < STRIPE_OFFER || payload_.kind > STRIPE_END )
+  {
+    Common::error( "Invalid stripe message kind %d!", payload_.kind );
+    return false;
+  }
+
+  // The session counts as well, with STRIPE_END
+  if( payload_.count < 0 || payload_.count > MAX_FILE_STRIPES + 1 )
+  {
+    Common::error( "Invalid number of data connections: %d", payload_.count );
+    return false;
+  }
+
+  return true;
+}
+
+
+
+StripeMessage::Kind StripeMessage::kind() const
+{
+  return static_cast<Kind>( payload_.kind );
+}
+
+
+
+const int StripeMessage::size() const
+{
+  return sizeof( Payload );
+}
+
+
+
+char* StripeMessage::toRawBytes() const
+{
+  char* buffer = static_cast<char*>( malloc( sizeof( Payload ) ) );
+  memcpy( buffer, &payload_, sizeof( Payload ) );
+
+  return buffer;
+}
+
+
+
+uint64_t StripeMessage::token() const
+{
+  return payload_.token;
+}
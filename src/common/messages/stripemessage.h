@@ -0,0 +1,110 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef STRIPEMESSAGE_H
+#define STRIPEMESSAGE_H
+
+#include "message.h"
+
+#include <stdint.h>
+
+
+/**
+ * @def MAX_FILE_STRIPES
+ *
+ * Maximum number of data connections a client may open for a file transfer, besides its session.
+ */
+#define MAX_FILE_STRIPES   8
+
+
+
+/**
+ * @class StripeMessage
+ *
+ * Setup of the data connections which carry the blocks of a file alongside the session.
+ *
+ * When a file transfer starts, the server offers its sender and its receivers a token, and
+ * how many data connections they may open. Each data connection sends the token as its
+ * first message, instead of logging in; the server answers with the same message once it's
+ * tied to the session. From then on, the blocks of the file are spread among the session
+ * and its data connections, and put back in place by their offset.
+ *
+ * The connections are kept for the next transfers. As the blocks may arrive out of order,
+ * after the last one the server marks the end of the file on each connection of a receiver.
+ */
+class StripeMessage : public Message
+{
+
+  public:
+
+    enum Kind
+    {
+      STRIPE_OFFER   /// Server to client: the token, and how many connections it may open
+    , STRIPE_JOIN    /// Client to server: a new connection for the session with the token. Server to client: it's joined
+    , STRIPE_END     /// Server to client: no more blocks of the file through this connection, out of how many
+    };
+
+
+  public:
+
+    StripeMessage();
+    StripeMessage( const Kind kind, const uint64_t token, const int count = 0 );
+    virtual ~StripeMessage();
+
+    /**
+     * Maximum number of data connections, with STRIPE_OFFER; connections carrying the file,
+     * session included, with STRIPE_END.
+     */
+    int count() const;
+
+    Kind kind() const;
+
+    /**
+     * Override, tells how big the message-specific payload is.
+     */
+    virtual const int size() const;
+
+    uint64_t token() const;
+
+
+  protected:
+
+    /**
+     * Override, analyzes a data buffer to retrieve the specific message type's data.
+     * @see Overrides::fromRawBytes()
+     */
+    virtual bool fromRawBytes( const char* buffer, int size );
+
+    /**
+     * Override, convert the message contents into raw data.
+     * @see Message::toRawBytes()
+     */
+    virtual char* toRawBytes() const;
+
+
+  private:
+
+    /// Container for the stripe message data
+    struct Payload
+    {
+      int32_t kind;
+      int32_t count;
+      uint64_t token;
+    };
+
+    /// Internal message data
+    Payload payload_;
+
+
+};
+
+
+
+#endif // STRIPEMESSAGE_H
@@ -17,14 +17,29 @@
 #include "byemessage.h"
 #include "chatmessage.h"
 #include "filedatamessage.h"
+#include "filemanifestmessage.h"
+#include "filesignaturemessage.h"
 #include "filetransfermessage.h"
 #include "hellomessage.h"
+#include "multicastmessage.h"
 #include "nicknamemessage.h"
+#include "privatemessage.h"
+#include "relaymessage.h"
+#include "rostermessage.h"
+#include "statsmessage.h"
 #include "statusmessage.h"
+#include "stripemessage.h"
+
+#include "tls.h"
 
 #include <netinet/in.h>
+#include <openssl/err.h>
+#include <sys/eventfd.h>
 #include <sys/poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -35,27 +50,231 @@
 
 
 SessionBase::SessionBase( const int socket )
-: bufferOffset_( 0 )
+: abortionFlag_( false )
+, behindSince_( 0 )
+, bufferOffset_( 0 )
 , disconnectionFlag_( false )
+, isHandshakeDone_( false )
+, isKernelTlsSending_( false )
+, suspensionFlag_( false )
+, pollingThread_( pthread_self() )
+, sendBuffer_( NULL )
+, sendBufferSize_( 0 )
+, sendBufferOffset_( 0 )
+, sendFile_( -1 )
+, sendFileOffset_( 0 )
+, sendFileSize_( 0 )
 , socket_( socket )
+, spillFile_( -1 )
+, spillReadOffset_( 0 )
+, spillWriteOffset_( 0 )
+, tls_( NULL )
+, tlsWantsWrite_( false )
 {
+ pthread_mutex_init( &queueMutex_, NULL );
+
+ wakeUpEvent_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+ if( wakeUpEvent_ < 0 )
+ {
+   Common::fatal( "Session 0x%X: Unable to create the wake up event: %s", this, strerror( errno ) );
+ }
+
  buffer_ = static_cast<char*>( malloc( MAX_MESSAGE_SIZE ) );
+
+ memset( &statistics_, '\0', sizeof( Statistics ) );
+ statistics_.startTime = time( NULL );
 }
 
 
 
 SessionBase::~SessionBase()
 {
+  if( tls_ != NULL )
+  {
+    // Tell the other end the connection ends here, if it's still there to listen
+    if( isHandshakeDone_ )
+    {
+      SSL_shutdown( tls_ );
+    }
+    SSL_free( tls_ );
+  }
+
   close( socket_ );
+  close( wakeUpEvent_ );
+
+  if( spillFile_ >= 0 )
+  {
+    close( spillFile_ );
+  }
+
+  if( sendFile_ != -1 )
+  {
+    close( sendFile_ );
+  }
 
   free( buffer_ );
+  free( sendBuffer_ );
+
+  // Sessions which were dropped may still have queued messages
+  while( sendingQueue_.size() > 0 )
+  {
+    delete sendingQueue_.front();
+    sendingQueue_.pop_front();
+  }
+  while( receivingQueue_.size() > 0 )
+  {
+    delete receivingQueue_.front();
+    receivingQueue_.pop_front();
+  }
+
+  pthread_mutex_destroy( &queueMutex_ );
+}
+
+
+
+bool SessionBase::acceptMessage( Message::Type, const int )
+{
+  return true;
+}
+
+
+
+bool SessionBase::canReceiveData()
+{
+  return true;
 }
 
 
 
 bool SessionBase::canSendMessages()
 {
-  return ( sendingQueue_.size() <= MAX_NETWORK_MESSAGE_QUEUE );
+  // The queue may be filled by other threads. While anything is spilled, new messages
+  // go to the disk too, however short the queue looks
+  pthread_mutex_lock( &queueMutex_ );
+  bool canSend = ( sendingQueue_.size() <= MAX_NETWORK_MESSAGE_QUEUE && spillWriteOffset_ == spillReadOffset_ );
+  pthread_mutex_unlock( &queueMutex_ );
+
+  return canSend;
+}
+
+
+
+bool SessionBase::canWriteDirectly() const
+{
+  return ( tls_ == NULL || isKernelTlsSending_ );
+}
+
+
+
+void SessionBase::consumeBuffer( const int size )
+{
+  int remainder = bufferOffset_ - size;
+  memmove( buffer_, buffer_ + size, remainder );
+
+  // Also zero out the rest so it's clearer where messages end
+  memset( buffer_ + remainder, '\0', MAX_MESSAGE_SIZE - remainder );
+  bufferOffset_ = remainder;
+}
+
+
+
+Message* SessionBase::createMessage( const Message::Type type )
+{
+  Message* message = NULL;
+
+  switch( type )
+  {
+    case Message::MSG_HELLO:
+      message = new HelloMessage();
+      break;
+    case Message::MSG_BYE:
+      message = new ByeMessage();
+      break;
+    case Message::MSG_NICKNAME:
+      message = new NicknameMessage();
+      break;
+    case Message::MSG_STATUS:
+      message = new StatusMessage();
+      break;
+    case Message::MSG_CHAT:
+      message = new ChatMessage();
+      break;
+    case Message::MSG_FILE_REQUEST:
+      message = new FileTransferMessage();
+      break;
+    case Message::MSG_FILE_DATA:
+      message = new FileDataMessage();
+      break;
+    case Message::MSG_STATS:
+      message = new StatsMessage();
+      break;
+    case Message::MSG_RELAY:
+      message = new RelayMessage();
+      break;
+    case Message::MSG_ROSTER:
+      message = new RosterMessage();
+      break;
+    case Message::MSG_PRIVATE:
+      message = new PrivateMessage();
+      break;
+    case Message::MSG_MULTICAST:
+      message = new MulticastMessage();
+      break;
+    case Message::MSG_STRIPE:
+      message = new StripeMessage();
+      break;
+    case Message::MSG_FILE_MANIFEST:
+      message = new FileManifestMessage();
+      break;
+    case Message::MSG_FILE_SIGNATURE:
+      message = new FileSignatureMessage();
+      break;
+    default:
+      Common::error( "Could not create the message. Invalid type %d", type );
+      break;
+  }
+
+
+  return message;
+}
+
+
+
+Message* SessionBase::deserializeMessage( const char* frame, const int frameSize )
+{
+  int messageHeaderSize = sizeof( MessageHeader );
+  if( frameSize < messageHeaderSize )
+  {
+    return NULL;
+  }
+
+  MessageHeader messageHeader;
+  memcpy( &messageHeader, frame, messageHeaderSize );
+
+  if( messageHeader.size != frameSize - messageHeaderSize )
+  {
+    Common::error( "Invalid frame: payload of %d bytes in a frame of %d", messageHeader.size, frameSize );
+    return NULL;
+  }
+
+  Message* message = NULL;
+  for( int i = Message::MSG_INVALID + 1; i < Message::MSG_MAX; i++ )
+  {
+    Message::Type type = static_cast<Message::Type>( i );
+    if( strncmp( messageHeader.command, Message::command( type ), COMMAND_SIZE ) == 0 )
+    {
+      message = createMessage( type );
+      break;
+    }
+  }
+
+  if( message == NULL || ! message->fromRawBytes( frame + messageHeaderSize, messageHeader.size ) )
+  {
+    delete message;
+    return NULL;
+  }
+
+  return message;
 }
 
 
@@ -63,6 +282,187 @@ bool SessionBase::canSendMessages()
 void SessionBase::disconnect()
 {
   disconnectionFlag_ = true;
+
+  if( ! isSessionThread() )
+  {
+    wakeUp();
+  }
+}
+
+
+
+void SessionBase::dropConnection()
+{
+  abortionFlag_ = true;
+  disconnectionFlag_ = true;
+  wakeUp();
+}
+
+
+
+int SessionBase::exportState( char*& input, int& inputSize, char*& output, int& outputSize, bool& isDisconnecting )
+{
+  inputSize = bufferOffset_;
+  input = static_cast<char*>( malloc( inputSize + 1 ) );
+  memcpy( input, buffer_, inputSize );
+  consumeBuffer( inputSize );
+
+  // Gather what remains of the message being sent and all the queued ones
+  outputSize = sendBufferSize_ - sendBufferOffset_;
+  output = static_cast<char*>( malloc( outputSize + 1 ) );
+  if( sendBuffer_ != NULL )
+  {
+    memcpy( output, sendBuffer_ + sendBufferOffset_, outputSize );
+    free( sendBuffer_ );
+    sendBuffer_ = NULL;
+    sendBufferSize_ = 0;
+    sendBufferOffset_ = 0;
+  }
+
+  // Followed by the rest of its file data
+  if( sendFile_ != -1 )
+  {
+    output = static_cast<char*>( realloc( output, outputSize + sendFileSize_ + 1 ) );
+    if( pread( sendFile_, output + outputSize, sendFileSize_, sendFileOffset_ ) == (ssize_t)sendFileSize_ )
+    {
+      outputSize += sendFileSize_;
+    }
+    else
+    {
+      Common::error( "Session 0x%X: Unable to read the file data: %s", this, strerror( errno ) );
+    }
+
+    close( sendFile_ );
+    sendFile_ = -1;
+    sendFileSize_ = 0;
+  }
+
+  pthread_mutex_lock( &queueMutex_ );
+
+  while( sendingQueue_.size() > 0 )
+  {
+    Message* message = sendingQueue_.front();
+    sendingQueue_.pop_front();
+
+    int frameSize;
+    char* frame = serializeMessage( message, frameSize );
+
+    output = static_cast<char*>( realloc( output, outputSize + frameSize ) );
+    memcpy( output + outputSize, frame, frameSize );
+    outputSize += frameSize;
+
+    free( frame );
+    delete message;
+  }
+
+  // The spilled data goes last
+  int spilledSize = spillWriteOffset_ - spillReadOffset_;
+  if( spilledSize > 0 )
+  {
+    output = static_cast<char*>( realloc( output, outputSize + spilledSize ) );
+    if( pread( spillFile_, output + outputSize, spilledSize, spillReadOffset_ ) == spilledSize )
+    {
+      outputSize += spilledSize;
+    }
+    else
+    {
+      Common::error( "Session 0x%X: Unable to read the spilled messages: %s", this, strerror( errno ) );
+    }
+
+    ftruncate( spillFile_, 0 );
+    spillReadOffset_ = 0;
+    spillWriteOffset_ = 0;
+  }
+
+  pthread_mutex_unlock( &queueMutex_ );
+
+  isDisconnecting = disconnectionFlag_;
+
+  return socket_;
+}
+
+
+
+bool SessionBase::hasPendingOutput() const
+{
+  return ( sendBuffer_ != NULL || sendFile_ != -1 || sendingQueue_.size() > 0 || spillWriteOffset_ > spillReadOffset_ );
+}
+
+
+
+bool SessionBase::hasTlsFailed( const int result, const char* action )
+{
+  switch( SSL_get_error( tls_, result ) )
+  {
+    // Non-blocking sockets may not be ready yet
+    case SSL_ERROR_WANT_READ:
+      tlsWantsWrite_ = false;
+      return false;
+
+    case SSL_ERROR_WANT_WRITE:
+      tlsWantsWrite_ = true;
+      return false;
+
+    case SSL_ERROR_ZERO_RETURN:
+      Common::debug( "Session 0x%X: The other end closed the connection", this );
+      return true;
+
+    case SSL_ERROR_SYSCALL:
+      Common::error( "Session 0x%X: %s: %s", this, action, ( errno != 0 ) ? strerror( errno ) : "Connection lost" );
+      break;
+
+    default:
+      Common::error( "Session 0x%X: %s", this, action );
+      break;
+  }
+
+  Tls::logErrors( "OpenSSL" );
+
+  // The connection is unusable, don't try to close it cleanly
+  SSL_set_quiet_shutdown( tls_, 1 );
+
+  return true;
+}
+
+
+
+void SessionBase::importState( const char* input, const int inputSize, const char* output, const int outputSize, const bool isDisconnecting )
+{
+  if( inputSize > MAX_MESSAGE_SIZE )
+  {
+    Common::error( "Session 0x%X: Invalid imported input size %d", this, inputSize );
+  }
+  else
+  {
+    memcpy( buffer_, input, inputSize );
+    bufferOffset_ = inputSize;
+  }
+
+  // The pending output is sent before any new message
+  if( outputSize > 0 )
+  {
+    sendBuffer_ = static_cast<char*>( malloc( outputSize ) );
+    memcpy( sendBuffer_, output, outputSize );
+    sendBufferSize_ = outputSize;
+    sendBufferOffset_ = 0;
+  }
+
+  disconnectionFlag_ = isDisconnecting;
+  suspensionFlag_ = false;
+}
+
+
+
+bool SessionBase::isSessionThread() const
+{
+  return pthread_equal( pollingThread_, pthread_self() );
+}
+
+
+
+bool SessionBase::isEncrypted() const
+{
+  return ( tls_ != NULL );
 }
 
 
@@ -74,8 +474,10 @@ bool SessionBase::isConnected() const
 
 
 
-Message* SessionBase::parseMessage()
+Message* SessionBase::parseMessage( bool& isDropped )
 {
+  isDropped = false;
+
   // Current position in the first message contained in the buffer
   int messageOffset_ = 0;
 
@@ -107,8 +509,8 @@ Message* SessionBase::parseMessage()
     Common::error( "Received invalid command \"%s\"!", messageHeader.command );
     return new Message();
   }
-  // Payload size upper limit
-  if( messageHeader.size > (int)MAX_PAYLOAD_SIZE )
+  // Payload size limits; the size says how much of the buffer is consumed, it can't be negative
+  if( messageHeader.size < 0 || messageHeader.size > (int)MAX_PAYLOAD_SIZE )
   {
     Common::error( "Received invalid message payload size %d, it should have been at most %d!", messageHeader.size, MAX_PAYLOAD_SIZE );
     return new Message();
@@ -121,36 +523,21 @@ Message* SessionBase::parseMessage()
     return NULL;
   }
 
-  // Make the message and pass to it only the message-specific data
+  // Let the session refuse the message before creating it
+  if( ! acceptMessage( type, messageHeaderSize + messageHeader.size ) )
+  {
+    __sync_fetch_and_add( &statistics_.messagesDropped, 1 );
+    consumeBuffer( messageHeaderSize + messageHeader.size );
+    isDropped = true;
+    return NULL;
+  }
 
-  Message* message = NULL;
+  // Make the message and pass to it only the message-specific data
 
-  switch( type )
+  Message* message = createMessage( type );
+  if( message == NULL )
   {
-    case Message::MSG_HELLO:
-      message = new HelloMessage();
-      break;
-    case Message::MSG_BYE:
-      message = new ByeMessage();
-      break;
-    case Message::MSG_NICKNAME:
-      message = new NicknameMessage();
-      break;
-    case Message::MSG_STATUS:
-      message = new StatusMessage();
-      break;
-    case Message::MSG_CHAT:
-      message = new ChatMessage();
-      break;
-    case Message::MSG_FILE_REQUEST:
-      message = new FileTransferMessage();
-      break;
-    case Message::MSG_FILE_DATA:
-      message = new FileDataMessage();
-      break;
-    default:
-      Common::error( "Could not create the message. Invalid type %d", type );
-      return new Message();
+    return new Message();
   }
 
   // Position in the buffer where the first payload byte is located
@@ -166,20 +553,19 @@ Message* SessionBase::parseMessage()
   // Message is OK, move the rest of the buffer data at the start of the buffer
   // so the next one can be read
 
-  messageOffset_ += message->size();
+  // Older peers may send shorter payloads than this version would
+  messageOffset_ += messageHeader.size;
+  consumeBuffer( messageOffset_ );
 
-  int remainder = MAX_MESSAGE_SIZE - messageOffset_;
-  char* remainderBuffer = static_cast<char*>( malloc( remainder ) );
-  memcpy( remainderBuffer, buffer_ + messageOffset_, remainder );
+  return message;
+}
 
-  // Also zero it out so it's clearer where messages end
-  memset( buffer_, '\0', MAX_MESSAGE_SIZE );
-  memcpy( buffer_, remainderBuffer, remainder );
-  bufferOffset_ -= messageOffset_;
 
-  free( remainderBuffer );
 
-  return message;
+bool SessionBase::peerAddress( sockaddr_in& address ) const
+{
+  socklen_t addressSize = sizeof( address );
+  return ( getpeername( socket_, reinterpret_cast<sockaddr*>( &address ), &addressSize ) == 0 );
 }
 
 
@@ -189,27 +575,30 @@ void* SessionBase::pollForData( void* thisPointer )
   // Get access to the owner instance
   SessionBase* self = static_cast<SessionBase*>( thisPointer );
 
-  // Poll for both read and write events
-  pollfd watched;
-  watched.fd = self->socket_;
-  watched.events = POLLIN | POLLOUT;
+  self->pollingThread_ = pthread_self();
 
-  // Polling will end after this timeout is reached..
-  timespec timeout;
-  timeout.tv_sec = 1;
-  timeout.tv_nsec = 0; // 1.0s
+  // Poll the socket for both read and write events, and the wake up event for other threads' requests
+  pollfd watched[ 2 ];
+  watched[ 0 ].fd = self->socket_;
+  watched[ 0 ].events = POLLIN | POLLOUT;
+  watched[ 1 ].fd = self->wakeUpEvent_;
+  watched[ 1 ].events = POLLIN;
 
-  // ..or a signal is caught
+  // There is no timeout: timers and other threads use the wake up event.
+  // Polling will also end when a signal is caught
   sigset_t set;
   sigemptyset( &set );
   pthread_sigmask( SIG_BLOCK, NULL, &set );
+  const timespec noWait = { 0, 0 };
 
 
-  bool hasError = false;
+  // Imported sessions may already have some messages to process
+  bool hasError = self->processBuffer();
 
   // Start the data transfer loop:
   // end when we have to disconnect and all pending messages have been sent
-  while( ! hasError && ( ! self->disconnectionFlag_ || self->sendingQueue_.size() > 0 ) )
+  while( ! hasError && ! self->suspensionFlag_ && ! self->abortionFlag_
+      && ( ! self->disconnectionFlag_ || self->hasPendingOutput() ) )
   {
 /*
     Common::debug( "** pollForData(): %s; %d in send queue; %d in receive queue",
@@ -224,19 +613,35 @@ void* SessionBase::pollForData( void* thisPointer )
 #endif
 */
 
-    // If there is nothing to send, don't poll for the availability of a write operation
-    if( self->sendingQueue_.size() > 0 )
+    bool isShakingHands = ( self->tls_ != NULL && ! self->isHandshakeDone_ );
+    bool hasBufferedInput = false;
+
+    watched[ 0 ].events = 0;
+    if( isShakingHands )
     {
-      watched.events = POLLIN | POLLOUT;
+      // Nothing else can be sent or received before the handshake is over
+      watched[ 0 ].events = self->tlsWantsWrite_ ? POLLOUT : POLLIN;
     }
     else
     {
-      watched.events = POLLIN;
+      // If there is nothing to send, don't poll for the availability of a write operation
+      if( self->hasPendingOutput() )
+      {
+        watched[ 0 ].events |= POLLOUT;
+      }
+      // Leave incoming data alone while the session doesn't want more of it
+      if( self->canReceiveData() )
+      {
+        watched[ 0 ].events |= POLLIN;
+
+        // OpenSSL may hold decrypted data which is not in the socket anymore
+        hasBufferedInput = ( self->tls_ != NULL && SSL_pending( self->tls_ ) > 0 );
+      }
     }
 
-    int ready = ppoll( &watched, 1, &timeout, &set );
+    int ready = ppoll( watched, 2, hasBufferedInput ? &noWait : NULL, &set );
 
-    if( ready == 0 )
+    if( ready == 0 && ! hasBufferedInput )
     {
       continue;
     }
@@ -246,31 +651,56 @@ void* SessionBase::pollForData( void* thisPointer )
       hasError = true;
     }
 
-    if( watched.revents & POLLERR )
+    // Reset the wake up event; the reason to wake up is checked by the loop and cycle()
+    if( watched[ 1 ].revents & POLLIN )
+    {
+      uint64_t wakeUps;
+      if( read( self->wakeUpEvent_, &wakeUps, sizeof( wakeUps ) ) < 0 && errno != EAGAIN )
+      {
+        Common::error( "Session 0x%X: Unable to read the wake up event: %s", self, strerror( errno ) );
+      }
+    }
+
+    if( watched[ 0 ].revents & POLLERR )
     {
       Common::error( "Session 0x%X: error: Unspecified error condition", self );
       hasError = true;
     }
-    if( watched.revents & POLLHUP )
+    if( watched[ 0 ].revents & POLLHUP )
     {
       Common::error( "Session 0x%X: error: Remote end hanged up", self );
       hasError = true;
     }
-    if( watched.revents & POLLNVAL )
+    if( watched[ 0 ].revents & POLLNVAL )
     {
       Common::error( "Session 0x%X: error: Socket is closed", self );
       hasError = true;
     }
-    if( watched.revents & POLLIN )
-    {
-      hasError = self->readData();
-    }
-    if( watched.revents & POLLOUT )
+    if( hasBufferedInput )
     {
-      hasError = self->writeData();
+      watched[ 0 ].revents |= POLLIN;
     }
 
-    if( hasError )
+    if( ! hasError && isShakingHands )
+    {
+      if( watched[ 0 ].revents & ( POLLIN | POLLOUT ) )
+      {
+        hasError = self->shakeHands();
+      }
+    }
+    else
+    {
+      if( ! hasError && ( watched[ 0 ].revents & POLLIN ) )
+      {
+        hasError = self->readData();
+      }
+      if( ! hasError && ( watched[ 0 ].revents & POLLOUT ) )
+      {
+        hasError = self->writeData();
+      }
+    }
+
+    if( hasError )
     {
       self->disconnectionFlag_ = true;
     }
@@ -280,65 +710,107 @@ void* SessionBase::pollForData( void* thisPointer )
     }
   }
 
+  // Suspended sessions are left alive for their new owner
+  if( self->suspensionFlag_ && ! hasError && ! self->abortionFlag_ )
+  {
+    return NULL;
+  }
+
   delete self;
 
   return NULL; // Unused value
 }
 
 
-bool SessionBase::readData()
+bool SessionBase::processBuffer()
 {
-//   Common::debug( "Session 0x%X: Receiving data...", this );
+  // Extract all the complete messages which have arrived
+  bool hasError = false;
+  int messageHeaderSize = sizeof( MessageHeader );
+  while( bufferOffset_ >= messageHeaderSize )
+  {
+    bool isDropped;
+    Message* message = parseMessage( isDropped );
 
-  int readBytes = recv( socket_,
-                        buffer_ + bufferOffset_,
-                        MAX_MESSAGE_SIZE - bufferOffset_,
-                        0 );
+    if( isDropped )
+    {
+      continue;
+    }
 
-  if( readBytes == 0 )
-  {
-    Common::debug( "Session 0x%X: Nothing was read. Socket closed?", this );
-    return true;
+    // There is not enough data yet for this kind of message
+    if( message == NULL )
+    {
+      break;
+    }
+
+    // The returned message isn't valid, something bad happened
+    if( message->type() == Message::MSG_INVALID )
+    {
+      delete message;
+      hasError = true;
+      break;
+    }
+
+    receivingQueue_.push_back( message );
+    statistics_.messagesIn++;
   }
-  else if( readBytes < 0 )
+
+  if( receivingQueue_.size() > 0 )
   {
-    Common::error( "Session 0x%X: Socket was closed!", this );
-    return true;
+    availableMessages();
   }
 
-  bufferOffset_ += readBytes;
+  return hasError;
+}
 
-  // Received data is shorter than the minimum message size, cannot be a valid message
-  int messageHeaderSize = sizeof( MessageHeader );
-  if( bufferOffset_ < messageHeaderSize )
-  {
-    Common::debug( "Not enough data yet. Got %d out of %d minimum.", bufferOffset_, messageHeaderSize );
-    return false;
-  }
 
-#ifdef NETWORK_DEBUG
-  Common::printData( buffer_, bufferOffset_, true, "Incoming data" );
-#endif
 
-  Message* message = parseMessage();
+bool SessionBase::readData()
+{
+//   Common::debug( "Session 0x%X: Receiving data...", this );
 
-  // There is not enough data yet for this kind of message
-  if( message == NULL )
+  int readBytes;
+  if( tls_ != NULL )
   {
-    return false;
+    readBytes = SSL_read( tls_, buffer_ + bufferOffset_, MAX_MESSAGE_SIZE - bufferOffset_ );
+    if( readBytes <= 0 )
+    {
+      return hasTlsFailed( readBytes, "Unable to receive data" );
+    }
   }
-
-  // The returned message isn't valid, something bad happened
-  if( message->type() == Message::MSG_INVALID )
+  else
   {
-    delete message;
-    return true;
+    readBytes = recv( socket_,
+                      buffer_ + bufferOffset_,
+                      MAX_MESSAGE_SIZE - bufferOffset_,
+                      0 );
+
+    if( readBytes == 0 )
+    {
+      Common::debug( "Session 0x%X: Nothing was read. Socket closed?", this );
+      return true;
+    }
+    else if( readBytes < 0 )
+    {
+      // Non-blocking sockets may have nothing to give yet
+      if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+      {
+        return false;
+      }
+
+      Common::error( "Session 0x%X: Socket was closed!", this );
+      return true;
+    }
   }
 
-  receivingQueue_.push_back( message );
-  availableMessages();
+  bufferOffset_ += readBytes;
+  statistics_.bytesIn += readBytes;
 
-  return false;
+#ifdef NETWORK_DEBUG
+  Common::printData( buffer_, bufferOffset_, true, "Incoming data" );
+#endif
+
+  return processBuffer();
 }
 
 
@@ -350,44 +822,136 @@ Message* SessionBase::receiveMessage()
     return NULL;
   }
 
-  Message* message = receivingQueue_.back();
-  receivingQueue_.pop_back();
+  Message* message = receivingQueue_.front();
+  receivingQueue_.pop_front();
 
   return message;
 }
 
 
 
-bool SessionBase::sendMessage( Message* message )
+bool SessionBase::replaceOldestMessage( Message* message )
 {
-  if( sendingQueue_.size() > MAX_NETWORK_MESSAGE_QUEUE )
+  bool isReplaced = false;
+
+  pthread_mutex_lock( &queueMutex_ );
+
+  std::list<Message*>::iterator it;
+  for( it = sendingQueue_.begin(); it != sendingQueue_.end(); it++ )
   {
-    return false;
+    if( (*it)->type() == message->type() )
+    {
+      delete (*it);
+      sendingQueue_.erase( it );
+      sendingQueue_.push_back( message );
+      isReplaced = true;
+      break;
+    }
   }
 
-  sendingQueue_.push_back( message );
-  return true;
+  pthread_mutex_unlock( &queueMutex_ );
+
+  return isReplaced;
 }
 
 
 
+int SessionBase::secondsBehind()
+{
+  time_t since = behindSince_;
+  if( since == 0 )
+  {
+    return 0;
+  }
+
+  return time( NULL ) - since;
+}
+
+
 
-bool SessionBase::writeData()
+bool SessionBase::sendMessage( Message* message, const bool canSpill, bool* isSpilled )
 {
-//   Common::debug( "Session 0x%X: Sending queued data...", this );
+  bool isQueued = true;
+  bool isInSpill = false;
+  bool wasIdle = false;
+
+  pthread_mutex_lock( &queueMutex_ );
 
-  if( sendingQueue_.size() == 0 )
+  // Don't let new messages overtake the spilled ones
+  if( spillWriteOffset_ > spillReadOffset_ )
   {
-    Common::debug( "Session 0x%X: Nothing to send", this );
-    return false;
+    isQueued = isInSpill = spill( message );
+  }
+  else if( sendingQueue_.size() > MAX_NETWORK_MESSAGE_QUEUE )
+  {
+    if( behindSince_ == 0 )
+    {
+      behindSince_ = time( NULL );
+    }
+
+    isQueued = isInSpill = ( canSpill && spill( message ) );
   }
+  else
+  {
+    sendingQueue_.push_back( message );
+    wasIdle = ( sendingQueue_.size() == 1 );
+  }
+
+  pthread_mutex_unlock( &queueMutex_ );
 
-  Message* message = sendingQueue_.front();
-  sendingQueue_.pop_front();
+  // The session thread may be sleeping without watching for writes: when the queue is
+  // not empty, it's either watching already or it has been woken up by whoever filled it
+  if( wasIdle && ! isSessionThread() )
+  {
+    wakeUp();
+  }
 
+  if( isSpilled != NULL )
+  {
+    *isSpilled = isInSpill;
+  }
+
+  if( ! isQueued )
+  {
+    // Other threads may be sending messages to this session at the same time
+    __sync_fetch_and_add( &statistics_.messagesDropped, 1 );
+  }
+
+  return isQueued;
+}
+
+
+
+char* SessionBase::serializeMessage( const Message* message, int& frameSize, const bool withFileData )
+{
   // Get the message payload
   int payloadSize = message->size();
-  char* payload = message->toRawBytes();
+  int rawSize = payloadSize;
+  char* payload;
+
+  const FileDataMessage* dataMessage = NULL;
+  if( message->type() == Message::MSG_FILE_DATA )
+  {
+    dataMessage = static_cast<const FileDataMessage*>( message );
+  }
+
+  if( ! withFileData && dataMessage != NULL && dataMessage->file() != -1 )
+  {
+    // The data will follow the frame straight from the file
+    payload = dataMessage->toRawHeader();
+    rawSize = payloadSize - dataMessage->bufferSize();
+  }
+  else
+  {
+    payload = message->toRawBytes();
+  }
+
+  // Already serialized messages are sent as they are
+  if( message->type() == Message::MSG_RAW )
+  {
+    frameSize = payloadSize;
+    return payload;
+  }
 
   // Generate the header
   MessageHeader header;
@@ -397,27 +961,366 @@ bool SessionBase::writeData()
   strncpy( header.command, Message::command( message->type() ), COMMAND_SIZE );
   header.size = payloadSize;
 
-  int sendBufferSize = headerSize + payloadSize;
-  char* sendBuffer = static_cast<char*>( malloc( sendBufferSize ) );
-  memcpy( sendBuffer, &header, headerSize );
+  frameSize = headerSize + rawSize;
+  char* frame = static_cast<char*>( malloc( frameSize ) );
+  memcpy( frame, &header, headerSize );
+
+  // If there's any payload, add it to the frame
+  if( rawSize > 0 )
+  {
+    memcpy( frame + headerSize, payload, rawSize );
+  }
+
+  free( payload );
+
+  return frame;
+}
+
+
+
+bool SessionBase::shakeHands()
+{
+  int result = SSL_do_handshake( tls_ );
+  if( result != 1 )
+  {
+    return hasTlsFailed( result, "TLS handshake failed" );
+  }
+
+  isHandshakeDone_ = true;
+
+  // OpenSSL has already tried to hand the keys over to the kernel
+  isKernelTlsSending_ = BIO_get_ktls_send( SSL_get_wbio( tls_ ) );
+  bool isKernelTlsReceiving = BIO_get_ktls_recv( SSL_get_rbio( tls_ ) );
+
+  Common::debug( "Session 0x%X: %s connection established; %s encrypts, %s decrypts", this,
+                 SSL_get_version( tls_ ),
+                 isKernelTlsSending_ ? "the kernel" : "OpenSSL",
+                 isKernelTlsReceiving ? "the kernel" : "OpenSSL" );
+
+  return false;
+}
+
+
+
+bool SessionBase::spill( Message* message )
+{
+  if( spillFile_ < 0 )
+  {
+    // The file has no name, it vanishes with the session
+    spillFile_ = open( SPILL_DIRECTORY, O_TMPFILE | O_RDWR, 0600 );
+    if( spillFile_ < 0 )
+    {
+      Common::error( "Session 0x%X: Unable to create a spill file: %s", this, strerror( errno ) );
+      return false;
+    }
+  }
+
+  int frameSize;
+  char* frame = serializeMessage( message, frameSize );
+
+  // A session which keeps spilling never starts over: only count what wasn't sent yet
+  if( spillWriteOffset_ - spillReadOffset_ + frameSize > SPILL_MAX_SIZE )
+  {
+    free( frame );
+    return false;
+  }
+
+  ssize_t writtenBytes = pwrite( spillFile_, frame, frameSize, spillWriteOffset_ );
+  free( frame );
+
+  if( writtenBytes != frameSize )
+  {
+    Common::error( "Session 0x%X: Unable to spill a message: %s", this, strerror( errno ) );
+    return false;
+  }
+
+  spillWriteOffset_ += frameSize;
+  delete message;
+
+  return true;
+}
+
+
+
+bool SessionBase::startTls( SSL_CTX* context, const bool isServer )
+{
+  tls_ = SSL_new( context );
+  if( tls_ == NULL || SSL_set_fd( tls_, socket_ ) != 1 )
+  {
+    Tls::logErrors( "Unable to set up TLS" );
+    SSL_free( tls_ );
+    tls_ = NULL;
+    return false;
+  }
+
+  // Clients speak first
+  if( isServer )
+  {
+    SSL_set_accept_state( tls_ );
+  }
+  else
+  {
+    SSL_set_connect_state( tls_ );
+  }
+  tlsWantsWrite_ = ! isServer;
+
+  // A blocking socket could stall the session in the middle of a record
+  int flags = fcntl( socket_, F_GETFL );
+  if( flags == -1 || fcntl( socket_, F_SETFL, flags | O_NONBLOCK ) == -1 )
+  {
+    Common::error( "Session 0x%X: Unable to make the socket non-blocking: %s", this, strerror( errno ) );
+  }
+
+  return true;
+}
+
+
+
+void SessionBase::statistics( Statistics& statistics ) const
+{
+  statistics = statistics_;
+  statistics.queueDepth = sendingQueue_.size();
+}
+
+
+
+void SessionBase::suspend()
+{
+  suspensionFlag_ = true;
+  wakeUp();
+}
+
+
+
+bool SessionBase::takeOutput()
+{
+  if( sendingQueue_.size() > 0 )
+  {
+    Message* message = sendingQueue_.front();
+    sendingQueue_.pop_front();
+
+    // File data goes from the page cache to the socket, without copying it here first
+    FileDataMessage* dataMessage = NULL;
+    if( message->type() == Message::MSG_FILE_DATA && canWriteDirectly() )
+    {
+      dataMessage = static_cast<FileDataMessage*>( message );
+    }
+
+    if( dataMessage != NULL && dataMessage->file() != -1 )
+    {
+      sendBuffer_ = serializeMessage( message, sendBufferSize_, false );
+      sendFileOffset_ = dataMessage->filePosition();
+      sendFileSize_ = dataMessage->bufferSize();
+      sendFile_ = dataMessage->releaseFile();
+    }
+    else
+    {
+      sendBuffer_ = serializeMessage( message, sendBufferSize_ );
+    }
+
+    statistics_.messagesOut++;
+
+    delete message;
+  }
+  else if( spillWriteOffset_ > spillReadOffset_ )
+  {
+    // Spilled data is already serialized, send it in big chunks
+    int size = spillWriteOffset_ - spillReadOffset_;
+    if( size > MAX_MESSAGE_SIZE )
+    {
+      size = MAX_MESSAGE_SIZE;
+    }
+
+    sendBuffer_ = static_cast<char*>( malloc( size ) );
+    ssize_t readBytes = pread( spillFile_, sendBuffer_, size, spillReadOffset_ );
+    if( readBytes <= 0 )
+    {
+      Common::error( "Session 0x%X: Unable to read the spilled messages: %s", this, strerror( errno ) );
+      free( sendBuffer_ );
+      sendBuffer_ = NULL;
+      spillReadOffset_ = spillWriteOffset_;
+    }
+    else
+    {
+      sendBufferSize_ = readBytes;
+      spillReadOffset_ += readBytes;
+
+      // Don't let the file grow forever while it's being filled as fast as it's sent
+      off_t sentSize = spillReadOffset_ - spillReadOffset_ % SPILL_RELEASE_SIZE;
+      if( sentSize > spillReadOffset_ - readBytes )
+      {
+        fallocate( spillFile_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, sentSize );
+      }
+    }
+
+    // Everything was read back, start over
+    if( spillReadOffset_ >= spillWriteOffset_ )
+    {
+      ftruncate( spillFile_, 0 );
+      spillReadOffset_ = 0;
+      spillWriteOffset_ = 0;
+    }
+  }
+
+  sendBufferOffset_ = 0;
 
-  // If there's any payload, add it to the send buffer
-  if( payloadSize > 0 )
+  // The session has caught up
+  if( behindSince_ != 0 && spillWriteOffset_ == 0 && sendingQueue_.size() <= MAX_NETWORK_MESSAGE_QUEUE / 2 )
   {
-    memcpy( sendBuffer + headerSize, payload, payloadSize );
+    behindSince_ = 0;
   }
 
+  return ( sendBuffer_ != NULL );
+}
+
+
+
+bool SessionBase::writeData()
+{
+//   Common::debug( "Session 0x%X: Sending queued data...", this );
+
+  // Prepare the next message, unless the previous one still has to be completely sent
+  if( sendBuffer_ == NULL && sendFile_ == -1 )
+  {
+    pthread_mutex_lock( &queueMutex_ );
+    bool hasOutput = takeOutput();
+    pthread_mutex_unlock( &queueMutex_ );
+
+    if( ! hasOutput )
+    {
+      Common::debug( "Session 0x%X: Nothing to send", this );
+      return false;
+    }
+
 #ifdef NETWORK_DEBUG
-  Common::printData( sendBuffer, sendBufferSize, false, "Sent message" );
+    Common::printData( sendBuffer_, sendBufferSize_, false, "Sent message" );
 #endif
+  }
 
-  send( socket_, sendBuffer, sendBufferSize, 0 );
+  // The headers of file data may have been sent already
+  if( sendBuffer_ == NULL )
+  {
+    return writeFileData();
+  }
 
-  free( sendBuffer );
-  free( payload );
-  delete message;
+  int sentBytes;
+  if( tls_ != NULL )
+  {
+    // A partially written record must be retried with the same data, which stays in the send buffer
+    sentBytes = SSL_write( tls_, sendBuffer_ + sendBufferOffset_, sendBufferSize_ - sendBufferOffset_ );
+    if( sentBytes <= 0 )
+    {
+      return hasTlsFailed( sentBytes, "Unable to send data" );
+    }
+  }
+  else
+  {
+    // Don't get killed by SIGPIPE if the other end has gone away.
+    // When file data follows, let it share the packets with the headers
+    sentBytes = send( socket_,
+                      sendBuffer_ + sendBufferOffset_,
+                      sendBufferSize_ - sendBufferOffset_,
+                      MSG_NOSIGNAL | ( sendFile_ != -1 ? MSG_MORE : 0 ) );
+
+    if( sentBytes < 0 )
+    {
+      // The socket buffer is full, try again later
+      if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+      {
+        return false;
+      }
+
+      Common::error( "Session 0x%X: Unable to send data: %s", this, strerror( errno ) );
+      return true;
+    }
+  }
+
+  sendBufferOffset_ += sentBytes;
+  statistics_.bytesOut += sentBytes;
+
+  if( sendBufferOffset_ < sendBufferSize_ )
+  {
+    return false;
+  }
+
+  free( sendBuffer_ );
+  sendBuffer_ = NULL;
+  sendBufferSize_ = 0;
+  sendBufferOffset_ = 0;
+
+  if( sendFile_ != -1 )
+  {
+    return writeFileData();
+  }
 
   return false;
 }
 
 
+
+bool SessionBase::writeFileData()
+{
+  ssize_t sentBytes;
+  if( tls_ != NULL )
+  {
+    // Only called when the kernel encrypts the data
+    sentBytes = SSL_sendfile( tls_, sendFile_, sendFileOffset_, sendFileSize_, 0 );
+    if( sentBytes <= 0 )
+    {
+      return hasTlsFailed( sentBytes, "Unable to send file data" );
+    }
+
+    sendFileOffset_ += sentBytes;
+  }
+  else
+  {
+    sentBytes = sendfile( socket_, sendFile_, &sendFileOffset_, sendFileSize_ );
+    if( sentBytes < 0 )
+    {
+      // The socket buffer is full, try again later
+      if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+      {
+        return false;
+      }
+
+      Common::error( "Session 0x%X: Unable to send file data: %s", this, strerror( errno ) );
+      return true;
+    }
+
+    // The frame can't be completed anymore
+    if( sentBytes == 0 )
+    {
+      Common::error( "Session 0x%X: Unable to send file data: the file has shrunk", this );
+      return true;
+    }
+  }
+
+  sendFileSize_ -= sentBytes;
+  statistics_.bytesOut += sentBytes;
+
+  if( sendFileSize_ == 0 )
+  {
+    close( sendFile_ );
+    sendFile_ = -1;
+  }
+
+  return false;
+}
+
+
+
+SSL_CTX* SessionBase::tlsContext() const
+{
+  return ( tls_ != NULL ) ? SSL_get_SSL_CTX( tls_ ) : NULL;
+}
+
+
+
+void SessionBase::wakeUp()
+{
+  uint64_t one = 1;
+  if( write( wakeUpEvent_, &one, sizeof( one ) ) < 0 && errno != EAGAIN )
+  {
+    Common::error( "Session 0x%X: Unable to wake up the session: %s", this, strerror( errno ) );
+  }
+}
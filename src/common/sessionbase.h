@@ -13,44 +13,233 @@
 
 #include "message.h"
 
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
 #include <list>
 
 
+/**
+ * @def SPILL_DIRECTORY
+ *
+ * Where the messages which don't fit in the sending queue of a session are spilled.
+ */
+#define SPILL_DIRECTORY   "/tmp"
+
+
+/**
+ * @def SPILL_MAX_SIZE
+ *
+ * Maximum amount of bytes a session can have spilled to disk.
+ */
+#define SPILL_MAX_SIZE   ( 64 * 1024 * 1024 )
+
+
+/**
+ * @def SPILL_RELEASE_SIZE
+ *
+ * Amount of bytes sent from the spill file after which their disk space is given back,
+ * while more messages keep being spilled.
+ */
+#define SPILL_RELEASE_SIZE   ( 1024 * 1024 )
+
+
 
 class SessionBase
 {
+  public:
+
+    /// Traffic counters of a session
+    struct Statistics
+    {
+      uint64_t bytesIn;
+      uint64_t bytesOut;
+      uint64_t messagesIn;
+      uint64_t messagesOut;
+      /// Messages which were refused, either incoming or outgoing
+      uint64_t messagesDropped;
+      /// Messages waiting to be sent
+      int queueDepth;
+      /// When the session has started
+      time_t startTime;
+    };
+
+
   public:
 
     SessionBase( const int socket );
     virtual ~SessionBase();
 
+    /**
+     * Return whether messages can be sent.
+     *
+     * It's safe to call it from other threads.
+     */
+    virtual bool canSendMessages();
+
+    /**
+     * Return whether the socket can be written to directly, for example with sendfile().
+     *
+     * It can when the connection is in clear text, or when it's encrypted by the kernel.
+     */
+    bool canWriteDirectly() const;
+
     virtual void disconnect();
     bool isConnected() const;
+    bool isEncrypted() const;
+
+    /**
+     * Close the connection as soon as possible, without sending the queued messages.
+     *
+     * Unlike disconnect(), it's safe to call it from other threads.
+     */
+    void dropConnection();
+
+    /**
+     * Get the address of the other end of the connection.
+     *
+     * @return false on error, with errno set
+     */
+    bool peerAddress( sockaddr_in& address ) const;
+
+    /**
+     * Make the session thread check its state again.
+     *
+     * The thread sleeps until something happens on the connection: it must be woken up
+     * when anything else needs its attention. It's safe to call it from other threads.
+     */
+    void wakeUp();
+
+    /**
+     * Take the state of a suspended session, to move it elsewhere.
+     *
+     * The data is moved out of the session: importState() gives it back.
+     *
+     * @note The caller is responsible of free()ing the returned buffers.
+     * @param input Set to a copy of the received data which wasn't processed yet
+     * @param inputSize Set to the size of the input buffer
+     * @param output Set to the serialized data which wasn't sent yet
+     * @param outputSize Set to the size of the output buffer
+     * @param isDisconnecting Set to whether the session was closing
+     * @return The session socket
+     */
+    int exportState( char*& input, int& inputSize, char*& output, int& outputSize, bool& isDisconnecting );
+
+    /**
+     * Continue a session from a state taken with exportState().
+     *
+     * Must be called before the session thread is (re)started.
+     */
+    void importState( const char* input, const int inputSize, const char* output, const int outputSize, const bool isDisconnecting );
+
+    /**
+     * Encrypt the connection with TLS.
+     *
+     * The session thread does the handshake before exchanging any message.
+     * Must be called before the session thread is started.
+     *
+     * @param isServer Whether to wait for the other end to start the handshake
+     * @return false on error
+     */
+    bool startTls( SSL_CTX* context, const bool isServer );
+
+    /**
+     * Get the settings of the encrypted connection, to open more connections like it.
+     *
+     * @return NULL if the connection is in clear text
+     */
+    SSL_CTX* tlsContext() const;
+
+    /**
+     * Stop the session thread without closing the connection.
+     *
+     * The session is not deleted when its thread ends, so its state can be taken.
+     */
+    void suspend();
+
+    /**
+     * Queue a message in place of the oldest queued message of the same type.
+     *
+     * @return False if there are no messages of that type to replace
+     */
+    bool replaceOldestMessage( Message* message );
+
+    /**
+     * Return for how many seconds the sending queue has been full, or 0 if it isn't.
+     */
+    int secondsBehind();
 
     /**
      * Send a message.
-     * @return False if the queue is full
+     *
+     * Once a message has been spilled, all following ones are spilled as well
+     * until the spilled data has been sent, so their order is kept.
+     *
+     * @param message The message to send
+     * @param canSpill If the queue is full, write the message to disk rather than refusing it
+     * @param isSpilled If not NULL, set to whether the message was written to disk
+     * @return False if the message could not be queued nor spilled; the caller still owns it
      */
-    bool sendMessage( Message* message );
+    bool sendMessage( Message* message, const bool canSpill = false, bool* isSpilled = NULL );
+
+    /**
+     * Get the traffic counters of the session.
+     */
+    void statistics( Statistics& statistics ) const;
 
 
   public:
 
     static void* pollForData( void* thisPointer );
 
+    /**
+     * Convert a message into the data which is sent through the network, header included.
+     *
+     * @note The caller is responsible of free()ing the buffer after its use.
+     * @param message The message to convert
+     * @param frameSize Set to the size of the returned buffer
+     * @param withFileData Whether to include file data which is not held in memory;
+     *                     without it, the frame ends where that data would start
+     * @return The serialized message
+     */
+    static char* serializeMessage( const Message* message, int& frameSize, const bool withFileData = true );
+
+    /**
+     * Convert a frame made by serializeMessage() back into a message.
+     *
+     * @return A new message, or NULL if the frame isn't valid
+     */
+    static Message* deserializeMessage( const char* frame, const int frameSize );
+
 
   protected:
 
+    /**
+     * Decide whether a received message should be processed or dropped.
+     *
+     * It's called as soon as a complete message has arrived, before anything is
+     * allocated for it, so refusing a message is cheap.
+     *
+     * @return false to drop the message
+     */
+    virtual bool acceptMessage( Message::Type type, const int size );
+
     /**
      * New data is incoming and may be processed.
      */
     virtual void availableMessages() = 0;
 
     /**
-     * Return whether messages can be sent.
-     * @return bool
+     * Return whether more data can be read from the socket.
+     *
+     * When not, the data is left within the OS buffers, and the remote end will
+     * be slowed down by TCP itself.
      */
-    virtual bool canSendMessages();
+    virtual bool canReceiveData();
 
     /**
      * Take a message from the received message list.
@@ -59,6 +248,11 @@ class SessionBase
      */
     Message* receiveMessage();
 
+    /**
+     * Return whether the caller is running within the session thread.
+     */
+    bool isSessionThread() const;
+
     /**
      * Invoked every time the class does anything.
      *
@@ -69,15 +263,34 @@ class SessionBase
 
   private:
 
+    /**
+     * Remove some bytes from the start of the data buffer.
+     */
+    void consumeBuffer( const int size );
+
     /**
      * Identifies a received message within the data buffer.
      *
+     * @param isDropped Set to true if a message was found but it was refused by acceptMessage()
      * @return
-     *  NULL if no messages are available yet;
+     *  NULL if no messages are available yet, or if it was dropped;
      *  an instance of the proper Message subclass if a good message is found;
      *  an instance of an invalid Message in case of error
      */
-    Message* parseMessage();
+    Message* parseMessage( bool& isDropped );
+
+    /**
+     * Extract all the complete messages from the data buffer, and process them.
+     * @return true on error
+     */
+    bool processBuffer();
+
+    /**
+     * Create an empty message of the given type, to be filled from the network.
+     *
+     * @return NULL if the type is not valid
+     */
+    static Message* createMessage( const Message::Type type );
 
     /**
      * Read some data from the socket.
@@ -85,15 +298,71 @@ class SessionBase
      */
     bool readData();
 
+    /**
+     * Continue the TLS handshake, as far as the socket allows.
+     * @return true on error
+     */
+    bool shakeHands();
+
     /**
      * Write queued messages to the socket.
+     *
+     * Sockets may be non-blocking: a message which could only be partially sent
+     * is kept in the send buffer, and its remainder is sent at the next call.
+     *
      * @return true on error
      */
     bool writeData();
 
+    /**
+     * Send what remains of the file data following the frame just written.
+     *
+     * The data goes from the file to the socket within the kernel.
+     *
+     * @return true on error
+     */
+    bool writeFileData();
+
+    /**
+     * Return whether there is any outgoing data still to be written.
+     */
+    bool hasPendingOutput() const;
+
+    /**
+     * Check the outcome of a failed OpenSSL call on the connection.
+     *
+     * @param result Value returned by the call
+     * @param action What was being done, to log errors
+     * @return false if the call only has to be repeated when the socket is ready
+     */
+    bool hasTlsFailed( const int result, const char* action );
+
+    /**
+     * Append a message to the spill file, and delete it.
+     *
+     * @note The queue mutex must be locked by the caller.
+     * @return false if the message could not be spilled, for example because SPILL_MAX_SIZE bytes
+     *         are waiting to be sent already
+     */
+    bool spill( Message* message );
+
+    /**
+     * Take the oldest queued message, or the next piece of the spill file.
+     *
+     * @note The queue mutex must be locked by the caller.
+     * @return true if there was anything to send
+     */
+    bool takeOutput();
+
 
   private:
 
+    /// Set by dropConnection()
+    bool abortionFlag_;
+
+    /// When the sending queue has become full, or 0
+    time_t behindSince_;
+
     char* buffer_;
 
     /// Total amount of unread bytes in the buffer
@@ -101,12 +370,65 @@ class SessionBase
 
     bool disconnectionFlag_;
 
+    /// Whether the TLS handshake is over, if the connection is encrypted
+    bool isHandshakeDone_;
+
+    /// Whether the kernel encrypts the outgoing data
+    bool isKernelTlsSending_;
+
+    bool suspensionFlag_;
+
+    /// Thread running pollForData()
+    pthread_t pollingThread_;
+
     std::list<Message*> receivingQueue_;
 
+    /// Guards the sending queue and the spill file, which are used by other threads too
+    pthread_mutex_t queueMutex_;
+
     std::list<Message*> sendingQueue_;
 
+    /// Message being currently written to the socket, if any
+    char* sendBuffer_;
+
+    /// Amount of bytes in the send buffer
+    int sendBufferSize_;
+
+    /// Amount of bytes of the send buffer which were already written
+    int sendBufferOffset_;
+
+    /// File holding the data to send after the send buffer, or -1
+    int sendFile_;
+
+    /// Position in the file of the next byte to send
+    off_t sendFileOffset_;
+
+    /// Amount of bytes of the file still to send
+    size_t sendFileSize_;
+
     int socket_;
 
+    /// Temporary file holding the spilled messages, or -1
+    int spillFile_;
+
+    /// Position of the next spilled byte to send
+    off_t spillReadOffset_;
+
+    /// Amount of bytes spilled
+    off_t spillWriteOffset_;
+
+    /// Traffic counters
+    Statistics statistics_;
+
+    /// TLS connection state, or NULL for clear text connections
+    SSL* tls_;
+
+    /// Whether the handshake is waiting for the socket to be writable, rather than readable
+    bool tlsWantsWrite_;
+
+    /// Event file descriptor, polled with the socket so other threads can wake the session
+    int wakeUpEvent_;
+
 
 };
 
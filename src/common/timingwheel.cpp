@@ -0,0 +1,310 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "timingwheel.h"
+
+#include "common.h"
+
+#include <string.h>
+
+
+#define TIMING_WHEEL_MASK   ( TIMING_WHEEL_SLOTS - 1 )
+
+
+
+TimingWheel::Timer::Timer( Callback callback, void* data, const int event )
+: callback( callback )
+, data( data )
+, event( event )
+, expiry( 0 )
+, isScheduled( false )
+, next( NULL )
+, previous( NULL )
+, slot( NULL )
+{
+}
+
+
+
+TimingWheel::TimingWheel()
+: isStopping_( false )
+, nextWakeUp_( 0 )
+, thread_( 0 )
+, tick_( 0 )
+, timersCount_( 0 )
+{
+  memset( slots_, '\0', sizeof( slots_ ) );
+
+  pthread_mutex_init( &mutex_, NULL );
+
+  // Waits are measured on the same clock as the ticks
+  pthread_condattr_t attributes;
+  pthread_condattr_init( &attributes );
+  pthread_condattr_setclock( &attributes, CLOCK_MONOTONIC );
+  pthread_cond_init( &newTimer_, &attributes );
+  pthread_condattr_destroy( &attributes );
+
+  clock_gettime( CLOCK_MONOTONIC, &startTime_ );
+}
+
+
+
+TimingWheel::~TimingWheel()
+{
+  if( thread_ != 0 )
+  {
+    pthread_mutex_lock( &mutex_ );
+    isStopping_ = true;
+    pthread_cond_signal( &newTimer_ );
+    pthread_mutex_unlock( &mutex_ );
+
+    pthread_join( thread_, NULL );
+  }
+
+  pthread_cond_destroy( &newTimer_ );
+  pthread_mutex_destroy( &mutex_ );
+}
+
+
+
+void TimingWheel::cancel( Timer* timer )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  if( timer->isScheduled )
+  {
+    unlink( timer );
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+int TimingWheel::cascade( const int level )
+{
+  int index = ( tick_ >> ( TIMING_WHEEL_SLOT_BITS * level ) ) & TIMING_WHEEL_MASK;
+
+  Timer* timer = slots_[ level ][ index ];
+  slots_[ level ][ index ] = NULL;
+
+  while( timer != NULL )
+  {
+    Timer* next = timer->next;
+    insert( timer );
+    timer = next;
+  }
+
+  return index;
+}
+
+
+
+void TimingWheel::insert( Timer* timer )
+{
+  // Timers which are late go in the slot being processed
+  if( timer->expiry < tick_ )
+  {
+    timer->expiry = tick_;
+  }
+
+  // Timers too far in the future are fired at the farthest possible tick
+  const uint64_t range = 1ULL << ( TIMING_WHEEL_SLOT_BITS * TIMING_WHEEL_LEVELS );
+  if( timer->expiry - tick_ >= range )
+  {
+    timer->expiry = tick_ + range - 1;
+  }
+
+  // The further the expiry, the coarser the level
+  uint64_t delta = timer->expiry - tick_;
+  int level = 0;
+  while( level < TIMING_WHEEL_LEVELS - 1 && delta >= ( 1ULL << ( TIMING_WHEEL_SLOT_BITS * ( level + 1 ) ) ) )
+  {
+    level++;
+  }
+
+  int index = ( timer->expiry >> ( TIMING_WHEEL_SLOT_BITS * level ) ) & TIMING_WHEEL_MASK;
+  Timer** slot = &slots_[ level ][ index ];
+
+  timer->slot = slot;
+  timer->previous = NULL;
+  timer->next = *slot;
+  if( *slot != NULL )
+  {
+    (*slot)->previous = timer;
+  }
+  *slot = timer;
+}
+
+
+
+uint64_t TimingWheel::now() const
+{
+  timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  uint64_t milliseconds = ( now.tv_sec - startTime_.tv_sec ) * 1000LL
+                        + ( now.tv_nsec - startTime_.tv_nsec ) / 1000000;
+
+  return milliseconds / TIMING_WHEEL_TICK;
+}
+
+
+
+void* TimingWheel::run( void* thisPointer )
+{
+  TimingWheel* self = static_cast<TimingWheel*>( thisPointer );
+
+  pthread_mutex_lock( &self->mutex_ );
+
+  while( ! self->isStopping_ )
+  {
+    // Catch up with all the ticks which have passed
+    uint64_t current = self->now();
+    while( self->tick_ <= current )
+    {
+      int index = self->tick_ & TIMING_WHEEL_MASK;
+
+      // A whole turn of a level was completed, refill it from the level above
+      if( index == 0 )
+      {
+        for( int level = 1; level < TIMING_WHEEL_LEVELS && self->cascade( level ) == 0; level++ )
+        {
+        }
+      }
+
+      Timer* timer = self->slots_[ 0 ][ index ];
+      self->slots_[ 0 ][ index ] = NULL;
+
+      while( timer != NULL )
+      {
+        Timer* next = timer->next;
+
+        timer->isScheduled = false;
+        timer->slot = NULL;
+        timer->next = NULL;
+        self->timersCount_--;
+
+        timer->callback( timer->data, timer->event );
+
+        timer = next;
+      }
+
+      self->tick_++;
+    }
+
+    // Nothing to do until a timer is scheduled
+    if( self->timersCount_ == 0 )
+    {
+      self->nextWakeUp_ = 0;
+      pthread_cond_wait( &self->newTimer_, &self->mutex_ );
+      continue;
+    }
+
+    // Sleep until the next non empty slot, or until the next cascade
+    uint64_t next = self->tick_;
+    while( ( next & TIMING_WHEEL_MASK ) != 0 && self->slots_[ 0 ][ next & TIMING_WHEEL_MASK ] == NULL )
+    {
+      next++;
+    }
+
+    self->nextWakeUp_ = next;
+
+    uint64_t milliseconds = next * TIMING_WHEEL_TICK;
+    timespec wakeUpTime = self->startTime_;
+    wakeUpTime.tv_sec += milliseconds / 1000;
+    wakeUpTime.tv_nsec += ( milliseconds % 1000 ) * 1000000;
+    if( wakeUpTime.tv_nsec >= 1000000000 )
+    {
+      wakeUpTime.tv_sec++;
+      wakeUpTime.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait( &self->newTimer_, &self->mutex_, &wakeUpTime );
+  }
+
+  pthread_mutex_unlock( &self->mutex_ );
+
+  return NULL;
+}
+
+
+
+void TimingWheel::schedule( Timer* timer, const int milliseconds )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  if( timer->isScheduled )
+  {
+    unlink( timer );
+  }
+
+  // The clock of an empty wheel can just jump forward, there's nothing to cascade
+  uint64_t current = now();
+  if( timersCount_ == 0 && tick_ <= current )
+  {
+    tick_ = current + 1;
+  }
+
+  int ticks = ( milliseconds + TIMING_WHEEL_TICK - 1 ) / TIMING_WHEEL_TICK;
+  timer->expiry = current + ( ticks > 0 ? ticks : 1 );
+  timer->isScheduled = true;
+  timersCount_++;
+
+  insert( timer );
+
+  // Wake up the thread if it's going to sleep past the new timer
+  if( nextWakeUp_ == 0 || timer->expiry < nextWakeUp_ )
+  {
+    pthread_cond_signal( &newTimer_ );
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+bool TimingWheel::start()
+{
+  int result = pthread_create( &thread_, NULL, &TimingWheel::run, this );
+  if( result != 0 )
+  {
+    Common::error( "Unable to start the timers thread: error %d", result );
+    thread_ = 0;
+    return false;
+  }
+
+  return true;
+}
+
+
+
+void TimingWheel::unlink( Timer* timer )
+{
+  if( timer->previous != NULL )
+  {
+    timer->previous->next = timer->next;
+  }
+  else
+  {
+    *timer->slot = timer->next;
+  }
+
+  if( timer->next != NULL )
+  {
+    timer->next->previous = timer->previous;
+  }
+
+  timer->isScheduled = false;
+  timer->slot = NULL;
+  timer->next = NULL;
+  timer->previous = NULL;
+  timersCount_--;
+}
@@ -0,0 +1,172 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/**
+ * @def TIMING_WHEEL_TICK
+ *
+ * Resolution of the timers, in milliseconds.
+ */
+#define TIMING_WHEEL_TICK   100
+
+
+/**
+ * @def TIMING_WHEEL_SLOT_BITS
+ *
+ * Each level of the wheel has 2^TIMING_WHEEL_SLOT_BITS slots.
+ */
+#define TIMING_WHEEL_SLOT_BITS   6
+
+
+/**
+ * @def TIMING_WHEEL_LEVELS
+ *
+ * Number of levels of the wheel. Each level covers TIMING_WHEEL_SLOT_BITS more bits of
+ * ticks than the previous one: with 4 levels of 64 slots, timers can be set up to ~19 days ahead.
+ */
+#define TIMING_WHEEL_LEVELS   4
+
+
+#define TIMING_WHEEL_SLOTS   ( 1 << TIMING_WHEEL_SLOT_BITS )
+
+
+
+/**
+ * @class TimingWheel
+ *
+ * Hierarchical timing wheel: many timers are handled by a single thread, and
+ * scheduling or cancelling one takes constant time however many there are.
+ *
+ * The thread only wakes up when a timer is due, or when the timers of a level have
+ * to be moved to the level below; when there are no timers it doesn't wake up at all.
+ *
+ * Callbacks are called from the wheel thread, with the wheel locked: they must be
+ * quick (for example, set a flag and wake up another thread), and can't use the wheel.
+ * In exchange, once cancel() has returned the callback of a timer is not running
+ * and won't be called, so its owner can be safely deleted.
+ */
+class TimingWheel
+{
+  public:
+
+    typedef void (*Callback)( void* data, const int event );
+
+    /// A timer. Its owner keeps it, usually within itself, as long as it's scheduled
+    struct Timer
+    {
+      Timer( Callback callback, void* data, const int event = 0 );
+
+      Callback callback;
+      void* data;
+      /// Passed to the callback, to tell apart the timers of the same owner
+      int event;
+
+      // Managed by the wheel
+
+      /// Tick when the timer expires
+      uint64_t expiry;
+      bool isScheduled;
+      Timer* next;
+      Timer* previous;
+      /// List which contains the timer
+      Timer** slot;
+    };
+
+
+  public:
+
+    TimingWheel();
+    ~TimingWheel();
+
+    /**
+     * Stop a timer, if it's scheduled.
+     */
+    void cancel( Timer* timer );
+
+    /**
+     * Start a timer, or move it if it's already scheduled.
+     *
+     * @param milliseconds Time after which the callback is called; it's rounded up to the next tick
+     */
+    void schedule( Timer* timer, const int milliseconds );
+
+    /**
+     * Start the thread which calls the expired timers.
+     */
+    bool start();
+
+
+  private:
+
+    /**
+     * Move the timers of a slot of a higher level to the lower levels.
+     *
+     * @return The slot index, so the caller knows whether to cascade the next level too
+     */
+    int cascade( const int level );
+
+    /**
+     * Put a timer in the slot matching its expiry.
+     */
+    void insert( Timer* timer );
+
+    /**
+     * Get the current time, in ticks.
+     */
+    uint64_t now() const;
+
+    /**
+     * Remove a timer from its slot.
+     */
+    void unlink( Timer* timer );
+
+    static void* run( void* thisPointer );
+
+
+  private:
+
+    /// Whether the thread should end
+    bool isStopping_;
+
+    pthread_mutex_t mutex_;
+
+    /// Signaled when a timer is scheduled earlier than the thread was going to wake up
+    pthread_cond_t newTimer_;
+
+    /// Tick when the thread will wake up next, or 0 if it's waiting for a timer
+    uint64_t nextWakeUp_;
+
+    /// Lists of timers of each level and slot
+    Timer* slots_[ TIMING_WHEEL_LEVELS ][ TIMING_WHEEL_SLOTS ];
+
+    /// Start of the clock of the wheel
+    timespec startTime_;
+
+    pthread_t thread_;
+
+    /// Next tick to be processed
+    uint64_t tick_;
+
+    /// Number of scheduled timers
+    int timersCount_;
+
+
+};
+
+
+
+#endif // TIMINGWHEEL_H
@@ -0,0 +1,129 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tls.h"
+
+#include "common.h"
+
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <signal.h>
+
+
+
+/**
+ * Forward an OpenSSL error line to the log.
+ */
+static int logError( const char* string, size_t length, void* what )
+{
+  Common::error( "%s: %.*s", static_cast<const char*>( what ), (int)length, string );
+  return 1;
+}
+
+
+
+SSL_CTX* Tls::createClientContext( const char* caFile, const char* serverName )
+{
+  SSL_CTX* context = createContext( TLS_client_method() );
+  if( context == NULL )
+  {
+    return NULL;
+  }
+
+  bool isLoaded = ( caFile != NULL ) ? SSL_CTX_load_verify_locations( context, caFile, NULL )
+                                     : SSL_CTX_set_default_verify_paths( context );
+  if( ! isLoaded )
+  {
+    logErrors( "Unable to load the trusted certificates" );
+    SSL_CTX_free( context );
+    return NULL;
+  }
+
+  // The certificate must be valid for the address the user typed in
+  X509_VERIFY_PARAM* parameters = SSL_CTX_get0_param( context );
+  in_addr address;
+  if( inet_aton( serverName, &address ) )
+  {
+    X509_VERIFY_PARAM_set1_ip_asc( parameters, serverName );
+  }
+  else
+  {
+    X509_VERIFY_PARAM_set1_host( parameters, serverName, 0 );
+  }
+
+  SSL_CTX_set_verify( context, SSL_VERIFY_PEER, NULL );
+
+  return context;
+}
+
+
+
+SSL_CTX* Tls::createContext( const SSL_METHOD* method )
+{
+  // OpenSSL writes to the socket without MSG_NOSIGNAL: don't get killed when the other end goes away
+  signal( SIGPIPE, SIG_IGN );
+
+  SSL_CTX* context = SSL_CTX_new( method );
+  if( context == NULL )
+  {
+    logErrors( "Unable to create the TLS context" );
+    return NULL;
+  }
+
+  SSL_CTX_set_min_proto_version( context, TLS1_2_VERSION );
+
+  // Let the kernel encrypt after the handshake, when it can.
+  // Peers closing the connection without notice are as good as the ones which say goodbye
+  SSL_CTX_set_options( context, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF );
+
+  // Sessions keep partially written messages around and retry them later
+  SSL_CTX_set_mode( context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+
+  return context;
+}
+
+
+
+SSL_CTX* Tls::createServerContext( const char* certificateFile, const char* keyFile )
+{
+  SSL_CTX* context = createContext( TLS_server_method() );
+  if( context == NULL )
+  {
+    return NULL;
+  }
+
+  if( SSL_CTX_use_certificate_chain_file( context, certificateFile ) != 1
+  ||  SSL_CTX_use_PrivateKey_file( context, keyFile, SSL_FILETYPE_PEM ) != 1
+  ||  SSL_CTX_check_private_key( context ) != 1 )
+  {
+    logErrors( "Unable to load the server certificate" );
+    SSL_CTX_free( context );
+    return NULL;
+  }
+
+  // Clients never resume sessions; the tickets would only be extra records to decrypt
+  SSL_CTX_set_num_tickets( context, 0 );
+
+  return context;
+}
+
+
+
+void Tls::logErrors( const char* what )
+{
+  if( ERR_peek_error() == 0 )
+  {
+    Common::error( "%s", what );
+    return;
+  }
+
+  ERR_print_errors_cb( &logError, const_cast<char*>( what ) );
+}
@@ -0,0 +1,67 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+
+
+
+/**
+ * @class Tls
+ *
+ * Setup of the encrypted connections between clients and servers.
+ *
+ * The contexts ask OpenSSL to hand the encryption over to the kernel after the
+ * handshake, when the system allows it: then the connection can be written to with
+ * sendfile(), and the data doesn't need to go through user space to be encrypted.
+ * Otherwise, sessions fall back to encrypting it themselves.
+ */
+class Tls
+{
+
+  public:
+
+    /**
+     * Create the context for the clients to connect to.
+     *
+     * @return NULL if the certificate or the key could not be loaded
+     */
+    static SSL_CTX* createServerContext( const char* certificateFile, const char* keyFile );
+
+    /**
+     * Create the context to connect to a server.
+     *
+     * @param caFile Certificate to trust, like the server's own self-signed one; if NULL, the system ones are used
+     * @param serverName Address or host name the server certificate must be valid for
+     * @return NULL on error
+     */
+    static SSL_CTX* createClientContext( const char* caFile, const char* serverName );
+
+    /**
+     * Log and clear the errors queued by OpenSSL.
+     */
+    static void logErrors( const char* what );
+
+
+  private:
+
+    /**
+     * Apply the settings shared by clients and servers.
+     */
+    static SSL_CTX* createContext( const SSL_METHOD* method );
+
+
+};
+
+
+
+#endif // TLS_H
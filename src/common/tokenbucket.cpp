@@ -0,0 +1,96 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tokenbucket.h"
+
+
+
+TokenBucket::TokenBucket( const double rate, const double burst )
+{
+  reset( rate, burst );
+}
+
+
+
+void TokenBucket::charge( const double amount )
+{
+  refill();
+  tokens_ -= amount;
+}
+
+
+
+bool TokenBucket::consume( const double amount )
+{
+  refill();
+
+  if( tokens_ < amount )
+  {
+    return false;
+  }
+
+  tokens_ -= amount;
+  return true;
+}
+
+
+
+bool TokenBucket::hasTokens()
+{
+  refill();
+  return ( tokens_ > 0 );
+}
+
+
+
+int TokenBucket::millisecondsToTokens()
+{
+  refill();
+
+  if( tokens_ > 0 )
+  {
+    return 0;
+  }
+
+  // Round up, so the bucket has something in it by then
+  return static_cast<int>( -tokens_ / rate_ * 1000.0 ) + 1;
+}
+
+
+
+void TokenBucket::refill()
+{
+  timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  double elapsed =   ( now.tv_sec  - lastRefill_.tv_sec  )
+                   + ( now.tv_nsec - lastRefill_.tv_nsec ) / 1000000000.0;
+
+  lastRefill_ = now;
+
+  tokens_ += elapsed * rate_;
+  if( tokens_ > burst_ )
+  {
+    tokens_ = burst_;
+  }
+}
+
+
+
+void TokenBucket::reset( const double rate, const double burst )
+{
+  rate_ = rate;
+  burst_ = burst;
+  tokens_ = burst;
+
+  clock_gettime( CLOCK_MONOTONIC, &lastRefill_ );
+}
+
+
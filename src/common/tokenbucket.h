@@ -0,0 +1,82 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <time.h>
+
+
+
+/**
+ * @class TokenBucket
+ *
+ * Simple rate limiter: tokens are added at a constant rate, up to a maximum burst,
+ * and each operation takes some away.
+ *
+ * No locking is done; callers must serialize access.
+ */
+class TokenBucket
+{
+
+  public:
+
+    TokenBucket( const double rate = 1.0, const double burst = 1.0 );
+
+    /**
+     * Take some tokens away without checking whether they are available.
+     *
+     * The bucket may go in debt; it won't give out tokens until the debt is paid off.
+     */
+    void charge( const double amount );
+
+    /**
+     * Take some tokens away, if enough are available.
+     *
+     * @return false if there aren't enough tokens
+     */
+    bool consume( const double amount = 1.0 );
+
+    /**
+     * Return whether the bucket is not in debt.
+     */
+    bool hasTokens();
+
+    /**
+     * Return how many milliseconds it will take for the debt to be paid off, or 0 if there is none.
+     */
+    int millisecondsToTokens();
+
+    /**
+     * Change the rate and the burst size, and fill up the bucket.
+     */
+    void reset( const double rate, const double burst );
+
+
+  private:
+
+    void refill();
+
+
+  private:
+
+    double burst_;
+    double rate_;
+    double tokens_;
+
+    /// Last time tokens were added
+    timespec lastRefill_;
+
+
+};
+
+
+
+#endif // TOKENBUCKET_H
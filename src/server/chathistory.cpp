@@ -0,0 +1,137 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "chathistory.h"
+
+#include "common.h"
+#include "protocol.h"
+#include "rawmessage.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+
+
+ChatHistory::ChatHistory()
+: count_( 0 )
+, first_( 0 )
+, totalSize_( 0 )
+{
+  int result = pthread_mutex_init( &mutex_, NULL );
+  if( result != 0 )
+  {
+    Common::fatal( "Chat history mutex creation failed: error %d", result );
+  }
+
+  for( int i = 0; i < CHAT_HISTORY_SIZE; i++ )
+  {
+    entries_[ i ].frame = NULL;
+    entries_[ i ].size = 0;
+  }
+}
+
+
+
+ChatHistory::~ChatHistory()
+{
+  for( int i = 0; i < CHAT_HISTORY_SIZE; i++ )
+  {
+    free( entries_[ i ].frame );
+  }
+
+  pthread_mutex_destroy( &mutex_ );
+}
+
+
+
+void ChatHistory::add( const char* frame, const int size )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  Entry* entry;
+  if( count_ < CHAT_HISTORY_SIZE )
+  {
+    entry = &entries_[ ( first_ + count_ ) % CHAT_HISTORY_SIZE ];
+    count_++;
+  }
+  else
+  {
+    // Overwrite the oldest message
+    entry = &entries_[ first_ ];
+    first_ = ( first_ + 1 ) % CHAT_HISTORY_SIZE;
+  }
+
+  // Keep each entry just as big as its message
+  totalSize_ -= entry->size;
+  entry->frame = static_cast<char*>( realloc( entry->frame, size ) );
+  entry->size = size;
+  totalSize_ += size;
+
+  memcpy( entry->frame, frame, size );
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+RawMessage* ChatHistory::replay()
+{
+  pthread_mutex_lock( &mutex_ );
+
+  if( count_ == 0 )
+  {
+    pthread_mutex_unlock( &mutex_ );
+    return NULL;
+  }
+
+  // Put all the messages one after the other, so they're sent with a single write
+  char* frames = static_cast<char*>( malloc( totalSize_ ) );
+  int offset = 0;
+
+  for( int i = 0; i < count_; i++ )
+  {
+    const Entry& entry = entries_[ ( first_ + i ) % CHAT_HISTORY_SIZE ];
+    memcpy( frames + offset, entry.frame, entry.size );
+    offset += entry.size;
+  }
+
+  RawMessage* message = new RawMessage( frames, totalSize_ );
+
+  pthread_mutex_unlock( &mutex_ );
+
+  free( frames );
+
+  return message;
+}
+
+
+void ChatHistory::restore( const char* frames, const int size )
+{
+  int offset = 0;
+  int headerSize = sizeof( MessageHeader );
+
+  while( ( offset + headerSize ) <= size )
+  {
+    MessageHeader header;
+    memcpy( &header, frames + offset, headerSize );
+
+    int frameSize = headerSize + header.size;
+    if( header.size < 0 || ( offset + frameSize ) > size )
+    {
+      Common::error( "Invalid history data at offset %d", offset );
+      break;
+    }
+
+    add( frames + offset, frameSize );
+    offset += frameSize;
+  }
+}
+
+
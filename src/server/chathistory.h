@@ -0,0 +1,90 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CHATHISTORY_H
+#define CHATHISTORY_H
+
+#include <pthread.h>
+
+
+/**
+ * @def CHAT_HISTORY_SIZE
+ *
+ * Number of chat messages which are kept to be shown to new users.
+ */
+#define CHAT_HISTORY_SIZE   50
+
+
+class RawMessage;
+
+
+
+/**
+ * @class ChatHistory
+ *
+ * Ring of the most recent chat messages, already serialized so they can
+ * be sent to new users without any more work.
+ */
+class ChatHistory
+{
+
+  public:
+
+    ChatHistory();
+    ~ChatHistory();
+
+    /**
+     * Store a serialized message, replacing the oldest one if the history is full.
+     */
+    void add( const char* frame, const int size );
+
+    /**
+     * Get all the stored messages, oldest first, in a single message.
+     *
+     * @return A new message, or NULL if there is no history yet
+     */
+    RawMessage* replay();
+
+    /**
+     * Store all the messages contained in a buffer taken with replay().
+     */
+    void restore( const char* frames, const int size );
+
+
+  private:
+
+    struct Entry
+    {
+      char* frame;
+      int size;
+    };
+
+
+  private:
+
+    /// Number of used entries
+    int count_;
+
+    Entry entries_[ CHAT_HISTORY_SIZE ];
+
+    /// Index of the oldest entry
+    int first_;
+
+    pthread_mutex_t mutex_;
+
+    /// Total size of the stored messages
+    int totalSize_;
+
+
+};
+
+
+
+#endif // CHATHISTORY_H
@@ -0,0 +1,582 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "chatlog.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+
+
+/**
+ * Return the current time in milliseconds since the Epoch.
+ */
+static int64_t currentTimestamp()
+{
+  timeval now;
+  gettimeofday( &now, NULL );
+
+  return ( (int64_t)now.tv_sec * 1000 ) + ( now.tv_usec / 1000 );
+}
+
+
+
+/**
+ * Write a whole buffer to a file, even if the system splits the operation.
+ */
+static bool writeAll( const int file, const char* buffer, size_t size )
+{
+  while( size > 0 )
+  {
+    ssize_t written = write( file, buffer, size );
+    if( written < 0 )
+    {
+      if( errno == EINTR )
+      {
+        continue;
+      }
+      return false;
+    }
+
+    buffer += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+
+
+ChatLog::ChatLog()
+: indexFile_( -1 )
+, isOpen_( false )
+, logFile_( -1 )
+, logFileSize_( 0 )
+, nextSequence_( 1 )
+, quitFlag_( false )
+, writerThread_( 0 )
+{
+  *directory_ = '\0';
+
+  pthread_mutex_init( &mutex_, NULL );
+  pthread_mutex_init( &segmentsMutex_, NULL );
+  pthread_cond_init( &pendingCondition_, NULL );
+}
+
+
+
+ChatLog::~ChatLog()
+{
+  close();
+
+  std::list<Record>::iterator it;
+  for( it = pending_.begin(); it != pending_.end(); it++ )
+  {
+    free( (*it).frame );
+  }
+
+  pthread_cond_destroy( &pendingCondition_ );
+  pthread_mutex_destroy( &segmentsMutex_ );
+  pthread_mutex_destroy( &mutex_ );
+}
+
+
+
+uint64_t ChatLog::append( const char* frame, const int size )
+{
+  Record record;
+  record.header.size = size;
+  record.frame = static_cast<char*>( malloc( size ) );
+  memcpy( record.frame, frame, size );
+
+  pthread_mutex_lock( &mutex_ );
+
+  record.header.sequence = nextSequence_++;
+  record.header.timestamp = currentTimestamp();
+
+  // When the log is disabled, sequence numbers are still handed out
+  if( ! isOpen_ )
+  {
+    pthread_mutex_unlock( &mutex_ );
+    free( record.frame );
+    return record.header.sequence;
+  }
+
+  pending_.push_back( record );
+  pthread_cond_signal( &pendingCondition_ );
+
+  pthread_mutex_unlock( &mutex_ );
+
+  return record.header.sequence;
+}
+
+
+
+void ChatLog::close()
+{
+  pthread_mutex_lock( &mutex_ );
+
+  if( ! isOpen_ )
+  {
+    pthread_mutex_unlock( &mutex_ );
+    return;
+  }
+
+  // Let the writer flush all the pending messages before quitting
+  isOpen_ = false;
+  quitFlag_ = true;
+  pthread_cond_signal( &pendingCondition_ );
+  pthread_mutex_unlock( &mutex_ );
+
+  pthread_join( writerThread_, NULL );
+
+  if( logFile_ != -1 )
+  {
+    ::close( logFile_ );
+    logFile_ = -1;
+  }
+  if( indexFile_ != -1 )
+  {
+    ::close( indexFile_ );
+    indexFile_ = -1;
+  }
+}
+
+
+
+const char* ChatLog::directory() const
+{
+  return directory_;
+}
+
+
+
+void ChatLog::compact()
+{
+  int64_t oldestAllowed = currentTimestamp() - ( (int64_t)CHATLOG_RETENTION * 1000 );
+  char path[ MAX_STRING_LENGTH ];
+
+  pthread_mutex_lock( &segmentsMutex_ );
+
+  // The current segment is never deleted
+  while( segments_.size() > 1 )
+  {
+    const Segment& oldest = segments_.front();
+
+    if( segments_.size() <= CHATLOG_MAX_SEGMENTS && oldest.lastTimestamp >= oldestAllowed )
+    {
+      break;
+    }
+
+    Common::debug( "Chat log: deleting segment %" PRIu64, oldest.firstSequence );
+
+    makePath( path, oldest.firstSequence, "log" );
+    unlink( path );
+    makePath( path, oldest.firstSequence, "idx" );
+    unlink( path );
+
+    segments_.pop_front();
+  }
+
+  pthread_mutex_unlock( &segmentsMutex_ );
+}
+
+
+
+bool ChatLog::findEntry( const int indexFile, const uint64_t sequence, IndexEntry& entry )
+{
+  struct stat info;
+  if( fstat( indexFile, &info ) != 0 )
+  {
+    return false;
+  }
+
+  // Ignore any incomplete entry at the end
+  int64_t count = info.st_size / sizeof( IndexEntry );
+  int64_t low = 0;
+  int64_t high = count;
+
+  while( low < high )
+  {
+    int64_t middle = ( low + high ) / 2;
+    IndexEntry current;
+
+    if( pread( indexFile, &current, sizeof( IndexEntry ), middle * sizeof( IndexEntry ) ) != sizeof( IndexEntry ) )
+    {
+      return false;
+    }
+
+    if( current.sequence < sequence )
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  if( low >= count )
+  {
+    return false;
+  }
+
+  return ( pread( indexFile, &entry, sizeof( IndexEntry ), low * sizeof( IndexEntry ) ) == sizeof( IndexEntry ) );
+}
+
+
+
+bool ChatLog::findSegment( const uint64_t sequence, Segment& segment )
+{
+  bool found = false;
+
+  pthread_mutex_lock( &segmentsMutex_ );
+
+  std::deque<Segment>::reverse_iterator it;
+  for( it = segments_.rbegin(); it != segments_.rend(); it++ )
+  {
+    if( (*it).firstSequence <= sequence )
+    {
+      segment = (*it);
+      found = true;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock( &segmentsMutex_ );
+
+  return found;
+}
+
+
+
+void ChatLog::makePath( char* path, const uint64_t firstSequence, const char* extension )
+{
+  snprintf( path, MAX_STRING_LENGTH, "%s/%020" PRIu64 ".%s", directory_, firstSequence, extension );
+}
+
+
+
+uint64_t ChatLog::nextSequence()
+{
+  pthread_mutex_lock( &mutex_ );
+  uint64_t sequence = nextSequence_;
+  pthread_mutex_unlock( &mutex_ );
+
+  return sequence;
+}
+
+
+
+bool ChatLog::open( const char* directory )
+{
+  strncpy( directory_, directory, MAX_PATH_SIZE - 1 );
+  directory_[ MAX_PATH_SIZE - 1 ] = '\0';
+
+  if( mkdir( directory_, 0755 ) != 0 && errno != EEXIST )
+  {
+    Common::error( "Unable to create the chat log directory %s: %s", directory_, strerror( errno ) );
+    return false;
+  }
+
+  DIR* dir = opendir( directory_ );
+  if( dir == NULL )
+  {
+    Common::error( "Unable to read the chat log directory %s: %s", directory_, strerror( errno ) );
+    return false;
+  }
+
+  // Find the existing segments through their indices
+  std::vector<uint64_t> firstSequences;
+  dirent* dirEntry;
+  while( ( dirEntry = readdir( dir ) ) != NULL )
+  {
+    uint64_t firstSequence;
+    char extension[ 4 ];
+    if( sscanf( dirEntry->d_name, "%" SCNu64 ".%3s", &firstSequence, extension ) == 2
+    &&  strcmp( extension, "idx" ) == 0 )
+    {
+      firstSequences.push_back( firstSequence );
+    }
+  }
+  closedir( dir );
+
+  std::sort( firstSequences.begin(), firstSequences.end() );
+
+  char path[ MAX_STRING_LENGTH ];
+  for( size_t i = 0; i < firstSequences.size(); i++ )
+  {
+    makePath( path, firstSequences[ i ], "idx" );
+    int indexFile = ::open( path, O_RDONLY | O_CLOEXEC );
+    if( indexFile == -1 )
+    {
+      continue;
+    }
+
+    struct stat info;
+    fstat( indexFile, &info );
+    int64_t count = info.st_size / sizeof( IndexEntry );
+
+    IndexEntry first, last;
+    if( count > 0
+    &&  pread( indexFile, &first, sizeof( IndexEntry ), 0 ) == sizeof( IndexEntry )
+    &&  pread( indexFile, &last, sizeof( IndexEntry ), ( count - 1 ) * sizeof( IndexEntry ) ) == sizeof( IndexEntry ) )
+    {
+      Segment segment;
+      segment.firstSequence = first.sequence;
+      segment.firstTimestamp = first.timestamp;
+      segment.lastTimestamp = last.timestamp;
+      segments_.push_back( segment );
+
+      // Continue numbering from the last logged message
+      nextSequence_ = last.sequence + 1;
+    }
+
+    ::close( indexFile );
+  }
+
+  Common::debug( "Chat log: found %lu segments in %s, next message is %" PRIu64,
+                 segments_.size(), directory_, nextSequence_ );
+
+  // Messages will be written to a new segment
+  isOpen_ = true;
+  quitFlag_ = false;
+
+  int result = pthread_create( &writerThread_, NULL, &ChatLog::writeRecords, this );
+  if( result != 0 )
+  {
+    Common::error( "Unable to start the chat log thread: error %d", result );
+    isOpen_ = false;
+    return false;
+  }
+
+  return true;
+}
+
+
+
+char* ChatLog::read( const uint64_t sequence, int& size )
+{
+  Segment segment;
+  if( ! findSegment( sequence, segment ) )
+  {
+    return NULL;
+  }
+
+  char path[ MAX_STRING_LENGTH ];
+  makePath( path, segment.firstSequence, "idx" );
+  int indexFile = ::open( path, O_RDONLY | O_CLOEXEC );
+  if( indexFile == -1 )
+  {
+    return NULL;
+  }
+
+  IndexEntry entry;
+  bool found = findEntry( indexFile, sequence, entry ) && entry.sequence == sequence;
+  ::close( indexFile );
+
+  if( ! found )
+  {
+    return NULL;
+  }
+
+  makePath( path, segment.firstSequence, "log" );
+  int logFile = ::open( path, O_RDONLY | O_CLOEXEC );
+  if( logFile == -1 )
+  {
+    return NULL;
+  }
+
+  char* frame = NULL;
+  RecordHeader header;
+  if( pread( logFile, &header, sizeof( RecordHeader ), entry.offset ) == sizeof( RecordHeader )
+  &&  header.sequence == sequence )
+  {
+    frame = static_cast<char*>( malloc( header.size ) );
+    if( pread( logFile, frame, header.size, entry.offset + sizeof( RecordHeader ) ) != header.size )
+    {
+      free( frame );
+      frame = NULL;
+    }
+    size = header.size;
+  }
+
+  ::close( logFile );
+
+  return frame;
+}
+
+
+
+bool ChatLog::startSegment( const uint64_t firstSequence, const int64_t firstTimestamp )
+{
+  if( logFile_ != -1 )
+  {
+    ::close( logFile_ );
+    ::close( indexFile_ );
+    logFile_ = -1;
+    indexFile_ = -1;
+  }
+
+  char path[ MAX_STRING_LENGTH ];
+
+  // A segment left without any index entry by a crash is started over, or the offsets would be wrong
+  makePath( path, firstSequence, "log" );
+  logFile_ = ::open( path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644 );
+
+  makePath( path, firstSequence, "idx" );
+  indexFile_ = ::open( path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644 );
+
+  if( logFile_ == -1 || indexFile_ == -1 )
+  {
+    Common::error( "Unable to create chat log segment %s: %s", path, strerror( errno ) );
+
+    if( logFile_ != -1 )
+    {
+      ::close( logFile_ );
+      logFile_ = -1;
+    }
+    if( indexFile_ != -1 )
+    {
+      ::close( indexFile_ );
+      indexFile_ = -1;
+    }
+    return false;
+  }
+
+  logFileSize_ = 0;
+
+  Segment segment;
+  segment.firstSequence = firstSequence;
+  segment.firstTimestamp = firstTimestamp;
+  segment.lastTimestamp = firstTimestamp;
+
+  pthread_mutex_lock( &segmentsMutex_ );
+  segments_.push_back( segment );
+  pthread_mutex_unlock( &segmentsMutex_ );
+
+  Common::debug( "Chat log: started segment %" PRIu64, firstSequence );
+
+  return true;
+}
+
+
+
+void* ChatLog::writeRecords( void* thisPointer )
+{
+  ChatLog* self = static_cast<ChatLog*>( thisPointer );
+
+  std::list<Record> batch;
+  std::vector<char> buffer;
+  std::vector<IndexEntry> entries;
+
+  pthread_mutex_lock( &self->mutex_ );
+
+  while( true )
+  {
+    while( self->pending_.empty() && ! self->quitFlag_ )
+    {
+      pthread_cond_wait( &self->pendingCondition_, &self->mutex_ );
+    }
+
+    if( self->pending_.empty() )
+    {
+      break;
+    }
+
+    // Take everything which has been queued meanwhile: it will all be synced at once
+    batch.swap( self->pending_ );
+
+    pthread_mutex_unlock( &self->mutex_ );
+
+    const Record& firstRecord = batch.front();
+    bool isSegmentStarted = false;
+    bool isOk = true;
+
+    if( self->logFile_ == -1 || self->logFileSize_ >= CHATLOG_SEGMENT_SIZE )
+    {
+      isOk = self->startSegment( firstRecord.header.sequence, firstRecord.header.timestamp );
+      isSegmentStarted = true;
+    }
+
+    // Lay out the whole batch, so it takes a single write
+    buffer.clear();
+    entries.clear();
+
+    std::list<Record>::iterator it;
+    for( it = batch.begin(); it != batch.end(); it++ )
+    {
+      Record& record = (*it);
+
+      IndexEntry entry;
+      entry.sequence = record.header.sequence;
+      entry.timestamp = record.header.timestamp;
+      entry.offset = self->logFileSize_ + buffer.size();
+      entries.push_back( entry );
+
+      const char* header = reinterpret_cast<const char*>( &record.header );
+      buffer.insert( buffer.end(), header, header + sizeof( RecordHeader ) );
+      buffer.insert( buffer.end(), record.frame, record.frame + record.header.size );
+
+      free( record.frame );
+    }
+
+    // The data is made durable before it's indexed, so the index never points to lost messages
+    if( isOk )
+    {
+      isOk = writeAll( self->logFile_, &buffer[ 0 ], buffer.size() )
+          && fdatasync( self->logFile_ ) == 0
+          && writeAll( self->indexFile_, reinterpret_cast<const char*>( &entries[ 0 ] ), entries.size() * sizeof( IndexEntry ) )
+          && fdatasync( self->indexFile_ ) == 0;
+    }
+
+    if( isOk )
+    {
+      self->logFileSize_ += buffer.size();
+
+      pthread_mutex_lock( &self->segmentsMutex_ );
+      self->segments_.back().lastTimestamp = entries.back().timestamp;
+      pthread_mutex_unlock( &self->segmentsMutex_ );
+    }
+    else
+    {
+      Common::error( "Chat log: unable to write %lu messages: %s", batch.size(), strerror( errno ) );
+
+      // Try again with a fresh segment next time
+      self->logFileSize_ = CHATLOG_SEGMENT_SIZE;
+    }
+
+    batch.clear();
+
+    if( isSegmentStarted )
+    {
+      self->compact();
+    }
+
+    pthread_mutex_lock( &self->mutex_ );
+  }
+
+  pthread_mutex_unlock( &self->mutex_ );
+
+  return NULL; // Unused value
+}
+
+
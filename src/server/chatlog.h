@@ -0,0 +1,226 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CHATLOG_H
+#define CHATLOG_H
+
+#include "common.h"
+#include "protocol.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <list>
+
+
+/**
+ * @def CHATLOG_DIRECTORY
+ *
+ * Default directory where the chat log segments are written, in the home directory of the user.
+ */
+#define CHATLOG_DIRECTORY   ".lanmessenger-chatlog"
+
+
+/**
+ * @def CHATLOG_SEGMENT_SIZE
+ *
+ * A new segment is started when the current one grows beyond this size.
+ */
+#define CHATLOG_SEGMENT_SIZE   ( 16 * 1024 * 1024 )
+
+
+/**
+ * @def CHATLOG_MAX_SEGMENTS
+ *
+ * Older segments are deleted when there are more than this many.
+ */
+#define CHATLOG_MAX_SEGMENTS   64
+
+
+/**
+ * @def CHATLOG_RETENTION
+ *
+ * Segments whose messages are all older than this amount of seconds are deleted.
+ */
+#define CHATLOG_RETENTION   ( 30 * 24 * 60 * 60 )
+
+
+
+/**
+ * @class ChatLog
+ *
+ * Durable, append-only log of the chat messages.
+ *
+ * Messages are appended to a queue and written by a background thread: all the
+ * messages which arrived while the previous batch was being synced are written and
+ * synced together, so logging never slows down the sessions.
+ *
+ * The log is split in segments, each with a file of serialized messages and an
+ * index file of fixed size entries, sorted by sequence number and timestamp.
+ * Each segment is named after the sequence number of its first message.
+ */
+class ChatLog
+{
+
+  public:
+
+    ChatLog();
+    ~ChatLog();
+
+    /**
+     * Add a serialized message to the log.
+     *
+     * @return The sequence number of the message
+     */
+    uint64_t append( const char* frame, const int size );
+
+    /**
+     * Write all pending messages and stop the writing thread.
+     *
+     * Messages appended afterwards only get a sequence number.
+     */
+    void close();
+
+    /**
+     * Where the log is stored.
+     */
+    const char* directory() const;
+
+    /**
+     * Sequence number which the next appended message will get.
+     */
+    uint64_t nextSequence();
+
+    /**
+     * Open the log and start the writing thread.
+     *
+     * @param directory Where the segments are stored; it's created if needed
+     * @return false if the log can't be used
+     */
+    bool open( const char* directory );
+
+    /**
+     * Read a logged message back.
+     *
+     * @note The caller is responsible of free()ing the returned buffer.
+     * @param sequence The sequence number of the message
+     * @param size Set to the size of the returned message
+     * @return The serialized message, or NULL if it isn't in the log (anymore)
+     */
+    char* read( const uint64_t sequence, int& size );
+
+
+  private:
+
+    /// On-disk header of each logged message, followed by the message itself
+    struct RecordHeader
+    {
+      uint64_t sequence;
+      int64_t timestamp;
+      int32_t size;
+    };
+
+    /// On-disk index entry
+    struct IndexEntry
+    {
+      uint64_t sequence;
+      int64_t timestamp;
+      int64_t offset;
+    };
+
+    /// A message waiting to be written
+    struct Record
+    {
+      RecordHeader header;
+      char* frame;
+    };
+
+    struct Segment
+    {
+      uint64_t firstSequence;
+      int64_t firstTimestamp;
+      int64_t lastTimestamp;
+    };
+
+
+  private:
+
+    /**
+     * Delete the segments which are too old or too many.
+     */
+    void compact();
+
+    /**
+     * Find the segment containing a message.
+     *
+     * @return false if no segment contains it
+     */
+    bool findSegment( const uint64_t sequence, Segment& segment );
+
+    /**
+     * Find an index entry by binary search.
+     *
+     * @param indexFile The open index file
+     * @param sequence The sequence number to search
+     * @param entry Set to the first entry whose sequence number is not lower than the given one
+     * @return false if there is no such entry
+     */
+    bool findEntry( const int indexFile, const uint64_t sequence, IndexEntry& entry );
+
+    void makePath( char* path, const uint64_t firstSequence, const char* extension );
+
+    /**
+     * Close the current segment and start a new one.
+     *
+     * @return false on error
+     */
+    bool startSegment( const uint64_t firstSequence, const int64_t firstTimestamp );
+
+    static void* writeRecords( void* thisPointer );
+
+
+  private:
+
+    char directory_[ MAX_PATH_SIZE ];
+
+    int indexFile_;
+
+    bool isOpen_;
+
+    int logFile_;
+
+    /// Size of the current segment
+    int64_t logFileSize_;
+
+    pthread_mutex_t mutex_;
+
+    uint64_t nextSequence_;
+
+    /// Messages waiting to be written
+    std::list<Record> pending_;
+
+    pthread_cond_t pendingCondition_;
+
+    bool quitFlag_;
+
+    /// Existing segments, oldest first; protected by segmentsMutex_
+    std::deque<Segment> segments_;
+
+    pthread_mutex_t segmentsMutex_;
+
+    pthread_t writerThread_;
+
+
+};
+
+
+
+#endif // CHATLOG_H
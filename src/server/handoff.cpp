@@ -0,0 +1,237 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "handoff.h"
+
+#include "common.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/**
+ * @def HANDOFF_MAX_DESCRIPTORS
+ *
+ * Maximum number of file descriptors passed with a single write.
+ */
+#define HANDOFF_MAX_DESCRIPTORS   16
+
+
+
+bool Handoff::isSameUser( const int socket )
+{
+  ucred credentials;
+  socklen_t size = sizeof( ucred );
+  if( getsockopt( socket, SOL_SOCKET, SO_PEERCRED, &credentials, &size ) == -1 )
+  {
+    Common::error( "Unable to identify the other end of the handoff connection: %s", strerror( errno ) );
+    return false;
+  }
+
+  return ( credentials.uid == getuid() );
+}
+
+
+
+bool Handoff::receive( const int socket, void* buffer, const int size )
+{
+  char* data = static_cast<char*>( buffer );
+  int received = 0;
+
+  while( received < size )
+  {
+    int result = recv( socket, data + received, size - received, 0 );
+    if( result == 0 )
+    {
+      return false;
+    }
+    if( result < 0 )
+    {
+      if( errno == EINTR )
+      {
+        continue;
+      }
+      return false;
+    }
+
+    received += result;
+  }
+
+  return true;
+}
+
+
+
+bool Handoff::receiveWithDescriptors( const int socket, void* buffer, const int size, int* descriptors, int& count )
+{
+  char control[ CMSG_SPACE( HANDOFF_MAX_DESCRIPTORS * sizeof( int ) ) ];
+  memset( control, '\0', sizeof( control ) );
+
+  iovec vector;
+  vector.iov_base = buffer;
+  vector.iov_len = size;
+
+  msghdr message;
+  memset( &message, '\0', sizeof( msghdr ) );
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof( control );
+
+  int result;
+  do
+  {
+    result = recvmsg( socket, &message, MSG_CMSG_CLOEXEC );
+  }
+  while( result < 0 && errno == EINTR );
+
+  if( result <= 0 )
+  {
+    return false;
+  }
+
+  // Pick up the descriptors
+  int received = 0;
+  cmsghdr* header;
+  for( header = CMSG_FIRSTHDR( &message ); header != NULL; header = CMSG_NXTHDR( &message, header ) )
+  {
+    if( header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS )
+    {
+      continue;
+    }
+
+    int available = ( header->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+    int* headerDescriptors = reinterpret_cast<int*>( CMSG_DATA( header ) );
+    for( int i = 0; i < available && received < count; i++ )
+    {
+      descriptors[ received++ ] = headerDescriptors[ i ];
+    }
+  }
+  count = received;
+
+  // The descriptors only come with the first byte: the rest of the data may need more reads
+  if( result < size )
+  {
+    return receive( socket, static_cast<char*>( buffer ) + result, size - result );
+  }
+
+  return true;
+}
+
+
+
+bool Handoff::send( const int socket, const void* buffer, const int size )
+{
+  const char* data = static_cast<const char*>( buffer );
+  int sent = 0;
+
+  while( sent < size )
+  {
+    int result = ::send( socket, data + sent, size - sent, MSG_NOSIGNAL );
+    if( result < 0 )
+    {
+      if( errno == EINTR )
+      {
+        continue;
+      }
+      return false;
+    }
+
+    sent += result;
+  }
+
+  return true;
+}
+
+
+
+bool Handoff::sendWithDescriptors( const int socket, const void* buffer, const int size, const int* descriptors, const int count )
+{
+  if( count > HANDOFF_MAX_DESCRIPTORS )
+  {
+    Common::error( "Cannot pass %d descriptors at once", count );
+    return false;
+  }
+
+  char control[ CMSG_SPACE( HANDOFF_MAX_DESCRIPTORS * sizeof( int ) ) ];
+  memset( control, '\0', sizeof( control ) );
+
+  iovec vector;
+  vector.iov_base = const_cast<void*>( buffer );
+  vector.iov_len = size;
+
+  msghdr message;
+  memset( &message, '\0', sizeof( msghdr ) );
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+
+  if( count > 0 )
+  {
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE( count * sizeof( int ) );
+
+    cmsghdr* header = CMSG_FIRSTHDR( &message );
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN( count * sizeof( int ) );
+    memcpy( CMSG_DATA( header ), descriptors, count * sizeof( int ) );
+  }
+
+  int result;
+  do
+  {
+    result = sendmsg( socket, &message, MSG_NOSIGNAL );
+  }
+  while( result < 0 && errno == EINTR );
+
+  if( result < 0 )
+  {
+    return false;
+  }
+
+  // Send whatever didn't fit
+  if( result < size )
+  {
+    return send( socket, static_cast<const char*>( buffer ) + result, size - result );
+  }
+
+  return true;
+}
+
+
+
+bool Handoff::socketPath( const int port, char* path, const int size )
+{
+  char directory[ MAX_PATH_SIZE ];
+  snprintf( directory, MAX_PATH_SIZE, HANDOFF_SOCKET_DIRECTORY, (int)getuid() );
+
+  if( mkdir( directory, 0700 ) == -1 && errno != EEXIST )
+  {
+    Common::error( "Unable to create the handoff directory %s: %s", directory, strerror( errno ) );
+    return false;
+  }
+
+  // Someone else may have created it first: a socket in it could belong to anybody
+  struct stat status;
+  if( lstat( directory, &status ) == -1 || ! S_ISDIR( status.st_mode )
+  ||  status.st_uid != getuid() || ( status.st_mode & ( S_IRWXG | S_IRWXO ) ) != 0 )
+  {
+    Common::error( "The handoff directory %s can be accessed by other users", directory );
+    return false;
+  }
+
+  snprintf( path, size, "%s/" HANDOFF_SOCKET_NAME, directory, port );
+  return true;
+}
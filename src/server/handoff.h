@@ -0,0 +1,139 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "protocol.h"
+
+#include <stdint.h>
+
+
+/**
+ * @def HANDOFF_SOCKET_DIRECTORY
+ *
+ * Directory of the UNIX sockets where the running servers wait for their replacements.
+ * It's formatted with the user id, and only that user may access it.
+ */
+#define HANDOFF_SOCKET_DIRECTORY   "/tmp/lanmessenger-server-%d"
+
+
+/**
+ * @def HANDOFF_SOCKET_NAME
+ *
+ * Name of the UNIX socket where a running server waits for its replacement.
+ * It's formatted with the server port.
+ */
+#define HANDOFF_SOCKET_NAME   "%d.sock"
+
+
+/**
+ * @def HANDOFF_MAGIC
+ *
+ * Identifies the handoff data, and its format version.
+ */
+#define HANDOFF_MAGIC   0x4C4D4803
+
+
+
+/**
+ * @class Handoff
+ *
+ * Transfer of a running server to a new process.
+ *
+ * The old server sends a Header, passing its listening sockets along with it;
+ * then the history data; then, for each session, a Session record along with its
+ * socket, followed by the session's pending input and output data.
+ * The new server confirms to have received everything by sending back a single byte.
+ */
+class Handoff
+{
+
+  public:
+
+    /// Server-wide state
+    struct Header
+    {
+      uint32_t magic;
+      int32_t listenSocketsCount;
+      int32_t sessionsCount;
+      int32_t connectionsCounter;
+      int32_t isFileTransferModeActive;
+      int32_t historySize;
+      uint32_t rosterVersion;
+    };
+
+    /// State of a single session
+    struct Session
+    {
+      char nickName[ MAX_NICKNAME_SIZE ];
+      uint32_t id;
+      int32_t state;
+      int32_t isFileTransferSender;
+      int32_t fileTransferStatus;
+      int32_t hasJoined;
+      int32_t isDisconnecting;
+      int32_t inputSize;
+      int32_t outputSize;
+    };
+
+
+  public:
+
+    /**
+     * Check the process at the other end of a handoff connection belongs to the current user.
+     */
+    static bool isSameUser( const int socket );
+
+    /**
+     * Read exactly the given amount of data.
+     *
+     * @return false on error or if the connection was closed
+     */
+    static bool receive( const int socket, void* buffer, const int size );
+
+    /**
+     * Read exactly the given amount of data, and the file descriptors sent along with it.
+     *
+     * @param descriptors Filled with the received descriptors
+     * @param count The maximum number of descriptors to receive; set to the received amount
+     * @return false on error or if the connection was closed
+     */
+    static bool receiveWithDescriptors( const int socket, void* buffer, const int size, int* descriptors, int& count );
+
+    /**
+     * Write all the given data.
+     *
+     * @return false on error
+     */
+    static bool send( const int socket, const void* buffer, const int size );
+
+    /**
+     * Write all the given data, passing some file descriptors along with it.
+     *
+     * @return false on error
+     */
+    static bool sendWithDescriptors( const int socket, const void* buffer, const int size, const int* descriptors, const int count );
+
+    /**
+     * Get the path of the handoff socket of the server on a port.
+     *
+     * Its directory is created if needed, so that only the current user can access it.
+     *
+     * @return false if the directory can't be created, or other users may access it
+     */
+    static bool socketPath( const int port, char* path, const int size );
+
+
+};
+
+
+
+#endif // HANDOFF_H
@@ -14,8 +14,13 @@
 
 #include <semaphore.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <list>
+
 
 // Semaphore used to quit
 sem_t quitSignal;
@@ -49,15 +54,211 @@ void handleSignal( const int signal )
 
 
 
+void usage( const char* programName )
+{
+  fprintf( stderr, "Usage: %s [-u] [-p port] [-c certificate -k key] [-m group:port] [-s policy[:seconds]] [-d count] [-l directory] [-a secret] [-f port] [-j host:port]...\n", programName );
+  fprintf( stderr, "  -p  Port where clients connect (default: %d).\n", SERVER_PORT );
+  fprintf( stderr, "  -c  Encrypt the client connections with TLS, using the certificate in the given PEM file.\n" );
+  fprintf( stderr, "  -k  PEM file with the private key of the certificate.\n" );
+  fprintf( stderr, "  -m  Send the chat messages once to the given LAN multicast group, like 239.255.76.77:12350,\n" );
+  fprintf( stderr, "      rather than to each client which can join it.\n" );
+  fprintf( stderr, "  -u  Upgrade: take over the clients of the server which is already running, without disconnecting them.\n" );
+  fprintf( stderr, "  -s  What to do when a client can't keep up with the messages sent to it:\n" );
+  fprintf( stderr, "      drop-newest (default), drop-oldest, spill (to disk), or disconnect (after %d seconds, by default).\n", SLOW_CONSUMER_TIMEOUT );
+  fprintf( stderr, "  -d  Data connections each client may open to send or receive a file, besides its session:\n" );
+  fprintf( stderr, "      0 to %d (default: %d).\n", MAX_FILE_STRIPES, SERVER_FILE_STRIPES );
+  fprintf( stderr, "  -l  Directory of the chat log (default: ~/%s, followed by the port if it's not the default one).\n", CHATLOG_DIRECTORY );
+  fprintf( stderr, "  -a  File with the secret shared by the servers of the federation, needed by -f and -j.\n" );
+  fprintf( stderr, "  -f  Port where other servers can link to this one, to form a federation.\n" );
+  fprintf( stderr, "  -j  Link to the server at the given address; can be repeated.\n" );
+}
+
+
+
+/**
+ * Read a slow consumer policy, like "disconnect:30".
+ *
+ * @return false if the policy is not valid
+ */
+bool parseSlowConsumerPolicy( const char* argument, Server::SlowConsumerPolicy& policy, int& timeout )
+{
+  static const char* names[ Server::SLOW_CONSUMER_MAX ] = { "drop-newest", "drop-oldest", "spill", "disconnect" };
+
+  const char* separator = strchr( argument, ':' );
+  int nameLength = ( separator != NULL ) ? ( separator - argument ) : strlen( argument );
+
+  for( int i = 0; i < Server::SLOW_CONSUMER_MAX; i++ )
+  {
+    if( (int)strlen( names[ i ] ) != nameLength || strncmp( argument, names[ i ], nameLength ) != 0 )
+    {
+      continue;
+    }
+
+    policy = static_cast<Server::SlowConsumerPolicy>( i );
+
+    if( separator != NULL )
+    {
+      timeout = atoi( separator + 1 );
+      if( timeout <= 0 )
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+
+
 /**
  * Server application entry point.
  */
 int main( int argc, char* argv[] )
 {
+  // Check command-line arguments
+  bool takeOver = false;
+  int port = SERVER_PORT;
+  int federationPort = 0;
+  std::list<const char*> joinedServers;
+  Server::SlowConsumerPolicy slowConsumerPolicy = Server::SLOW_CONSUMER_DROP_NEWEST;
+  int slowConsumerTimeout = SLOW_CONSUMER_TIMEOUT;
+  int fileStripes = SERVER_FILE_STRIPES;
+  const char* certificateFile = NULL;
+  const char* chatLogDirectory = NULL;
+  const char* federationSecretFile = NULL;
+  const char* keyFile = NULL;
+  const char* multicastGroup = NULL;
+
+  int option;
+  while( ( option = getopt( argc, argv, "a:c:d:f:hj:k:l:m:p:s:u" ) ) != -1 )
+  {
+    switch( option )
+    {
+      case 'a':
+        federationSecretFile = optarg;
+        break;
+      case 'c':
+        certificateFile = optarg;
+        break;
+      case 'd':
+        fileStripes = atoi( optarg );
+        if( fileStripes < 0 || fileStripes > MAX_FILE_STRIPES )
+        {
+          usage( argv[ 0 ] );
+          return 1;
+        }
+        break;
+      case 'f':
+        federationPort = atoi( optarg );
+        break;
+      case 'j':
+        if( strchr( optarg, ':' ) == NULL )
+        {
+          usage( argv[ 0 ] );
+          return 1;
+        }
+        joinedServers.push_back( optarg );
+        break;
+      case 'k':
+        keyFile = optarg;
+        break;
+      case 'l':
+        chatLogDirectory = optarg;
+        break;
+      case 'm':
+        if( strchr( optarg, ':' ) == NULL )
+        {
+          usage( argv[ 0 ] );
+          return 1;
+        }
+        multicastGroup = optarg;
+        break;
+      case 'p':
+        port = atoi( optarg );
+        break;
+      case 's':
+        if( ! parseSlowConsumerPolicy( optarg, slowConsumerPolicy, slowConsumerTimeout ) )
+        {
+          usage( argv[ 0 ] );
+          return 1;
+        }
+        break;
+      case 'u':
+        takeOver = true;
+        break;
+      default:
+        usage( argv[ 0 ] );
+        return 1;
+    }
+  }
+
+  // Both are needed for TLS
+  if( ( certificateFile == NULL ) != ( keyFile == NULL ) )
+  {
+    usage( argv[ 0 ] );
+    return 1;
+  }
+
+  // Links are only accepted from servers which know the secret
+  if( ( federationPort != 0 || joinedServers.size() > 0 ) && federationSecretFile == NULL )
+  {
+    usage( argv[ 0 ] );
+    return 1;
+  }
+
 //   Common::setLogFile( "lanmessenger-server.log" );
   Common::debug( "LAN Messenger server" );
 
   Server* server = new Server();
+  server->setSlowConsumerPolicy( slowConsumerPolicy, slowConsumerTimeout );
+  server->setFileStripes( fileStripes );
+  if( chatLogDirectory != NULL )
+  {
+    server->setChatLogDirectory( chatLogDirectory );
+  }
+
+  if( certificateFile != NULL )
+  {
+    Errors::ErrorCode status = server->setTls( certificateFile, keyFile );
+    if( status != Errors::Error_None )
+    {
+      Common::error( "The certificate could not be loaded: error %d", status );
+
+      delete server;
+      return status;
+    }
+  }
+
+  if( federationSecretFile != NULL )
+  {
+    Errors::ErrorCode status = server->setFederationSecret( federationSecretFile );
+    if( status != Errors::Error_None )
+    {
+      Common::error( "The federation secret could not be loaded: error %d", status );
+
+      delete server;
+      return status;
+    }
+  }
+
+  if( multicastGroup != NULL )
+  {
+    char group[ MAX_PATH_SIZE ];
+    const char* separator = strrchr( multicastGroup, ':' );
+    snprintf( group, MAX_PATH_SIZE, "%.*s", (int)( separator - multicastGroup ), multicastGroup );
+
+    Errors::ErrorCode status = server->setMulticast( group, atoi( separator + 1 ) );
+    if( status != Errors::Error_None )
+    {
+      Common::error( "Chat messages can't be multicast: error %d", status );
+
+      delete server;
+      return status;
+    }
+  }
 
   // Create a semaphore as a quit condition
   sem_init( &quitSignal, 0, 0 );
@@ -70,7 +271,7 @@ int main( int argc, char* argv[] )
   signal( SIGTERM, handleSignal ); // terminate signal
   signal( SIGQUIT, handleSignal ); // quit signal
 
-  Errors::ErrorCode status = server->initialize( "0.0.0.0", SERVER_PORT );
+  Errors::ErrorCode status = server->initialize( "0.0.0.0", port, takeOver );
   if( status != Errors::Error_None )
   {
     Common::error( "Server could not be started: error %d", status );
@@ -79,6 +280,21 @@ int main( int argc, char* argv[] )
     return status;
   }
 
+  std::list<const char*>::iterator it;
+  for( it = joinedServers.begin(); it != joinedServers.end(); it++ )
+  {
+    char host[ MAX_PATH_SIZE ];
+    const char* separator = strrchr( *it, ':' );
+    snprintf( host, MAX_PATH_SIZE, "%.*s", (int)( separator - *it ), *it );
+    server->joinFederation( host, atoi( separator + 1 ) );
+  }
+
+  status = server->startFederation( federationPort );
+  if( status != Errors::Error_None )
+  {
+    Common::error( "Links from other servers can't be accepted: error %d", status );
+  }
+
   // Wait for a quit signal to arrive
   sem_init( &quitSignal, 0, 0 );
   sem_wait( &quitSignal );
@@ -0,0 +1,593 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "multicaster.h"
+
+#include "common.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+
+
+/**
+ * Current time in milliseconds, from an arbitrary point.
+ */
+static long milliseconds()
+{
+  timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+
+
+Multicaster::Multicaster()
+: fileBlocksCount_( 0 )
+, fileBlocksSent_( 0 )
+, fileParitySize_( 0 )
+, fileSenderId_( 0 )
+, fileTransferId_( 0 )
+, isStopping_( false )
+, sequence_( 0 )
+, socket_( -1 )
+, streamId_( 0 )
+{
+  memset( fileBlocks_, '\0', sizeof( fileBlocks_ ) );
+  memset( fileParities_, '\0', sizeof( fileParities_ ) );
+  memset( fileParity_, '\0', MAX_MESSAGE_SIZE );
+  memset( &group_, '\0', sizeof( sockaddr_in ) );
+  memset( history_, '\0', sizeof( history_ ) );
+
+  pthread_mutex_init( &mutex_, NULL );
+  pthread_cond_init( &heartbeatCondition_, NULL );
+}
+
+
+
+Multicaster::~Multicaster()
+{
+  if( socket_ != -1 )
+  {
+    pthread_mutex_lock( &mutex_ );
+    isStopping_ = true;
+    pthread_cond_signal( &heartbeatCondition_ );
+    pthread_mutex_unlock( &mutex_ );
+
+    pthread_join( thread_, NULL );
+    close( socket_ );
+  }
+
+  for( int i = 0; i < MULTICAST_HISTORY_SIZE; i++ )
+  {
+    free( history_[ i ].frame );
+  }
+
+  clearFile();
+
+  pthread_cond_destroy( &heartbeatCondition_ );
+  pthread_mutex_destroy( &mutex_ );
+}
+
+
+
+void Multicaster::acknowledgeFile( const uint32_t clientId, const uint32_t blocksCount )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  std::map<uint32_t,FileReceiver>::iterator it = fileReceivers_.find( clientId );
+  if( it != fileReceivers_.end() && blocksCount > (*it).second.acknowledged && blocksCount <= fileBlocksSent_ )
+  {
+    (*it).second.acknowledged = blocksCount;
+    (*it).second.progressAt = time( NULL );
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+void Multicaster::addFileReceiver( const uint32_t clientId )
+{
+  FileReceiver receiver;
+  receiver.acknowledged = 0;
+  receiver.progressAt = time( NULL );
+
+  pthread_mutex_lock( &mutex_ );
+  fileReceivers_[ clientId ] = receiver;
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+void Multicaster::announce( MulticastMessage* message ) const
+{
+  message->setGroup( group_.sin_addr.s_addr, ntohs( group_.sin_port ), streamId_ );
+}
+
+
+
+bool Multicaster::canReadFileBlocks( const uint32_t clientId, const uint32_t blocksRead )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  bool canRead = true;
+  if( fileTransferId_ != 0 && clientId == fileSenderId_ && ! fileReceivers_.empty() )
+  {
+    uint32_t slowest = fileBlocksSent_;
+    std::map<uint32_t,FileReceiver>::iterator it;
+    for( it = fileReceivers_.begin(); it != fileReceivers_.end(); it++ )
+    {
+      slowest = std::min( slowest, (*it).second.acknowledged );
+    }
+
+    // The next block takes the place of one the slowest receiver already has
+    canRead = ( blocksRead < slowest + MULTICAST_FILE_WINDOW );
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+
+  return canRead;
+}
+
+
+
+void Multicaster::clearFile()
+{
+  for( int i = 0; i < MULTICAST_FILE_WINDOW; i++ )
+  {
+    free( fileBlocks_[ i ].frame );
+  }
+  for( int i = 0; i < MULTICAST_FILE_WINDOW / MULTICAST_FEC_GROUP_SIZE; i++ )
+  {
+    free( fileParities_[ i ].frame );
+  }
+
+  memset( fileBlocks_, '\0', sizeof( fileBlocks_ ) );
+  memset( fileParities_, '\0', sizeof( fileParities_ ) );
+  memset( fileParity_, '\0', MAX_MESSAGE_SIZE );
+
+  fileBlocksCount_ = 0;
+  fileBlocksSent_ = 0;
+  fileParitySize_ = 0;
+  fileReceivers_.clear();
+  fileSenderId_ = 0;
+  fileTransferId_ = 0;
+}
+
+
+
+bool Multicaster::endFile( std::list<uint32_t>& unfinished )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  std::map<uint32_t,FileReceiver>::iterator it;
+  for( it = fileReceivers_.begin(); it != fileReceivers_.end(); it++ )
+  {
+    if( fileBlocksCount_ == 0 || (*it).second.acknowledged < fileBlocksCount_ )
+    {
+      unfinished.push_back( (*it).first );
+    }
+  }
+
+  bool wasSent = ( fileBlocksCount_ > 0 );
+
+  clearFile();
+
+  pthread_mutex_unlock( &mutex_ );
+
+  return wasSent;
+}
+
+
+
+uint32_t Multicaster::fileSenderId()
+{
+  pthread_mutex_lock( &mutex_ );
+  uint32_t senderId = fileSenderId_;
+  pthread_mutex_unlock( &mutex_ );
+
+  return senderId;
+}
+
+
+
+uint32_t Multicaster::fileTransferId()
+{
+  pthread_mutex_lock( &mutex_ );
+  uint32_t transferId = fileTransferId_;
+  pthread_mutex_unlock( &mutex_ );
+
+  return transferId;
+}
+
+
+
+bool Multicaster::isActive() const
+{
+  return ( socket_ != -1 );
+}
+
+
+
+bool Multicaster::isFileDelivered()
+{
+  pthread_mutex_lock( &mutex_ );
+
+  bool isDelivered = ( fileTransferId_ != 0 );
+  if( isDelivered && ! fileReceivers_.empty() )
+  {
+    isDelivered = ( fileBlocksCount_ > 0 );
+
+    std::map<uint32_t,FileReceiver>::iterator it;
+    for( it = fileReceivers_.begin(); isDelivered && it != fileReceivers_.end(); it++ )
+    {
+      isDelivered = ( (*it).second.acknowledged >= fileBlocksCount_ );
+    }
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+
+  return isDelivered;
+}
+
+
+
+void Multicaster::keepFileBlock( FileBlock& block, const uint32_t sequence, const char* frame, const int frameSize )
+{
+  // The slots are reused for the whole file
+  if( block.frame == NULL )
+  {
+    block.frame = static_cast<char*>( malloc( MAX_MESSAGE_SIZE ) );
+  }
+
+  memcpy( block.frame, frame, frameSize );
+  block.frameSize = frameSize;
+  block.sequence = sequence;
+  block.repairedAt = 0;
+}
+
+
+
+uint32_t Multicaster::nextSequence()
+{
+  pthread_mutex_lock( &mutex_ );
+  uint32_t sequence = sequence_ + 1;
+  pthread_mutex_unlock( &mutex_ );
+
+  return sequence;
+}
+
+
+
+void Multicaster::publish( const char* frame, const int frameSize, const uint32_t senderId )
+{
+  if( frameSize > MULTICAST_MAX_FRAME_SIZE )
+  {
+    Common::error( "Message of %d bytes is too big to be multicast", frameSize );
+    return;
+  }
+
+  pthread_mutex_lock( &mutex_ );
+
+  uint32_t sequence = ++sequence_;
+
+  // Take the place of the oldest message
+  Entry& entry = history_[ sequence % MULTICAST_HISTORY_SIZE ];
+  entry.frame = static_cast<char*>( realloc( entry.frame, frameSize ) );
+  memcpy( entry.frame, frame, frameSize );
+  entry.frameSize = frameSize;
+  entry.sequence = sequence;
+  entry.senderId = senderId;
+
+  send( MulticastMessage::DATAGRAM_CHAT, sequence, senderId, frame, frameSize );
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+void Multicaster::publishFileBlock( const char* frame, const int frameSize, const bool isLast )
+{
+  if( frameSize > MAX_MESSAGE_SIZE )
+  {
+    Common::error( "File block of %d bytes is too big to be multicast", frameSize );
+    return;
+  }
+
+  pthread_mutex_lock( &mutex_ );
+
+  if( fileTransferId_ == 0 )
+  {
+    pthread_mutex_unlock( &mutex_ );
+    return;
+  }
+
+  uint32_t sequence = fileBlocksSent_++;
+  if( isLast )
+  {
+    fileBlocksCount_ = fileBlocksSent_;
+  }
+
+  keepFileBlock( fileBlocks_[ sequence % MULTICAST_FILE_WINDOW ], sequence, frame, frameSize );
+  send( MulticastMessage::DATAGRAM_FILE_BLOCK, sequence, fileTransferId_, frame, frameSize );
+
+  MulticastMessage::addToParity( fileParity_, frame, frameSize );
+  fileParitySize_ = std::max( fileParitySize_, frameSize );
+
+  // The parity follows the last block of its group
+  if( ( sequence + 1 ) % MULTICAST_FEC_GROUP_SIZE == 0 || isLast )
+  {
+    uint32_t firstBlock = sequence - sequence % MULTICAST_FEC_GROUP_SIZE;
+    FileBlock& parity = fileParities_[ ( firstBlock / MULTICAST_FEC_GROUP_SIZE ) % ( MULTICAST_FILE_WINDOW / MULTICAST_FEC_GROUP_SIZE ) ];
+
+    keepFileBlock( parity, firstBlock, fileParity_, fileParitySize_ );
+    send( MulticastMessage::DATAGRAM_FILE_PARITY, firstBlock, fileTransferId_, fileParity_, fileParitySize_ );
+
+    memset( fileParity_, '\0', MAX_MESSAGE_SIZE );
+    fileParitySize_ = 0;
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+bool Multicaster::removeFileReceiver( const uint32_t clientId )
+{
+  pthread_mutex_lock( &mutex_ );
+  bool wasReceiver = ( fileReceivers_.erase( clientId ) > 0 );
+  pthread_mutex_unlock( &mutex_ );
+
+  return wasReceiver;
+}
+
+
+
+void Multicaster::removeStalledFileReceivers( std::list<uint32_t>& stalled )
+{
+  time_t now = time( NULL );
+
+  pthread_mutex_lock( &mutex_ );
+
+  std::map<uint32_t,FileReceiver>::iterator it = fileReceivers_.begin();
+  while( it != fileReceivers_.end() )
+  {
+    const FileReceiver& receiver = (*it).second;
+    if( receiver.acknowledged < fileBlocksSent_ && now - receiver.progressAt >= MULTICAST_FILE_STALL_TIMEOUT )
+    {
+      stalled.push_back( (*it).first );
+      fileReceivers_.erase( it++ );
+    }
+    else
+    {
+      it++;
+    }
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+MulticastMessage* Multicaster::repair( const uint32_t sequence )
+{
+  MulticastMessage* message = new MulticastMessage( MulticastMessage::MULTICAST_REPAIR );
+  message->setSequence( sequence );
+
+  pthread_mutex_lock( &mutex_ );
+
+  const Entry& entry = history_[ sequence % MULTICAST_HISTORY_SIZE ];
+  if( entry.frame != NULL && entry.sequence == sequence )
+  {
+    message->setClientId( entry.senderId );
+    message->setFrame( entry.frame, entry.frameSize );
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+
+  return message;
+}
+
+
+
+void Multicaster::repairFile( const uint32_t firstBlock, const uint32_t missingBlocks )
+{
+  if( firstBlock % MULTICAST_FEC_GROUP_SIZE != 0 || missingBlocks == 0 )
+  {
+    return;
+  }
+
+  long now = milliseconds();
+
+  pthread_mutex_lock( &mutex_ );
+
+  if( fileTransferId_ == 0 || firstBlock >= fileBlocksSent_ )
+  {
+    pthread_mutex_unlock( &mutex_ );
+    return;
+  }
+
+  FileBlock& parity = fileParities_[ ( firstBlock / MULTICAST_FEC_GROUP_SIZE ) % ( MULTICAST_FILE_WINDOW / MULTICAST_FEC_GROUP_SIZE ) ];
+  bool hasParity = ( parity.frame != NULL && parity.sequence == firstBlock );
+
+  // Receivers missing different single blocks of the group are all repaired by the parity
+  if( hasParity && __builtin_popcount( missingBlocks ) == 1 )
+  {
+    resendFileBlock( parity, MulticastMessage::DATAGRAM_FILE_PARITY, now );
+  }
+  else
+  {
+    for( uint32_t i = 0; i < MULTICAST_FEC_GROUP_SIZE && firstBlock + i < fileBlocksSent_; i++ )
+    {
+      FileBlock& block = fileBlocks_[ ( firstBlock + i ) % MULTICAST_FILE_WINDOW ];
+      if( ( missingBlocks & ( 1U << i ) ) && block.frame != NULL && block.sequence == firstBlock + i )
+      {
+        resendFileBlock( block, MulticastMessage::DATAGRAM_FILE_BLOCK, now );
+      }
+    }
+  }
+
+  pthread_mutex_unlock( &mutex_ );
+}
+
+
+
+void Multicaster::resendFileBlock( FileBlock& block, const MulticastMessage::DatagramKind kind, const long now )
+{
+  if( now - block.repairedAt < MULTICAST_FILE_REPAIR_HOLDOFF )
+  {
+    return;
+  }
+
+  block.repairedAt = now;
+  send( kind, block.sequence, fileTransferId_, block.frame, block.frameSize );
+}
+
+
+
+void* Multicaster::run( void* thisPointer )
+{
+  Multicaster* self = static_cast<Multicaster*>( thisPointer );
+
+  pthread_mutex_lock( &self->mutex_ );
+
+  while( ! self->isStopping_ )
+  {
+    timespec wakeUpTime;
+    clock_gettime( CLOCK_REALTIME, &wakeUpTime );
+    wakeUpTime.tv_nsec += MULTICAST_HEARTBEAT_INTERVAL * 1000000L;
+    wakeUpTime.tv_sec += wakeUpTime.tv_nsec / 1000000000L;
+    wakeUpTime.tv_nsec %= 1000000000L;
+
+    pthread_cond_timedwait( &self->heartbeatCondition_, &self->mutex_, &wakeUpTime );
+
+    if( ! self->isStopping_ && self->sequence_ > 0 )
+    {
+      self->send( MulticastMessage::DATAGRAM_HEARTBEAT, self->sequence_, 0, NULL, 0 );
+    }
+
+    // The receivers of a file may have missed its last blocks too
+    if( ! self->isStopping_ && self->fileTransferId_ != 0 )
+    {
+      self->send( MulticastMessage::DATAGRAM_FILE_HEARTBEAT, self->fileBlocksSent_, self->fileTransferId_, NULL, 0 );
+    }
+  }
+
+  pthread_mutex_unlock( &self->mutex_ );
+
+  return NULL; // Unused value
+}
+
+
+
+void Multicaster::send( const MulticastMessage::DatagramKind kind, const uint32_t sequence, const uint32_t senderId, const char* frame, const int frameSize )
+{
+  bool isFileDatagram = ( kind == MulticastMessage::DATAGRAM_FILE_BLOCK
+                       || kind == MulticastMessage::DATAGRAM_FILE_PARITY
+                       || kind == MulticastMessage::DATAGRAM_FILE_HEARTBEAT );
+
+  MulticastMessage::Datagram header;
+  header.streamId = streamId_;
+  header.kind = kind;
+  header.sequence = sequence;
+  header.senderId = senderId;
+  header.blocksCount = isFileDatagram ? fileBlocksCount_ : 0;
+  header.frameSize = frameSize;
+
+  // The header and the frame are gathered by the kernel, without copying them together first
+  iovec parts[ 2 ];
+  parts[ 0 ].iov_base = &header;
+  parts[ 0 ].iov_len = sizeof( MulticastMessage::Datagram );
+  parts[ 1 ].iov_base = const_cast<char*>( frame );
+  parts[ 1 ].iov_len = frameSize;
+
+  msghdr datagram;
+  memset( &datagram, '\0', sizeof( msghdr ) );
+  datagram.msg_name = &group_;
+  datagram.msg_namelen = sizeof( sockaddr_in );
+  datagram.msg_iov = parts;
+  datagram.msg_iovlen = ( frameSize > 0 ) ? 2 : 1;
+
+  // Lost datagrams are repaired on request, there's nothing else to do about them here
+  if( sendmsg( socket_, &datagram, 0 ) == -1 )
+  {
+    Common::debug( "Unable to send multicast datagram %u: %s", sequence, strerror( errno ) );
+  }
+}
+
+
+
+Errors::ErrorCode Multicaster::start( const char* group, const int port, const uint32_t streamId )
+{
+  memset( &group_, '\0', sizeof( sockaddr_in ) );
+  group_.sin_family = AF_INET;
+  group_.sin_port = htons( port );
+  if( inet_aton( group, &group_.sin_addr ) == 0 || ! IN_MULTICAST( ntohl( group_.sin_addr.s_addr ) ) || port <= 0 )
+  {
+    Common::error( "Invalid multicast group %s:%d", group, port );
+    return Errors::Error_Invalid_Address;
+  }
+
+  int newSocket = socket( AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+  if( newSocket == -1 )
+  {
+    Common::error( "Unable to create the multicast socket: %s", strerror( errno ) );
+    return Errors::Error_Socket_Init;
+  }
+
+  // Stay in the LAN, and let the clients on this same machine get the datagrams too
+  unsigned char ttl = MULTICAST_TTL;
+  unsigned char loop = 1;
+  if( setsockopt( newSocket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof( ttl ) ) == -1
+  ||  setsockopt( newSocket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof( loop ) ) == -1 )
+  {
+    Common::error( "Unable to set up the multicast socket: %s", strerror( errno ) );
+    close( newSocket );
+    return Errors::Error_Socket_Option;
+  }
+
+  socket_ = newSocket;
+  streamId_ = streamId;
+
+  int result = pthread_create( &thread_, NULL, &Multicaster::run, this );
+  if( result != 0 )
+  {
+    Common::error( "Unable to start the multicast heartbeats: error %d", result );
+    close( socket_ );
+    socket_ = -1;
+    return Errors::Error_Socket_Init;
+  }
+
+  Common::debug( "Chat messages are multicast to %s:%d", group, port );
+
+  return Errors::Error_None;
+}
+
+
+
+void Multicaster::startFile( const uint32_t transferId, const uint32_t senderId )
+{
+  pthread_mutex_lock( &mutex_ );
+
+  clearFile();
+  fileTransferId_ = transferId;
+  fileSenderId_ = senderId;
+
+  pthread_mutex_unlock( &mutex_ );
+}
@@ -0,0 +1,341 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MULTICASTER_H
+#define MULTICASTER_H
+
+#include "errors.h"
+#include "multicastmessage.h"
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+
+
+/**
+ * @def MULTICAST_HISTORY_SIZE
+ *
+ * Number of the latest chat messages kept to repair the ones which clients have missed.
+ */
+#define MULTICAST_HISTORY_SIZE   1024
+
+
+/**
+ * @def MULTICAST_HEARTBEAT_INTERVAL
+ *
+ * Milliseconds between two heartbeats, so clients notice when they've missed the latest messages.
+ */
+#define MULTICAST_HEARTBEAT_INTERVAL   500
+
+
+/**
+ * @def MULTICAST_TTL
+ *
+ * Routers the datagrams may cross; they shouldn't leave the LAN.
+ */
+#define MULTICAST_TTL   1
+
+
+/**
+ * @def MULTICAST_FILE_MIN_RECEIVERS
+ *
+ * Receivers needed to send a file through the group; fewer get it through their sessions.
+ */
+#define MULTICAST_FILE_MIN_RECEIVERS   2
+
+
+/**
+ * @def MULTICAST_FILE_REPAIR_HOLDOFF
+ *
+ * Milliseconds during which a repaired file block isn't sent again: the other receivers
+ * asking for it get the same repair.
+ */
+#define MULTICAST_FILE_REPAIR_HOLDOFF   30
+
+
+/**
+ * @def MULTICAST_FILE_STALL_TIMEOUT
+ *
+ * Seconds a receiver may go without acknowledging new blocks while it's behind; then it's
+ * left out of the transfer, rather than holding back everybody else.
+ */
+#define MULTICAST_FILE_STALL_TIMEOUT   15
+
+
+
+/**
+ * @class Multicaster
+ *
+ * Sends each chat message once to a multicast group, rather than once per client.
+ *
+ * Messages get consecutive sequence numbers; the latest ones are kept, so the clients which
+ * have missed some can get them back through their sessions. A thread sends heartbeats
+ * with the last sequence number, for the clients which have missed the latest messages.
+ *
+ * One file at a time can be sent to the group as well, with the parity of each group of
+ * blocks. The latest MULTICAST_FILE_WINDOW blocks and their parities are kept, to be sent
+ * again when receivers report them missing; the sender is held back until the slowest
+ * receiver has acknowledged the blocks which would be dropped.
+ */
+class Multicaster
+{
+
+  public:
+
+    Multicaster();
+    ~Multicaster();
+
+    /**
+     * Record how many blocks of the file a receiver has, from the first.
+     */
+    void acknowledgeFile( const uint32_t clientId, const uint32_t blocksCount );
+
+    /**
+     * Add a client to the receivers of the file.
+     */
+    void addFileReceiver( const uint32_t clientId );
+
+    /**
+     * Fill in the group to join, for the clients.
+     */
+    void announce( MulticastMessage* message ) const;
+
+    /**
+     * Check whether more blocks can be read from a client, without dropping the ones
+     * which the slowest receiver may still ask for. Only the sender of the file is held back.
+     *
+     * @param blocksRead Blocks of the file read from the client so far, sent or not
+     */
+    bool canReadFileBlocks( const uint32_t clientId, const uint32_t blocksRead );
+
+    /**
+     * Stop sending the file, and drop the kept blocks.
+     *
+     * @param unfinished Filled with the receivers which don't have the whole file
+     * @return Whether the whole file had been sent
+     */
+    bool endFile( std::list<uint32_t>& unfinished );
+
+    /**
+     * Id of the client which sends the file.
+     */
+    uint32_t fileSenderId();
+
+    /**
+     * Id of the file transfer going through the group, or 0.
+     */
+    uint32_t fileTransferId();
+
+    bool isActive() const;
+
+    /**
+     * Whether the whole file was sent and acknowledged by all receivers, or none is left.
+     */
+    bool isFileDelivered();
+
+    /**
+     * Return the sequence number the next message will have.
+     */
+    uint32_t nextSequence();
+
+    /**
+     * Send a chat message to the group.
+     *
+     * @param frame The serialized message
+     * @param senderId Id of the client who wrote it, or 0
+     */
+    void publish( const char* frame, const int frameSize, const uint32_t senderId );
+
+    /**
+     * Send the next block of the file to the group, followed by the parity of its group
+     * when it's the last block of it.
+     *
+     * @param frame The serialized file data message
+     */
+    void publishFileBlock( const char* frame, const int frameSize, const bool isLast );
+
+    /**
+     * Remove a client from the receivers of the file.
+     *
+     * @return false if it wasn't one
+     */
+    bool removeFileReceiver( const uint32_t clientId );
+
+    /**
+     * Remove the receivers which have been behind without acknowledging new blocks for
+     * MULTICAST_FILE_STALL_TIMEOUT seconds.
+     *
+     * @param stalled Filled with the removed receivers
+     */
+    void removeStalledFileReceivers( std::list<uint32_t>& stalled );
+
+    /**
+     * Make a copy of an already sent message, for a client which has missed it.
+     *
+     * @return A new repair message, without a frame if the message is not kept anymore
+     */
+    MulticastMessage* repair( const uint32_t sequence );
+
+    /**
+     * Send again to the group what a receiver needs to complete a parity group: the
+     * parity if a single block is missing, otherwise the missing blocks.
+     *
+     * @param firstBlock First block of the group
+     * @param missingBlocks The missing blocks of the group, one bit each
+     */
+    void repairFile( const uint32_t firstBlock, const uint32_t missingBlocks );
+
+    /**
+     * Start sending to a group.
+     *
+     * @param group Address of the group, like 239.255.76.77
+     * @param streamId Tells apart the servers which use the same group
+     */
+    Errors::ErrorCode start( const char* group, const int port, const uint32_t streamId );
+
+    /**
+     * Start sending a file to the group, once the receivers have accepted it.
+     *
+     * @param senderId Id of the client which sends the file, to hold it back
+     */
+    void startFile( const uint32_t transferId, const uint32_t senderId );
+
+
+  private:
+
+    /// A message which was sent
+    struct Entry
+    {
+      uint32_t sequence;
+      uint32_t senderId;
+      char* frame;
+      int frameSize;
+    };
+
+    /// A block of the file, or the parity of a group, which was sent
+    struct FileBlock
+    {
+      /// Index of the block, or of the first block of the group
+      uint32_t sequence;
+      /// NULL until used by the current file
+      char* frame;
+      int frameSize;
+      /// When it was last sent again, in milliseconds
+      long repairedAt;
+    };
+
+    /// A client which receives the file
+    struct FileReceiver
+    {
+      /// Blocks it has, from the first
+      uint32_t acknowledged;
+      /// When it last acknowledged new blocks
+      time_t progressAt;
+    };
+
+
+  private:
+
+    /**
+     * Drop the blocks of the file and its receivers.
+     *
+     * @note The mutex must be locked by the caller.
+     */
+    void clearFile();
+
+    /**
+     * Keep a copy of a block or a parity, in place of the oldest one.
+     *
+     * @note The mutex must be locked by the caller.
+     */
+    static void keepFileBlock( FileBlock& block, const uint32_t sequence, const char* frame, const int frameSize );
+
+    /**
+     * Send a kept block or parity again, unless it just was.
+     *
+     * @note The mutex must be locked by the caller.
+     */
+    void resendFileBlock( FileBlock& block, const MulticastMessage::DatagramKind kind, const long now );
+
+    /**
+     * Send a datagram to the group. Heartbeats have no frame.
+     *
+     * @note The mutex must be locked by the caller.
+     */
+    void send( const MulticastMessage::DatagramKind kind, const uint32_t sequence, const uint32_t senderId, const char* frame, const int frameSize );
+
+    /**
+     * Send the heartbeats, until the multicaster is destroyed.
+     */
+    static void* run( void* thisPointer );
+
+
+  private:
+
+    /// Latest sent blocks of the file, by index
+    FileBlock fileBlocks_[ MULTICAST_FILE_WINDOW ];
+
+    /// Number of blocks of the file, once the last one was sent, or 0
+    uint32_t fileBlocksCount_;
+
+    /// Number of blocks of the file sent so far
+    uint32_t fileBlocksSent_;
+
+    /// Parities of the latest groups of blocks, by index of the group
+    FileBlock fileParities_[ MULTICAST_FILE_WINDOW / MULTICAST_FEC_GROUP_SIZE ];
+
+    /// Parity of the group being sent
+    char fileParity_[ MAX_MESSAGE_SIZE ];
+
+    int fileParitySize_;
+
+    /// Receivers of the file, by client id
+    std::map<uint32_t,FileReceiver> fileReceivers_;
+
+    uint32_t fileSenderId_;
+
+    /// Id of the file transfer, or 0 if no file is being sent
+    uint32_t fileTransferId_;
+
+    /// Where the datagrams go
+    sockaddr_in group_;
+
+    /// Signaled to stop the heartbeats
+    pthread_cond_t heartbeatCondition_;
+
+    /// Latest sent messages, by sequence number
+    Entry history_[ MULTICAST_HISTORY_SIZE ];
+
+    bool isStopping_;
+
+    /// Guards everything but the settings made by start()
+    pthread_mutex_t mutex_;
+
+    /// Sequence number of the last message sent, 0 before the first one
+    uint32_t sequence_;
+
+    /// UDP socket, or -1 when not multicasting
+    int socket_;
+
+    uint32_t streamId_;
+
+    /// Sends the heartbeats
+    pthread_t thread_;
+
+
+};
+
+
+
+#endif // MULTICASTER_H
@@ -0,0 +1,291 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "router.h"
+
+#include "common.h"
+#include "message.h"
+#include "relaymessage.h"
+#include "server.h"
+#include "sessionclient.h"
+
+
+
+Router::Router( Server* server )
+: server_( server )
+, workersCount_( 0 )
+{
+  for( int i = 0; i < ROUTING_WORKERS; i++ )
+  {
+    Worker& worker = workers_[ i ];
+    worker.router = this;
+    worker.current = NULL;
+    worker.isFileCheckDue = false;
+    worker.isHousekeeping = false;
+    worker.isRelaying = false;
+    worker.isRosterDue = false;
+    worker.isStopping = false;
+    pthread_mutex_init( &worker.mutex, NULL );
+    pthread_cond_init( &worker.hasJobs, NULL );
+    pthread_cond_init( &worker.progress, NULL );
+  }
+}
+
+
+
+Router::~Router()
+{
+  for( int i = 0; i < workersCount_; i++ )
+  {
+    Worker& worker = workers_[ i ];
+
+    pthread_mutex_lock( &worker.mutex );
+    worker.isStopping = true;
+    pthread_cond_signal( &worker.hasJobs );
+    pthread_mutex_unlock( &worker.mutex );
+
+    pthread_join( worker.thread, NULL );
+  }
+
+  for( int i = 0; i < ROUTING_WORKERS; i++ )
+  {
+    Worker& worker = workers_[ i ];
+
+    std::list<Job>::iterator it;
+    for( it = worker.queue.begin(); it != worker.queue.end(); it++ )
+    {
+      delete (*it).message;
+    }
+
+    pthread_cond_destroy( &worker.progress );
+    pthread_cond_destroy( &worker.hasJobs );
+    pthread_mutex_destroy( &worker.mutex );
+  }
+}
+
+
+
+void Router::drain()
+{
+  for( int i = 0; i < workersCount_; i++ )
+  {
+    Worker& worker = workers_[ i ];
+
+    pthread_mutex_lock( &worker.mutex );
+    while( worker.queue.size() > 0 || worker.current != NULL || worker.isRelaying
+        || worker.isRosterDue || worker.isFileCheckDue || worker.isHousekeeping )
+    {
+      pthread_cond_wait( &worker.progress, &worker.mutex );
+    }
+    pthread_mutex_unlock( &worker.mutex );
+  }
+}
+
+
+
+void Router::forget( SessionClient* client )
+{
+  Worker* worker = workerFor( client );
+
+  pthread_mutex_lock( &worker->mutex );
+
+  std::list<Job>::iterator it = worker->queue.begin();
+  while( it != worker->queue.end() )
+  {
+    if( (*it).client == client )
+    {
+      delete (*it).message;
+      it = worker->queue.erase( it );
+    }
+    else
+    {
+      it++;
+    }
+  }
+
+  // Someone may be waiting for the queue to have room
+  pthread_cond_broadcast( &worker->progress );
+
+  while( worker->current == client )
+  {
+    pthread_cond_wait( &worker->progress, &worker->mutex );
+  }
+
+  pthread_mutex_unlock( &worker->mutex );
+}
+
+
+
+void* Router::run( void* workerPointer )
+{
+  Worker* worker = static_cast<Worker*>( workerPointer );
+  Server* server = worker->router->server_;
+
+  pthread_mutex_lock( &worker->mutex );
+
+  while( true )
+  {
+    while( worker->queue.size() == 0 && ! worker->isRosterDue && ! worker->isFileCheckDue && ! worker->isStopping )
+    {
+      pthread_cond_wait( &worker->hasJobs, &worker->mutex );
+    }
+
+    if( worker->isRosterDue || worker->isFileCheckDue )
+    {
+      bool isRosterDue = worker->isRosterDue;
+      bool isFileCheckDue = worker->isFileCheckDue;
+      worker->isRosterDue = false;
+      worker->isFileCheckDue = false;
+      worker->isHousekeeping = true;
+      pthread_mutex_unlock( &worker->mutex );
+
+      if( isRosterDue )
+      {
+        server->flushRoster();
+      }
+      if( isFileCheckDue )
+      {
+        server->checkFileReceivers();
+      }
+
+      pthread_mutex_lock( &worker->mutex );
+      worker->isHousekeeping = false;
+      pthread_cond_broadcast( &worker->progress );
+      continue;
+    }
+
+    if( worker->queue.size() == 0 )
+    {
+      break;
+    }
+
+    Job job = worker->queue.front();
+    worker->queue.pop_front();
+    worker->current = job.client;
+    worker->isRelaying = ( job.client == NULL );
+
+    pthread_mutex_unlock( &worker->mutex );
+
+    if( job.client != NULL )
+    {
+      server->routeMessage( job.client, job.message );
+    }
+    else
+    {
+      server->routeRelay( static_cast<RelayMessage*>( job.message ) );
+    }
+    delete job.message;
+
+    pthread_mutex_lock( &worker->mutex );
+
+    worker->current = NULL;
+    worker->isRelaying = false;
+    pthread_cond_broadcast( &worker->progress );
+  }
+
+  pthread_mutex_unlock( &worker->mutex );
+
+  return NULL;
+}
+
+
+
+void Router::queue( Worker* worker, const Job& job )
+{
+  pthread_mutex_lock( &worker->mutex );
+
+  // Slow the sender down until the worker catches up
+  while( worker->queue.size() >= ROUTING_QUEUE_SIZE )
+  {
+    pthread_cond_wait( &worker->progress, &worker->mutex );
+  }
+
+  worker->queue.push_back( job );
+  pthread_cond_signal( &worker->hasJobs );
+
+  pthread_mutex_unlock( &worker->mutex );
+}
+
+
+
+void Router::requestFileCheck()
+{
+  Worker& worker = workers_[ 0 ];
+
+  pthread_mutex_lock( &worker.mutex );
+  worker.isFileCheckDue = true;
+  pthread_cond_signal( &worker.hasJobs );
+  pthread_mutex_unlock( &worker.mutex );
+}
+
+
+
+void Router::requestRosterFlush()
+{
+  Worker& worker = workers_[ 0 ];
+
+  pthread_mutex_lock( &worker.mutex );
+  worker.isRosterDue = true;
+  pthread_cond_signal( &worker.hasJobs );
+  pthread_mutex_unlock( &worker.mutex );
+}
+
+
+
+bool Router::start()
+{
+  for( int i = 0; i < ROUTING_WORKERS; i++ )
+  {
+    int result = pthread_create( &workers_[ i ].thread, NULL, &Router::run, &workers_[ i ] );
+    if( result != 0 )
+    {
+      Common::error( "Unable to start routing worker %d: error %d", i, result );
+      return false;
+    }
+
+    workersCount_++;
+  }
+
+  return true;
+}
+
+
+
+void Router::submit( SessionClient* client, Message* message )
+{
+  Worker* worker = workerFor( client );
+
+  Job job;
+  job.client = client;
+  job.message = message;
+
+  queue( worker, job );
+}
+
+
+
+void Router::submitRelay( RelayMessage* message )
+{
+  // The relays of each server stay in order
+  Worker* worker = &workers_[ message->origin() % ROUTING_WORKERS ];
+
+  Job job;
+  job.client = NULL;
+  job.message = message;
+
+  queue( worker, job );
+}
+
+
+
+Router::Worker* Router::workerFor( SessionClient* client )
+{
+  return &workers_[ client->id() % ROUTING_WORKERS ];
+}
@@ -0,0 +1,174 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <pthread.h>
+
+#include <list>
+
+
+/**
+ * @def ROUTING_WORKERS
+ *
+ * Number of threads which deliver the messages of the clients to the other clients.
+ */
+#define ROUTING_WORKERS   4
+
+
+/**
+ * @def ROUTING_QUEUE_SIZE
+ *
+ * Maximum number of messages waiting for each routing worker. When full, the sessions
+ * submitting more messages wait, and stop reading from their clients meanwhile.
+ */
+#define ROUTING_QUEUE_SIZE   1024
+
+
+class Message;
+class RelayMessage;
+class Server;
+class SessionClient;
+
+
+
+/**
+ * @class Router
+ *
+ * Moves the fan out of the messages off the session threads.
+ *
+ * Session threads only read and decode the messages, then submit them here;
+ * the routing workers pass them to the server, which queues the copies in the
+ * recipients' sessions; their own threads encode and send them.
+ *
+ * The messages of each session always go to the same worker, so they're routed
+ * in the order they were received, and so do the relays from each server of the
+ * federation, which the link threads submit the same way. The first worker also sends the roster changes,
+ * and checks on the receivers of the files sent through the multicast group.
+ */
+class Router
+{
+
+  public:
+
+    Router( Server* server );
+    ~Router();
+
+    /**
+     * Wait until all the submitted messages have been routed.
+     */
+    void drain();
+
+    /**
+     * Drop the messages of a session which weren't routed yet, and wait until
+     * none is being routed anymore. Must be called before the session goes away.
+     */
+    void forget( SessionClient* client );
+
+    /**
+     * Have a worker send the pending roster changes to the clients.
+     *
+     * Doesn't wait, so it can be called from a timer.
+     */
+    void requestRosterFlush();
+
+    /**
+     * Have a worker check on the receivers of the file sent through the multicast group.
+     *
+     * Doesn't wait, so it can be called from a timer.
+     */
+    void requestFileCheck();
+
+    /**
+     * Start the routing workers.
+     */
+    bool start();
+
+    /**
+     * Queue a message to be routed, taking ownership of it.
+     *
+     * Waits if the queue of the session's worker is full.
+     */
+    void submit( SessionClient* client, Message* message );
+
+    /**
+     * Queue a relay from another server to be delivered to the clients, taking ownership of it.
+     *
+     * Waits if the queue of the origin server's worker is full.
+     */
+    void submitRelay( RelayMessage* message );
+
+
+  private:
+
+    /// A message waiting to be routed
+    struct Job
+    {
+      /// NULL for the relays
+      SessionClient* client;
+      Message* message;
+    };
+
+    /// A routing thread, with its own queue
+    struct Worker
+    {
+      Router* router;
+      pthread_t thread;
+      pthread_mutex_t mutex;
+      /// Signaled when a job is queued
+      pthread_cond_t hasJobs;
+      /// Broadcast when a job is done
+      pthread_cond_t progress;
+      std::list<Job> queue;
+      /// Session whose message is being routed, or NULL
+      SessionClient* current;
+      /// Whether the multicast file receivers should be checked
+      bool isFileCheckDue;
+      /// Whether the roster changes are being sent, or the file receivers checked
+      bool isHousekeeping;
+      /// Whether a relay is being delivered
+      bool isRelaying;
+      /// Whether the roster changes should be sent
+      bool isRosterDue;
+      bool isStopping;
+    };
+
+
+  private:
+
+    /**
+     * Queue a job, waiting for room in the worker's queue.
+     */
+    void queue( Worker* worker, const Job& job );
+
+    /**
+     * Get the worker which routes the messages of a session.
+     */
+    Worker* workerFor( SessionClient* client );
+
+    static void* run( void* workerPointer );
+
+
+  private:
+
+    Server* server_;
+
+    Worker workers_[ ROUTING_WORKERS ];
+
+    /// Number of started workers
+    int workersCount_;
+
+
+};
+
+
+
+#endif // ROUTER_H
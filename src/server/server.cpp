@@ -12,82 +12,572 @@
 
 #include "chatmessage.h"
 #include "filedatamessage.h"
+#include "filemanifestmessage.h"
+#include "filesignaturemessage.h"
 #include "filetransfermessage.h"
+#include "multicastmessage.h"
 #include "nicknamemessage.h"
+#include "privatemessage.h"
+#include "rawmessage.h"
+#include "relaymessage.h"
+#include "rostermessage.h"
+#include "statsmessage.h"
 #include "statusmessage.h"
+#include "stripemessage.h"
 #include "common.h"
 #include "errors.h"
+#include "handoff.h"
 #include "sessionclient.h"
+#include "sessionpeer.h"
 
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <vector>
+
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+
+
+Server::NickNameKey::NickNameKey( const char* nickName )
+{
+  memset( this->nickName, '\0', MAX_NICKNAME_SIZE );
+  strncpy( this->nickName, nickName, MAX_NICKNAME_SIZE - 1 );
+}
+
+
+
+bool Server::NickNameKey::operator<( const NickNameKey& other ) const
+{
+  return ( strcasecmp( nickName, other.nickName ) < 0 );
+}
 
 
 
 Server::Server()
-: connectionsCounter_( 0 )
+: acceptorsCount_( 0 )
+, connectionsRejected_( 0 )
+, connectionsAccepted_( 0 )
+, connectionsCounter_( 0 )
+, federationSecretSize_( 0 )
+, federationSocket_( -1 )
+, federationThread_( 0 )
+, fileStripes_( SERVER_FILE_STRIPES )
 , fileTransferModeActive_( false )
-, listenThread_( 0 )
+, handoffSocket_( -1 )
+, handoffThread_( 0 )
+, hasTakenOver_( false )
+, isHandedOff_( false )
+, multicastFileTimer_( &Server::multicastFileTimerExpired, this )
+, multicastTransfers_( 0 )
+, relaySequence_( 0 )
+, rosterTimer_( &Server::rosterTimerExpired, this )
+, rosterVersion_( 0 )
+, router_( this )
+, slowConsumerPolicy_( SLOW_CONSUMER_DROP_NEWEST )
+, slowConsumerTimeout_( SLOW_CONSUMER_TIMEOUT )
+, tlsContext_( NULL )
 {
+  *chatLogDirectory_ = '\0';
+  *handoffPath_ = '\0';
+
+  memset( federationSecret_, '\0', FEDERATION_MAX_SECRET_SIZE );
+  memset( slowConsumerCounters_, '\0', sizeof( slowConsumerCounters_ ) );
+
   int result = pthread_mutex_init( &accessMutex_, NULL );
   if( result != 0 )
   {
     Common::fatal( "Server mutex creation failed: error %d", result );
   }
+
+  result = pthread_mutex_init( &admissionMutex_, NULL );
+  if( result != 0 )
+  {
+    Common::fatal( "Server admission mutex creation failed: error %d", result );
+  }
+
+  result = pthread_mutex_init( &federationMutex_, NULL );
+  if( result != 0 )
+  {
+    Common::fatal( "Server federation mutex creation failed: error %d", result );
+  }
+
+  // Sessions leaving must not wait behind a steady flow of messages
+  pthread_rwlockattr_t deliveryLockAttributes;
+  pthread_rwlockattr_init( &deliveryLockAttributes );
+  pthread_rwlockattr_setkind_np( &deliveryLockAttributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+  result = pthread_rwlock_init( &deliveryLock_, &deliveryLockAttributes );
+  pthread_rwlockattr_destroy( &deliveryLockAttributes );
+  if( result != 0 )
+  {
+    Common::fatal( "Server delivery lock creation failed: error %d", result );
+  }
+
+  // Servers of a federation must have different identifiers, even when started together
+  serverId_ = randomNumber();
+
+  for( int i = 0; i < ADMISSION_TABLE_SIZE; i++ )
+  {
+    admissionTable_[ i ].address = INADDR_NONE;
+  }
+
+  startTime_ = time( NULL );
+
+  // All session threads are created with the same, smaller, stack
+  pthread_attr_init( &sessionThreadAttributes_ );
+  pthread_attr_setstacksize( &sessionThreadAttributes_, SESSION_THREAD_STACK_SIZE );
+
+  if( ! timers_.start() )
+  {
+    Common::fatal( "Server timers creation failed" );
+  }
+
+  if( ! router_.start() )
+  {
+    Common::fatal( "Server routing workers creation failed" );
+  }
 }
 
 
 
 Server::~Server()
 {
-  while( sessions_.size() > 0 )
+  // Close the links first, so leaving users aren't announced to the federation
+  if( federationThread_ != 0 )
+  {
+    pthread_cancel( federationThread_ );
+    pthread_join( federationThread_, NULL );
+  }
+  if( federationSocket_ != -1 )
+  {
+    close( federationSocket_ );
+  }
+
+  std::list<pthread_t> peerThreads;
+  pthread_mutex_lock( &federationMutex_ );
+  std::map<SessionPeer*,pthread_t>::iterator peerIt;
+  for( peerIt = peers_.begin(); peerIt != peers_.end(); peerIt++ )
+  {
+    (*peerIt).first->dropConnection();
+    peerThreads.push_back( (*peerIt).second );
+  }
+  pthread_mutex_unlock( &federationMutex_ );
+
+  std::list<pthread_t>::iterator threadIt;
+  for( threadIt = peerThreads.begin(); threadIt != peerThreads.end(); threadIt++ )
+  {
+    pthread_join( *threadIt, NULL );
+  }
+
+  std::list<FederationTarget*>::iterator targetIt;
+  for( targetIt = federationTargets_.begin(); targetIt != federationTargets_.end(); targetIt++ )
   {
+    delete (*targetIt);
+  }
+
+  // Sessions remove themselves from the list as soon as they end, so only walk it while locked
+  pthread_mutex_lock( &accessMutex_ );
+  while( sessions_.size() > 0 || stripes_.size() > 0 )
+  {
+    std::list<pthread_t> sessionThreads;
     std::map<SessionClient*,SessionData*>::iterator it;
     for( it = sessions_.begin(); it != sessions_.end(); it++ )
     {
       SessionData* session = (*it).second;
       // Tell the session to disconnect; it will auto-delete itself and end its thread
       session->client->disconnect();
-      pthread_join( session->thread, NULL );
+      sessionThreads.push_back( session->thread );
+    }
+    for( it = stripes_.begin(); it != stripes_.end(); it++ )
+    {
+      (*it).first->disconnect();
+      sessionThreads.push_back( (*it).second->thread );
+    }
+    pthread_mutex_unlock( &accessMutex_ );
+
+    for( threadIt = sessionThreads.begin(); threadIt != sessionThreads.end(); threadIt++ )
+    {
+      pthread_join( *threadIt, NULL );
+    }
+
+    pthread_mutex_lock( &accessMutex_ );
+  }
+  pthread_mutex_unlock( &accessMutex_ );
+
+  // Nobody is left to tell about the roster changes
+  timers_.cancel( &rosterTimer_ );
+  timers_.cancel( &multicastFileTimer_ );
+  router_.drain();
+
+  for( int i = 0; i < acceptorsCount_; i++ )
+  {
+    pthread_cancel( acceptors_[ i ].thread );
+    pthread_join( acceptors_[ i ].thread, NULL );
+    close( acceptors_[ i ].socket );
+  }
+
+  if( handoffThread_ != 0 )
+  {
+    if( ! pthread_equal( handoffThread_, pthread_self() ) )
+    {
+      pthread_cancel( handoffThread_ );
+      pthread_join( handoffThread_, NULL );
+    }
+    if( handoffSocket_ != -1 )
+    {
+      close( handoffSocket_ );
+      unlink( handoffPath_ );
     }
   }
 
-  pthread_cancel( listenThread_ );
+  // The sessions had their own references to it
+  SSL_CTX_free( tlsContext_ );
+
+  pthread_attr_destroy( &sessionThreadAttributes_ );
+  pthread_rwlock_destroy( &deliveryLock_ );
+  pthread_mutex_destroy( &federationMutex_ );
+  pthread_mutex_destroy( &admissionMutex_ );
   pthread_mutex_destroy( &accessMutex_ );
 }
 
 
 
-void Server::addSession( int newSocket )
+bool Server::admitConnection( const in_addr& address )
+{
+  // Multiplicative hashing spreads neighbouring LAN addresses over the whole table
+  uint32_t hash = ( address.s_addr * 2654435761U ) & ( ADMISSION_TABLE_SIZE - 1 );
+  AdmissionSlot& slot = admissionTable_[ hash ];
+
+  pthread_mutex_lock( &admissionMutex_ );
+
+  // On collisions the older address loses its history, keeping the table size fixed
+  if( slot.address != address.s_addr )
+  {
+    slot.address = address.s_addr;
+    slot.limiter.reset( CONNECTION_RATE_PER_ADDRESS, CONNECTION_BURST_PER_ADDRESS );
+  }
+
+  bool isAdmitted = slot.limiter.consume();
+  if( ! isAdmitted )
+  {
+    connectionsRejected_++;
+  }
+
+  pthread_mutex_unlock( &admissionMutex_ );
+
+  return isAdmitted;
+}
+
+
+
+void Server::addPeer( const int socket, const char* name, FederationTarget* target )
+{
+  SessionPeer* peer = new SessionPeer( this, socket, name );
+
+  pthread_mutex_lock( &federationMutex_ );
+
+  // Register the link before its thread starts, as it may immediately end
+  pthread_t thread;
+  int result = pthread_create( &thread, &sessionThreadAttributes_, &SessionPeer::pollForData, peer );
+  if( result != 0 )
+  {
+    pthread_mutex_unlock( &federationMutex_ );
+    Common::error( "Unable to start a thread for the link to %s: error %d", name, result );
+    delete peer;
+    return;
+  }
+
+  peers_[ peer ] = thread;
+  if( target != NULL )
+  {
+    target->link = peer;
+  }
+
+  // Nothing is relayed to the other server until it proves it's part of the federation
+  sendToPeer( peer, new RelayMessage( serverId_, 0, RelayMessage::RELAY_CHALLENGE, peer->challenge(), FEDERATION_CHALLENGE_SIZE ) );
+
+  pthread_mutex_unlock( &federationMutex_ );
+
+  Common::debug( "Linked to server %s", name );
+}
+
+
+
+void Server::addRosterChange( const RosterMessage::Event event, const unsigned int id, const char* nickName, const char* oldNickName )
+{
+  // Start collecting a new batch
+  if( rosterChanges_.size() == 0 )
+  {
+    timers_.schedule( &rosterTimer_, ROSTER_BATCH_INTERVAL );
+  }
+
+  // Nickname of the user before this change
+  const char* currentNickName = ( event == RosterMessage::ROSTER_RENAMED ) ? oldNickName : nickName;
+
+  // Merge the change with the previous pending one about the same user, so clients only see the outcome
+  std::list<RosterMessage::Entry>::iterator it;
+  for( it = rosterChanges_.begin(); it != rosterChanges_.end(); it++ )
+  {
+    RosterMessage::Entry& pending = *it;
+
+    if( event == RosterMessage::ROSTER_JOINED )
+    {
+      // The same user left and came back: for the clients, nothing happened. Somebody
+      // else taking the nickname is a different entry, so they must see both changes
+      if( pending.event == RosterMessage::ROSTER_LEFT && pending.id == id && strcmp( pending.nickName, nickName ) == 0 )
+      {
+        rosterChanges_.erase( it );
+        return;
+      }
+      continue;
+    }
+
+    if( pending.event == RosterMessage::ROSTER_LEFT || strcmp( pending.nickName, currentNickName ) != 0 )
+    {
+      continue;
+    }
+
+    if( event == RosterMessage::ROSTER_LEFT )
+    {
+      if( pending.event == RosterMessage::ROSTER_JOINED )
+      {
+        // Came and went
+        rosterChanges_.erase( it );
+      }
+      else
+      {
+        // Renamed and went: the clients only knew the old nickname
+        pending.event = RosterMessage::ROSTER_LEFT;
+        memcpy( pending.nickName, pending.oldNickName, MAX_NICKNAME_SIZE );
+        memset( pending.oldNickName, '\0', MAX_NICKNAME_SIZE );
+      }
+      return;
+    }
+
+    // Renamed again
+    if( pending.event == RosterMessage::ROSTER_RENAMED && strcmp( pending.oldNickName, nickName ) == 0 )
+    {
+      rosterChanges_.erase( it );
+      return;
+    }
+
+    memset( pending.nickName, '\0', MAX_NICKNAME_SIZE );
+    strncpy( pending.nickName, nickName, MAX_NICKNAME_SIZE - 1 );
+    return;
+  }
+
+  RosterMessage::Entry change;
+  memset( &change, '\0', sizeof( RosterMessage::Entry ) );
+  change.event = event;
+  change.id = id;
+  strncpy( change.nickName, nickName, MAX_NICKNAME_SIZE - 1 );
+  if( oldNickName != NULL )
+  {
+    strncpy( change.oldNickName, oldNickName, MAX_NICKNAME_SIZE - 1 );
+  }
+
+  rosterChanges_.push_back( change );
+}
+
+
+
+void Server::addSessions( const int* newSockets, const int count )
+{
+  // The client sessions will take care of the sockets and free them up when done.
+  // They will also self-destruct when not needed anymore.
+
+  std::list<SessionData*> newSessions;
+
+  pthread_mutex_lock( &accessMutex_ );
+
+  connectionsAccepted_ += count;
+
+  for( int i = 0; i < count; i++ )
+  {
+    connectionsCounter_++;
+
+    SessionData* newSession = new SessionData;
+    newSession->client = new SessionClient( this, newSockets[ i ], connectionsCounter_ );
+    newSession->state = CLIENT_STATE_START;
+    newSession->isFileTransferSender = false;
+    newSession->isFileTransferDirect = false;
+    newSession->isMulticastSubscriber = false;
+    newSession->isMulticastFileReceiver = false;
+    newSession->stripeOwner = NULL;
+    newSession->stripeToken = 0;
+    newSession->nextStripe = 0;
+    newSession->fileStart = 0;
+    newSession->fileReceived = 0;
+    newSession->fileLastBlock = NULL;
+    newSession->fileSignature.clear();
+
+    if( tlsContext_ != NULL && ! newSession->client->startTls( tlsContext_, true ) )
+    {
+      newSession->client->dropConnection();
+    }
+
+    // Assign a default unique name to the client
+    char nickName[ MAX_NICKNAME_SIZE ];
+    sprintf( nickName, "User %d", connectionsCounter_ );
+    newSession->client->setNickName( nickName );
+
+    // Register the session before its thread starts, as it may immediately need the server
+    sessions_[ newSession->client ] = newSession;
+    newSessions.push_back( newSession );
+  }
+
+  startSessions( newSessions );
+
+  Common::debug( "%d sessions registered, %lu active", count, sessions_.size() );
+
+  pthread_mutex_unlock( &accessMutex_ );
+}
+
+
+
+void Server::announceNickNames( SessionPeer* peer )
+{
+  std::list<RemoteNickName> nickNames;
+
+  pthread_mutex_lock( &accessMutex_ );
+
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    SessionClient* client = (*it).first;
+    if( client->hasJoined() )
+    {
+      RemoteNickName nickName;
+      strncpy( nickName.nickName, client->nickName(), MAX_NICKNAME_SIZE );
+      nickNames.push_back( nickName );
+    }
+  }
+
+  pthread_mutex_unlock( &accessMutex_ );
+
+  // The nicknames used beyond the other links are taken as well
+  pthread_mutex_lock( &federationMutex_ );
+  std::list<RemoteNickName>::iterator remoteIt;
+  for( remoteIt = remoteNickNames_.begin(); remoteIt != remoteNickNames_.end(); remoteIt++ )
+  {
+    if( (*remoteIt).link != peer )
+    {
+      nickNames.push_back( *remoteIt );
+    }
+  }
+  pthread_mutex_unlock( &federationMutex_ );
+
+  std::list<RemoteNickName>::iterator nickIt;
+  for( nickIt = nickNames.begin(); nickIt != nickNames.end(); nickIt++ )
+  {
+    const char* nickName = (*nickIt).nickName;
+    relay( RelayMessage::RELAY_NICKNAME_TAKEN, nickName, strlen( nickName ) + 1, peer );
+  }
+}
+
+
+
+bool Server::canReceiveFileBlocks( SessionClient* client, const uint32_t blocksRead )
+{
+  return multicaster_.canReadFileBlocks( client->id(), blocksRead );
+}
+
+
+
+bool Server::canRelayFileBlocks( SessionClient* client )
 {
-  connectionsCounter_++;
+  bool canRelay = true;
+
+  pthread_mutex_lock( &accessMutex_ );
 
-  // The client session will take care of the socket and free it up when done.
-  // It will also self-destruct when not needed anymore.
+  SessionClient* sender = client;
+  std::map<SessionClient*,SessionData*>::iterator it = stripes_.find( client );
+  if( it != stripes_.end() )
+  {
+    sender = (*it).second->stripeOwner;
+  }
+
+  it = sessions_.find( sender );
+  if( sender != NULL && it != sessions_.end() && (*it).second->isFileTransferSender )
+  {
+    for( it = sessions_.begin(); it != sessions_.end() && canRelay; it++ )
+    {
+      SessionData* data = (*it).second;
+      if( (*it).first == sender || data->isMulticastFileReceiver
+      ||  (*it).first->fileTransferAccepted() != Errors::Status_AcceptFileTransfer )
+      {
+        continue;
+      }
 
-  SessionData* newSession = new SessionData;
-  newSession->client = new SessionClient( this, newSocket );
-  newSession->state = CLIENT_STATE_START;
-  newSession->isFileTransferSender = false;
+      canRelay = ( nextFileConnection( data ) != NULL );
+    }
+  }
+
+  pthread_mutex_unlock( &accessMutex_ );
+
+  return canRelay;
+}
 
-  // Assign a default unique name to the client
-  char nickName[ MAX_NICKNAME_SIZE ];
-  sprintf( nickName, "User %d", connectionsCounter_ );
-  newSession->client->setNickName( nickName );
 
-  pthread_create( &newSession->thread, NULL, &SessionClient::pollForData, newSession->client );
 
+void Server::checkFileReceivers()
+{
   pthread_mutex_lock( &accessMutex_ );
-  sessions_[ newSession->client ] = newSession;
+
+  checkMulticastFile();
+
+  if( multicaster_.fileTransferId() != 0 )
+  {
+    timers_.schedule( &multicastFileTimer_, MULTICAST_FILE_STALL_TIMEOUT * 1000 );
+  }
+
   pthread_mutex_unlock( &accessMutex_ );
+}
+
+
+
+void Server::checkMulticastFile()
+{
+  uint32_t transferId = multicaster_.fileTransferId();
+  if( transferId == 0 )
+  {
+    return;
+  }
+
+  std::list<uint32_t> stalled;
+  multicaster_.removeStalledFileReceivers( stalled );
+  if( stalled.size() > 0 )
+  {
+    Common::error( "%lu clients stopped receiving the multicast file, leaving them out", stalled.size() );
+    dropFileReceivers( stalled, transferId );
+  }
+
+  // The receivers may have made room for more blocks
+  std::map<unsigned int,SessionClient*>::iterator it = idDirectory_.find( multicaster_.fileSenderId() );
+  if( it != idDirectory_.end() )
+  {
+    (*it).second->wakeUp();
+  }
 
-  Common::debug( "Session \"%s\" registered, %lu active", nickName, sessions_.size() );
+  if( multicaster_.isFileDelivered() )
+  {
+    endMulticastFile();
+  }
 }
 
 
@@ -126,6 +616,7 @@ void Server::checkSessionStateChange( SessionClient* client, Message::Type messa
       expectedStates.push_back( CLIENT_STATE_START );
       expectedStates.push_back( CLIENT_STATE_IDENTIFY );
       expectedStates.push_back( CLIENT_STATE_READY );
+      expectedStates.push_back( CLIENT_STATE_STRIPE );
       nextState = CLIENT_STATE_INVALID;
       break;
 
@@ -134,7 +625,7 @@ void Server::checkSessionStateChange( SessionClient* client, Message::Type messa
       return;
   }
 
-// States: CLIENT_STATE_INVALID CLIENT_STATE_START CLIENT_STATE_IDENTIFY CLIENT_STATE_READY CLIENT_STATE_END
+// States: CLIENT_STATE_INVALID CLIENT_STATE_START CLIENT_STATE_IDENTIFY CLIENT_STATE_READY CLIENT_STATE_END CLIENT_STATE_STRIPE
 
   if( std::find( expectedStates.begin(), expectedStates.end(), current->state ) == expectedStates.end() )
   {
@@ -154,41 +645,138 @@ void Server::checkSessionStateChange( SessionClient* client, Message::Type messa
 
 
 
-bool Server::clientChangedNickName( SessionClient* client, const NicknameMessage* message )
+void Server::clearFileLastBlock( SessionData* data )
 {
-  SessionData* current = findSession( client );
-  if( ! current )
+  delete data->fileLastBlock;
+  data->fileLastBlock = NULL;
+}
+
+
+
+void Server::clearFileSignature( SessionData* data )
+{
+  while( data->fileSignature.size() > 0 )
   {
-    Common::fatal( "Received a message from unknown session 0x%X!", client );
+    delete data->fileSignature.front();
+    data->fileSignature.pop_front();
   }
+}
 
-  // Remove non-printable chars from the name
-  const char* newNickName = message->nickName();
-  char verifiedNickName[ MAX_NICKNAME_SIZE ];
-  for( uint i = 0; i <= strlen( newNickName ); i++ )
+
+
+void Server::clientAbandonedFile( SessionClient* client, const uint32_t transferId )
+{
+  pthread_mutex_lock( &accessMutex_ );
+
+  SessionData* current = findSession( client );
+  if( current != NULL && transferId == multicaster_.fileTransferId() && multicaster_.removeFileReceiver( client->id() ) )
   {
-    verifiedNickName[ i ] = isprint( newNickName[ i ] ) ? newNickName[ i ] : ' ';
+    Common::debug( "Session \"%s\" abandoned the multicast file", client->nickName() );
+    current->isMulticastFileReceiver = false;
+    checkMulticastFile();
   }
 
-  // Check if the new name is unique
-  std::map<SessionClient*,SessionData*>::iterator it;
-  for( it = sessions_.begin(); it != sessions_.end(); it++ )
-  {
-    const SessionClient* peer = (*it).first;
+  pthread_mutex_unlock( &accessMutex_ );
+}
 
-    if( peer == client )
+
+
+void Server::clientAcknowledgedFileBlocks( SessionClient* client, const uint32_t transferId, const uint32_t blocksCount )
+{
+  pthread_mutex_lock( &accessMutex_ );
+
+  if( transferId == multicaster_.fileTransferId() )
+  {
+    multicaster_.acknowledgeFile( client->id(), blocksCount );
+    checkMulticastFile();
+  }
+
+  pthread_mutex_unlock( &accessMutex_ );
+}
+
+
+
+bool Server::clientChangedNickName( SessionClient* client, const NicknameMessage* message )
+{
+  pthread_mutex_lock( &accessMutex_ );
+
+  SessionData* current = findSession( client );
+  if( ! current )
+  {
+    Common::fatal( "Received a message from unknown session 0x%X!", client );
+  }
+
+  // Remove non-printable chars from the name
+  const char* newNickName = message->nickName();
+  char verifiedNickName[ MAX_NICKNAME_SIZE ];
+  memset( verifiedNickName, '\0', MAX_NICKNAME_SIZE );
+  for( uint i = 0; i < strlen( newNickName ) && i < MAX_NICKNAME_SIZE - 1; i++ )
+  {
+    verifiedNickName[ i ] = isprint( newNickName[ i ] ) ? newNickName[ i ] : ' ';
+  }
+
+  // Check if the new name is unique
+  bool isTaken = false;
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    const SessionClient* peer = (*it).first;
+
+    if( peer == client )
     {
         continue;
     }
 
     if( strcasecmp( verifiedNickName, peer->nickName() ) == 0 )
     {
-      return false;
+      isTaken = true;
+      break;
+    }
+  }
+
+  // Also within the federation
+  pthread_mutex_lock( &federationMutex_ );
+  std::list<RemoteNickName>::iterator remoteIt;
+  for( remoteIt = remoteNickNames_.begin(); ! isTaken && remoteIt != remoteNickNames_.end(); remoteIt++ )
+  {
+    if( strcasecmp( verifiedNickName, (*remoteIt).nickName ) == 0 )
+    {
+      isTaken = true;
+    }
+  }
+  pthread_mutex_unlock( &federationMutex_ );
+
+  if( isTaken )
+  {
+    pthread_mutex_unlock( &accessMutex_ );
+    return false;
+  }
+
+  const char* oldNickName = current->client->nickName();
+  if( client->hasJoined() )
+  {
+    relay( RelayMessage::RELAY_NICKNAME_RELEASED, oldNickName, strlen( oldNickName ) + 1 );
+  }
+  relay( RelayMessage::RELAY_NICKNAME_TAKEN, newNickName, strlen( newNickName ) + 1 );
+
+  if( client->hasJoined() )
+  {
+    nickNameDirectory_.erase( NickNameKey( oldNickName ) );
+    nickNameDirectory_[ NickNameKey( newNickName ) ] = client;
+
+    if( strcmp( oldNickName, newNickName ) != 0 )
+    {
+      addRosterChange( RosterMessage::ROSTER_RENAMED, client->id(), newNickName, oldNickName );
     }
   }
 
   Common::debug( "Session \"%s\" is now known as \"%s\"", current->client->nickName(), newNickName );
 
+  // Renamed while locked, as the private messages look the recipients' names up
+  client->setNickName( newNickName );
+
+  pthread_mutex_unlock( &accessMutex_ );
+
   return true;
 }
 
@@ -196,6 +784,8 @@ bool Server::clientChangedNickName( SessionClient* client, const NicknameMessage
 
 bool Server::clientSentChatMessage( SessionClient* client, const ChatMessage* message )
 {
+  pthread_mutex_lock( &accessMutex_ );
+
   SessionData* current = findSession( client );
   if( ! current )
   {
@@ -203,8 +793,9 @@ bool Server::clientSentChatMessage( SessionClient* client, const ChatMessage* me
   }
 
   // The user is alone by him/herself in chat
-  if( sessions_.size() == 1 )
+  if( sessions_.size() == 1 && peers_.size() == 0 )
   {
+    pthread_mutex_unlock( &accessMutex_ );
     return false;
   }
 
@@ -213,346 +804,2790 @@ bool Server::clientSentChatMessage( SessionClient* client, const ChatMessage* me
 
   Common::debug( "Session \"%s\" sent message \"%s\"", sender, chatMessage );
 
+  // Remember the message for the users who will join later, and log it
+  ChatMessage historyMessage( chatMessage );
+  historyMessage.setSender( sender );
+
+  int frameSize;
+  char* frame = SessionBase::serializeMessage( &historyMessage, frameSize );
+  history_.add( frame, frameSize );
+  chatLog_.append( frame, frameSize );
+
+  // Links are not encrypted
+  if( ! client->isEncrypted() )
+  {
+    relay( RelayMessage::RELAY_CHAT, frame, frameSize );
+  }
+
+  if( multicaster_.isActive() )
+  {
+    multicaster_.publish( frame, frameSize, client->id() );
+  }
+  free( frame );
+
   // Send the same message to everybody but the sender
+  std::list<SessionClient*> recipients;
   std::map<SessionClient*,SessionData*>::iterator it;
   for( it = sessions_.begin(); it != sessions_.end(); it++ )
   {
     SessionClient* peer = (*it).first;
 
-    // Don't send back the same message
-    if( peer == client )
+    // Don't send back the same message, nor send it again to the multicast group members
+    if( peer == client || (*it).second->isMulticastSubscriber )
+    {
+      continue;
+    }
+
+    recipients.push_back( peer );
+  }
+
+  pthread_mutex_unlock( &accessMutex_ );
+
+  std::list<SessionClient*>::iterator recipientIt;
+  for( recipientIt = recipients.begin(); recipientIt != recipients.end(); recipientIt++ )
+  {
+    ChatMessage* newMessage = new ChatMessage( chatMessage );
+    newMessage->setSender( sender );
+    deliver( *recipientIt, newMessage );
+  }
+
+  return true;
+}
+
+
+
+void Server::clientSentFileData( SessionClient* client, const FileDataMessage* message )
+{
+  SessionData* current = findSession( client );
+  if( ! current )
+  {
+    Common::fatal( "Received a message from unknown session 0x%X!", client );
+  }
+
+  // Blocks arriving through a data connection belong to its session
+  if( stripes_.find( client ) != stripes_.end() )
+  {
+    client = current->stripeOwner;
+    current = ( client != NULL ) ? findSession( client ) : NULL;
+    if( current == NULL )
+    {
+      return;
+    }
+  }
+
+  // The user is alone by him/herself in chat
+  if( sessions_.size() == 1 )
+  {
+    return;
+  }
+
+  // Through other connections, earlier blocks may still be on their way: the last one waits for them
+  current->fileReceived += message->blockSize();
+  if( message->isLastBlock() && current->fileStart + current->fileReceived < message->fileOffset() + message->blockSize() )
+  {
+    clearFileLastBlock( current );
+    current->fileLastBlock = new FileDataMessage();
+    current->fileLastBlock->setBuffer( message->buffer(), message->bufferSize() );
+    current->fileLastBlock->setChecksum( message->checksum() );
+    current->fileLastBlock->setFileOffset( message->fileOffset() );
+    current->fileLastBlock->setFileChecksum( message->fileChecksum() );
+    current->fileLastBlock->markLastBlock();
+    if( message->isCopy() )
+    {
+      current->fileLastBlock->markCopy();
+    }
+    return;
+  }
+
+  relayFileData( client, current, message );
+
+  FileDataMessage* lastBlock = current->fileLastBlock;
+  if( lastBlock != NULL && current->fileStart + current->fileReceived >= lastBlock->fileOffset() + lastBlock->blockSize() )
+  {
+    current->fileLastBlock = NULL;
+    relayFileData( client, current, lastBlock );
+    delete lastBlock;
+  }
+}
+
+
+
+void Server::clientSentFileManifest( SessionClient* client, const FileManifestMessage* message )
+{
+  SessionData* current = findSession( client );
+  if( ! current )
+  {
+    Common::fatal( "Received a message from unknown session 0x%X!", client );
+  }
+
+  if( ! current->isFileTransferSender )
+  {
+    Common::debug( "Session \"%s\" sent the contents of a folder it isn't sending", client->nickName() );
+    return;
+  }
+
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    SessionClient* peer = (*it).first;
+
+    // The clients which refused the folder don't need it, the others answer once they have it all
+    if( peer == client || peer->fileTransferAccepted() == Errors::Status_RejectFileTransfer )
     {
       continue;
     }
 
-    ChatMessage* newMessage = new ChatMessage( chatMessage );
-    newMessage->setSender( sender );
-    peer->sendMessage( newMessage );
+    FileManifestMessage* manifestMessage = new FileManifestMessage();
+    for( int i = 0; i < message->entriesCount(); i++ )
+    {
+      manifestMessage->addEntry( message->entry( i ) );
+    }
+    if( message->isLast() )
+    {
+      manifestMessage->markLast();
+    }
+
+    // Like the blocks of the files, a lost part of the list would spoil the whole transfer
+    if( ! peer->sendMessage( manifestMessage, true ) )
+    {
+      Common::error( "Unable to pass the contents of a folder on to \"%s\"", peer->nickName() );
+      delete manifestMessage;
+    }
+  }
+}
+
+
+
+void Server::clientSentFileSignature( SessionClient* client, const FileSignatureMessage* message )
+{
+  SessionData* current = findSession( client );
+  if( ! current )
+  {
+    Common::fatal( "Received a message from unknown session 0x%X!", client );
+  }
+
+  // Only kept while the client still has to answer the request
+  if( ! fileTransferModeActive_ || current->isFileTransferSender
+  ||  client->fileTransferAccepted() != Errors::Status_FileTransferCanceled )
+  {
+    Common::debug( "Session \"%s\" sent the signature of a file it wasn't asked for", client->nickName() );
+    return;
+  }
+
+  if( current->fileSignature.size() > SIGNATURE_MAX_BLOCKS / SIGNATURE_BLOCKS_PER_MESSAGE )
+  {
+    Common::error( "Session \"%s\" sent too big a file signature, the file will be sent whole", client->nickName() );
+    clearFileSignature( current );
+    return;
+  }
+
+  FileSignatureMessage* signatureMessage = new FileSignatureMessage();
+  signatureMessage->setBlockSize( message->blockSize() );
+  for( int i = 0; i < message->blocksCount(); i++ )
+  {
+    signatureMessage->addBlock( message->block( i ) );
+  }
+  if( message->isLast() )
+  {
+    signatureMessage->markLast();
+  }
+
+  current->fileSignature.push_back( signatureMessage );
+}
+
+
+
+void Server::clientJoined( SessionClient* client )
+{
+  pthread_mutex_lock( &accessMutex_ );
+  idDirectory_[ client->id() ] = client;
+  nickNameDirectory_[ NickNameKey( client->nickName() ) ] = client;
+  addRosterChange( RosterMessage::ROSTER_JOINED, client->id(), client->nickName() );
+  pthread_mutex_unlock( &accessMutex_ );
+
+  // The new user appears in the next version, which the client will get as well
+  clientRequestedRoster( client );
+
+  // Let it join the multicast group, if it can; the group is plaintext, encrypted sessions keep getting chat here
+  if( multicaster_.isActive() && ! client->isEncrypted() )
+  {
+    MulticastMessage* announcement = new MulticastMessage( MulticastMessage::MULTICAST_ANNOUNCE );
+    multicaster_.announce( announcement );
+    if( ! client->sendMessage( announcement ) )
+    {
+      delete announcement;
+    }
+  }
+}
+
+
+
+bool Server::clientJoinedStripe( SessionClient* client, const uint64_t token )
+{
+  pthread_mutex_lock( &accessMutex_ );
+
+  SessionData* current = findSession( client );
+
+  SessionData* owner = NULL;
+  std::map<uint64_t,SessionClient*>::iterator it = stripeTokens_.find( token );
+  if( it != stripeTokens_.end() )
+  {
+    owner = findSession( (*it).second );
+  }
+
+  if( current == NULL || current->state != CLIENT_STATE_START
+  ||  owner == NULL || owner->stripes.size() >= (size_t)fileStripes_ )
+  {
+    pthread_mutex_unlock( &accessMutex_ );
+    return false;
+  }
+
+  // From now on the connection is only known to its session
+  current->state = CLIENT_STATE_STRIPE;
+  current->stripeOwner = owner->client;
+  owner->stripes.push_back( client );
+  sessions_.erase( client );
+  stripes_[ client ] = current;
+
+  Common::debug( "Session \"%s\" has %lu data connections", owner->client->nickName(), owner->stripes.size() );
+
+  pthread_mutex_unlock( &accessMutex_ );
+
+  return true;
+}
+
+
+
+void Server::clientRequestedRoster( SessionClient* client )
+{
+  std::list<RosterMessage*> messages;
+
+  pthread_mutex_lock( &accessMutex_ );
+
+  // The users of the current version, spread over as many messages as needed
+  RosterMessage* message = NULL;
+  std::list<RosterMessage::Entry>::iterator it;
+  for( it = roster_.begin(); it != roster_.end(); it++ )
+  {
+    if( message == NULL || ! message->addEntry( *it ) )
+    {
+      message = new RosterMessage( rosterVersion_, true );
+      message->addEntry( *it );
+      messages.push_back( message );
+    }
+  }
+
+  if( messages.size() == 0 )
+  {
+    messages.push_back( new RosterMessage( rosterVersion_, true ) );
+  }
+
+  messages.back()->markLast();
+
+  // Queued while locked, so no newer changes can get to the client first
+  std::list<RosterMessage*>::iterator messageIt;
+  for( messageIt = messages.begin(); messageIt != messages.end(); messageIt++ )
+  {
+    if( ! client->sendMessage( *messageIt ) )
+    {
+      delete (*messageIt);
+    }
+  }
+
+  pthread_mutex_unlock( &accessMutex_ );
+}
+
+
+
+void Server::clientRequestedFileRepairs( SessionClient* client, const uint32_t transferId, const uint32_t firstBlock, const uint32_t missingBlocks )
+{
+  // Requests for a previous file may still be on their way
+  if( transferId == multicaster_.fileTransferId() )
+  {
+    multicaster_.repairFile( firstBlock, missingBlocks );
+  }
+}
+
+
+
+uint32_t Server::clientRequestedRepairs( SessionClient* client, const uint32_t sequence, const uint32_t count )
+{
+  uint32_t repairsCount = std::min( count, (uint32_t)MULTICAST_MAX_REPAIRS );
+  for( uint32_t i = 0; i < repairsCount; i++ )
+  {
+    // Never spilled: a client which can't even take them in memory would only pile up more
+    // requests on disk. It asks again for the ones which don't fit
+    MulticastMessage* repair = multicaster_.repair( sequence + i );
+    if( ! client->sendMessage( repair ) )
+    {
+      delete repair;
+      return i;
+    }
+  }
+
+  return repairsCount;
+}
+
+
+
+void Server::clientRequestedStats( SessionClient* client )
+{
+  time_t now = time( NULL );
+
+  StatsMessage::Summary summary;
+  summary.uptime = now - startTime_;
+  summary.threadsCount = threadsCount();
+  summary.connectionsAccepted = connectionsAccepted_;
+  summary.connectionsRejected = connectionsRejected_;
+  summary.slowDroppedNewest = slowConsumerCounters_[ SLOW_CONSUMER_DROP_NEWEST ];
+  summary.slowDroppedOldest = slowConsumerCounters_[ SLOW_CONSUMER_DROP_OLDEST ];
+  summary.slowSpilled = slowConsumerCounters_[ SLOW_CONSUMER_SPILL ];
+  summary.slowDisconnected = slowConsumerCounters_[ SLOW_CONSUMER_DISCONNECT ];
+
+  std::list<StatsMessage*> messages;
+
+  pthread_mutex_lock( &accessMutex_ );
+
+  summary.sessionsCount = sessions_.size();
+
+  // Describe all sessions, spread over as many messages as needed
+  StatsMessage* message = NULL;
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    SessionClient* peer = (*it).first;
+
+    SessionBase::Statistics statistics;
+    peer->statistics( statistics );
+
+    StatsMessage::Entry entry;
+    memset( &entry, '\0', sizeof( StatsMessage::Entry ) );
+    strncpy( entry.nickName, peer->nickName(), MAX_NICKNAME_SIZE - 1 );
+    entry.bytesIn = statistics.bytesIn;
+    entry.bytesOut = statistics.bytesOut;
+    entry.messagesIn = statistics.messagesIn;
+    entry.messagesOut = statistics.messagesOut;
+    entry.messagesDropped = statistics.messagesDropped;
+    entry.queueDepth = statistics.queueDepth;
+
+    time_t duration = ( now > statistics.startTime ) ? ( now - statistics.startTime ) : 1;
+    entry.rateIn = statistics.bytesIn / duration;
+    entry.rateOut = statistics.bytesOut / duration;
+
+    if( message == NULL || ! message->addEntry( entry ) )
+    {
+      message = new StatsMessage();
+      message->setSummary( summary );
+      message->addEntry( entry );
+      messages.push_back( message );
+    }
+  }
+
+  pthread_mutex_unlock( &accessMutex_ );
+
+  // Only the summary if there is nothing else
+  if( messages.size() == 0 )
+  {
+    message = new StatsMessage();
+    message->setSummary( summary );
+    messages.push_back( message );
+  }
+
+  messages.back()->markLast();
+
+  std::list<StatsMessage*>::iterator messageIt;
+  for( messageIt = messages.begin(); messageIt != messages.end(); messageIt++ )
+  {
+    if( ! client->sendMessage( *messageIt ) )
+    {
+      delete (*messageIt);
+    }
+  }
+}
+
+
+
+bool Server::clientSentFileTransferRequest( SessionClient* client, const FileTransferMessage* message )
+{
+  SessionData* current = findSession( client );
+  if( ! current )
+  {
+    Common::fatal( "Received a message from unknown session 0x%X!", client );
+  }
+
+  // The user is alone by him/herself in chat
+  if( sessions_.size() == 1 )
+  {
+    return false;
+  }
+
+  // Enable the file transfer
+  fileTransferModeActive_ = true;
+
+  const char* filePath = message->fileName();
+  const char* fileName = basename( filePath );
+  const char* sender = client->nickName();
+
+  Common::debug( "Session \"%s\" wants to send file \"%s\"", sender, fileName );
+
+  // The receivers will connect to the sender at the address it has on this side
+  sockaddr_in senderAddress;
+  memset( &senderAddress, '\0', sizeof( senderAddress ) );
+  current->isFileTransferDirect = ( message->directPort() != 0 );
+  if( current->isFileTransferDirect && ! client->peerAddress( senderAddress ) )
+  {
+    Common::error( "Unable to get the address of \"%s\": %s", sender, strerror( errno ) );
+  }
+
+  // Send the same message to everybody but the sender
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    SessionClient* peer = (*it).first;
+
+    // Don't send back the same message
+    if( peer == client )
+    {
+      continue;
+    }
+
+    FileTransferMessage* transferMessage = new FileTransferMessage( fileName );
+    transferMessage->setEntriesCount( message->entriesCount() );
+    transferMessage->setFileSize( message->fileSize() );
+    transferMessage->setSender( sender );
+    transferMessage->setTransferId( message->transferId() );
+    if( current->isFileTransferDirect )
+    {
+      transferMessage->setDirectAddress( senderAddress.sin_addr.s_addr, message->directPort() );
+      transferMessage->setDirectToken( message->directToken() );
+    }
+
+    // Clients which don't answer in time, or which didn't even get the request, don't block the transfer
+    peer->awaitFileTransferResponse();
+    clearFileSignature( (*it).second );
+    deliver( peer, transferMessage );
+  }
+
+  // Allow to identify the initial sender
+  current->isFileTransferSender = true;
+
+  // The data doesn't cross servers: only tell the rest of the federation about it,
+  // unless the sender expects its traffic to be encrypted
+  if( client->isEncrypted() )
+  {
+    return true;
+  }
+
+  char announcement[ MAX_CHATMESSAGE_SIZE ];
+  snprintf( announcement, MAX_CHATMESSAGE_SIZE, "* is sending the file \"%s\" to the users of another server", fileName );
+
+  ChatMessage announcementMessage( announcement );
+  announcementMessage.setSender( sender );
+
+  int frameSize;
+  char* frame = SessionBase::serializeMessage( &announcementMessage, frameSize );
+  relay( RelayMessage::RELAY_FILE_REQUEST, frame, frameSize );
+  free( frame );
+
+  return true;
+}
+
+
+
+bool Server::clientSentFileTransferResponse( SessionClient* client, bool accept )
+{
+  SessionData* current = findSession( client );
+  if( ! current )
+  {
+    Common::fatal( "Received a message from unknown session 0x%X!", client );
+  }
+
+  // The user is alone by him/herself in chat
+  if( sessions_.size() == 1 )
+  {
+    return false;
+  }
+
+  Common::debug( "Checking whether the transfer can be started" );
+
+  // If all clients have confirmed, allow the sender to start transmitting the file
+  bool allClientsConfirmed = true;
+  bool canStart = false;
+  SessionClient* sender = 0;
+  SessionData* senderData = NULL;
+
+  // The file continues from where all the receivers have it
+  int64_t offset = -1;
+
+  // The only receiver, if there's one: it may already have an older copy of the file
+  int receiversCount = 0;
+  SessionData* receiverData = NULL;
+
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    SessionClient* peer = (*it).first;
+    SessionData* peerData = (*it).second;
+
+    // The sender doesn't answer its own request
+    if( peerData->isFileTransferSender )
+    {
+      sender = peer;
+      senderData = peerData;
+      continue;
+    }
+
+    // Nor do the connections which didn't log in, like data connections on their way
+    if( peerData->state == CLIENT_STATE_START )
+    {
+      continue;
+    }
+
+    if( peer->fileTransferAccepted() == Errors::Status_FileTransferCanceled )
+    {
+      allClientsConfirmed = false;
+      break;
+    }
+
+    if( peer->fileTransferAccepted() == Errors::Status_AcceptFileTransfer )
+    {
+      canStart = true;
+      receiversCount++;
+      receiverData = peerData;
+      if( offset == -1 || peer->fileTransferOffset() < offset )
+      {
+        offset = peer->fileTransferOffset();
+      }
+    }
+  }
+
+  Common::debug( "All clients have confirmed? %s. Can the FT start? %s. Is sender set? %s",
+                 allClientsConfirmed ? "yes" : "no",
+                 canStart ? "yes" : "no",
+                 sender ? "yes" : "no" );
+
+  // Send the file transfer initiator the OK to send the file,
+  // if everybody has answered the request and at least one has said yes
+  if( allClientsConfirmed && sender )
+  {
+    StatusMessage* answer;
+    if( canStart )
+    {
+      answer = new StatusMessage( Errors::Status_AcceptFileTransfer );
+      answer->setFileOffset( offset );
+    }
+    else
+    {
+      answer = new StatusMessage( Errors::Status_RejectFileTransfer );
+    }
+
+    // With a single receiver, the sender can leave out what it has already; the blocks
+    // which stand for its older copy don't make sense to anyone else, so they're never multicast
+    bool isDelta = ( receiversCount == 1 && offset == 0 && receiverData->fileSignature.size() > 0
+                 &&  receiverData->fileSignature.back()->isLast() );
+    if( isDelta )
+    {
+      Common::debug( "Passing the signature of \"%s\" on to the sender", receiverData->client->nickName() );
+      while( receiverData->fileSignature.size() > 0 )
+      {
+        FileSignatureMessage* signatureMessage = receiverData->fileSignature.front();
+        receiverData->fileSignature.pop_front();
+        if( ! sender->sendMessage( signatureMessage, true ) )
+        {
+          Common::error( "Unable to pass a file signature on to \"%s\"", sender->nickName() );
+          delete signatureMessage;
+        }
+      }
+    }
+    for( it = sessions_.begin(); it != sessions_.end(); it++ )
+    {
+      clearFileSignature( (*it).second );
+    }
+
+    // The file doesn't go through this server: it's done with the transfer once the sender has the answer
+    if( senderData->isFileTransferDirect )
+    {
+      senderData->isFileTransferSender = false;
+      senderData->isFileTransferDirect = false;
+      fileTransferModeActive_ = false;
+      canStart = false;
+    }
+
+    if( canStart )
+    {
+      if( ! isDelta )
+      {
+        startMulticastFile( sender );
+      }
+
+      senderData->fileStart = offset;
+      senderData->fileReceived = 0;
+      clearFileLastBlock( senderData );
+
+      // The blocks which don't go through the multicast group can be spread over more connections,
+      // which must be offered before the sender starts
+      if( multicaster_.fileTransferId() == 0 )
+      {
+        offerStripes( senderData );
+      }
+      for( it = sessions_.begin(); it != sessions_.end(); it++ )
+      {
+        SessionData* peerData = (*it).second;
+        if( peerData != senderData && ! peerData->isMulticastFileReceiver
+        &&  (*it).first->fileTransferAccepted() == Errors::Status_AcceptFileTransfer )
+        {
+          offerStripes( peerData );
+        }
+      }
+    }
+    // Behind a whole signature, the queue may be full: the answer can't be lost
+    if( ! sender->sendMessage( answer, true ) )
+    {
+      Common::error( "Unable to answer the file transfer request of \"%s\"", sender->nickName() );
+      delete answer;
+    }
+  }
+
+  return true;
+}
+
+
+
+bool Server::clientSentPrivateMessage( SessionClient* client, const PrivateMessage* message )
+{
+  // Look the recipient up, rather than going through all the sessions
+  pthread_mutex_lock( &accessMutex_ );
+
+  SessionClient* recipient = NULL;
+  if( message->recipientId() != 0 )
+  {
+    std::map<unsigned int,SessionClient*>::iterator it = idDirectory_.find( message->recipientId() );
+    if( it != idDirectory_.end() )
+    {
+      recipient = (*it).second;
+    }
+  }
+  else
+  {
+    std::map<NickNameKey,SessionClient*>::iterator it = nickNameDirectory_.find( NickNameKey( message->recipient() ) );
+    if( it != nickNameDirectory_.end() )
+    {
+      recipient = (*it).second;
+    }
+  }
+
+  if( recipient != NULL )
+  {
+    Common::debug( "Session \"%s\" sent a private message to \"%s\"", client->nickName(), recipient->nickName() );
+
+    PrivateMessage* newMessage = new PrivateMessage( message->message() );
+    newMessage->setSender( client->nickName(), client->id() );
+    newMessage->setRecipient( recipient->nickName(), recipient->id() );
+
+    pthread_mutex_unlock( &accessMutex_ );
+
+    deliver( recipient, newMessage );
+    return true;
+  }
+
+  pthread_mutex_unlock( &accessMutex_ );
+
+  // Users of other servers can only be reached by nickname, and links are not encrypted
+  if( message->recipientId() != 0 || client->isEncrypted() )
+  {
+    return false;
+  }
+
+  bool isRemote = false;
+  pthread_mutex_lock( &federationMutex_ );
+  std::list<RemoteNickName>::iterator remoteIt;
+  for( remoteIt = remoteNickNames_.begin(); remoteIt != remoteNickNames_.end(); remoteIt++ )
+  {
+    if( strcasecmp( (*remoteIt).nickName, message->recipient() ) == 0 )
+    {
+      isRemote = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &federationMutex_ );
+
+  if( ! isRemote )
+  {
+    return false;
+  }
+
+  // Ids only mean something on the server of the user
+  PrivateMessage remoteMessage( message->message() );
+  remoteMessage.setSender( client->nickName() );
+  remoteMessage.setRecipient( message->recipient() );
+
+  int frameSize;
+  char* frame = SessionBase::serializeMessage( &remoteMessage, frameSize );
+
+  // Every server gets it, the one of the recipient delivers it
+  char* data = static_cast<char*>( malloc( MAX_NICKNAME_SIZE + frameSize ) );
+  memcpy( data, remoteMessage.recipient(), MAX_NICKNAME_SIZE );
+  memcpy( data + MAX_NICKNAME_SIZE, frame, frameSize );
+  relay( RelayMessage::RELAY_PRIVATE, data, MAX_NICKNAME_SIZE + frameSize );
+
+  free( data );
+  free( frame );
+
+  return true;
+}
+
+
+void Server::clientSubscribedToMulticast( SessionClient* client )
+{
+  pthread_mutex_lock( &accessMutex_ );
+
+  SessionData* current = findSession( client );
+  if( current == NULL || current->isMulticastSubscriber || client->isEncrypted() )
+  {
+    pthread_mutex_unlock( &accessMutex_ );
+    return;
+  }
+
+  // Chat messages are sent while locked too: the ones before this sequence number
+  // were queued in the session, the next ones only go to the group
+  current->isMulticastSubscriber = true;
+
+  MulticastMessage* reply = new MulticastMessage( MulticastMessage::MULTICAST_SUBSCRIBE );
+  multicaster_.announce( reply );
+  reply->setSequence( multicaster_.nextSequence() );
+  reply->setClientId( client->id() );
+
+  // The client can't do without it, as if it was one of the messages it replaces
+  if( ! client->sendMessage( reply, true ) )
+  {
+    delete reply;
+    current->isMulticastSubscriber = false;
+  }
+
+  pthread_mutex_unlock( &accessMutex_ );
+
+  Common::debug( "Session \"%s\" gets the chat messages through the multicast group", client->nickName() );
+}
+
+
+
+Server::SessionData* Server::findSession( SessionClient* client )
+{
+  std::map<SessionClient*,SessionData*>::iterator it = sessions_.find( client );
+
+  if( it == sessions_.end() )
+  {
+    it = stripes_.find( client );
+    if( it == stripes_.end() )
+    {
+      return NULL;
+    }
+  }
+
+  return (*it).second;
+}
+
+
+
+Errors::ErrorCode Server::checkPortFree( const sockaddr_in& address )
+{
+  // Without SO_REUSEPORT, the bind fails if any other socket listens on the port
+  int probeSocket;
+  Errors::ErrorCode status = createListenSocket( address, false, probeSocket );
+  if( status != Errors::Error_None )
+  {
+    return status;
+  }
+
+  close( probeSocket );
+  return Errors::Error_None;
+}
+
+
+
+void Server::connectPeers()
+{
+  std::list<FederationTarget*> unlinked;
+
+  pthread_mutex_lock( &federationMutex_ );
+  std::list<FederationTarget*>::iterator it;
+  for( it = federationTargets_.begin(); it != federationTargets_.end(); it++ )
+  {
+    if( (*it)->link == NULL )
+    {
+      unlinked.push_back( *it );
+    }
+  }
+  pthread_mutex_unlock( &federationMutex_ );
+
+  for( it = unlinked.begin(); it != unlinked.end(); it++ )
+  {
+    FederationTarget* target = (*it);
+
+    char port[ 16 ];
+    snprintf( port, sizeof( port ), "%d", target->port );
+
+    addrinfo hints;
+    memset( &hints, '\0', sizeof( addrinfo ) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* addresses;
+    if( getaddrinfo( target->host, port, &hints, &addresses ) != 0 )
+    {
+      Common::error( "Unable to find server %s", target->host );
+      continue;
+    }
+
+    int newSocket = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    int result = connect( newSocket, addresses->ai_addr, addresses->ai_addrlen );
+    freeaddrinfo( addresses );
+
+    // Don't let an unreachable server hold up the others
+    if( result == -1 && errno == EINPROGRESS )
+    {
+      pollfd watched;
+      watched.fd = newSocket;
+      watched.events = POLLOUT;
+
+      int error = ETIMEDOUT;
+      socklen_t errorSize = sizeof( error );
+      if( poll( &watched, 1, FEDERATION_CONNECT_TIMEOUT ) == 1 )
+      {
+        getsockopt( newSocket, SOL_SOCKET, SO_ERROR, &error, &errorSize );
+      }
+
+      result = ( error == 0 ) ? 0 : -1;
+      errno = error;
+    }
+
+    if( result == -1 )
+    {
+      Common::debug( "Unable to link to server %s:%d: %s", target->host, target->port, strerror( errno ) );
+      close( newSocket );
+      continue;
+    }
+
+    char name[ MAX_PATH_SIZE + 16 ];
+    snprintf( name, sizeof( name ), "%s:%d", target->host, target->port );
+    addPeer( newSocket, name, target );
+  }
+}
+
+
+
+Errors::ErrorCode Server::createListenSocket( const sockaddr_in& address, bool reusePort, int& newSocket )
+{
+  // Non-blocking, so the acceptors can empty the backlog without stalling on it
+  newSocket = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if( newSocket == -1 )
+  {
+    return Errors::Error_Socket_Init;
+  }
+
+  int yes = 1;
+  int result;
+  result = setsockopt( newSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) );
+  if( result == -1 )
+  {
+    close( newSocket );
+    return Errors::Error_Socket_Option;
+  }
+
+  if( reusePort )
+  {
+    result = setsockopt( newSocket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof( int ) );
+    if( result == -1 )
+    {
+      close( newSocket );
+      return Errors::Error_Socket_Option;
+    }
+  }
+
+  // Listen on the specified address and port
+  result = bind( newSocket, reinterpret_cast<const sockaddr*>( &address ), sizeof( sockaddr ) );
+  if( result == -1 )
+  {
+    close( newSocket );
+    return Errors::Error_Socket_Bind;
+  }
+  result = listen( newSocket, SERVER_LISTEN_BACKLOG );
+  if( result == -1 )
+  {
+    close( newSocket );
+    return Errors::Error_Socket_Listen;
+  }
+
+  return Errors::Error_None;
+}
+
+
+
+void Server::deliver( SessionClient* peer, Message* message )
+{
+  // Clients which are leaving don't need any more messages
+  if( ! peer->isConnected() )
+  {
+    delete message;
+    return;
+  }
+
+  bool isSpilled;
+  if( peer->sendMessage( message, ( slowConsumerPolicy_ == SLOW_CONSUMER_SPILL ), &isSpilled ) )
+  {
+    if( isSpilled )
+    {
+      __sync_fetch_and_add( &slowConsumerCounters_[ SLOW_CONSUMER_SPILL ], 1 );
+    }
+    return;
+  }
+
+  switch( slowConsumerPolicy_ )
+  {
+    case SLOW_CONSUMER_DROP_OLDEST:
+      if( peer->replaceOldestMessage( message ) )
+      {
+        __sync_fetch_and_add( &slowConsumerCounters_[ SLOW_CONSUMER_DROP_OLDEST ], 1 );
+        return;
+      }
+      break;
+
+    case SLOW_CONSUMER_SPILL:
+      // Not even the disk can hold more: the client will never catch up
+      Common::debug( "Session \"%s\" can't spill any more messages, dropping it", peer->nickName() );
+      __sync_fetch_and_add( &slowConsumerCounters_[ SLOW_CONSUMER_DISCONNECT ], 1 );
+      peer->dropConnection();
+      delete message;
+      return;
+
+    case SLOW_CONSUMER_DISCONNECT:
+      if( peer->secondsBehind() >= slowConsumerTimeout_ )
+      {
+        Common::debug( "Session \"%s\" has been behind for too long, dropping it", peer->nickName() );
+        __sync_fetch_and_add( &slowConsumerCounters_[ SLOW_CONSUMER_DISCONNECT ], 1 );
+        peer->dropConnection();
+        delete message;
+        return;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  __sync_fetch_and_add( &slowConsumerCounters_[ SLOW_CONSUMER_DROP_NEWEST ], 1 );
+  delete message;
+}
+
+
+
+void Server::dropFileReceivers( const std::list<uint32_t>& clientIds, const uint32_t transferId )
+{
+  std::list<uint32_t>::const_iterator it;
+  for( it = clientIds.begin(); it != clientIds.end(); it++ )
+  {
+    std::map<unsigned int,SessionClient*>::iterator directoryIt = idDirectory_.find( *it );
+    if( directoryIt == idDirectory_.end() )
+    {
+      continue;
+    }
+
+    SessionClient* receiver = (*directoryIt).second;
+    SessionData* data = findSession( receiver );
+    if( data != NULL )
+    {
+      data->isMulticastFileReceiver = false;
+    }
+
+    MulticastMessage* abort = new MulticastMessage( MulticastMessage::MULTICAST_FILE_ABORT );
+    abort->setTransferId( transferId );
+    if( ! receiver->sendMessage( abort, true ) )
+    {
+      delete abort;
+    }
+  }
+}
+
+
+
+void Server::endMulticastFile()
+{
+  uint32_t transferId = multicaster_.fileTransferId();
+
+  timers_.cancel( &multicastFileTimer_ );
+
+  std::list<uint32_t> unfinished;
+  bool wasSent = multicaster_.endFile( unfinished );
+  dropFileReceivers( unfinished, transferId );
+
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    (*it).second->isMulticastFileReceiver = false;
+  }
+
+  // Otherwise the sender still has to finish, for the clients which get the file through their sessions
+  if( wasSent )
+  {
+    Common::debug( "The multicast file transfer %u is over", transferId );
+    fileTransferModeActive_ = false;
+  }
+}
+
+
+
+void Server::flushRoster()
+{
+  pthread_mutex_lock( &accessMutex_ );
+  sendRosterChanges();
+  pthread_mutex_unlock( &accessMutex_ );
+}
+
+
+
+Errors::ErrorCode Server::initialize( const char* address, const int port, const bool takeOver )
+{
+  // Without a safe place for the handoff socket, the server can't be upgraded
+  if( ! Handoff::socketPath( port, handoffPath_, MAX_PATH_SIZE ) )
+  {
+    *handoffPath_ = '\0';
+  }
+
+  // The log doesn't depend on where the server was started from; servers running side by side keep separate logs
+  char chatLogDirectory[ MAX_PATH_SIZE ];
+  if( *chatLogDirectory_ != '\0' )
+  {
+    snprintf( chatLogDirectory, MAX_PATH_SIZE, "%s", chatLogDirectory_ );
+  }
+  else
+  {
+    const char* home = getenv( "HOME" );
+    if( home == NULL || *home == '\0' )
+    {
+      passwd* user = getpwuid( getuid() );
+      home = ( user != NULL ) ? user->pw_dir : "/tmp";
+    }
+
+    if( port == SERVER_PORT )
+    {
+      snprintf( chatLogDirectory, MAX_PATH_SIZE, "%s/%s", home, CHATLOG_DIRECTORY );
+    }
+    else
+    {
+      snprintf( chatLogDirectory, MAX_PATH_SIZE, "%s/%s-%d", home, CHATLOG_DIRECTORY, port );
+    }
+  }
+
+  if( takeOver )
+  {
+    Errors::ErrorCode status = this->takeOver();
+    if( status != Errors::Error_None )
+    {
+      return status;
+    }
+
+    // The previous server has closed the log: continue it
+    if( ! chatLog_.open( chatLogDirectory ) )
+    {
+      Common::error( "The chat log is disabled" );
+    }
+
+    hasTakenOver_ = true;
+    startAcceptors();
+    listenForHandoff();
+    return Errors::Error_None;
+  }
+
+  // Convert the IP string to an usable binary address
+  in_addr listenAddr;
+  if( inet_aton( address, &listenAddr ) == 0 )
+  {
+    return Errors::Error_Invalid_Address;
+  }
+
+  // Set up the address where to listen
+  sockaddr_in myAddress;
+  myAddress.sin_family = AF_INET;
+  myAddress.sin_port = htons( port );
+  myAddress.sin_addr.s_addr = listenAddr.s_addr;
+  memset( &( myAddress.sin_zero ), '\0', 8 );
+  Common::debug( "Will listen on %s:%d", address, port );
+
+  // SO_REUSEPORT would let another server share the port, make sure nobody uses it
+  // before touching its log
+  Errors::ErrorCode portStatus = checkPortFree( myAddress );
+  if( portStatus != Errors::Error_None )
+  {
+    return portStatus;
+  }
+
+  // The server works without a log, too
+  if( ! chatLog_.open( chatLogDirectory ) )
+  {
+    Common::error( "The chat log is disabled" );
+  }
+  else
+  {
+    // Show the new users what was said before the server was restarted
+    uint64_t nextSequence = chatLog_.nextSequence();
+    uint64_t sequence = ( nextSequence > CHAT_HISTORY_SIZE ) ? nextSequence - CHAT_HISTORY_SIZE : 1;
+    for( ; sequence < nextSequence; sequence++ )
+    {
+      int frameSize;
+      char* frame = chatLog_.read( sequence, frameSize );
+      if( frame != NULL )
+      {
+        history_.add( frame, frameSize );
+        free( frame );
+      }
+    }
+  }
+
+  // Give each acceptor its own socket. If the system doesn't support SO_REUSEPORT,
+  // go on with a single one.
+  for( int i = 0; i < SERVER_ACCEPT_THREADS; i++ )
+  {
+    int newSocket;
+    Errors::ErrorCode status = createListenSocket( myAddress, true, newSocket );
+
+    if( status == Errors::Error_Socket_Option && i == 0 )
+    {
+      Common::debug( "SO_REUSEPORT is not available, using a single acceptor" );
+      status = createListenSocket( myAddress, false, newSocket );
+      i = SERVER_ACCEPT_THREADS;
+    }
+
+    if( status != Errors::Error_None )
+    {
+      if( acceptorsCount_ > 0 )
+      {
+        Common::error( "Unable to create listening socket %d: error %d", i, status );
+        break;
+      }
+      return status;
+    }
+
+    Acceptor& acceptor = acceptors_[ acceptorsCount_++ ];
+    acceptor.server = this;
+    acceptor.socket = newSocket;
+  }
+
+  startAcceptors();
+
+  // Allow a newer server to replace this one without dropping the connections
+  listenForHandoff();
+
+  return Errors::Error_None;
+}
+
+
+
+bool Server::handOff( const int connection )
+{
+  Common::debug( "Handing off the server to a new process..." );
+
+  // The encryption state of the sessions lives in this process, and can't be passed on
+  if( tlsContext_ != NULL )
+  {
+    Common::error( "Servers with encrypted connections can't be handed off" );
+    return false;
+  }
+
+  // So do the blocks kept for the receivers of a multicast file
+  if( multicaster_.fileTransferId() != 0 )
+  {
+    Common::error( "Servers sending a file through the multicast group can't be handed off" );
+    return false;
+  }
+
+  // And the data connections, which only make sense along with their sessions
+  pthread_mutex_lock( &accessMutex_ );
+  bool hasStripes = ( stripes_.size() > 0 );
+  pthread_mutex_unlock( &accessMutex_ );
+  if( hasStripes )
+  {
+    Common::error( "Servers with data connections open for a file transfer can't be handed off" );
+    return false;
+  }
+
+  // Stop accepting connections; the sockets stay open and keep queueing them
+  for( int i = 0; i < acceptorsCount_; i++ )
+  {
+    pthread_cancel( acceptors_[ i ].thread );
+    pthread_join( acceptors_[ i ].thread, NULL );
+  }
+
+  // Stop all sessions, so their state doesn't change anymore
+  std::vector<pthread_t> threads;
+  pthread_mutex_lock( &accessMutex_ );
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    (*it).first->suspend();
+    threads.push_back( (*it).second->thread );
+  }
+  pthread_mutex_unlock( &accessMutex_ );
+
+  // Sessions which end meanwhile remove themselves
+  for( size_t i = 0; i < threads.size(); i++ )
+  {
+    pthread_join( threads[ i ], NULL );
+  }
+
+  // Messages already received are delivered before the sessions are taken
+  router_.drain();
+
+  pthread_mutex_lock( &accessMutex_ );
+  sendRosterChanges();
+  pthread_mutex_unlock( &accessMutex_ );
+
+  // The new process will continue the log from where this one stops
+  char chatLogDirectory[ MAX_PATH_SIZE ];
+  snprintf( chatLogDirectory, MAX_PATH_SIZE, "%s", chatLog_.directory() );
+  chatLog_.close();
+
+  pthread_mutex_lock( &accessMutex_ );
+
+  // Send the server state, along with the listening sockets
+  int listenSockets[ SERVER_ACCEPT_THREADS ];
+  for( int i = 0; i < acceptorsCount_; i++ )
+  {
+    listenSockets[ i ] = acceptors_[ i ].socket;
+  }
+
+  int historySize = 0;
+  char* history = NULL;
+  RawMessage* historyMessage = history_.replay();
+  if( historyMessage )
+  {
+    history = SessionBase::serializeMessage( historyMessage, historySize );
+    delete historyMessage;
+  }
+
+  Handoff::Header header;
+  header.magic = HANDOFF_MAGIC;
+  header.listenSocketsCount = acceptorsCount_;
+  header.sessionsCount = sessions_.size();
+  header.connectionsCounter = connectionsCounter_;
+  header.isFileTransferModeActive = fileTransferModeActive_;
+  header.historySize = historySize;
+  header.rosterVersion = rosterVersion_;
+
+  bool isOk = Handoff::sendWithDescriptors( connection, &header, sizeof( Handoff::Header ), listenSockets, acceptorsCount_ )
+           && Handoff::send( connection, history, historySize );
+  free( history );
+
+  // Then each session's state, along with its socket
+  std::list<SessionData*> sessions;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    SessionClient* client = (*it).first;
+    SessionData* data = (*it).second;
+    sessions.push_back( data );
+
+    Handoff::Session record;
+    memset( &record, '\0', sizeof( Handoff::Session ) );
+
+    char* input;
+    char* output;
+    int inputSize, outputSize;
+    bool isDisconnecting;
+    int socket = client->exportState( input, inputSize, output, outputSize, isDisconnecting );
+
+    strncpy( record.nickName, client->nickName(), MAX_NICKNAME_SIZE - 1 );
+    record.id = client->id();
+    record.state = data->state;
+    record.isFileTransferSender = data->isFileTransferSender;
+    record.fileTransferStatus = client->fileTransferAccepted();
+    record.hasJoined = client->hasJoined();
+    record.isDisconnecting = isDisconnecting;
+    record.inputSize = inputSize;
+    record.outputSize = outputSize;
+
+    isOk = isOk
+        && Handoff::sendWithDescriptors( connection, &record, sizeof( Handoff::Session ), &socket, 1 )
+        && Handoff::send( connection, input, inputSize )
+        && Handoff::send( connection, output, outputSize );
+
+    // Put the state back, in case the new process fails
+    client->importState( input, inputSize, output, outputSize, isDisconnecting );
+    free( input );
+    free( output );
+  }
+
+  // Wait for the new process to confirm it has everything
+  char confirmation = 0;
+  isOk = isOk && Handoff::receive( connection, &confirmation, 1 ) && confirmation == 1;
+
+  if( ! isOk )
+  {
+    Common::error( "The handoff failed, resuming" );
+
+    chatLog_.open( chatLogDirectory );
+    startSessions( sessions );
+    pthread_mutex_unlock( &accessMutex_ );
+
+    startAcceptors();
+    return false;
+  }
+
+  // The users are still online through the new process: the federation mustn't hear they left
+  isHandedOff_ = true;
+
+  pthread_mutex_unlock( &accessMutex_ );
+
+  // The new process owns the connections now. Closing our copies of the sockets doesn't affect them
+  fileTransferModeActive_ = false;
+  std::list<SessionData*>::iterator sessionIt;
+  for( sessionIt = sessions.begin(); sessionIt != sessions.end(); sessionIt++ )
+  {
+    delete (*sessionIt)->client;
+  }
+
+  for( int i = 0; i < acceptorsCount_; i++ )
+  {
+    close( acceptors_[ i ].socket );
+  }
+  acceptorsCount_ = 0;
+
+  Common::debug( "The server was handed off to the new process, quitting" );
+
+  // Let main() terminate normally
+  kill( getpid(), SIGTERM );
+
+  return true;
+}
+
+
+
+bool Server::isFileTransferModeActive()
+{
+  return fileTransferModeActive_;
+}
+
+
+
+bool Server::isPeerTrusted( SessionPeer* peer )
+{
+  pthread_mutex_lock( &federationMutex_ );
+  bool isTrusted = peer->isTrusted();
+  pthread_mutex_unlock( &federationMutex_ );
+
+  return isTrusted;
+}
+
+
+
+void Server::joinFederation( const char* host, const int port )
+{
+  FederationTarget* target = new FederationTarget;
+  memset( target->host, '\0', MAX_PATH_SIZE );
+  strncpy( target->host, host, MAX_PATH_SIZE - 1 );
+  target->port = port;
+  target->link = NULL;
+
+  pthread_mutex_lock( &federationMutex_ );
+  federationTargets_.push_back( target );
+  pthread_mutex_unlock( &federationMutex_ );
+}
+
+
+
+bool Server::listenForHandoff()
+{
+  if( *handoffPath_ == '\0' )
+  {
+    Common::error( "Upgrades without disconnecting the clients are disabled" );
+    return false;
+  }
+
+  handoffSocket_ = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if( handoffSocket_ == -1 )
+  {
+    Common::error( "Unable to create the handoff socket: %s", strerror( errno ) );
+    return false;
+  }
+
+  sockaddr_un address;
+  memset( &address, '\0', sizeof( sockaddr_un ) );
+  address.sun_family = AF_UNIX;
+  strncpy( address.sun_path, handoffPath_, sizeof( address.sun_path ) - 1 );
+
+  // A previous server, if any, has already handed off to us
+  unlink( handoffPath_ );
+
+  if( bind( handoffSocket_, reinterpret_cast<sockaddr*>( &address ), sizeof( sockaddr_un ) ) == -1
+  ||  listen( handoffSocket_, 1 ) == -1 )
+  {
+    Common::error( "Unable to listen on %s: %s", handoffPath_, strerror( errno ) );
+    close( handoffSocket_ );
+    handoffSocket_ = -1;
+    return false;
+  }
+
+  if( handoffThread_ == 0 )
+  {
+    pthread_create( &handoffThread_, NULL, &Server::waitHandoff, this );
+  }
+
+  return true;
+}
+
+
+
+void Server::markFileEnd( SessionData* data )
+{
+  std::list<SessionClient*> connections( data->stripes );
+  connections.push_front( data->client );
+
+  std::list<SessionClient*>::iterator it;
+  for( it = connections.begin(); it != connections.end(); it++ )
+  {
+    // Without it, the receiver would wait forever for the blocks of the other connections
+    StripeMessage* mark = new StripeMessage( StripeMessage::STRIPE_END, data->stripeToken, connections.size() );
+    if( ! (*it)->sendMessage( mark, true ) )
+    {
+      delete mark;
+    }
+  }
+}
+
+
+
+SessionClient* Server::nextFileConnection( SessionData* data )
+{
+  unsigned int count = data->stripes.size() + 1;
+
+  for( unsigned int i = 0; i < count; i++ )
+  {
+    unsigned int index = data->nextStripe++ % count;
+
+    SessionClient* connection = data->client;
+    if( index > 0 )
+    {
+      std::list<SessionClient*>::iterator it = data->stripes.begin();
+      std::advance( it, index - 1 );
+      connection = *it;
+    }
+
+    if( connection->isConnected() && connection->canSendMessages() )
+    {
+      return connection;
+    }
+  }
+
+  return NULL;
+}
+
+
+
+void Server::offerStripes( SessionData* data )
+{
+  if( fileStripes_ == 0 )
+  {
+    return;
+  }
+
+  // Whoever has the token can add connections to the session, so it's kept for its whole life
+  if( data->stripeToken == 0 )
+  {
+    uint64_t token = randomNumber();
+    if( token == 0 || stripeTokens_.find( token ) != stripeTokens_.end() )
+    {
+      return;
+    }
+
+    data->stripeToken = token;
+    stripeTokens_[ token ] = data->client;
+  }
+
+  StripeMessage* offer = new StripeMessage( StripeMessage::STRIPE_OFFER, data->stripeToken, fileStripes_ );
+  if( ! data->client->sendMessage( offer ) )
+  {
+    delete offer;
+  }
+}
+
+
+
+void Server::peerSentChallenge( SessionPeer* peer, const RelayMessage* message )
+{
+  if( message->dataSize() != FEDERATION_CHALLENGE_SIZE )
+  {
+    Common::error( "Link to server %s sent an invalid challenge", peer->name() );
+    return;
+  }
+
+  unsigned char proof[ SHA256_DIGEST_LENGTH ];
+  signChallenge( message->data(), serverId_, proof );
+
+  pthread_mutex_lock( &federationMutex_ );
+  sendToPeer( peer, new RelayMessage( serverId_, 0, RelayMessage::RELAY_PROOF, (const char*)proof, SHA256_DIGEST_LENGTH ) );
+  pthread_mutex_unlock( &federationMutex_ );
+}
+
+
+
+bool Server::peerSentProof( SessionPeer* peer, const RelayMessage* message )
+{
+  // A server can't answer its own challenge by sending it back to us
+  if( message->origin() == serverId_ || message->dataSize() != SHA256_DIGEST_LENGTH )
+  {
+    return false;
+  }
+
+  unsigned char proof[ SHA256_DIGEST_LENGTH ];
+  signChallenge( peer->challenge(), message->origin(), proof );
+  if( CRYPTO_memcmp( proof, message->data(), SHA256_DIGEST_LENGTH ) != 0 )
+  {
+    return false;
+  }
+
+  pthread_mutex_lock( &federationMutex_ );
+  bool isAlreadyTrusted = peer->isTrusted();
+  peer->setTrusted();
+  pthread_mutex_unlock( &federationMutex_ );
+
+  if( ! isAlreadyTrusted )
+  {
+    Common::debug( "Server %s proved it's part of the federation", peer->name() );
+    announceNickNames( peer );
+  }
+
+  return true;
+}
+
+
+
+void Server::peerSentRelay( SessionPeer* peer, const RelayMessage* message )
+{
+  pthread_mutex_lock( &federationMutex_ );
+
+  // Drop our own relays coming back, and the ones which already arrived through another link
+  std::map<uint64_t,RelaySource>::iterator sourceIt = relaysSeen_.find( message->origin() );
+  if( message->origin() == serverId_ || ( sourceIt != relaysSeen_.end() && message->sequence() <= (*sourceIt).second.sequence ) )
+  {
+    pthread_mutex_unlock( &federationMutex_ );
+    return;
+  }
+
+  RelaySource& source = relaysSeen_[ message->origin() ];
+  source.sequence = message->sequence();
+  source.link = peer;
+
+  // Pass it on to the rest of the federation
+  int hops = message->hops() + 1;
+  if( hops < FEDERATION_MAX_HOPS )
+  {
+    std::map<SessionPeer*,pthread_t>::iterator it;
+    for( it = peers_.begin(); it != peers_.end(); it++ )
+    {
+      SessionPeer* link = (*it).first;
+      if( link == peer || ! link->isTrusted() )
+      {
+        continue;
+      }
+
+      RelayMessage* forward = new RelayMessage( message->origin(), message->sequence(), message->event(),
+                                                message->data(), message->dataSize() );
+      forward->setHops( hops );
+      sendToPeer( link, forward );
+    }
+  }
+
+  // Keep track of the nicknames used elsewhere
+  RemoteNickName nickName;
+  memset( nickName.nickName, '\0', MAX_NICKNAME_SIZE );
+  bool isNewNickName = false;
+  bool isNickNameReleased = false;
+
+  if( message->event() == RelayMessage::RELAY_NICKNAME_TAKEN )
+  {
+    strncpy( nickName.nickName, message->data(), std::min( message->dataSize(), MAX_NICKNAME_SIZE - 1 ) );
+    nickName.link = peer;
+
+    // Announced through more than one link, it's still the same user
+    isNewNickName = true;
+    std::list<RemoteNickName>::iterator it;
+    for( it = remoteNickNames_.begin(); it != remoteNickNames_.end(); it++ )
+    {
+      if( strcasecmp( (*it).nickName, nickName.nickName ) == 0 )
+      {
+        isNewNickName = false;
+        break;
+      }
+    }
+
+    remoteNickNames_.push_back( nickName );
+  }
+  else if( message->event() == RelayMessage::RELAY_NICKNAME_RELEASED )
+  {
+    // A nickname may have been announced through more than one link: forget all of them
+    std::list<RemoteNickName>::iterator it = remoteNickNames_.begin();
+    while( it != remoteNickNames_.end() )
+    {
+      if( strncasecmp( (*it).nickName, message->data(), std::min( message->dataSize(), MAX_NICKNAME_SIZE ) ) == 0 )
+      {
+        if( ! isNickNameReleased )
+        {
+          memcpy( nickName.nickName, (*it).nickName, MAX_NICKNAME_SIZE );
+          isNickNameReleased = true;
+        }
+        it = remoteNickNames_.erase( it );
+      }
+      else
+      {
+        it++;
+      }
+    }
+  }
+
+  pthread_mutex_unlock( &federationMutex_ );
+
+  // The users of the other servers are in the roster too
+  if( isNewNickName || isNickNameReleased )
+  {
+    pthread_mutex_lock( &accessMutex_ );
+    addRosterChange( isNewNickName ? RosterMessage::ROSTER_JOINED : RosterMessage::ROSTER_LEFT, 0, nickName.nickName );
+    pthread_mutex_unlock( &accessMutex_ );
+  }
+
+  // The messages for the clients are fanned out by the routing workers, like the local ones
+  if( message->event() == RelayMessage::RELAY_CHAT || message->event() == RelayMessage::RELAY_FILE_REQUEST
+  || ( message->event() == RelayMessage::RELAY_PRIVATE && message->dataSize() > MAX_NICKNAME_SIZE ) )
+  {
+    router_.submitRelay( new RelayMessage( message->origin(), message->sequence(), message->event(),
+                                           message->data(), message->dataSize() ) );
+  }
+}
+
+
+
+uint64_t Server::randomNumber()
+{
+  uint64_t number = 0;
+
+  int randomSource = open( "/dev/urandom", O_RDONLY );
+  if( randomSource == -1 || read( randomSource, &number, sizeof( number ) ) != sizeof( number ) )
+  {
+    number = ( (uint64_t)time( NULL ) << 32 ) ^ getpid();
+  }
+  if( randomSource != -1 )
+  {
+    close( randomSource );
+  }
+
+  return number;
+}
+
+
+
+RawMessage* Server::recentChatHistory()
+{
+  return history_.replay();
+}
+
+
+
+void Server::relay( const RelayMessage::Event event, const char* data, const int size, SessionPeer* peer )
+{
+  pthread_mutex_lock( &federationMutex_ );
+
+  if( peers_.size() == 0 )
+  {
+    pthread_mutex_unlock( &federationMutex_ );
+    return;
+  }
+
+  // Sequence numbers are given out while locked, so each link gets the relays in order
+  uint64_t sequence = ++relaySequence_;
+
+  std::map<SessionPeer*,pthread_t>::iterator it;
+  for( it = peers_.begin(); it != peers_.end(); it++ )
+  {
+    if( ( peer == NULL || peer == (*it).first ) && (*it).first->isTrusted() )
+    {
+      sendToPeer( (*it).first, new RelayMessage( serverId_, sequence, event, data, size ) );
+    }
+  }
+
+  pthread_mutex_unlock( &federationMutex_ );
+}
+
+
+
+void Server::relayFileData( SessionClient* sender, SessionData* senderData, const FileDataMessage* message )
+{
+  // A single copy goes to the receivers in the multicast group
+  if( multicaster_.fileTransferId() != 0 )
+  {
+    int frameSize;
+    char* frame = SessionBase::serializeMessage( message, frameSize );
+    multicaster_.publishFileBlock( frame, frameSize, message->isLastBlock() );
+    free( frame );
+  }
+
+  // Send the same message to everybody but the sender
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    SessionClient* peer = (*it).first;
+
+    // Don't send back the same message
+    if( peer == sender || (*it).second->isMulticastFileReceiver )
+    {
+      continue;
+    }
+
+    // Don't send the message to a client who refused the file transfer
+    if( peer->fileTransferAccepted() != Errors::Status_AcceptFileTransfer )
+    {
+      continue;
+    }
+
+    FileDataMessage* dataMessage = new FileDataMessage();
+    dataMessage->setBuffer( message->buffer(), message->bufferSize() );
+    dataMessage->setChecksum( message->checksum() );
+    dataMessage->setFileOffset( message->fileOffset() );
+    if( message->isCopy() )
+    {
+      dataMessage->markCopy();
+    }
+    if( message->isLastBlock() )
+    {
+      dataMessage->markLastBlock();
+      dataMessage->setFileChecksum( message->fileChecksum() );
+    }
+
+    // A lost block would spoil the whole file, and the sender waits while the receiver
+    // is behind: queue it on disk instead of applying the slow consumer policy
+    SessionClient* connection = nextFileConnection( (*it).second );
+    if( ! ( connection != NULL ? connection : peer )->sendMessage( dataMessage, true ) )
+    {
+      Common::error( "Unable to pass a file block on to \"%s\"", peer->nickName() );
+      delete dataMessage;
+    }
+
+    if( message->isLastBlock() && (*it).second->stripeToken != 0 )
+    {
+      markFileEnd( (*it).second );
+    }
+  }
+
+  if( message->isLastBlock() )
+  {
+    senderData->isFileTransferSender = false;
+
+    // The multicast receivers may still need some repairs
+    if( multicaster_.fileTransferId() == 0 )
+    {
+      fileTransferModeActive_ = false;
+    }
+  }
+}
+
+
+
+void Server::removePeer( SessionPeer* peer )
+{
+  std::list<RemoteNickName> lostNickNames;
+
+  pthread_mutex_lock( &federationMutex_ );
+
+  peers_.erase( peer );
+
+  std::list<FederationTarget*>::iterator targetIt;
+  for( targetIt = federationTargets_.begin(); targetIt != federationTargets_.end(); targetIt++ )
+  {
+    if( (*targetIt)->link == peer )
+    {
+      (*targetIt)->link = NULL;
+    }
+  }
+
+  // Servers reached through the link may be gone for good, and come back with another identifier
+  std::map<uint64_t,RelaySource>::iterator sourceIt = relaysSeen_.begin();
+  while( sourceIt != relaysSeen_.end() )
+  {
+    if( (*sourceIt).second.link == peer )
+    {
+      relaysSeen_.erase( sourceIt++ );
+    }
+    else
+    {
+      sourceIt++;
+    }
+  }
+
+  // The users beyond the link can't be reached anymore
+  std::list<RemoteNickName>::iterator it = remoteNickNames_.begin();
+  while( it != remoteNickNames_.end() )
+  {
+    if( (*it).link == peer )
+    {
+      lostNickNames.push_back( *it );
+      it = remoteNickNames_.erase( it );
+    }
+    else
+    {
+      it++;
+    }
+  }
+
+  // Nicknames which were also announced through other links are still in use
+  it = lostNickNames.begin();
+  while( it != lostNickNames.end() )
+  {
+    bool isStillKnown = false;
+    std::list<RemoteNickName>::iterator remoteIt;
+    for( remoteIt = remoteNickNames_.begin(); remoteIt != remoteNickNames_.end(); remoteIt++ )
+    {
+      if( strcasecmp( (*remoteIt).nickName, (*it).nickName ) == 0 )
+      {
+        isStillKnown = true;
+        break;
+      }
+    }
+
+    if( isStillKnown )
+    {
+      it = lostNickNames.erase( it );
+    }
+    else
+    {
+      it++;
+    }
+  }
+
+  pthread_mutex_unlock( &federationMutex_ );
+
+  Common::debug( "Link to server %s ended, %lu nicknames released", peer->name(), lostNickNames.size() );
+
+  // Tell the rest of the federation as well
+  for( it = lostNickNames.begin(); it != lostNickNames.end(); it++ )
+  {
+    const char* nickName = (*it).nickName;
+    relay( RelayMessage::RELAY_NICKNAME_RELEASED, nickName, strlen( nickName ) + 1 );
+  }
+
+  pthread_mutex_lock( &accessMutex_ );
+  for( it = lostNickNames.begin(); it != lostNickNames.end(); it++ )
+  {
+    addRosterChange( RosterMessage::ROSTER_LEFT, 0, (*it).nickName );
+  }
+  pthread_mutex_unlock( &accessMutex_ );
+}
+
+
+
+void Server::removeSession( SessionClient* client )
+{
+  // Wait for the messages being delivered to the session
+  pthread_rwlock_wrlock( &deliveryLock_ );
+  pthread_mutex_lock( &accessMutex_ );
+
+  SessionData* current = findSession( client );
+
+  if( ! current )
+  {
+    Common::fatal( "Received a session state change from unknown session 0x%X!", client );
+  }
+
+  // If the client was sending out a file, cancel the transfer for everybody else
+  if( fileTransferModeActive_ && current->isFileTransferSender )
+  {
+    fileTransferModeActive_ = false;
+
+    std::map<SessionClient*,SessionData*>::iterator it;
+    for( it = sessions_.begin(); it != sessions_.end(); it++ )
+    {
+      SessionClient* peer = (*it).first;
+
+      if( peer == client )
+      {
+        continue;
+      }
+
+      client->sendMessage( new StatusMessage( Errors::Status_FileTransferCanceled ) );
+    }
+
+    if( multicaster_.fileTransferId() != 0 )
+    {
+      endMulticastFile();
+    }
+  }
+
+  bool wasFileReceiver = current->isMulticastFileReceiver && multicaster_.removeFileReceiver( client->id() );
+
+  // A data connection only leaves its session; a session takes its data connections along
+  if( current->stripeOwner != NULL )
+  {
+    SessionData* owner = findSession( current->stripeOwner );
+    owner->stripes.remove( client );
+  }
+
+  std::list<SessionClient*>::iterator stripeIt;
+  for( stripeIt = current->stripes.begin(); stripeIt != current->stripes.end(); stripeIt++ )
+  {
+    findSession( *stripeIt )->stripeOwner = NULL;
+    (*stripeIt)->dropConnection();
+  }
+
+  if( current->stripeToken != 0 )
+  {
+    stripeTokens_.erase( current->stripeToken );
+  }
+
+  clearFileLastBlock( current );
+  clearFileSignature( current );
+
+  sessions_.erase( client );
+  stripes_.erase( client );
+
+  Common::debug( "Session \"%s\" ended, %lu remaining", current->client->nickName(), sessions_.size() );
+
+  if( client->hasJoined() )
+  {
+    if( ! isHandedOff_ )
+    {
+      relay( RelayMessage::RELAY_NICKNAME_RELEASED, client->nickName(), strlen( client->nickName() ) + 1 );
+    }
+    idDirectory_.erase( client->id() );
+
+    std::map<NickNameKey,SessionClient*>::iterator directoryIt = nickNameDirectory_.find( NickNameKey( client->nickName() ) );
+    if( directoryIt != nickNameDirectory_.end() && (*directoryIt).second == client )
+    {
+      nickNameDirectory_.erase( directoryIt );
+    }
+    addRosterChange( RosterMessage::ROSTER_LEFT, client->id(), client->nickName() );
+  }
+
+  // The others may be able to go faster, or may already have the whole file
+  if( wasFileReceiver )
+  {
+    checkMulticastFile();
+  }
+
+  delete current;
+
+  pthread_mutex_unlock( &accessMutex_ );
+  pthread_rwlock_unlock( &deliveryLock_ );
+
+  // We won't delete the SessionClient, it does so by itself
+}
+
+
+
+void Server::multicastFileTimerExpired( void* thisPointer, const int event )
+{
+  // The wheel is locked: let a routing worker do the work
+  Server* self = static_cast<Server*>( thisPointer );
+  self->router_.requestFileCheck();
+}
+
+
+
+void Server::rosterTimerExpired( void* thisPointer, const int event )
+{
+  // The wheel is locked: let a routing worker do the work
+  Server* self = static_cast<Server*>( thisPointer );
+  self->router_.requestRosterFlush();
+}
+
+
+
+void Server::routeMessage( SessionClient* client, Message* message )
+{
+  // The recipients can't go away while the message is being delivered
+  pthread_rwlock_rdlock( &deliveryLock_ );
+
+  // Chat messages only lock the sessions while looking the recipients up, so the workers
+  // deliver them side by side; file transfers change the state of the sessions throughout
+  bool isChat = ( message->type() == Message::MSG_CHAT || message->type() == Message::MSG_PRIVATE
+               || message->type() == Message::MSG_NICKNAME );
+  if( ! isChat )
+  {
+    pthread_mutex_lock( &accessMutex_ );
+  }
+
+  client->routeMessage( message );
+
+  if( ! isChat )
+  {
+    pthread_mutex_unlock( &accessMutex_ );
+  }
+
+  pthread_rwlock_unlock( &deliveryLock_ );
+}
+
+
+
+void Server::routeRelay( const RelayMessage* message )
+{
+  // The recipients can't go away while the message is being delivered
+  pthread_rwlock_rdlock( &deliveryLock_ );
+
+  // Private messages are only delivered by the server of the recipient
+  if( message->event() == RelayMessage::RELAY_PRIVATE )
+  {
+    char recipientName[ MAX_NICKNAME_SIZE ];
+    memcpy( recipientName, message->data(), MAX_NICKNAME_SIZE );
+    recipientName[ MAX_NICKNAME_SIZE - 1 ] = '\0';
+
+    SessionClient* recipient = NULL;
+    pthread_mutex_lock( &accessMutex_ );
+    std::map<NickNameKey,SessionClient*>::iterator it = nickNameDirectory_.find( NickNameKey( recipientName ) );
+    if( it != nickNameDirectory_.end() )
+    {
+      recipient = (*it).second;
+    }
+    pthread_mutex_unlock( &accessMutex_ );
+
+    if( recipient != NULL )
+    {
+      deliver( recipient, new RawMessage( message->data() + MAX_NICKNAME_SIZE, message->dataSize() - MAX_NICKNAME_SIZE ) );
+    }
+
+    pthread_rwlock_unlock( &deliveryLock_ );
+    return;
+  }
+
+  // Chat messages are remembered as if they were said here
+  if( message->event() == RelayMessage::RELAY_CHAT )
+  {
+    history_.add( message->data(), message->dataSize() );
+    chatLog_.append( message->data(), message->dataSize() );
+  }
+
+  pthread_mutex_lock( &accessMutex_ );
+
+  bool isMulticast = ( message->event() == RelayMessage::RELAY_CHAT && multicaster_.isActive() );
+  if( isMulticast )
+  {
+    multicaster_.publish( message->data(), message->dataSize(), 0 );
+  }
+
+  std::list<SessionClient*> recipients;
+  std::map<SessionClient*,SessionData*>::iterator it;
+  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  {
+    if( isMulticast && (*it).second->isMulticastSubscriber )
+    {
+      continue;
+    }
+
+    recipients.push_back( (*it).first );
+  }
+
+  pthread_mutex_unlock( &accessMutex_ );
+
+  std::list<SessionClient*>::iterator recipientIt;
+  for( recipientIt = recipients.begin(); recipientIt != recipients.end(); recipientIt++ )
+  {
+    deliver( *recipientIt, new RawMessage( message->data(), message->dataSize() ) );
+  }
+
+  pthread_rwlock_unlock( &deliveryLock_ );
+}
+
+
+
+Router* Server::router()
+{
+  return &router_;
+}
+
+
+
+void Server::sendRosterChanges()
+{
+  if( rosterChanges_.size() == 0 )
+  {
+    return;
+  }
+
+  // Apply the changes to the current version, and make a new version for each full message
+  std::list<RosterMessage*> messages;
+  RosterMessage* message = NULL;
+
+  std::list<RosterMessage::Entry>::iterator it;
+  for( it = rosterChanges_.begin(); it != rosterChanges_.end(); it++ )
+  {
+    RosterMessage::Entry& change = *it;
+
+    if( change.event == RosterMessage::ROSTER_JOINED )
+    {
+      roster_.push_back( change );
+    }
+    else
+    {
+      const char* nickName = ( change.event == RosterMessage::ROSTER_RENAMED ) ? change.oldNickName : change.nickName;
+
+      std::list<RosterMessage::Entry>::iterator userIt;
+      for( userIt = roster_.begin(); userIt != roster_.end(); userIt++ )
+      {
+        if( strcmp( (*userIt).nickName, nickName ) != 0 )
+        {
+          continue;
+        }
+
+        if( change.event == RosterMessage::ROSTER_LEFT )
+        {
+          roster_.erase( userIt );
+        }
+        else
+        {
+          memcpy( (*userIt).nickName, change.nickName, MAX_NICKNAME_SIZE );
+        }
+        break;
+      }
+    }
+
+    if( message == NULL || ! message->addEntry( change ) )
+    {
+      message = new RosterMessage( ++rosterVersion_, false );
+      message->addEntry( change );
+      messages.push_back( message );
+    }
+  }
+
+  rosterChanges_.clear();
+
+  // Serialize the batch once for all the clients
+  char* frames = NULL;
+  int framesSize = 0;
+
+  std::list<RosterMessage*>::iterator messageIt;
+  for( messageIt = messages.begin(); messageIt != messages.end(); messageIt++ )
+  {
+    int frameSize;
+    char* frame = SessionBase::serializeMessage( *messageIt, frameSize );
+
+    frames = static_cast<char*>( realloc( frames, framesSize + frameSize ) );
+    memcpy( frames + framesSize, frame, frameSize );
+    framesSize += frameSize;
+
+    free( frame );
+    delete (*messageIt);
+  }
+
+  Common::debug( "Sending roster version %u", rosterVersion_ );
+
+  // Clients get the roster once they've logged in
+  std::map<SessionClient*,SessionData*>::iterator sessionIt;
+  for( sessionIt = sessions_.begin(); sessionIt != sessions_.end(); sessionIt++ )
+  {
+    SessionClient* peer = (*sessionIt).first;
+    if( peer->hasJoined() )
+    {
+      deliver( peer, new RawMessage( frames, framesSize ) );
+    }
+  }
+
+  free( frames );
+}
+
+
+
+void Server::sendToPeer( SessionPeer* peer, RelayMessage* message )
+{
+  // Links never drop messages: a link which can't keep up is closed, and reconnected later
+  if( ! peer->sendMessage( message, true ) )
+  {
+    Common::error( "Link to server %s is too slow, closing it", peer->name() );
+    delete message;
+    peer->dropConnection();
+  }
+}
+
+
+
+void Server::setChatLogDirectory( const char* directory )
+{
+  strncpy( chatLogDirectory_, directory, MAX_PATH_SIZE - 1 );
+  chatLogDirectory_[ MAX_PATH_SIZE - 1 ] = '\0';
+}
+
+
+
+Errors::ErrorCode Server::setFederationSecret( const char* secretFile )
+{
+  FILE* file = fopen( secretFile, "r" );
+  if( file == NULL )
+  {
+    Common::error( "Unable to open the federation secret file \"%s\": %s", secretFile, strerror( errno ) );
+    return Errors::Error_Federation_Secret;
+  }
+
+  int size = fread( federationSecret_, 1, FEDERATION_MAX_SECRET_SIZE, file );
+  fclose( file );
+
+  // Files written by hand usually end with a newline
+  while( size > 0 && ( federationSecret_[ size - 1 ] == '\n' || federationSecret_[ size - 1 ] == '\r' ) )
+  {
+    size--;
+  }
+
+  if( size == 0 )
+  {
+    Common::error( "The federation secret file \"%s\" is empty", secretFile );
+    return Errors::Error_Federation_Secret;
+  }
+
+  federationSecretSize_ = size;
+
+  return Errors::Error_None;
+}
+
+
+
+void Server::setFileStripes( const int count )
+{
+  fileStripes_ = std::max( 0, std::min( count, MAX_FILE_STRIPES ) );
+}
+
+
+
+void Server::setSlowConsumerPolicy( const SlowConsumerPolicy policy, const int timeout )
+{
+  slowConsumerPolicy_ = policy;
+  slowConsumerTimeout_ = timeout;
+}
+
+
+
+Errors::ErrorCode Server::setMulticast( const char* group, const int port )
+{
+  // Servers sharing a group tell their streams apart by their own identifier
+  return multicaster_.start( group, port, (uint32_t)( serverId_ ^ ( serverId_ >> 32 ) ) );
+}
+
+
+
+Errors::ErrorCode Server::setTls( const char* certificateFile, const char* keyFile )
+{
+  SSL_CTX* context = Tls::createServerContext( certificateFile, keyFile );
+  if( context == NULL )
+  {
+    return Errors::Error_Tls;
+  }
+
+  SSL_CTX_free( tlsContext_ );
+  tlsContext_ = context;
+
+  return Errors::Error_None;
+}
+
+
+
+TimingWheel* Server::timers()
+{
+  return &timers_;
+}
+
+
+
+int Server::threadsCount()
+{
+  FILE* status = fopen( "/proc/self/status", "r" );
+  if( status == NULL )
+  {
+    return 0;
+  }
+
+  int count = 0;
+  char line[ MAX_STRING_LENGTH ];
+  while( fgets( line, MAX_STRING_LENGTH, status ) != NULL )
+  {
+    if( sscanf( line, "Threads: %d", &count ) == 1 )
+    {
+      break;
+    }
+  }
+
+  fclose( status );
+
+  return count;
+}
+
+
+
+void Server::signChallenge( const char* challenge, const uint64_t serverId, unsigned char* proof )
+{
+  // The signing server is part of the signature, so a proof can't be reflected back to its sender
+  unsigned char signedData[ FEDERATION_CHALLENGE_SIZE + sizeof( serverId ) ];
+  memcpy( signedData, challenge, FEDERATION_CHALLENGE_SIZE );
+  memcpy( signedData + FEDERATION_CHALLENGE_SIZE, &serverId, sizeof( serverId ) );
+
+  unsigned int proofSize = SHA256_DIGEST_LENGTH;
+  HMAC( EVP_sha256(), federationSecret_, federationSecretSize_, signedData, sizeof( signedData ), proof, &proofSize );
+}
+
+
+
+void Server::startAcceptors()
+{
+  for( int i = 0; i < acceptorsCount_; i++ )
+  {
+    pthread_create( &acceptors_[ i ].thread, NULL, &Server::waitConnections, &acceptors_[ i ] );
+  }
+}
+
+
+
+Errors::ErrorCode Server::startFederation( const int port )
+{
+  if( port > 0 )
+  {
+    sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_port = htons( port );
+    address.sin_addr.s_addr = INADDR_ANY;
+    memset( &( address.sin_zero ), '\0', 8 );
+
+    // A server we're taking over from may still be listening, any other one may not
+    Errors::ErrorCode status = Errors::Error_None;
+    if( ! hasTakenOver_ )
+    {
+      status = checkPortFree( address );
+    }
+    if( status == Errors::Error_None )
+    {
+      status = createListenSocket( address, true, federationSocket_ );
+    }
+    if( status != Errors::Error_None )
+    {
+      return status;
+    }
+
+    Common::debug( "Accepting links from other servers on port %d", port );
   }
 
-  return true;
+  if( federationSocket_ != -1 || federationTargets_.size() > 0 )
+  {
+    pthread_create( &federationThread_, NULL, &Server::waitPeers, this );
+  }
+
+  return Errors::Error_None;
 }
 
 
 
-void Server::clientSentFileData( SessionClient* client, const FileDataMessage* message )
+void Server::startMulticastFile( SessionClient* sender )
 {
-  SessionData* current = findSession( client );
-  if( ! current )
-  {
-    Common::fatal( "Received a message from unknown session 0x%X!", client );
-  }
-
-  // The user is alone by him/herself in chat
-  if( sessions_.size() == 1 )
+  // The group is plaintext, files sent or received through TLS don't go there
+  if( ! multicaster_.isActive() || sender->isEncrypted() )
   {
     return;
   }
 
-  // Send the same message to everybody but the sender
+  std::list<SessionData*> receivers;
   std::map<SessionClient*,SessionData*>::iterator it;
   for( it = sessions_.begin(); it != sessions_.end(); it++ )
   {
     SessionClient* peer = (*it).first;
-
-    // Don't send back the same message
-    if( peer == client )
+    if( peer != sender && (*it).second->isMulticastSubscriber && ! peer->isEncrypted()
+    &&  peer->fileTransferAccepted() == Errors::Status_AcceptFileTransfer )
     {
-      continue;
+      receivers.push_back( (*it).second );
     }
+  }
 
-    // Don't send the message to a client who refused the file transfer
-    if( peer->fileTransferAccepted() != Errors::Status_AcceptFileTransfer )
-    {
-      continue;
-    }
+  // A single copy isn't any cheaper through the group
+  if( receivers.size() < MULTICAST_FILE_MIN_RECEIVERS )
+  {
+    return;
+  }
 
-    FileDataMessage* dataMessage = new FileDataMessage();
-    dataMessage->setBuffer( message->buffer(), message->bufferSize() );
-    dataMessage->setFileOffset( message->fileOffset() );
-    if( message->isLastBlock() )
+  uint32_t transferId = ++multicastTransfers_;
+  multicaster_.startFile( transferId, sender->id() );
+
+  std::list<SessionData*>::iterator receiverIt;
+  for( receiverIt = receivers.begin(); receiverIt != receivers.end(); receiverIt++ )
+  {
+    SessionData* receiver = *receiverIt;
+
+    // Clients which can't be told get the file through their sessions
+    MulticastMessage* start = new MulticastMessage( MulticastMessage::MULTICAST_FILE_START );
+    start->setTransferId( transferId );
+    if( ! receiver->client->sendMessage( start, true ) )
     {
-      dataMessage->markLastBlock();
+      delete start;
+      continue;
     }
 
-    peer->sendMessage( dataMessage );
+    multicaster_.addFileReceiver( receiver->client->id() );
+    receiver->isMulticastFileReceiver = true;
   }
 
-  if( message->isLastBlock() )
-  {
-    current->isFileTransferSender = false;
-    fileTransferModeActive_ = false;
-  }
+  timers_.schedule( &multicastFileTimer_, MULTICAST_FILE_STALL_TIMEOUT * 1000 );
+
+  Common::debug( "The file goes to %lu clients through the multicast group, as transfer %u", receivers.size(), transferId );
 }
 
 
 
-bool Server::clientSentFileTransferRequest( SessionClient* client, const FileTransferMessage* message )
+void Server::startSessions( const std::list<SessionData*>& sessions )
 {
-  SessionData* current = findSession( client );
-  if( ! current )
+  // The access mutex must be locked by the caller
+  std::list<SessionData*>::const_iterator it;
+  for( it = sessions.begin(); it != sessions.end(); it++ )
   {
-    Common::fatal( "Received a message from unknown session 0x%X!", client );
-  }
+    SessionData* session = (*it);
 
-  // The user is alone by him/herself in chat
-  if( sessions_.size() == 1 )
-  {
-    return false;
-  }
+    int result = pthread_create( &session->thread, &sessionThreadAttributes_, &SessionClient::pollForData, session->client );
+    if( result != 0 )
+    {
+      Common::error( "Unable to start a thread for session \"%s\": error %d", session->client->nickName(), result );
 
-  // Enable the file transfer
-  fileTransferModeActive_ = true;
+      // The session unregisters itself (and its data) on deletion
+      pthread_mutex_unlock( &accessMutex_ );
+      delete session->client;
+      pthread_mutex_lock( &accessMutex_ );
+    }
+  }
+}
 
-  const char* filePath = message->fileName();
-  const char* fileName = basename( filePath );
-  const char* sender = client->nickName();
 
-  Common::debug( "Session \"%s\" wants to send file \"%s\"", sender, fileName );
 
-  // Send the same message to everybody but the sender
-  std::map<SessionClient*,SessionData*>::iterator it;
-  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+Errors::ErrorCode Server::takeOver()
+{
+  if( *handoffPath_ == '\0' )
   {
-    SessionClient* peer = (*it).first;
+    return Errors::Error_Handoff;
+  }
 
-    // Don't send back the same message
-    if( peer == client )
-    {
-      continue;
-    }
+  Common::debug( "Taking over the server running at %s...", handoffPath_ );
 
-    FileTransferMessage* transferMessage = new FileTransferMessage( fileName );
-    transferMessage->setSender( sender );
-    peer->sendMessage( transferMessage );
+  int connection = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if( connection == -1 )
+  {
+    return Errors::Error_Socket_Init;
   }
 
-  // Allow to identify the initial sender
-  current->isFileTransferSender = true;
+  sockaddr_un address;
+  memset( &address, '\0', sizeof( sockaddr_un ) );
+  address.sun_family = AF_UNIX;
+  strncpy( address.sun_path, handoffPath_, sizeof( address.sun_path ) - 1 );
 
-  return true;
-}
+  if( connect( connection, reinterpret_cast<sockaddr*>( &address ), sizeof( sockaddr_un ) ) == -1 )
+  {
+    Common::error( "Unable to connect to the running server: %s", strerror( errno ) );
+    close( connection );
+    return Errors::Error_Socket_Connection;
+  }
 
+  if( ! Handoff::isSameUser( connection ) )
+  {
+    Common::error( "The running server belongs to another user" );
+    close( connection );
+    return Errors::Error_Handoff;
+  }
 
+  // Get the server state and the listening sockets
+  Handoff::Header header;
+  int listenSockets[ SERVER_ACCEPT_THREADS ];
+  int listenSocketsCount = SERVER_ACCEPT_THREADS;
 
-bool Server::clientSentFileTransferResponse( SessionClient* client, bool accept )
-{
-  SessionData* current = findSession( client );
-  if( ! current )
+  if( ! Handoff::receiveWithDescriptors( connection, &header, sizeof( Handoff::Header ), listenSockets, listenSocketsCount )
+  ||  header.magic != HANDOFF_MAGIC
+  ||  listenSocketsCount == 0 )
   {
-    Common::fatal( "Received a message from unknown session 0x%X!", client );
+    Common::error( "Invalid handoff data from the running server" );
+    close( connection );
+    return Errors::Error_Handoff;
   }
 
-  // The user is alone by him/herself in chat
-  if( sessions_.size() == 1 )
+  for( int i = 0; i < listenSocketsCount; i++ )
   {
-    return false;
+    Acceptor& acceptor = acceptors_[ acceptorsCount_++ ];
+    acceptor.server = this;
+    acceptor.socket = listenSockets[ i ];
   }
 
-  Common::debug( "Checking whether the transfer can be started" );
+  connectionsCounter_ = header.connectionsCounter;
+  fileTransferModeActive_ = header.isFileTransferModeActive;
 
-  // If all clients have confirmed, allow the sender to start transmitting the file
-  bool allClientsConfirmed = true;
-  bool canStart = false;
-  SessionClient* sender = 0;
+  // Skip a version: the users of the other servers are only known again once the links
+  // are back up, so clients will see the gap at the next change and ask for a new roster
+  rosterVersion_ = header.rosterVersion + 1;
 
-  std::map<SessionClient*,SessionData*>::iterator it;
-  for( it = sessions_.begin(); it != sessions_.end(); it++ )
+  bool isOk = true;
+  if( header.historySize > 0 )
   {
-    SessionClient* peer = (*it).first;
-    SessionData* peerData = (*it).second;
-
-    // Don't send back the same message
-    if( peer == client )
+    char* history = static_cast<char*>( malloc( header.historySize ) );
+    isOk = Handoff::receive( connection, history, header.historySize );
+    if( isOk )
     {
-      continue;
+      history_.restore( history, header.historySize );
     }
+    free( history );
+  }
 
-    if( peer->fileTransferAccepted() == Errors::Status_FileTransferCanceled )
+  // Recreate the sessions
+  std::list<SessionData*> newSessions;
+
+  pthread_mutex_lock( &accessMutex_ );
+
+  for( int i = 0; isOk && i < header.sessionsCount; i++ )
+  {
+    Handoff::Session record;
+    int socket;
+    int socketsCount = 1;
+
+    isOk = Handoff::receiveWithDescriptors( connection, &record, sizeof( Handoff::Session ), &socket, socketsCount )
+        && socketsCount == 1
+        && record.inputSize >= 0 && record.inputSize <= MAX_MESSAGE_SIZE
+        && record.outputSize >= 0;
+    if( ! isOk )
     {
-      allClientsConfirmed = false;
       break;
     }
 
-    if( peer->fileTransferAccepted() == Errors::Status_AcceptFileTransfer )
+    char* input = static_cast<char*>( malloc( record.inputSize + 1 ) );
+    char* output = static_cast<char*>( malloc( record.outputSize + 1 ) );
+    isOk = Handoff::receive( connection, input, record.inputSize )
+        && Handoff::receive( connection, output, record.outputSize );
+
+    if( isOk )
     {
-      canStart = true;
-    }
+      record.nickName[ MAX_NICKNAME_SIZE - 1 ] = '\0';
+
+      SessionData* newSession = new SessionData;
+      newSession->client = new SessionClient( this, socket, record.id );
+      newSession->state = static_cast<ClientState>( record.state );
+      newSession->isFileTransferSender = record.isFileTransferSender;
+      newSession->isFileTransferDirect = false;
+      newSession->isMulticastSubscriber = false;
+      newSession->isMulticastFileReceiver = false;
+      newSession->stripeOwner = NULL;
+      newSession->stripeToken = 0;
+      newSession->nextStripe = 0;
+      newSession->fileStart = 0;
+      newSession->fileReceived = 0;
+      newSession->fileLastBlock = NULL;
+      newSession->fileSignature.clear();
+
+      newSession->client->setNickName( record.nickName );
+      newSession->client->restoreState( static_cast<Errors::StatusCode>( record.fileTransferStatus ), record.hasJoined );
+
+      if( record.hasJoined )
+      {
+        RosterMessage::Entry user;
+        memset( &user, '\0', sizeof( RosterMessage::Entry ) );
+        user.event = RosterMessage::ROSTER_JOINED;
+        user.id = record.id;
+        strncpy( user.nickName, record.nickName, MAX_NICKNAME_SIZE - 1 );
+        roster_.push_back( user );
+
+        idDirectory_[ record.id ] = newSession->client;
+        nickNameDirectory_[ NickNameKey( record.nickName ) ] = newSession->client;
+      }
+      newSession->client->importState( input, record.inputSize, output, record.outputSize, record.isDisconnecting );
 
-    if( peerData->isFileTransferSender )
+      sessions_[ newSession->client ] = newSession;
+      newSessions.push_back( newSession );
+    }
+    else
     {
-      sender = peer;
+      close( socket );
     }
+
+    free( input );
+    free( output );
   }
 
-  Common::debug( "All clients have confirmed? %s. Can the FT start? %s. Is sender set? %s",
-                 allClientsConfirmed ? "yes" : "no",
-                 canStart ? "yes" : "no",
-                 sender ? "yes" : "no" );
+  // Confirm to the old server that it can go away
+  char confirmation = 1;
+  isOk = isOk && Handoff::send( connection, &confirmation, 1 );
 
-  // Send the file transfer initiator the OK to send the file,
-  // if everybody has answered the request and at least one has said yes
-  if( allClientsConfirmed && sender )
+  close( connection );
+
+  if( ! isOk )
   {
-    Errors::StatusCode code;
-    if( canStart )
+    pthread_mutex_unlock( &accessMutex_ );
+    Common::error( "The handoff from the running server failed" );
+
+    // The old server still has its copies of the sockets and resumes using them
+    std::list<SessionData*>::iterator it;
+    for( it = newSessions.begin(); it != newSessions.end(); it++ )
     {
-      code = Errors::Status_AcceptFileTransfer;
+      delete (*it)->client;
     }
-    else
+
+    for( int i = 0; i < acceptorsCount_; i++ )
     {
-      code = Errors::Status_RejectFileTransfer;
+      close( acceptors_[ i ].socket );
     }
-    sender->sendMessage( new StatusMessage( code ) );
-  }
-
-  return true;
-}
+    acceptorsCount_ = 0;
 
+    return Errors::Error_Handoff;
+  }
 
+  startSessions( newSessions );
 
-Server::SessionData* Server::findSession( SessionClient* client )
-{
-  std::map<SessionClient*,SessionData*>::iterator it = sessions_.find( client );
+  Common::debug( "Took over %lu sessions", sessions_.size() );
 
-  if( it == sessions_.end() )
-  {
-    return NULL;
-  }
+  pthread_mutex_unlock( &accessMutex_ );
 
-  return (*it).second;
+  return Errors::Error_None;
 }
 
 
 
-Errors::ErrorCode Server::initialize( const char* address, const int port )
+void* Server::waitConnections( void* acceptorPointer )
 {
-  listenSocket_ = socket( AF_INET, SOCK_STREAM, 0 );
-  if( listenSocket_ == -1 )
-  {
-    return Errors::Error_Socket_Init;
-  }
+  // Get access to the calling instance
+  Acceptor* acceptor = static_cast<Acceptor*>( acceptorPointer );
+  Server* self = acceptor->server;
 
-  int yes = 1;
-  int result;
-  result = setsockopt( listenSocket_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) );
-  if( result == -1 )
-  {
-    return Errors::Error_Socket_Option;
-  }
+  pollfd watched;
+  watched.fd = acceptor->socket;
+  watched.events = POLLIN;
 
-  // Convert the IP string to an usable binary address
-  in_addr listenAddr;
-  if( inet_aton( address, &listenAddr ) == 0 )
-  {
-    return Errors::Error_Invalid_Address;
-  }
+  sockaddr_in remote;
+  socklen_t addressSize;
+  int newConnections[ SERVER_ACCEPT_BATCH ];
 
-  // Set up the address where to listen
-  sockaddr_in myAddress;
-  myAddress.sin_family = AF_INET;
-  myAddress.sin_port = htons( port );
-  myAddress.sin_addr.s_addr = listenAddr.s_addr;
-  memset( &( myAddress.sin_zero ), '\0', 8 );
-  Common::debug( "Will listen on %s:%d", address, port );
+  Common::debug( "Server is now accepting connections" );
 
-  // Listen on the specified address and port
-  result = bind( listenSocket_, reinterpret_cast<sockaddr*>( &myAddress ), sizeof( sockaddr ) );
-  if( result == -1 )
-  {
-    return Errors::Error_Socket_Bind;
-  }
-  result = listen( listenSocket_, MAX_NETWORK_MESSAGE_QUEUE );
-  if( result == -1 )
+  while( true )
   {
-    return Errors::Error_Socket_Listen;
-  }
+    // Sleep until there's something in the backlog; this is also a cancellation point
+    if( poll( &watched, 1, -1 ) == -1 && errno != EINTR )
+    {
+      Common::error( "Unable to wait for connections: %s", strerror( errno ) );
+      continue;
+    }
+
+    // Take as many waiting connections as possible, then set them all up at once
+    int count = 0;
+    while( count < SERVER_ACCEPT_BATCH )
+    {
+      addressSize = sizeof( sockaddr_in );
+      int newConnection = accept4( acceptor->socket,
+                                   reinterpret_cast<sockaddr*>( &remote ),
+                                   &addressSize,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC );
+      if( newConnection == -1 )
+      {
+        // The backlog is empty, or was emptied by another acceptor
+        if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+        {
+          Common::error( "Unable to accept a connection: %s", strerror( errno ) );
+        }
+        break;
+      }
 
-  // Start accepting connections
-  pthread_create( &listenThread_, NULL, &Server::waitConnections, this );
+      // Turn away clients which connect too often, before spending anything on them
+      if( ! self->admitConnection( remote.sin_addr ) )
+      {
+        close( newConnection );
+        continue;
+      }
 
-  return Errors::Error_None;
-}
+#ifdef NETWORK_DEBUG
+      Common::debug( "Incoming connection from %s:%d", inet_ntoa( remote.sin_addr ), ntohs( remote.sin_port ) );
+#endif
 
+      newConnections[ count++ ] = newConnection;
+    }
 
+    if( count > 0 )
+    {
+      self->addSessions( newConnections, count );
+    }
+  }
 
-bool Server::isFileTransferModeActive()
-{
-  return fileTransferModeActive_;
+  return NULL; // Unused value
 }
 
 
 
-void Server::removeSession( SessionClient* client )
+void* Server::waitHandoff( void* thisPointer )
 {
-  pthread_mutex_lock( &accessMutex_ );
-
-  SessionData* current = findSession( client );
-
-  if( ! current )
-  {
-    Common::fatal( "Received a session state change from unknown session 0x%X!", client );
-  }
+  Server* self = static_cast<Server*>( thisPointer );
 
-  // If the client was sending out a file, cancel the transfer for everybody else
-  if( fileTransferModeActive_ && current->isFileTransferSender )
+  while( true )
   {
-    fileTransferModeActive_ = false;
-
-    std::map<SessionClient*,SessionData*>::iterator it;
-    for( it = sessions_.begin(); it != sessions_.end(); it++ )
+    int connection = accept4( self->handoffSocket_, NULL, NULL, SOCK_CLOEXEC );
+    if( connection == -1 )
     {
-      SessionClient* peer = (*it).first;
-
-      if( peer == client )
+      if( errno != EINTR )
       {
-        continue;
+        Common::error( "Unable to accept the handoff connection: %s", strerror( errno ) );
+        sleep( 1 );
       }
+      continue;
+    }
 
-      client->sendMessage( new StatusMessage( Errors::Status_FileTransferCanceled ) );
+    // Only a server started by the same user may take the clients over
+    if( ! Handoff::isSameUser( connection ) )
+    {
+      Common::error( "Refusing to hand the clients off to a process of another user" );
+      close( connection );
+      continue;
     }
-  }
-  sessions_.erase( client );
 
-  Common::debug( "Session \"%s\" ended, %lu remaining", current->client->nickName(), sessions_.size() );
+    // The new process will listen on the same path
+    close( self->handoffSocket_ );
+    self->handoffSocket_ = -1;
 
-  delete current;
+    bool isHandedOff = self->handOff( connection );
+    close( connection );
 
-  pthread_mutex_unlock( &accessMutex_ );
+    if( isHandedOff || ! self->listenForHandoff() )
+    {
+      break;
+    }
+  }
 
-  // We won't delete the SessionClient, it does so by itself
+  return NULL; // Unused value
 }
 
 
 
-void* Server::waitConnections( void* thisPointer )
+void* Server::waitPeers( void* thisPointer )
 {
-  // Get access to the calling instance
   Server* self = static_cast<Server*>( thisPointer );
 
-  sockaddr_in remote;
-  socklen_t addressSize = sizeof( sockaddr_in );
-  int newConnection;
+  pollfd watched;
+  watched.fd = self->federationSocket_;
+  watched.events = POLLIN;
 
-  Common::debug( "Server is now accepting connections" );
+  sockaddr_in remote;
+  socklen_t addressSize;
+  time_t lastAttempt = 0;
 
   while( true )
   {
-    newConnection = accept( self->listenSocket_,
-                            reinterpret_cast<sockaddr*>( &remote ),
-                            &addressSize );
-    char* remoteAddress = inet_ntoa( remote.sin_addr );
-    if( newConnection == -1 )
+    time_t now = time( NULL );
+    if( now - lastAttempt >= FEDERATION_RETRY_INTERVAL )
+    {
+      self->connectPeers();
+      lastAttempt = now;
+    }
+
+    // Without a listening socket, this just waits for the next attempt; it's also a cancellation point
+    if( poll( &watched, ( self->federationSocket_ != -1 ) ? 1 : 0, 1000 ) <= 0 )
     {
-      Common::error( "Unable to connect to %s:%d", remoteAddress, remote.sin_port );
       continue;
     }
 
-    Common::debug( "Incoming connection from %s:%d", remoteAddress, remote.sin_port );
+    addressSize = sizeof( sockaddr_in );
+    int newConnection = accept4( self->federationSocket_,
+                                 reinterpret_cast<sockaddr*>( &remote ),
+                                 &addressSize,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if( newConnection == -1 )
+    {
+      continue;
+    }
 
-    self->addSession( newConnection );
+    char name[ MAX_PATH_SIZE ];
+    snprintf( name, MAX_PATH_SIZE, "%s:%d", inet_ntoa( remote.sin_addr ), ntohs( remote.sin_port ) );
+    self->addPeer( newConnection, name, NULL );
   }
 
   return NULL; // Unused value
 }
-
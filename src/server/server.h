@@ -11,45 +11,411 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "chathistory.h"
+#include "chatlog.h"
 #include "errors.h"
 #include "message.h"
+#include "multicaster.h"
 #include "protocol.h"
+#include "relaymessage.h"
+#include "rostermessage.h"
+#include "router.h"
+#include "stripemessage.h"
+#include "timingwheel.h"
+#include "tls.h"
+#include "tokenbucket.h"
 
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
+#include <list>
 #include <map>
 
 
+/**
+ * @def SERVER_ACCEPT_THREADS
+ *
+ * Number of threads accepting new connections. Each one gets its own listening
+ * socket (through SO_REUSEPORT), so the kernel spreads incoming connections among them.
+ */
+#define SERVER_ACCEPT_THREADS   4
+
+
+/**
+ * @def SERVER_ACCEPT_BATCH
+ *
+ * Maximum number of connections which are accepted at once, before their sessions are set up.
+ */
+#define SERVER_ACCEPT_BATCH   64
+
+
+/**
+ * @def SERVER_LISTEN_BACKLOG
+ *
+ * Amount of pending connections the OS will keep for each listening socket.
+ * Large enough to survive the reconnection of all clients after a restart; the
+ * kernel caps it to net.core.somaxconn anyway.
+ */
+#define SERVER_LISTEN_BACKLOG   4096
+
+
+/**
+ * @def SESSION_THREAD_STACK_SIZE
+ *
+ * Stack size of the session threads. Sessions keep their buffers on the heap, so the
+ * default (usually 8MB) is a waste when thousands of clients are connected.
+ */
+#define SESSION_THREAD_STACK_SIZE   ( 256 * 1024 )
+
+
+/**
+ * @def ADMISSION_TABLE_SIZE
+ *
+ * Number of remote addresses whose connection rate is tracked at once.
+ * Must be a power of 2.
+ */
+#define ADMISSION_TABLE_SIZE   4096
+
+
+/**
+ * @def CONNECTION_RATE_PER_ADDRESS
+ *
+ * New connections per second accepted from a single remote address.
+ */
+#define CONNECTION_RATE_PER_ADDRESS   5
+
+
+/**
+ * @def CONNECTION_BURST_PER_ADDRESS
+ *
+ * New connections accepted at once from a single remote address, before it's rate limited.
+ */
+#define CONNECTION_BURST_PER_ADDRESS   20
+
+
+/**
+ * @def SLOW_CONSUMER_TIMEOUT
+ *
+ * Default amount of seconds a client may be unable to keep up with the messages
+ * sent to it, before being disconnected, when that policy is in use.
+ */
+#define SLOW_CONSUMER_TIMEOUT   10
+
+
+/**
+ * @def SERVER_FILE_STRIPES
+ *
+ * Default number of data connections each client may open to send or receive a file,
+ * besides its session. At most MAX_FILE_STRIPES.
+ */
+#define SERVER_FILE_STRIPES   4
+
+
+/**
+ * @def ROSTER_BATCH_INTERVAL
+ *
+ * Milliseconds during which the changes to the roster are collected, and merged,
+ * before being sent to the clients all together.
+ */
+#define ROSTER_BATCH_INTERVAL   250
+
+
+/**
+ * @def FEDERATION_MAX_HOPS
+ *
+ * Maximum number of links a relayed message may go through, as a last
+ * defence against loops.
+ */
+#define FEDERATION_MAX_HOPS   8
+
+
+/**
+ * @def FEDERATION_RETRY_INTERVAL
+ *
+ * Seconds between attempts to connect to the federated servers which can't be reached.
+ */
+#define FEDERATION_RETRY_INTERVAL   5
+
+
+/**
+ * @def FEDERATION_CONNECT_TIMEOUT
+ *
+ * Milliseconds to wait for a federated server to answer a connection attempt.
+ */
+#define FEDERATION_CONNECT_TIMEOUT   2000
+
+
+/**
+ * @def FEDERATION_MAX_SECRET_SIZE
+ *
+ * Maximum size of the secret which the servers of a federation share.
+ */
+#define FEDERATION_MAX_SECRET_SIZE   256
+
+
 class ChatMessage;
 class FileDataMessage;
+class FileManifestMessage;
+class FileSignatureMessage;
 class FileTransferMessage;
 class NicknameMessage;
+class PrivateMessage;
+class RawMessage;
 
 class SessionClient;
+class SessionPeer;
 
 
 
 class Server
 {
 public:
+
+  /// What to do with the messages for a client whose sending queue is full
+  enum SlowConsumerPolicy
+  {
+    SLOW_CONSUMER_DROP_NEWEST   /// Drop the new message
+  , SLOW_CONSUMER_DROP_OLDEST   /// Drop the oldest queued message of the same type
+  , SLOW_CONSUMER_SPILL         /// Keep the new message on disk until the client catches up
+  , SLOW_CONSUMER_DISCONNECT    /// Drop the new message, and the client once it has been behind for too long
+  , SLOW_CONSUMER_MAX
+  };
+
   Server();
   ~Server();
 
-    Errors::ErrorCode initialize( const char* address, const int port );
+    /**
+     * Start the server.
+     *
+     * @param address Address where to listen
+     * @param port Port where to listen
+     * @param takeOver If true, take the connections and state of a server already running on the same port
+     */
+    Errors::ErrorCode initialize( const char* address, const int port, const bool takeOver = false );
 
-    void addSession( int newSocket );
+    void addSessions( const int* newSockets, const int count );
     void removeSession( SessionClient* client );
     void checkSessionStateChange( SessionClient* client, Message::Type messageType );
 
+    /**
+     * Check whether more file blocks can be read from a client. The sender of a file which
+     * goes through the multicast group waits for the slowest receivers.
+     *
+     * @param blocksRead Blocks of the current file read from the client so far
+     */
+    bool canReceiveFileBlocks( SessionClient* client, const uint32_t blocksRead );
+
+    /**
+     * Check whether the file blocks read from a client, or from its data connections, can
+     * be passed on. They can't while a receiver has no room left on any of its connections.
+     */
+    bool canRelayFileBlocks( SessionClient* client );
+
+    /**
+     * Leave out the receivers of the multicast file which stopped keeping up.
+     *
+     * Called by a routing worker, every few seconds while the file is being sent.
+     */
+    void checkFileReceivers();
+
+    /**
+     * Rename a client, if nobody else in the federation has the nickname.
+     *
+     * Called by the routing workers, so the messages sent before are delivered with the old one.
+     */
     bool clientChangedNickName( SessionClient* client, const NicknameMessage* message );
+
+    /**
+     * A new connection wants to carry the file blocks of the session which was offered the token.
+     *
+     * @return false if no session has the token, or it has enough data connections
+     */
+    bool clientJoinedStripe( SessionClient* client, const uint64_t token );
+
+    /**
+     * A client has logged in: add it to the roster, and send it the current one.
+     */
+    void clientJoined( SessionClient* client );
+
     bool clientSentChatMessage( SessionClient* client, const ChatMessage* message );
     void clientSentFileData( SessionClient* client, const FileDataMessage* message );
+
+    /**
+     * Pass the contents of the folder being sent on to the clients which may still accept it.
+     */
+    void clientSentFileManifest( SessionClient* client, const FileManifestMessage* message );
+
+    /**
+     * Keep the signature of a receiver's older copy of the file being sent, until it answers.
+     *
+     * It's passed on to the sender only if that receiver turns out to be the only one.
+     */
+    void clientSentFileSignature( SessionClient* client, const FileSignatureMessage* message );
+
     bool clientSentFileTransferRequest( SessionClient* client, const FileTransferMessage* message );
     bool clientSentFileTransferResponse( SessionClient* client, bool accept );
+    void clientRequestedRoster( SessionClient* client );
+
+    /**
+     * Deliver a private message to its recipient only.
+     *
+     * @return false if the recipient isn't online
+     */
+    bool clientSentPrivateMessage( SessionClient* client, const PrivateMessage* message );
+
+    void clientRequestedStats( SessionClient* client );
+
+    /**
+     * Send again the multicast messages a client has missed.
+     *
+     * @return How many were queued, from the first; the others are dropped, the client will ask again
+     */
+    uint32_t clientRequestedRepairs( SessionClient* client, const uint32_t sequence, const uint32_t count );
+
+    /**
+     * A client has received the blocks of the multicast file, from the first up to the given count.
+     */
+    void clientAcknowledgedFileBlocks( SessionClient* client, const uint32_t transferId, const uint32_t blocksCount );
+
+    /**
+     * A client can't rebuild some blocks of the multicast file: send them again to the group.
+     *
+     * @param missingBlocks The missing blocks of the parity group starting at firstBlock, one bit each
+     */
+    void clientRequestedFileRepairs( SessionClient* client, const uint32_t transferId, const uint32_t firstBlock, const uint32_t missingBlocks );
+
+    /**
+     * A client won't receive the rest of the multicast file.
+     */
+    void clientAbandonedFile( SessionClient* client, const uint32_t transferId );
+
+    /**
+     * A client has joined the multicast group: stop sending it chat messages through its session.
+     */
+    void clientSubscribedToMulticast( SessionClient* client );
+
+    /**
+     * Send the pending roster changes to the clients.
+     *
+     * Called by a routing worker, once the changes have been collected for a while.
+     */
+    void flushRoster();
 
     bool isFileTransferModeActive();
 
+    /**
+     * Add a server to link to; the link is kept up once the federation is started.
+     */
+    void joinFederation( const char* host, const int port );
+
+    /**
+     * Start linking to the other servers of the federation.
+     *
+     * @param port Port where other servers can link to this one, or 0 not to accept links
+     */
+    Errors::ErrorCode startFederation( const int port );
+
+    /**
+     * Whether a link has proved it's part of the federation, so its relays can be trusted.
+     */
+    bool isPeerTrusted( SessionPeer* peer );
+
+    /**
+     * Prove the other end of a link this server knows the federation secret.
+     */
+    void peerSentChallenge( SessionPeer* peer, const RelayMessage* message );
+
+    /**
+     * Check the other end of a link signed our challenge with the federation secret,
+     * and start relaying to it if so.
+     *
+     * @return false if the proof is wrong
+     */
+    bool peerSentProof( SessionPeer* peer, const RelayMessage* message );
+
+    void peerSentRelay( SessionPeer* peer, const RelayMessage* message );
+    void removePeer( SessionPeer* peer );
+
+    /**
+     * Get a random number from the OS, or a less random one if it can't give any.
+     */
+    static uint64_t randomNumber();
+
+    /**
+     * Choose where the chat log is kept, instead of the home directory of the user.
+     */
+    void setChatLogDirectory( const char* directory );
+
+    /**
+     * Read the secret which the servers of the federation share, to recognize each other.
+     *
+     * @param secretFile File whose contents, without the final newline, are the secret
+     */
+    Errors::ErrorCode setFederationSecret( const char* secretFile );
+
+    /**
+     * Choose how many data connections each client may open for a file transfer.
+     *
+     * @param count Up to MAX_FILE_STRIPES; 0 sends all the files through the sessions
+     */
+    void setFileStripes( const int count );
+
+    /**
+     * Choose how messages are handled when a client doesn't read them fast enough.
+     *
+     * @param policy What to do when the sending queue of a client is full
+     * @param timeout Seconds after which a client is dropped, with SLOW_CONSUMER_DISCONNECT
+     */
+    void setSlowConsumerPolicy( const SlowConsumerPolicy policy, const int timeout = SLOW_CONSUMER_TIMEOUT );
+
+    /**
+     * Encrypt the connections of the clients which connect from now on.
+     *
+     * @param certificateFile PEM file with the server certificate, and its chain if any
+     * @param keyFile PEM file with the private key of the certificate
+     */
+    Errors::ErrorCode setTls( const char* certificateFile, const char* keyFile );
+
+    /**
+     * Send the chat messages once to a multicast group, rather than to each client which can join it.
+     *
+     * @param group Address of the group, like 239.255.76.77
+     */
+    Errors::ErrorCode setMulticast( const char* group, const int port );
+
+    /**
+     * Get the latest chat messages, to show them to a user who just joined.
+     *
+     * @return A new message, or NULL if nothing was said yet
+     */
+    RawMessage* recentChatHistory();
+
+    /**
+     * Get the router which the sessions give their messages to.
+     */
+    Router* router();
+
+    /**
+     * Deliver a message of a client to the other ones.
+     *
+     * Called by the routing workers, never by the session threads.
+     */
+    void routeMessage( SessionClient* client, Message* message );
+
+    /**
+     * Deliver a message relayed by another server of the federation to the clients.
+     *
+     * Called by the routing workers, never by the link threads.
+     */
+    void routeRelay( const RelayMessage* message );
+
+    /**
+     * Get the timers shared by all the sessions.
+     */
+    TimingWheel* timers();
+
 private:
 
   enum ClientState
@@ -59,6 +425,7 @@ private:
   , CLIENT_STATE_IDENTIFY  /// The client saluted but didn't identify itself yet
   , CLIENT_STATE_READY     /// The client is connected and can transfer messages
   , CLIENT_STATE_END       /// The client is about to disconnect
+  , CLIENT_STATE_STRIPE    /// The connection carries file blocks for another session
   };
 
   struct SessionData
@@ -67,30 +434,400 @@ private:
     pthread_t thread;
     ClientState state;
     bool isFileTransferSender;
+    /// Whether the file the client sends goes straight to the receivers, rather than through the server
+    bool isFileTransferDirect;
+    /// Whether the client gets the chat messages through the multicast group
+    bool isMulticastSubscriber;
+    /// Whether the client gets the file being sent through the multicast group
+    bool isMulticastFileReceiver;
+    /// Data connections of the session, which share its file blocks
+    std::list<SessionClient*> stripes;
+    /// Session of a data connection, or NULL once it's gone
+    SessionClient* stripeOwner;
+    /// Token offered to the session for its data connections, or 0
+    uint64_t stripeToken;
+    /// Connection which gets the next relayed file block: 0 is the session, then its data connections
+    unsigned int nextStripe;
+    /// Where the file being sent starts, and how much of it arrived so far
+    int64_t fileStart;
+    int64_t fileReceived;
+    /// Last block of the file, waiting for the ones which were sent before it through other connections
+    FileDataMessage* fileLastBlock;
+    /// Signature of the client's older copy of the file being offered to it
+    std::list<FileSignatureMessage*> fileSignature;
+  };
+
+  /// Connection rate of a remote address
+  struct AdmissionSlot
+  {
+    in_addr_t address;
+    TokenBucket limiter;
+  };
+
+  /// A server to keep a link to
+  struct FederationTarget
+  {
+    char host[ MAX_PATH_SIZE ];
+    int port;
+    SessionPeer* link;
+  };
+
+  /// Nickname of a client, compared regardless of case as when it's registered
+  struct NickNameKey
+  {
+    char nickName[ MAX_NICKNAME_SIZE ];
+
+    NickNameKey( const char* nickName );
+    bool operator<( const NickNameKey& other ) const;
+  };
+
+  /// A nickname used on another server
+  struct RemoteNickName
+  {
+    char nickName[ MAX_NICKNAME_SIZE ];
+    /// Link through which the nickname was announced
+    SessionPeer* link;
+  };
+
+  /// The last relay received from a server
+  struct RelaySource
+  {
+    uint64_t sequence;
+    /// Link through which it arrived
+    SessionPeer* link;
+  };
+
+  /// A thread accepting connections from its own listening socket
+  struct Acceptor
+  {
+    Server* server;
+    int socket;
+    pthread_t thread;
   };
 
 
 private:
 
+  /**
+   * Check whether a new connection from an address can be accepted.
+   */
+  bool admitConnection( const in_addr& address );
+
+  /**
+   * Start the session of a new link to another server.
+   *
+   * @param target The server which was joined, or NULL if it linked to us
+   */
+  void addPeer( const int socket, const char* name, FederationTarget* target );
+
+  /**
+   * Queue a change to the list of online users, merging it with the pending ones.
+   *
+   * Must be called with the server locked.
+   *
+   * @param oldNickName Previous nickname, with ROSTER_RENAMED
+   */
+  void addRosterChange( const RosterMessage::Event event, const unsigned int id, const char* nickName, const char* oldNickName = NULL );
+
+  /**
+   * Tell a new link about the nicknames which are taken.
+   */
+  void announceNickNames( SessionPeer* peer );
+
+  /**
+   * Leave out the receivers of the multicast file which stopped keeping up, let its sender
+   * go on, and end the transfer once it's over.
+   *
+   * Must be called with the server locked.
+   */
+  void checkMulticastFile();
+
+  /**
+   * Try to link to the joined servers which aren't linked yet.
+   */
+  void connectPeers();
+
+  /**
+   * Delete the file block a sender's last block was waiting for, if any.
+   */
+  static void clearFileLastBlock( SessionData* data );
+
+  /**
+   * Delete the signature a client sent of its copy of the file being sent, if any.
+   */
+  static void clearFileSignature( SessionData* data );
+
+  /**
+   * Tell clients they won't get the rest of the multicast file.
+   *
+   * Must be called with the server locked.
+   */
+  void dropFileReceivers( const std::list<uint32_t>& clientIds, const uint32_t transferId );
+
+  /**
+   * Stop sending the file through the multicast group.
+   *
+   * Must be called with the server locked.
+   */
+  void endMulticastFile();
+
+  /**
+   * Tell a receiver, through each of its connections, that the blocks of the file are over.
+   *
+   * Must be called with the server locked.
+   */
+  void markFileEnd( SessionData* data );
+
+  /**
+   * Pick the connection of a client which gets the next file block: its session and
+   * its data connections take turns, skipping the ones which are full.
+   *
+   * Must be called with the server locked.
+   *
+   * @return NULL if they're all full
+   */
+  SessionClient* nextFileConnection( SessionData* data );
+
+  /**
+   * Let a client open data connections for the file transfer which is starting.
+   *
+   * Must be called with the server locked.
+   */
+  void offerStripes( SessionData* data );
+
+  /**
+   * Sign a link challenge with the federation secret, on behalf of a server.
+   *
+   * @param proof Set to the signature, of SHA256_DIGEST_LENGTH bytes
+   */
+  void signChallenge( const char* challenge, const uint64_t serverId, unsigned char* proof );
+
+  /**
+   * Send something which happened on this server to the rest of the federation.
+   *
+   * @param peer Only send to this link, or to all of them if NULL
+   */
+  void relay( const RelayMessage::Event event, const char* data, const int size, SessionPeer* peer = NULL );
+
+  /**
+   * Send a block of the file to its receivers, and end the transfer after the last one.
+   *
+   * Must be called with the server locked.
+   */
+  void relayFileData( SessionClient* sender, SessionData* senderData, const FileDataMessage* message );
+
+  /**
+   * Send the pending roster changes to the clients, as a new roster version.
+   *
+   * Must be called with the server locked.
+   */
+  void sendRosterChanges();
+
+  /**
+   * Queue a relay message on a link, taking ownership of it.
+   */
+  static void sendToPeer( SessionPeer* peer, RelayMessage* message );
+
+  /**
+   * Send a broadcast message to a client, applying the slow consumer policy if it's not keeping up.
+   *
+   * The message is deleted if it can't be sent.
+   */
+  void deliver( SessionClient* peer, Message* message );
+
+  /**
+   * Give the listening sockets, the sessions and their state to a new server process.
+   *
+   * @param connection UNIX socket connected to the new process
+   * @return false if the new process couldn't take over; this server then keeps running
+   */
+  bool handOff( const int connection );
+
+  /**
+   * Count the threads of the server process.
+   */
+  static int threadsCount();
+
+  /**
+   * Wait on a UNIX socket for a new server process to hand off to.
+   */
+  bool listenForHandoff();
+
+  /**
+   * Start the threads which accept connections.
+   */
+  void startAcceptors();
+
+  /**
+   * Send the accepted file through the multicast group, if enough of its receivers joined it.
+   *
+   * Must be called with the server locked.
+   */
+  void startMulticastFile( SessionClient* sender );
+
+  /**
+   * Start the threads of the given sessions.
+   */
+  void startSessions( const std::list<SessionData*>& sessions );
+
+  /**
+   * Get the listening sockets, the sessions and their state from a running server process.
+   */
+  Errors::ErrorCode takeOver();
+
   SessionData* findSession( SessionClient* client );
 
-  static void* waitConnections( void* thisPointer );
+  /**
+   * Make sure no other socket listens on the address, before sharing it among the acceptors.
+   */
+  static Errors::ErrorCode checkPortFree( const sockaddr_in& address );
+
+  static Errors::ErrorCode createListenSocket( const sockaddr_in& address, bool reusePort, int& newSocket );
+
+  static void multicastFileTimerExpired( void* thisPointer, const int event );
+
+  static void rosterTimerExpired( void* thisPointer, const int event );
+
+  static void* waitConnections( void* acceptorPointer );
+
+  static void* waitHandoff( void* thisPointer );
+
+  static void* waitPeers( void* thisPointer );
 
 
 private:
 
+  Acceptor acceptors_[ SERVER_ACCEPT_THREADS ];
+
+  int acceptorsCount_;
+
+  /// Fixed size hash table of the remote addresses' connection rates
+  AdmissionSlot admissionTable_[ ADMISSION_TABLE_SIZE ];
+
+  pthread_mutex_t admissionMutex_;
+
+  unsigned long connectionsRejected_;
+
+  unsigned long connectionsAccepted_;
+
   int connectionsCounter_;
 
+  /// Guards the federation links and the relay state
+  pthread_mutex_t federationMutex_;
+
+  /// Shared by the servers of the federation, to sign the challenges of the links
+  char federationSecret_[ FEDERATION_MAX_SECRET_SIZE ];
+
+  int federationSecretSize_;
+
+  /// Socket where other servers link to this one, or -1
+  int federationSocket_;
+
+  std::list<FederationTarget*> federationTargets_;
+
+  pthread_t federationThread_;
+
+  /// Data connections each client may open for a file transfer
+  int fileStripes_;
+
   bool fileTransferModeActive_;
 
-  int listenSocket_;
+  /// Path of the UNIX socket used to hand off the server to a new process
+  char handoffPath_[ MAX_PATH_SIZE ];
+
+  int handoffSocket_;
+
+  pthread_t handoffThread_;
+
+  /// Whether the listening sockets came from a previous server process
+  bool hasTakenOver_;
 
-  pthread_t listenThread_;
+  /// Whether the sessions were passed on to a new server process
+  bool isHandedOff_;
+
+  /// Latest chat messages
+  ChatHistory history_;
+
+  /// Durable log of all chat messages
+  ChatLog chatLog_;
+
+  /// Where the chat log is kept, or empty for the default
+  char chatLogDirectory_[ MAX_PATH_SIZE ];
 
   pthread_mutex_t accessMutex_;
 
+  /// Held for reading while the routing workers deliver messages, for writing while a session goes away
+  pthread_rwlock_t deliveryLock_;
+
+  /// Logged in clients, by id and by nickname, to find the recipients of private messages
+  std::map<unsigned int,SessionClient*> idDirectory_;
+  std::map<NickNameKey,SessionClient*> nickNameDirectory_;
+
+  /// Sends the chat messages to the clients which joined the multicast group
+  Multicaster multicaster_;
+
+  /// Checks on the receivers of the multicast file while it's being sent
+  TimingWheel::Timer multicastFileTimer_;
+
+  /// Id of the last file transfer which went through the multicast group
+  uint32_t multicastTransfers_;
+
+  /// Links to the other servers of the federation, and their threads
+  std::map<SessionPeer*,pthread_t> peers_;
+
+  /// Sequence number of the last relay generated by this server
+  uint64_t relaySequence_;
+
+  /// Highest relay sequence number received from each server, forgotten with the link
+  std::map<uint64_t,RelaySource> relaysSeen_;
+
+  std::list<RemoteNickName> remoteNickNames_;
+
+  /// Users online, as of the last roster version sent to the clients
+  std::list<RosterMessage::Entry> roster_;
+
+  /// Roster changes not sent yet
+  std::list<RosterMessage::Entry> rosterChanges_;
+
+  /// Sends the pending roster changes when they've been collected for a while
+  TimingWheel::Timer rosterTimer_;
+
+  /// Version of the roster last sent to the clients
+  uint32_t rosterVersion_;
+
+  /// Fans out the messages of the clients, away from their session threads
+  Router router_;
+
+  /// Random identifier of this server within the federation
+  uint64_t serverId_;
+
+  pthread_attr_t sessionThreadAttributes_;
+
+  /// Times each slow consumer policy has been applied
+  unsigned long slowConsumerCounters_[ SLOW_CONSUMER_MAX ];
+
+  SlowConsumerPolicy slowConsumerPolicy_;
+
+  /// Seconds a client may be behind, with SLOW_CONSUMER_DISCONNECT
+  int slowConsumerTimeout_;
+
+  /// When the server was started
+  time_t startTime_;
+
   std::map<SessionClient*,SessionData*> sessions_;
 
+  /// Data connections, kept apart from the sessions so they never get chat messages and such
+  std::map<SessionClient*,SessionData*> stripes_;
+
+  /// Sessions by the token they were offered for their data connections
+  std::map<uint64_t,SessionClient*> stripeTokens_;
+
+  /// Login, idle and file transfer timeouts of all the sessions
+  TimingWheel timers_;
+
+  /// Settings of the encrypted client connections, or NULL if they're in clear text
+  SSL_CTX* tlsContext_;
+
 };
 
 
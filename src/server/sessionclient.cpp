@@ -12,35 +12,123 @@
 
 #include "common.h"
 #include "message.h"
+#include "router.h"
 #include "server.h"
 
 #include "byemessage.h"
 #include "chatmessage.h"
 #include "filedatamessage.h"
+#include "filemanifestmessage.h"
+#include "filesignaturemessage.h"
 #include "filetransfermessage.h"
+#include "multicastmessage.h"
+#include "privatemessage.h"
+#include "rawmessage.h"
+#include "rostermessage.h"
+#include "statsmessage.h"
 #include "statusmessage.h"
+#include "stripemessage.h"
 #include "nicknamemessage.h"
 
 #include <string.h>
+#include <time.h>
 
 
 
-SessionClient::SessionClient( Server* parent, const int socket )
+SessionClient::SessionClient( Server* parent, const int socket, const unsigned int id )
 : SessionBase( socket )
+, byteLimiter_( SESSION_BYTE_RATE, SESSION_BYTE_BURST )
+, droppedMessages_( 0 )
+, expiredTimers_( 0 )
+, fileBlocksRead_( 0 )
+, fileTransferOffset_( 0 )
 , fileTransferStatus_( Errors::Status_FileTransferCanceled )
+, hasJoined_( false )
+, heartbeatTimer_( &SessionClient::timerExpired, this, TIMER_HEARTBEAT )
+, id_( id )
+, isRateLimited_( false )
+, isStripe_( false )
+, lastReceived_( time( NULL ) )
+, loginTimer_( &SessionClient::timerExpired, this, TIMER_LOGIN )
+, messageLimiter_( SESSION_MESSAGE_RATE, SESSION_MESSAGE_BURST )
+, repairsEnd_( 0 )
+, repairsStart_( 0 )
+, responseTimer_( &SessionClient::timerExpired, this, TIMER_RESPONSE )
+, router_( parent->router() )
 , server_( parent )
+, throttleTimer_( &SessionClient::timerExpired, this, TIMER_THROTTLE )
+, timers_( parent->timers() )
 {
+  timers_->schedule( &loginTimer_, SESSION_LOGIN_TIMEOUT * 1000 );
+  timers_->schedule( &heartbeatTimer_, SESSION_HEARTBEAT_INTERVAL * 1000 );
 }
 
 
 
 SessionClient::~SessionClient()
 {
+  // After this, the timers can't call back into the session anymore
+  timers_->cancel( &heartbeatTimer_ );
+  timers_->cancel( &loginTimer_ );
+  timers_->cancel( &responseTimer_ );
+  timers_->cancel( &throttleTimer_ );
+
+  // Nor can the routing workers
+  router_->forget( this );
+
   server_->removeSession( this );
 }
 
 
 
+bool SessionClient::acceptMessage( Message::Type type, const int size )
+{
+  lastReceived_ = time( NULL );
+
+  // All data counts towards the byte rate; excess is handled by canReceiveData()
+  byteLimiter_.charge( size );
+
+  // File transfers are only slowed down, never dropped; neither are the reports of their multicast receivers,
+  // though the requests for repairs of the chat messages are charged once they're decoded
+  bool isExempt = ( type == Message::MSG_FILE_DATA || type == Message::MSG_FILE_MANIFEST
+                 || type == Message::MSG_FILE_SIGNATURE || type == Message::MSG_MULTICAST );
+  if( isExempt || messageLimiter_.consume() )
+  {
+    // Only a client which keeps flooding gets disconnected: the count starts over once it slows down
+    if( ! isExempt )
+    {
+      droppedMessages_ = 0;
+    }
+    isRateLimited_ = false;
+    return true;
+  }
+
+  droppedMessages_++;
+
+  if( droppedMessages_ > SESSION_MAX_DROPPED_MESSAGES )
+  {
+    Common::error( "Session \"%s\" is flooding the server, disconnecting it", nickName_ );
+    disconnect();
+    return false;
+  }
+
+  // Only warn the client once for each sequence of dropped messages
+  if( ! isRateLimited_ )
+  {
+    Common::debug( "Session \"%s\" is sending too many messages, dropping them", nickName_ );
+    StatusMessage* warning = new StatusMessage( Errors::Status_RateLimited );
+    if( ! sendMessage( warning ) )
+    {
+      delete warning;
+    }
+    isRateLimited_ = true;
+  }
+
+  return false;
+}
+
+
+
 void SessionClient::availableMessages()
 {
   Message* message;
@@ -48,6 +136,13 @@ void SessionClient::availableMessages()
   {
     server_->checkSessionStateChange( this, message->type() );
 
+    // Data connections only carry file blocks
+    if( isStripe_ && message->type() != Message::MSG_FILE_DATA && message->type() != Message::MSG_STATUS )
+    {
+      delete message;
+      continue;
+    }
+
     switch( message->type() )
     {
       case Message::MSG_HELLO:
@@ -57,24 +152,6 @@ void SessionClient::availableMessages()
         break;
       }
 
-      case Message::MSG_NICKNAME:
-      {
-        NicknameMessage* nickNameMessage = dynamic_cast<NicknameMessage*>( message );
-        if( ! server_->clientChangedNickName( this, nickNameMessage ) )
-        {
-          // The nickname could not be changed, report the problem to the client
-          sendMessage( new StatusMessage( Errors::Status_NickNameAlreadyRegistered ) );
-        }
-        else
-        {
-          // Change the nickname
-          setNickName( nickNameMessage->nickName() );
-          sendMessage( new NicknameMessage( nickName_ ) );
-        }
-
-        break;
-      }
-
       case Message::MSG_STATUS:
       {
         StatusMessage* statusMessage = dynamic_cast<StatusMessage*>( message );
@@ -87,18 +164,19 @@ void SessionClient::availableMessages()
             Common::debug( "Session \"%s\" sent status OK", nickName_ );
             break;
 
+          case Errors::Status_Heartbeat:
+            // Receiving it is enough
+            break;
+
           case Errors::Status_AcceptFileTransfer:
           case Errors::Status_RejectFileTransfer:
-            if( ! server_->isFileTransferModeActive() )
+            if( isStripe_ )
             {
-              sendMessage( new StatusMessage( Errors::Status_FileTransferCanceled ) );
               break;
             }
-
-            // Save the status
-            fileTransferStatus_ = code;
-
-            server_->clientSentFileTransferResponse( this, code == Errors::Status_AcceptFileTransfer );
+            timers_->cancel( &responseTimer_ );
+            router_->submit( this, message );
+            message = NULL;
             break;
 
           default:
@@ -108,46 +186,125 @@ void SessionClient::availableMessages()
         break;
       }
 
+      // The routing workers deliver these to the other clients
+      case Message::MSG_FILE_REQUEST:
+        fileBlocksRead_ = 0;
+        router_->submit( this, message );
+        message = NULL;
+        break;
+
+      case Message::MSG_FILE_DATA:
+      {
+        // Counted here, as canReceiveData() needs to know it before reading the next block
+        FileDataMessage* dataMessage = dynamic_cast<FileDataMessage*>( message );
+        fileBlocksRead_ = dataMessage->isLastBlock() ? 0 : fileBlocksRead_ + 1;
+        router_->submit( this, message );
+        message = NULL;
+        break;
+      }
+
+      // Renames go through the worker too, so they don't overtake the messages sent before
+      case Message::MSG_FILE_MANIFEST:
+      case Message::MSG_FILE_SIGNATURE:
       case Message::MSG_CHAT:
+      case Message::MSG_NICKNAME:
+      case Message::MSG_PRIVATE:
+        router_->submit( this, message );
+        message = NULL;
+        break;
+
+      case Message::MSG_ROSTER:
       {
-        ChatMessage* chatMessage = dynamic_cast<ChatMessage*>( message );
-        if( ! server_->clientSentChatMessage( this, chatMessage ) )
+        RosterMessage* rosterMessage = dynamic_cast<RosterMessage*>( message );
+        if( rosterMessage->isRequest() && hasJoined_ )
         {
-          sendMessage( new StatusMessage( Errors::Status_ChattingAlone ) );
+          server_->clientRequestedRoster( this );
         }
         break;
       }
 
-      case Message::MSG_FILE_REQUEST:
+      case Message::MSG_STATS:
       {
-        // Deny new file transfers if one is already active
-        if( server_->isFileTransferModeActive() )
+        StatsMessage* statsMessage = dynamic_cast<StatsMessage*>( message );
+        if( statsMessage->isRequest() )
+        {
+          server_->clientRequestedStats( this );
+        }
+        break;
+      }
+
+      case Message::MSG_STRIPE:
+      {
+        StripeMessage* stripeMessage = dynamic_cast<StripeMessage*>( message );
+        if( stripeMessage->kind() != StripeMessage::STRIPE_JOIN || hasJoined_ )
         {
-          sendMessage( new StatusMessage( Errors::Status_FileTransferCanceled ) );
           break;
         }
 
-        FileTransferMessage* fileMessage = dynamic_cast<FileTransferMessage*>( message );
-        if( ! server_->clientSentFileTransferRequest( this, fileMessage ) )
+        if( ! server_->clientJoinedStripe( this, stripeMessage->token() ) )
         {
-          sendMessage( new StatusMessage( Errors::Status_ChattingAlone ) );
+          Common::error( "Session 0x%X tried to join a session with an unknown token, disconnecting it", this );
+          disconnect();
           break;
         }
 
-        fileTransferStatus_ = Errors::Status_AcceptFileTransfer;
+        isStripe_ = true;
+        timers_->cancel( &loginTimer_ );
+        sendMessage( new StripeMessage( StripeMessage::STRIPE_JOIN, stripeMessage->token() ) );
         break;
       }
 
-      case Message::MSG_FILE_DATA:
+      case Message::MSG_MULTICAST:
       {
-        FileDataMessage* dataMessage = dynamic_cast<FileDataMessage*>( message );
-
-        server_->clientSentFileData( this, dataMessage );
+        MulticastMessage* multicastMessage = dynamic_cast<MulticastMessage*>( message );
+        if( ! hasJoined_ )
+        {
+          break;
+        }
 
-        // Reset the file transfer status for the next file
-        if( dataMessage->isLastBlock() )
+        if( multicastMessage->kind() == MulticastMessage::MULTICAST_SUBSCRIBE )
         {
-          fileTransferStatus_ = Errors::Status_FileTransferCanceled;
+          server_->clientSubscribedToMulticast( this );
+        }
+        else if( multicastMessage->kind() == MulticastMessage::MULTICAST_NACK )
+        {
+          // Each request queues many messages, so it counts like any other message
+          if( ! messageLimiter_.consume() )
+          {
+            Common::debug( "Session \"%s\" is asking for too many repairs, ignoring them", nickName_ );
+            break;
+          }
+
+          // The repairs which were already queued will arrive anyway
+          uint32_t sequence = multicastMessage->sequence();
+          uint32_t end = sequence + multicastMessage->count();
+          if( (int32_t)( sequence - repairsStart_ ) >= 0 && (int32_t)( sequence - repairsEnd_ ) < 0 )
+          {
+            sequence = repairsEnd_;
+          }
+
+          if( (int32_t)( end - sequence ) > 0 )
+          {
+            uint32_t queued = server_->clientRequestedRepairs( this, sequence, end - sequence );
+            if( sequence != repairsEnd_ )
+            {
+              repairsStart_ = sequence;
+            }
+            repairsEnd_ = sequence + queued;
+          }
+        }
+        else if( multicastMessage->kind() == MulticastMessage::MULTICAST_FILE_ACK )
+        {
+          server_->clientAcknowledgedFileBlocks( this, multicastMessage->transferId(), multicastMessage->sequence() );
+        }
+        else if( multicastMessage->kind() == MulticastMessage::MULTICAST_FILE_NACK )
+        {
+          server_->clientRequestedFileRepairs( this, multicastMessage->transferId(), multicastMessage->sequence(),
+                                               multicastMessage->missingBlocks() );
+        }
+        else if( multicastMessage->kind() == MulticastMessage::MULTICAST_FILE_ABORT )
+        {
+          server_->clientAbandonedFile( this, multicastMessage->transferId() );
         }
         break;
       }
@@ -162,6 +319,100 @@ void SessionClient::availableMessages()
 
 
 
+void SessionClient::awaitFileTransferResponse()
+{
+  fileTransferOffset_ = 0;
+  fileTransferStatus_ = Errors::Status_FileTransferCanceled;
+  timers_->schedule( &responseTimer_, FILE_TRANSFER_RESPONSE_TIMEOUT * 1000 );
+}
+
+
+
+bool SessionClient::canReceiveData()
+{
+  // While sending a file to the multicast group, wait for its slowest receivers: the server
+  // wakes the session up when they acknowledge more blocks, or get left out
+  if( fileBlocksRead_ > 0 && ! server_->canReceiveFileBlocks( this, fileBlocksRead_ ) )
+  {
+    return false;
+  }
+
+  // Nobody wakes the session up when the receivers catch up, so it checks again shortly
+  if( fileBlocksRead_ > 0 && ! server_->canRelayFileBlocks( this ) )
+  {
+    timers_->schedule( &throttleTimer_, FILE_RELAY_RETRY_DELAY );
+    return false;
+  }
+
+  int delay = byteLimiter_.millisecondsToTokens();
+  if( delay == 0 )
+  {
+    return true;
+  }
+
+  // The session thread sleeps until something happens: make sure it wakes up when it can read again
+  timers_->schedule( &throttleTimer_, delay );
+  return false;
+}
+
+
+
+void SessionClient::cycle()
+{
+  int expired = __sync_fetch_and_and( &expiredTimers_, 0 );
+  if( expired == 0 )
+  {
+    return;
+  }
+
+  if( ( expired & ( 1 << TIMER_LOGIN ) ) && ! hasJoined_ && ! isStripe_ )
+  {
+    Common::error( "Session 0x%X didn't join within %d seconds, disconnecting it", this, SESSION_LOGIN_TIMEOUT );
+    disconnect();
+    return;
+  }
+
+  // Reject the transfer on behalf of the client; the routing worker sees it after any real answer
+  if( ( expired & ( 1 << TIMER_RESPONSE ) )
+  &&  server_->isFileTransferModeActive()
+  &&  fileTransferStatus_ == Errors::Status_FileTransferCanceled )
+  {
+    Common::debug( "Session \"%s\" didn't answer the file transfer request, rejecting it", nickName_ );
+    router_->submit( this, new StatusMessage( Errors::Status_RejectFileTransfer ) );
+  }
+
+  if( expired & ( 1 << TIMER_HEARTBEAT ) )
+  {
+    int silence = time( NULL ) - lastReceived_;
+
+    if( silence >= SESSION_IDLE_TIMEOUT )
+    {
+      Common::error( "Session \"%s\" didn't answer for %d seconds, disconnecting it", nickName_, silence );
+      disconnect();
+      return;
+    }
+
+    if( silence >= SESSION_HEARTBEAT_INTERVAL )
+    {
+      StatusMessage* heartbeat = new StatusMessage( Errors::Status_Heartbeat );
+      if( ! sendMessage( heartbeat ) )
+      {
+        delete heartbeat;
+      }
+      timers_->schedule( &heartbeatTimer_, SESSION_HEARTBEAT_INTERVAL * 1000 );
+    }
+    else
+    {
+      // The client has talked meanwhile, check again when it'll have been silent for long enough
+      timers_->schedule( &heartbeatTimer_, ( SESSION_HEARTBEAT_INTERVAL - silence ) * 1000 );
+    }
+  }
+
+  // TIMER_THROTTLE only has to wake up the session
+}
+
+
+
 void SessionClient::disconnect()
 {
   if( isConnected() )
@@ -180,6 +431,27 @@ Errors::StatusCode SessionClient::fileTransferAccepted() const
 
 
 
+int64_t SessionClient::fileTransferOffset() const
+{
+  return fileTransferOffset_;
+}
+
+
+
+bool SessionClient::hasJoined() const
+{
+  return hasJoined_;
+}
+
+
+
+unsigned int SessionClient::id() const
+{
+  return id_;
+}
+
+
+
 const char* SessionClient::nickName() const
 {
   return nickName_;
@@ -187,6 +459,155 @@ const char* SessionClient::nickName() const
 
 
 
+void SessionClient::restoreState( const Errors::StatusCode fileTransferStatus, const bool hasJoined )
+{
+  fileTransferStatus_ = fileTransferStatus;
+  hasJoined_ = hasJoined;
+
+  if( hasJoined_ )
+  {
+    timers_->cancel( &loginTimer_ );
+  }
+}
+
+
+
+void SessionClient::routeMessage( const Message* message )
+{
+  switch( message->type() )
+  {
+    case Message::MSG_STATUS:
+    {
+      const StatusMessage* statusMessage = dynamic_cast<const StatusMessage*>( message );
+      Errors::StatusCode code = statusMessage->statusCode();
+
+      // The answer came too late, the transfer was already rejected for this client
+      if( fileTransferStatus_ != Errors::Status_FileTransferCanceled )
+      {
+        Common::debug( "Session \"%s\" answered the file transfer request too late", nickName_ );
+        sendMessage( new StatusMessage( Errors::Status_FileTransferCanceled ) );
+        break;
+      }
+
+      if( ! server_->isFileTransferModeActive() )
+      {
+        sendMessage( new StatusMessage( Errors::Status_FileTransferCanceled ) );
+        break;
+      }
+
+      // Save the status
+      fileTransferOffset_ = ( code == Errors::Status_AcceptFileTransfer ) ? statusMessage->fileOffset() : 0;
+      fileTransferStatus_ = code;
+
+      server_->clientSentFileTransferResponse( this, code == Errors::Status_AcceptFileTransfer );
+      break;
+    }
+
+    case Message::MSG_NICKNAME:
+    {
+      const NicknameMessage* nickNameMessage = dynamic_cast<const NicknameMessage*>( message );
+      if( ! server_->clientChangedNickName( this, nickNameMessage ) )
+      {
+        // The nickname could not be changed, report the problem to the client
+        sendMessage( new StatusMessage( Errors::Status_NickNameAlreadyRegistered ) );
+      }
+      else
+      {
+        sendMessage( new NicknameMessage( nickName_ ) );
+      }
+
+      // The first nickname completes the login: show the user what was said before
+      if( ! hasJoined_ && isConnected() )
+      {
+        hasJoined_ = true;
+        timers_->cancel( &loginTimer_ );
+
+        server_->clientJoined( this );
+
+        RawMessage* history = server_->recentChatHistory();
+        if( history && ! sendMessage( history ) )
+        {
+          delete history;
+        }
+      }
+      break;
+    }
+
+    case Message::MSG_CHAT:
+    {
+      const ChatMessage* chatMessage = dynamic_cast<const ChatMessage*>( message );
+      if( ! server_->clientSentChatMessage( this, chatMessage ) )
+      {
+        sendMessage( new StatusMessage( Errors::Status_ChattingAlone ) );
+      }
+      break;
+    }
+
+    case Message::MSG_PRIVATE:
+    {
+      const PrivateMessage* privateMessage = dynamic_cast<const PrivateMessage*>( message );
+      if( ! server_->clientSentPrivateMessage( this, privateMessage ) )
+      {
+        sendMessage( new StatusMessage( Errors::Status_UnknownRecipient ) );
+      }
+      break;
+    }
+
+    case Message::MSG_FILE_REQUEST:
+    {
+      // Deny new file transfers if one is already active
+      if( server_->isFileTransferModeActive() )
+      {
+        sendMessage( new StatusMessage( Errors::Status_FileTransferCanceled ) );
+        break;
+      }
+
+      const FileTransferMessage* fileMessage = dynamic_cast<const FileTransferMessage*>( message );
+      if( ! server_->clientSentFileTransferRequest( this, fileMessage ) )
+      {
+        sendMessage( new StatusMessage( Errors::Status_ChattingAlone ) );
+        break;
+      }
+
+      fileTransferStatus_ = Errors::Status_AcceptFileTransfer;
+      break;
+    }
+
+    case Message::MSG_FILE_MANIFEST:
+    {
+      const FileManifestMessage* manifestMessage = dynamic_cast<const FileManifestMessage*>( message );
+      server_->clientSentFileManifest( this, manifestMessage );
+      break;
+    }
+
+    case Message::MSG_FILE_SIGNATURE:
+    {
+      const FileSignatureMessage* signatureMessage = dynamic_cast<const FileSignatureMessage*>( message );
+      server_->clientSentFileSignature( this, signatureMessage );
+      break;
+    }
+
+    case Message::MSG_FILE_DATA:
+    {
+      const FileDataMessage* dataMessage = dynamic_cast<const FileDataMessage*>( message );
+
+      server_->clientSentFileData( this, dataMessage );
+
+      // Reset the file transfer status for the next file
+      if( dataMessage->isLastBlock() )
+      {
+        fileTransferStatus_ = Errors::Status_FileTransferCanceled;
+      }
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+
+
 void SessionClient::setNickName( const char* newNickName )
 {
   memset( nickName_, '\0', MAX_NICKNAME_SIZE );
@@ -194,3 +615,11 @@ void SessionClient::setNickName( const char* newNickName )
 }
 
 
+
+void SessionClient::timerExpired( void* thisPointer, const int event )
+{
+  SessionClient* self = static_cast<SessionClient*>( thisPointer );
+
+  __sync_fetch_and_or( &self->expiredTimers_, 1 << event );
+  self->wakeUp();
+}
@@ -13,8 +13,92 @@
 
 #include "errors.h"
 #include "sessionbase.h"
+#include "timingwheel.h"
+#include "tokenbucket.h"
 
 
+/**
+ * @def SESSION_MESSAGE_RATE
+ *
+ * Messages per second a client may send, file data excluded.
+ */
+#define SESSION_MESSAGE_RATE   20
+
+
+/**
+ * @def SESSION_MESSAGE_BURST
+ *
+ * Messages a client may send at once before being rate limited.
+ */
+#define SESSION_MESSAGE_BURST   40
+
+
+/**
+ * @def SESSION_BYTE_RATE
+ *
+ * Bytes per second a client may send. When exceeded, the server stops reading from it for a while.
+ */
+#define SESSION_BYTE_RATE   ( 8 * 1024 * 1024 )
+
+
+/**
+ * @def SESSION_BYTE_BURST
+ *
+ * Bytes a client may send at once before being slowed down.
+ */
+#define SESSION_BYTE_BURST   ( 16 * 1024 * 1024 )
+
+
+/**
+ * @def SESSION_MAX_DROPPED_MESSAGES
+ *
+ * A client which keeps flooding the server gets disconnected after this many messages dropped in a row.
+ */
+#define SESSION_MAX_DROPPED_MESSAGES   500
+
+
+/**
+ * @def SESSION_LOGIN_TIMEOUT
+ *
+ * Seconds a new client has to choose a nickname and join the chat, before being disconnected.
+ */
+#define SESSION_LOGIN_TIMEOUT   30
+
+
+/**
+ * @def SESSION_HEARTBEAT_INTERVAL
+ *
+ * Seconds of silence from a client after which the server checks that it's still there.
+ */
+#define SESSION_HEARTBEAT_INTERVAL   60
+
+
+/**
+ * @def SESSION_IDLE_TIMEOUT
+ *
+ * Seconds of silence, heartbeats included, after which a client is considered gone and disconnected.
+ */
+#define SESSION_IDLE_TIMEOUT   ( 3 * SESSION_HEARTBEAT_INTERVAL )
+
+
+/**
+ * @def FILE_TRANSFER_RESPONSE_TIMEOUT
+ *
+ * Seconds a client has to accept or reject a file transfer; after that, it's rejected.
+ */
+#define FILE_TRANSFER_RESPONSE_TIMEOUT   60
+
+
+/**
+ * @def FILE_RELAY_RETRY_DELAY
+ *
+ * Milliseconds a file sender waits before checking again whether its receivers have room
+ * for more blocks.
+ */
+#define FILE_RELAY_RETRY_DELAY   10
+
+
+class Router;
 class Server;
 
 
@@ -29,31 +113,138 @@ class SessionClient : public SessionBase
 {
   public:
 
-    SessionClient( Server* parent, const int socket );
+    /**
+     * @param id Identifies the session within the server, it's never reused
+     */
+    SessionClient( Server* parent, const int socket, const unsigned int id );
     virtual ~SessionClient();
 
+    /**
+     * Wait for the client to answer a file transfer request which was just sent to it.
+     *
+     * Unless it answers within FILE_TRANSFER_RESPONSE_TIMEOUT, the transfer is rejected for it.
+     */
+    void awaitFileTransferResponse();
+
     virtual void disconnect();
 
     Errors::StatusCode fileTransferAccepted() const;
 
+    /**
+     * Where the client can continue the accepted file transfer from, because it has the
+     * data before it from an interrupted transfer of the same file.
+     */
+    int64_t fileTransferOffset() const;
+
+    bool hasJoined() const;
+    unsigned int id() const;
+
+    /**
+     * Continue the session of a client which was connected to another server process.
+     */
+    void restoreState( const Errors::StatusCode fileTransferStatus, const bool hasJoined );
+
     const char* nickName() const;
+
+    /**
+     * Handle a message which concerns the other clients.
+     *
+     * Called by the routing workers with the server locked, after the session thread
+     * has submitted the message to the router.
+     */
+    void routeMessage( const Message* message );
+
     void setNickName( const char* newNickName );
 
 
   private:
 
+    /// Timers of the session
+    enum TimerEvent
+    {
+      TIMER_HEARTBEAT   /// Check whether the client is still there
+    , TIMER_LOGIN       /// The client took too long to join
+    , TIMER_RESPONSE    /// The client took too long to answer a file transfer request
+    , TIMER_THROTTLE    /// The client can be read from again
+    };
+
+
+  private:
+
+    virtual bool acceptMessage( Message::Type type, const int size );
     virtual void availableMessages();
+    virtual bool canReceiveData();
+
+    /**
+     * Handle the timers which have expired.
+     */
+    virtual void cycle();
+
+    /**
+     * Called by the timing wheel: take note of the expiry, the session thread handles it.
+     */
+    static void timerExpired( void* thisPointer, const int event );
 
 
   private:
 
+    /// Limits the bytes per second received from the client
+    TokenBucket byteLimiter_;
+
+    /// Number of messages dropped since the client last kept within the rate
+    int droppedMessages_;
+
+    /// Bit mask of the TimerEvents which have expired and weren't handled yet
+    int expiredTimers_;
+
+    /// Blocks of the file being sent read so far, 0 when there isn't one
+    uint32_t fileBlocksRead_;
+
+    /// Set with the acceptance of a file transfer
+    int64_t fileTransferOffset_;
+
     Errors::StatusCode fileTransferStatus_;
 
+    /// Whether the client has completed the login and joined the chat
+    bool hasJoined_;
+
+    TimingWheel::Timer heartbeatTimer_;
+
+    const unsigned int id_;
+
+    /// Whether the client has been told that its messages are being dropped
+    bool isRateLimited_;
+
+    /// Whether the connection carries file blocks for another session, rather than being a session
+    bool isStripe_;
+
+    /// When the last message was received from the client
+    time_t lastReceived_;
+
+    TimingWheel::Timer loginTimer_;
+
+    /// Limits the messages per second received from the client
+    TokenBucket messageLimiter_;
+
     char nickName_[ MAX_NICKNAME_SIZE ];
 
+    /// Multicast messages last queued again for the client, from the start to before the end
+    uint32_t repairsEnd_;
+    uint32_t repairsStart_;
+
+    TimingWheel::Timer responseTimer_;
+
+    /// Router of the parent server
+    Router* router_;
+
     /// Pointer to the parent server
     Server* server_;
 
+    TimingWheel::Timer throttleTimer_;
+
+    /// Shared with all the sessions of the server
+    TimingWheel* timers_;
+
 
 };
 
@@ -0,0 +1,110 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sessionpeer.h"
+
+#include "common.h"
+#include "message.h"
+#include "server.h"
+
+#include "relaymessage.h"
+
+#include <string.h>
+
+
+
+SessionPeer::SessionPeer( Server* parent, const int socket, const char* name )
+: SessionBase( socket )
+, isTrusted_( false )
+, server_( parent )
+{
+  memset( name_, '\0', MAX_PATH_SIZE );
+  strncpy( name_, name, MAX_PATH_SIZE - 1 );
+
+  for( int i = 0; i < FEDERATION_CHALLENGE_SIZE; i += sizeof( uint64_t ) )
+  {
+    uint64_t number = Server::randomNumber();
+    memcpy( challenge_ + i, &number, sizeof( uint64_t ) );
+  }
+}
+
+
+
+SessionPeer::~SessionPeer()
+{
+  server_->removePeer( this );
+}
+
+
+
+void SessionPeer::availableMessages()
+{
+  // Nothing else is trusted from a link which is being closed
+  Message* message;
+  while( isConnected() && ( message = receiveMessage() ) != NULL )
+  {
+    RelayMessage* relayMessage = dynamic_cast<RelayMessage*>( message );
+    if( relayMessage == NULL )
+    {
+      Common::debug( "Link to %s sent unexpected message type %d", name_, message->type() );
+    }
+    else if( relayMessage->event() == RelayMessage::RELAY_CHALLENGE )
+    {
+      server_->peerSentChallenge( this, relayMessage );
+    }
+    else if( relayMessage->event() == RelayMessage::RELAY_PROOF )
+    {
+      if( ! server_->peerSentProof( this, relayMessage ) )
+      {
+        Common::error( "Link to %s doesn't know the federation secret, closing it", name_ );
+        disconnect();
+      }
+    }
+    else if( server_->isPeerTrusted( this ) )
+    {
+      server_->peerSentRelay( this, relayMessage );
+    }
+    else
+    {
+      Common::error( "Link to %s sent relays before proving it's part of the federation, closing it", name_ );
+      disconnect();
+    }
+
+    delete message;
+  }
+}
+
+
+
+const char* SessionPeer::challenge() const
+{
+  return challenge_;
+}
+
+
+
+bool SessionPeer::isTrusted() const
+{
+  return isTrusted_;
+}
+
+
+
+const char* SessionPeer::name() const
+{
+  return name_;
+}
+
+
+
+void SessionPeer::setTrusted()
+{
+  isTrusted_ = true;
+}
@@ -0,0 +1,88 @@
+/**
+ * LAN Messenger
+ * Copyright (C) 2011 Valerio Pilo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SESSIONPEER_H
+#define SESSIONPEER_H
+
+#include "protocol.h"
+#include "sessionbase.h"
+
+
+/**
+ * @def FEDERATION_CHALLENGE_SIZE
+ *
+ * Random bytes each server signs to prove the other end of a link it knows the federation secret.
+ */
+#define FEDERATION_CHALLENGE_SIZE   32
+
+
+class Server;
+
+
+
+/**
+ * @class SessionPeer
+ *
+ * A link to another server of the federation.
+ *
+ * Links only carry relay messages, in both directions: anything else is ignored.
+ * Each side first proves it knows the secret shared by the federation, by signing a
+ * challenge sent by the other one; until then, no other relay goes through the link.
+ */
+class SessionPeer : public SessionBase
+{
+  public:
+
+    /**
+     * @param parent The server owning the link
+     * @param socket Socket connected to the other server
+     * @param name Description of the other end, for the logs
+     */
+    SessionPeer( Server* parent, const int socket, const char* name );
+    virtual ~SessionPeer();
+
+    /**
+     * Random bytes the other server must sign.
+     */
+    const char* challenge() const;
+
+    /**
+     * Whether the other server has proved it's part of the federation.
+     *
+     * Protected by the federation mutex of the server.
+     */
+    bool isTrusted() const;
+    void setTrusted();
+
+    const char* name() const;
+
+
+  private:
+
+    virtual void availableMessages();
+
+
+  private:
+
+    char challenge_[ FEDERATION_CHALLENGE_SIZE ];
+
+    bool isTrusted_;
+
+    char name_[ MAX_PATH_SIZE ];
+
+    /// Pointer to the parent server
+    Server* server_;
+
+
+};
+
+
+
+#endif // SESSIONPEER_H